@@ -19,14 +19,19 @@
 #include "progs.h"
 #endif
 #include "s_apps.h"
+#include "internal/sockets.h"
 
 /* tweaks needed due to missing unistd.h on Windows */
 #ifdef _WIN32
 #define access _access
+#define sleep(x) Sleep((x) * 1000)
 #endif
 #ifndef F_OK
 # define F_OK 0
 #endif
+#ifdef OPENSSL_SYS_UNIX
+# include <poll.h>
+#endif
 
 #ifndef OPENSSL_NO_CMP
 
@@ -150,6 +155,7 @@ static int proxy_port = 8080;
 static char *opt_path = "/";
 static int opt_msgtimeout = -1;
 static int opt_totaltimeout = -1;
+static char *opt_timing = NULL;
 
 static int opt_tls_used = 0;
 static char *opt_tls_cert = NULL;
@@ -185,6 +191,9 @@ static char *opt_rspin = NULL;
 static char *opt_rspout = NULL;
 
 static int opt_mock_srv = 0;
+static int opt_port = 0;
+static int opt_srv_threads = 4;
+static int opt_srv_timeout = 10;
 
 static char *opt_srv_ref = NULL;
 static char *opt_srv_secret = NULL;
@@ -265,9 +274,13 @@ static char *opt_out_trusted = NULL;
 static int opt_implicitConfirm = 0;
 static int opt_disableConfirm = 0;
 static char *opt_certout = NULL;
+static char *opt_jobs = NULL;
+static int opt_parallel = 8;
 
 static char *opt_oldcert = NULL;
 static int opt_revreason = CRL_REASON_NONE;
+static char *opt_revcerts = NULL;
+static int opt_revbatch = -1;
 
 static char *opt_cmd_s = NULL;
 static int opt_cmd = -1;
@@ -372,7 +385,7 @@ typedef enum OPTION_choice {
     OPT_CONFIG, OPT_SECTION,
 
     OPT_SERVER, OPT_PROXY, OPT_PATH,
-    OPT_MSGTIMEOUT, OPT_TOTALTIMEOUT,
+    OPT_MSGTIMEOUT, OPT_TOTALTIMEOUT, OPT_TIMING,
 
     OPT_RECIPIENT, OPT_EXPECT_SENDER, OPT_SRVCERT,
     OPT_TRUSTED, OPT_UNTRUSTED,
@@ -389,9 +402,9 @@ typedef enum OPTION_choice {
     OPT_POLICIES, OPT_POLICIES_CRITICAL,
     OPT_POPO, OPT_CSR,
     OPT_OUT_TRUSTED, OPT_IMPLICITCONFIRM, OPT_DISABLECONFIRM,
-    OPT_CERTOUT,
+    OPT_CERTOUT, OPT_JOBS, OPT_PARALLEL,
 
-    OPT_OLDCERT, OPT_REVREASON,
+    OPT_OLDCERT, OPT_REVREASON, OPT_REVCERTS, OPT_REVBATCH,
 
     OPT_OWNFORM, OPT_KEYFORM, OPT_CRLFORM, OPT_OTHERFORM, OPT_OTHERPASS,
     OPT_BATCH,
@@ -405,7 +418,7 @@ typedef enum OPTION_choice {
 #ifndef NDEBUG
     OPT_REQIN, OPT_REQOUT, OPT_RSPOUT, OPT_RSPIN,
 
-    OPT_MOCK_SRV,
+    OPT_MOCK_SRV, OPT_PORT, OPT_SRV_THREADS, OPT_SRV_TIMEOUT,
     OPT_SRV_REF, OPT_SRV_SECRET,
     OPT_SRV_CERT, OPT_SRV_KEY, OPT_SRV_KEYPASS,
     OPT_SRV_TRUSTED, OPT_SRV_UNTRUSTED,
@@ -452,6 +465,8 @@ OPTIONS cmp_options[] = {
      "Timeout per CMP message round trip (or 0 for none). Default 120 seconds"},
     {"totaltimeout", OPT_TOTALTIMEOUT, 'n',
      "Overall time an enrollment incl. polling may take. Default 0 = infinite"},
+    {"timing", OPT_TIMING, 's',
+     "File to write the timing of each phase of message exchanges as JSON"},
 
     {OPT_MORE_STR, 0, 0, "\nServer authentication options:"},
     {"recipient", OPT_RECIPIENT, 's',
@@ -551,6 +566,10 @@ OPTIONS cmp_options[] = {
      "WARNING: This setting leads to behavior violating RFC 4210"},
     {"certout", OPT_CERTOUT, 's',
      "File to save the newly enrolled certificate"},
+    {"jobs", OPT_JOBS, 's',
+     "File with ir or cr jobs, one per line: newkey file, certout file, subject"},
+    {"parallel", OPT_PARALLEL, 'n',
+     "Maximum number of jobs to run in parallel. Default 8"},
 
     {OPT_MORE_STR, 0, 0, "\nCertificate enrollment and revocation options:"},
 
@@ -564,6 +583,12 @@ OPTIONS cmp_options[] = {
  "Set reason code to be included in revocation request (rr); possible values:"},
     {OPT_MORE_STR, 0, 0,
      "0..10 (see RFC5280, 5.3.1) or -1 for none. Default -1 = none"},
+    {"revcerts", OPT_REVCERTS, 's',
+     "File with further certificates to be revoked in the same rr, one per line:"},
+    {OPT_MORE_STR, 0, 0,
+     "certificate file or serial number (with issuer from -issuer or -oldcert)"},
+    {"revbatch", OPT_REVBATCH, 'n',
+     "Maximum number of certificates per rr, or 0 for unlimited. Default 256"},
 
     {OPT_MORE_STR, 0, 0, "\nCredentials format options:"},
     {"ownform", OPT_OWNFORM, 's',
@@ -617,6 +642,12 @@ OPTIONS cmp_options[] = {
     {"rspout", OPT_RSPOUT, 's', "Save sequence of CMP responses to file(s)"},
 
     {"mock_srv", OPT_MOCK_SRV, '-', "Mock the server"},
+    {"port", OPT_PORT, 'n',
+     "Act as HTTP server on given port, using the mock server options below"},
+    {"srv_threads", OPT_SRV_THREADS, 'n',
+     "Number of connections -port serves in parallel. Default 4"},
+    {"srv_timeout", OPT_SRV_TIMEOUT, 'n',
+     "Seconds -port waits for input on a connection. Default 10, 0: no limit"},
     {"srv_ref", OPT_SRV_REF, 's',
      "Reference value to use as senderKID of server in case no -cert is given"},
     {"srv_secret", OPT_SRV_SECRET, 's',
@@ -721,7 +752,7 @@ static varref cmp_vars[] = {/* must be in the same order as enumerated above! */
     {&opt_config}, {&opt_section},
 
     {&opt_server}, {&opt_proxy}, {&opt_path},
-    {(char **)&opt_msgtimeout}, {(char **)&opt_totaltimeout},
+    {(char **)&opt_msgtimeout}, {(char **)&opt_totaltimeout}, {&opt_timing},
 
     {&opt_recipient}, {&opt_expect_sender}, {&opt_srvcert},
     {&opt_trusted}, {&opt_untrusted},
@@ -740,9 +771,10 @@ static varref cmp_vars[] = {/* must be in the same order as enumerated above! */
     {(char **)&opt_popo}, {&opt_csr},
     {&opt_out_trusted},
     {(char **)&opt_implicitConfirm}, {(char **)&opt_disableConfirm},
-    {&opt_certout},
+    {&opt_certout}, {&opt_jobs}, {(char **)&opt_parallel},
 
-    {&opt_oldcert}, {(char **)&opt_revreason},
+    {&opt_oldcert}, {(char **)&opt_revreason}, {&opt_revcerts},
+    {(char **)&opt_revbatch},
 
     {&opt_ownform_s}, {&opt_keyform_s}, {&opt_crlform_s}, {&opt_otherform_s},
     {&opt_otherpass}, {(char **)&opt_batch},
@@ -756,7 +788,8 @@ static varref cmp_vars[] = {/* must be in the same order as enumerated above! */
 #ifndef NDEBUG
     {&opt_reqin}, {&opt_reqout}, {&opt_rspin}, {&opt_rspout},
 
-    {(char **)&opt_mock_srv},
+    {(char **)&opt_mock_srv}, {(char **)&opt_port},
+    {(char **)&opt_srv_threads}, {(char **)&opt_srv_timeout},
     {&opt_srv_ref}, {&opt_srv_secret},
     {&opt_srv_cert}, {&opt_srv_key}, {&opt_srv_keypass},
     {&opt_srv_trusted}, {&opt_srv_untrusted},
@@ -2167,6 +2200,7 @@ static int read_write_req_resp(CMP_CTX *ctx,
            */
             CMP_PKIHEADER_set1_transactionID(CMP_PKIMESSAGE_get0_header
                                              (req_new), NULL);
+            CMP_PKIMESSAGE_modified(req_new);
             CMP_PKIMESSAGE_protect((CMP_CTX *)ctx, req_new);
 # endif
         }
@@ -2227,6 +2261,38 @@ static BIO *tls_http_cb(CMP_CTX *ctx, BIO *hbio, int connect)
     }
 }
 
+static BIO *timing_bio = NULL;
+static uint64_t timing_origin = 0;
+static int timing_records = 0;
+
+/*
+ * writes the timing of a phase of a message exchange as JSON object
+ * to timing_bio, with the start time relative to the first phase reported
+ */
+static void timing_cb(CMP_CTX *ctx, int phase, uint64_t start, uint64_t end,
+                      size_t bytes)
+{
+    static const char *const phase_names[] = {
+        "protect", "connect", "tls", "encode", "transfer", "decode",
+        "validate", "certConf_cb"
+    };
+    ASN1_OCTET_STRING *tid = CMP_CTX_get0_transactionID(ctx);
+    int i;
+
+    if (timing_records++ == 0)
+        timing_origin = start;
+    BIO_printf(timing_bio, "%s\n  {\"transactionID\": \"",
+               timing_records > 1 ? "," : "");
+    for (i = 0; tid != NULL && i < tid->length; i++)
+        BIO_printf(timing_bio, "%02X", tid->data[i]);
+    BIO_printf(timing_bio, "\", \"phase\": \"%s\", \"start_us\": %llu, "
+               "\"duration_us\": %llu, \"bytes\": %llu}",
+               phase >= 0 && phase < (int)OSSL_NELEM(phase_names) ?
+               phase_names[phase] : "unknown",
+               (unsigned long long)(start - timing_origin),
+               (unsigned long long)(end - start), (unsigned long long)bytes);
+}
+
 /*
  * This function is a callback used by OpenSSL's verify_cert function.
  * It is called at the end of a cert verification to allow an opportunity
@@ -2732,6 +2798,156 @@ static int setup_srv_ctx(ENGINE *e)
     srv_ctx = NULL;
     return 0;
 }
+
+# ifndef OPENSSL_NO_SOCK
+#  if defined(OPENSSL_THREADS) && defined(OPENSSL_SYS_UNIX)
+#   include <pthread.h>
+#   define CMP_SRV_THREADS
+#  endif
+
+static CRYPTO_RWLOCK *accept_lock = NULL;
+static CRYPTO_RWLOCK *log_lock = NULL;
+
+/*
+ * returns 1 if the given socket error of a failed accept() is worth retrying,
+ * like an aborted connection or temporary lack of file descriptors or memory
+ */
+static int accept_error_is_transient(int err)
+{
+    switch (err) {
+#  ifdef EINTR
+    case EINTR:
+#  endif
+#  ifdef ECONNABORTED
+    case ECONNABORTED:
+#  endif
+#  ifdef EPROTO
+    case EPROTO:
+#  endif
+#  ifdef EMFILE
+    case EMFILE:
+#  endif
+#  ifdef ENFILE
+    case ENFILE:
+#  endif
+#  ifdef ENOBUFS
+    case ENOBUFS:
+#  endif
+#  ifdef ENOMEM
+    case ENOMEM:
+#  endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * serves the connections accepted on the given accept BIO one at a time,
+ * processing the CMP requests with srv_ctx, until accepting fails for good.
+ * Several workers may share the accept BIO, which is guarded by accept_lock,
+ * while their output to bio_err is serialized using log_lock.
+ * A connection on which no input arrives for opt_srv_timeout seconds is
+ * closed, such that idle clients cannot keep the workers busy.
+ */
+static void *srv_worker(void *acbio)
+{
+    for (;;) {
+        BIO *cbio = NULL;
+        int ok, err = 0;
+
+        if (!CRYPTO_THREAD_write_lock(accept_lock))
+            break;
+        clear_socket_error();
+        ok = BIO_do_accept(acbio) > 0 && (cbio = BIO_pop(acbio)) != NULL;
+        if (!ok)
+            err = get_last_socket_error();
+        CRYPTO_THREAD_unlock(accept_lock);
+
+        if (!ok) {
+            int transient = accept_error_is_transient(err);
+
+            if (CRYPTO_THREAD_write_lock(log_lock)) {
+                BIO_printf(bio_err,
+                           "%s: accepting connection failed (errno %d)\n",
+                           transient ? "warning" : "error", err);
+                ERR_print_errors(bio_err);
+                CRYPTO_THREAD_unlock(log_lock);
+            }
+            if (!transient)
+                break;
+            sleep(1); /* avoid spinning, e.g., while out of descriptors */
+            continue;
+        }
+
+        if (CMP_SRV_http_serve(srv_ctx, cbio) < 0
+                && CRYPTO_THREAD_write_lock(log_lock)) {
+            ERR_print_errors(bio_err);
+            CRYPTO_THREAD_unlock(log_lock);
+        }
+        BIO_free_all(cbio);
+    }
+    return NULL;
+}
+
+/*
+ * acts as CMP server via HTTP on opt_port, using srv_ctx,
+ * with opt_srv_threads workers serving connections in parallel.
+ * Returns only on error, with 0
+ */
+static int run_server(void)
+{
+    BIO *acbio = NULL;
+    char port[12];
+#  ifdef CMP_SRV_THREADS
+    pthread_t *threads = NULL;
+    int i, started = 0;
+#  endif
+
+    if (opt_srv_threads < 1) {
+        BIO_puts(bio_err, "error: -srv_threads must be at least 1\n");
+        return 0;
+    }
+    (void)CMP_SRV_CTX_set_http_timeout(srv_ctx, opt_srv_timeout);
+    BIO_snprintf(port, sizeof(port), "%d", opt_port);
+    if ((accept_lock = CRYPTO_THREAD_lock_new()) == NULL ||
+        (log_lock = CRYPTO_THREAD_lock_new()) == NULL ||
+        (acbio = BIO_new_accept(port)) == NULL ||
+        BIO_set_bind_mode(acbio, BIO_BIND_REUSEADDR) < 0 ||
+        BIO_do_accept(acbio) <= 0) { /* the first call sets up the socket */
+        BIO_printf(bio_err, "error: cannot listen on port %s\n", port);
+        goto err;
+    }
+    CMP_printf(cmp_ctx, FL_INFO, "CMP server listening on port %s", port);
+
+#  ifdef CMP_SRV_THREADS
+    threads = app_malloc(opt_srv_threads * sizeof(*threads), "thread array");
+    for (i = 1; i < opt_srv_threads; i++) {
+        if (pthread_create(&threads[i], NULL, srv_worker, acbio) != 0) {
+            BIO_printf(bio_err, "warning: could only start %d threads\n", i);
+            break;
+        }
+        started++;
+    }
+#  else
+    if (opt_srv_threads > 1)
+        BIO_puts(bio_err,
+                 "warning: threads not supported, serving one connection at a time\n");
+#  endif
+    (void)srv_worker(acbio);
+#  ifdef CMP_SRV_THREADS
+    for (i = 1; i <= started; i++)
+        pthread_join(threads[i], NULL);
+    OPENSSL_free(threads);
+#  endif
+
+ err:
+    BIO_free_all(acbio);
+    CRYPTO_THREAD_lock_free(accept_lock);
+    CRYPTO_THREAD_lock_free(log_lock);
+    return 0;
+}
+# endif /* !defined(OPENSSL_NO_SOCK) */
 #endif
 
 /*
@@ -3203,6 +3419,82 @@ static int setup_protection_ctx(CMP_CTX *ctx, ENGINE *e) {
     return 0;
 }
 
+/*
+ * reads further certificates to be revoked from the given file, one per line,
+ * each given as a certificate file or as serial number (decimal or hex with
+ * leading 0x) of a certificate issued by the given issuer, and adds them to ctx.
+ * Empty lines and lines starting with '#' are skipped.
+ * Returns the number of certificates, or -1 on error.
+ */
+static int load_rev_certs(CMP_CTX *ctx, const char *file,
+                          const X509_NAME *issuer)
+{
+    BIO *bio;
+    char line[4096];
+    int len, lineno = 0, num = 0;
+    X509 *cert;
+    ASN1_INTEGER *serial;
+
+    if ((bio = BIO_new_file(file, "r")) == NULL) {
+        BIO_printf(bio_err, "error: cannot open revcerts file '%s'\n", file);
+        return -1;
+    }
+    while ((len = BIO_gets(bio, line, sizeof(line))) > 0) {
+        char *str = line;
+        int hex;
+
+        lineno++;
+        while (len > 0 && isspace(_UC(line[len - 1])))
+            line[--len] = '\0';
+        while (isspace(_UC(*str)))
+            str++;
+        if (*str == '\0' || *str == '#')
+            continue;
+
+        hex = str[0] == '0' && (str[1] == 'x' || str[1] == 'X');
+        if (str[strspn(str + 2 * hex,
+                       hex ? "0123456789abcdefABCDEF" : "0123456789")
+                + 2 * hex] == '\0') {
+            if (issuer == NULL) {
+                BIO_printf(bio_err,
+                  "error: missing -issuer for serial number in line %d of revcerts file '%s'\n",
+                           lineno, file);
+                goto err;
+            }
+            if ((serial = s2i_ASN1_INTEGER(NULL, str)) == NULL) {
+                BIO_printf(bio_err,
+             "error: invalid serial number in line %d of revcerts file '%s'\n",
+                           lineno, file);
+                goto err;
+            }
+            if (!CMP_CTX_revCert_push1(ctx, issuer, serial)) {
+                ASN1_INTEGER_free(serial);
+                goto oom;
+            }
+            ASN1_INTEGER_free(serial);
+        } else {
+            if ((cert = load_cert_autofmt(str, opt_ownform, NULL,
+                                          "certificate to be revoked")) == NULL)
+                goto err;
+            if (!CMP_CTX_revCert_push1(ctx, X509_get_issuer_name(cert),
+                                       X509_get0_serialNumber(cert))) {
+                X509_free(cert);
+                goto oom;
+            }
+            X509_free(cert);
+        }
+        num++;
+    }
+    BIO_free(bio);
+    return num;
+
+ oom:
+    BIO_printf(bio_err, "out of memory\n");
+ err:
+    BIO_free(bio);
+    return -1;
+}
+
 /*
  * set up IR/CR/KUR/CertConf/RR specific parts of the CMP_CTX
  * based on options from config file/CLI.
@@ -3210,6 +3502,8 @@ static int setup_protection_ctx(CMP_CTX *ctx, ENGINE *e) {
  * Returns pointer on success, NULL on error
  */
 static int setup_request_ctx(CMP_CTX *ctx, ENGINE *e) {
+    X509_NAME *issuer = NULL; /* for any serial numbers given via -revcerts */
+
     if (!set_name(opt_subject, CMP_CTX_set1_subjectName, ctx, "subject") ||
         !set_name(opt_issuer, CMP_CTX_set1_issuer, ctx, "issuer"))
         goto err;
@@ -3324,12 +3618,32 @@ static int setup_request_ctx(CMP_CTX *ctx, ENGINE *e) {
     /* opt_keypass is needed in case opt_oldcert is an encrypted PKCS#12 file */
         if (oldcert == NULL)
             goto err;
-        if (!CMP_CTX_set1_oldClCert(ctx, oldcert)) {
+        if (!CMP_CTX_set1_oldClCert(ctx, oldcert) ||
+            (opt_revcerts != NULL && opt_issuer == NULL &&
+             (issuer = X509_NAME_dup(X509_get_issuer_name(oldcert))) == NULL)) {
             X509_free(oldcert);
             goto oom;
         }
         X509_free(oldcert);
     }
+    if (opt_revcerts != NULL) {
+        if (opt_cmd != CMP_RR) {
+            BIO_puts(bio_err,
+         "warning: -revcerts option is ignored for command other than rr\n");
+        } else {
+            /* issuer of any serial numbers given, defaulting to the oldcert's */
+            if (opt_issuer != NULL &&
+                (issuer = parse_name(opt_issuer, MBSTRING_ASC, 0)) == NULL) {
+                BIO_printf(bio_err, "error parsing issuer DN '%s'\n",
+                           opt_issuer);
+                goto err;
+            }
+            if (load_rev_certs(ctx, opt_revcerts, issuer) < 0)
+                goto err;
+        }
+        X509_NAME_free(issuer);
+        issuer = NULL;
+    }
     if (opt_keypass) {
         OPENSSL_cleanse(opt_keypass, strlen(opt_keypass));
         opt_keypass = NULL;
@@ -3338,11 +3652,15 @@ static int setup_request_ctx(CMP_CTX *ctx, ENGINE *e) {
     if (opt_revreason > CRL_REASON_NONE)
         (void)CMP_CTX_set_option(ctx, CMP_CTX_OPT_REVOCATION_REASON,
                                  opt_revreason);
+    if (opt_revbatch >= 0)
+        (void)CMP_CTX_set_option(ctx, CMP_CTX_OPT_REVOCATION_BATCH,
+                                 opt_revbatch);
     return 1;
 
  oom:
     BIO_printf(bio_err, "out of memory\n");
  err:
+    X509_NAME_free(issuer);
     return 0;
 }
 
@@ -3380,7 +3698,24 @@ static int setup_ctx(CMP_CTX *ctx, ENGINE *e)
     if (!transform_opts())
         goto err;
 
-    if (opt_cmd == CMP_IR || opt_cmd == CMP_CR || opt_cmd == CMP_KUR) {
+    if (opt_jobs != NULL) {
+        if (opt_cmd != CMP_IR && opt_cmd != CMP_CR) {
+            BIO_puts(bio_err, "error: -jobs is supported only for ir and cr\n");
+            goto err;
+        }
+        if (opt_parallel < 1) {
+            BIO_puts(bio_err, "error: -parallel must be at least 1\n");
+            goto err;
+        }
+#ifdef OPENSSL_SYS_WINDOWS
+        /* select() can wait for at most FD_SETSIZE sockets */
+        if (opt_parallel > FD_SETSIZE) {
+            BIO_printf(bio_err, "error: -parallel must be at most %d\n",
+                       FD_SETSIZE);
+            goto err;
+        }
+#endif
+    } else if (opt_cmd == CMP_IR || opt_cmd == CMP_CR || opt_cmd == CMP_KUR) {
         if (opt_newkey == NULL && opt_key == NULL) {
             BIO_puts(bio_err,
                      "error: missing -key or -newkey to be certified\n");
@@ -3396,7 +3731,7 @@ static int setup_ctx(CMP_CTX *ctx, ENGINE *e)
         BIO_puts(bio_err, "error: missing certificate to be updated\n");
         goto err;
     }
-    if (opt_cmd == CMP_RR && opt_oldcert == NULL) {
+    if (opt_cmd == CMP_RR && opt_oldcert == NULL && opt_revcerts == NULL) {
         BIO_puts(bio_err, "error: missing certificate to be revoked\n");
         goto err;
     }
@@ -3541,6 +3876,13 @@ static int setup_ctx(CMP_CTX *ctx, ENGINE *e)
         (void)CMP_CTX_set_option(ctx, CMP_CTX_OPT_MSGTIMEOUT, opt_msgtimeout);
     if (opt_totaltimeout >= 0)
         (void)CMP_CTX_set_option(ctx, CMP_CTX_OPT_TOTALTIMEOUT, opt_totaltimeout);
+    if (opt_timing != NULL) {
+        if ((timing_bio = bio_open_default(opt_timing, 'w', FORMAT_TEXT))
+            == NULL)
+            goto err;
+        BIO_puts(timing_bio, "[");
+        (void)CMP_CTX_set_phase_cb(ctx, timing_cb);
+    }
 
 #ifndef NDEBUG
     if (opt_reqin || opt_reqout || opt_rspin || opt_rspout || opt_mock_srv)
@@ -3618,6 +3960,366 @@ static int save_certs(STACK_OF(X509) *certs, char *destFile, char *desc)
     return n;
 }
 
+/*
+ * writes out the newly enrolled certificate to the given file.
+ * Returns 1 on success, 0 on error.
+ */
+static int save_newcert(X509 *cert, char *destFile)
+{
+    STACK_OF(X509) *certs = sk_X509_new_null();
+    int ret = certs != NULL && sk_X509_push(certs, X509_dup(cert)) &&
+        save_certs(certs, destFile, "enrolled") >= 0;
+
+    sk_X509_pop_free(certs, X509_free);
+    return ret;
+}
+
+/*
+ * an enrollment job given in the -jobs file, run via the CMP_SES API
+ */
+typedef struct batch_job_st {
+    int line; /* line number in the jobs file */
+    char *newkey; /* the fields point into buf */
+    char *certout;
+    char *subject; /* empty string if not given */
+    char *buf;
+    CMP_CTX *ctx;
+    CMP_SES *ses;
+    int rv; /* result of the last CMP_SES_step() */
+    int ready; /* whether CMP_SES_step() is to be called again right now */
+    int polled; /* whether rv is from CMP_SES_step() by CMP_SES_SCHED_run() */
+} BATCH_JOB;
+
+static char *next_field(char *str)
+{
+    while (*str != '\0' && !isspace(_UC(*str)))
+        str++;
+    if (*str != '\0')
+        *str++ = '\0';
+    while (isspace(_UC(*str)))
+        str++;
+    return str;
+}
+
+/*
+ * reads the jobs from the given file, one per line, consisting of the files
+ * with the new key and for the new certificate and an optional subject DN,
+ * separated by whitespace. Empty lines and lines starting with '#' are skipped.
+ * Returns the number of jobs, or -1 on error.
+ */
+static int load_batch_jobs(const char *file, BATCH_JOB **jobs)
+{
+    BIO *bio;
+    char line[4096];
+    int len, lineno = 0, num = 0, size = 0;
+    BATCH_JOB *job;
+
+    *jobs = NULL;
+    if ((bio = BIO_new_file(file, "r")) == NULL) {
+        BIO_printf(bio_err, "error: cannot open jobs file '%s'\n", file);
+        return -1;
+    }
+    while ((len = BIO_gets(bio, line, sizeof(line))) > 0) {
+        char *str = line;
+
+        lineno++;
+        while (len > 0 && isspace(_UC(line[len - 1])))
+            line[--len] = '\0';
+        while (isspace(_UC(*str)))
+            str++;
+        if (*str == '\0' || *str == '#')
+            continue;
+        if (num == size) {
+            BATCH_JOB *tmp;
+
+            size = size == 0 ? 64 : 2 * size;
+            if ((tmp = OPENSSL_realloc(*jobs, size * sizeof(*tmp))) == NULL)
+                goto oom;
+            *jobs = tmp;
+        }
+        job = &(*jobs)[num];
+        memset(job, 0, sizeof(*job));
+        if ((job->buf = OPENSSL_strdup(str)) == NULL)
+            goto oom;
+        num++;
+        job->line = lineno;
+        job->newkey = job->buf;
+        job->certout = next_field(job->newkey);
+        job->subject = next_field(job->certout);
+        if (*job->certout == '\0') {
+            BIO_printf(bio_err,
+                   "error: missing certout file in line %d of jobs file '%s'\n",
+                       lineno, file);
+            goto err;
+        }
+    }
+    BIO_free(bio);
+    return num;
+
+ oom:
+    BIO_printf(bio_err, "out of memory\n");
+ err:
+    while (num > 0)
+        OPENSSL_free((*jobs)[--num].buf);
+    OPENSSL_free(*jobs);
+    *jobs = NULL;
+    BIO_free(bio);
+    return -1;
+}
+
+/*
+ * prepares a transaction for the given job, sharing the settings of cmp_ctx
+ * Returns 1 on success, 0 on error
+ */
+static int batch_job_start(BATCH_JOB *job, ENGINE *e)
+{
+    EVP_PKEY *pkey;
+
+    if ((job->ctx = CMP_CTX_dup(cmp_ctx)) == NULL ||
+        !set_name(*job->subject != '\0' ? job->subject : NULL,
+                  CMP_CTX_set1_subjectName, job->ctx, "subject"))
+        return 0;
+    pkey = load_key_autofmt(job->newkey, opt_keyform, opt_newkeypass, e,
+                            "new private key for certificate to be enrolled");
+    if (pkey == NULL || !CMP_CTX_set0_newPkey(job->ctx, pkey)) {
+        EVP_PKEY_free(pkey);
+        return 0;
+    }
+    job->ses = CMP_SES_start(job->ctx, opt_cmd == CMP_IR ? V_CMP_PKIBODY_IR
+                                                         : V_CMP_PKIBODY_CR);
+    job->ready = 1;
+    return job->ses != NULL;
+}
+
+/*
+ * saves the certificate of a finished job and reports the job's result
+ * Returns 1 if the job succeeded, else 0
+ */
+static int batch_job_finish(BATCH_JOB *job)
+{
+    int ok = job->rv == CMP_SES_DONE &&
+        save_newcert(CMP_CTX_get0_newClCert(job->ctx), job->certout);
+
+    if (!ok)
+        ERR_print_errors(bio_err);
+    BIO_printf(bio_out, "job in line %d%s%s: %s\n", job->line,
+               *job->subject != '\0' ? " for " : "", job->subject,
+               ok ? "enrolled" : "failed");
+    CMP_SES_free(job->ses);
+    job->ses = NULL;
+    CMP_CTX_delete(job->ctx);
+    job->ctx = NULL;
+    return ok;
+}
+
+/* takes the result of a job that has been continued after polling */
+static void batch_job_polled(CMP_SES *ses, int rv, void *arg)
+{
+    BATCH_JOB *job = arg;
+
+    job->rv = rv;
+    job->polled = 1;
+    job->ready = 1;
+}
+
+/*
+ * runs the jobs given in the -jobs file, up to opt_parallel of them at a time,
+ * using the settings of cmp_ctx. Trust material and credentials are loaded
+ * only once and shared among all jobs.
+ * Returns 1 if all jobs succeeded, else 0
+ */
+static int run_batch_jobs(ENGINE *e)
+{
+    BATCH_JOB *jobs = NULL;
+    BATCH_JOB **slots = NULL; /* jobs in progress */
+    CMP_SES_SCHED *sched = NULL; /* jobs waiting to poll for their response */
+#ifdef OPENSSL_SYS_UNIX
+    /*
+     * poll() is used where available since with many parallel jobs the
+     * sockets may exceed the range that can be given to select()
+     */
+    struct pollfd *pfds = NULL; /* one per slot, unused ones having fd -1 */
+#endif
+    int num, next = 0, active = 0, succeeded = 0, i;
+    time_t start = time(NULL);
+
+    if ((num = load_batch_jobs(opt_jobs, &jobs)) < 0)
+        return 0;
+    if ((slots = OPENSSL_zalloc(opt_parallel * sizeof(*slots))) == NULL ||
+#ifdef OPENSSL_SYS_UNIX
+        (pfds = OPENSSL_malloc(opt_parallel * sizeof(*pfds))) == NULL ||
+#endif
+        (sched = CMP_SES_SCHED_new()) == NULL) {
+        BIO_printf(bio_err, "out of memory\n");
+        goto end;
+    }
+
+    while (next < num || active > 0) {
+        time_t now, deadline, wait = -1;
+#ifndef OPENSSL_SYS_UNIX
+        struct timeval tv;
+        fd_set readfds, writefds;
+        int maxfd = -1;
+#endif
+        int nfds = 0, rv;
+
+        /* start further jobs as long as there are free slots */
+        for (i = 0; i < opt_parallel && next < num; i++) {
+            BATCH_JOB *job = &jobs[next];
+
+            if (slots[i] != NULL)
+                continue;
+            next++;
+            if (!batch_job_start(job, e)) {
+                job->rv = CMP_SES_ERROR;
+                succeeded += batch_job_finish(job);
+                i--; /* try again with the same slot */
+                continue;
+            }
+            slots[i] = job;
+            active++;
+        }
+
+        /* continue all jobs that are ready */
+        for (i = 0; i < opt_parallel; i++) {
+            BATCH_JOB *job = slots[i];
+
+            if (job == NULL || !job->ready)
+                continue;
+            if (job->polled)
+                job->polled = 0;
+            else
+                job->rv = CMP_SES_step(job->ses);
+            if (job->rv == CMP_SES_WANT_TIMER &&
+                !CMP_SES_SCHED_add(sched, job->ses, job))
+                job->rv = CMP_SES_ERROR;
+            if (job->rv == CMP_SES_DONE || job->rv == CMP_SES_ERROR) {
+                succeeded += batch_job_finish(job);
+                slots[i] = NULL;
+                active--;
+            } else {
+                job->ready = job->rv == CMP_SES_WANT_ASYNC;
+            }
+        }
+        if (active == 0)
+            continue;
+
+        /* wait for I/O or the next deadline of the remaining jobs */
+#ifndef OPENSSL_SYS_UNIX
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+#endif
+        now = time(NULL);
+        if ((deadline = CMP_SES_SCHED_next_deadline(sched)) != 0)
+            wait = deadline > now ? deadline - now : 0;
+        for (i = 0; i < opt_parallel; i++) {
+            BATCH_JOB *job = slots[i];
+            int fd;
+
+#ifdef OPENSSL_SYS_UNIX
+            pfds[i].fd = -1;
+            pfds[i].revents = 0;
+#endif
+            if (job == NULL || job->rv == CMP_SES_WANT_TIMER)
+                continue;
+            if (job->ready) {
+                wait = 0;
+                continue;
+            }
+            if ((deadline = CMP_SES_get_deadline(job->ses)) != 0 &&
+                (wait < 0 || deadline - now < wait))
+                wait = deadline > now ? deadline - now : 0;
+            if (job->rv == CMP_SES_WANT_READ || job->rv == CMP_SES_WANT_WRITE) {
+                if ((fd = CMP_SES_get_fd(job->ses)) < 0) {
+                    job->ready = 1;
+                    wait = 0;
+                    continue;
+                }
+#ifdef OPENSSL_SYS_UNIX
+                pfds[i].fd = fd;
+                pfds[i].events =
+                    job->rv == CMP_SES_WANT_READ ? POLLIN : POLLOUT;
+#else
+# ifndef OPENSSL_SYS_WINDOWS
+                if (fd >= FD_SETSIZE) {
+                    BIO_printf(bio_err,
+                               "error: socket %d exceeds FD_SETSIZE\n", fd);
+                    goto end;
+                }
+# endif
+                if (job->rv == CMP_SES_WANT_READ)
+                    openssl_fdset(fd, &readfds);
+                else
+                    openssl_fdset(fd, &writefds);
+                if (fd > maxfd)
+                    maxfd = fd;
+#endif
+                nfds++;
+            }
+        }
+        if (nfds > 0) {
+#ifdef OPENSSL_SYS_UNIX
+            rv = poll(pfds, opt_parallel, wait < 0 ? -1
+                      : wait > INT_MAX / 1000 ? INT_MAX : (int)wait * 1000);
+#else
+            tv.tv_sec = (long)wait;
+            tv.tv_usec = 0;
+            rv = select(maxfd + 1, &readfds, &writefds, NULL,
+                        wait >= 0 ? &tv : NULL);
+#endif
+            if (rv < 0) {
+                BIO_printf(bio_err, "error: waiting for I/O failed\n");
+                goto end;
+            }
+        } else if (wait > 0) {
+            sleep((unsigned int)wait);
+        }
+
+        now = time(NULL);
+        for (i = 0; i < opt_parallel; i++) {
+            BATCH_JOB *job = slots[i];
+            int fd;
+
+            if (job == NULL || job->ready || job->rv == CMP_SES_WANT_TIMER)
+                continue;
+            deadline = CMP_SES_get_deadline(job->ses);
+#ifdef OPENSSL_SYS_UNIX
+            fd = pfds[i].fd;
+            job->ready = (deadline != 0 && now >= deadline) ||
+                (fd >= 0 && pfds[i].revents != 0);
+#else
+            fd = CMP_SES_get_fd(job->ses);
+            job->ready = (deadline != 0 && now >= deadline) ||
+                (fd >= 0 && (FD_ISSET(fd, &readfds) ||
+                             FD_ISSET(fd, &writefds)));
+#endif
+        }
+        /* send the pollReqs of the jobs whose checkAfter time has passed */
+        if (CMP_SES_SCHED_run(sched, batch_job_polled) < 0) {
+            ERR_print_errors(bio_err);
+            goto end;
+        }
+    }
+
+ end:
+    for (i = 0; slots != NULL && i < opt_parallel; i++)
+        if (slots[i] != NULL) {
+            slots[i]->rv = CMP_SES_ERROR;
+            (void)batch_job_finish(slots[i]);
+        }
+    CMP_SES_SCHED_free(sched);
+    BIO_printf(bio_out, "%d of %d jobs succeeded in %ld seconds\n",
+               succeeded, num, (long)(time(NULL) - start));
+    for (i = 0; i < num; i++)
+        OPENSSL_free(jobs[i].buf);
+    OPENSSL_free(jobs);
+    OPENSSL_free(slots);
+#ifdef OPENSSL_SYS_UNIX
+    OPENSSL_free(pfds);
+#endif
+    return succeeded == num;
+}
+
 static void print_itavs(STACK_OF(CMP_INFOTYPEANDVALUE) *itavs)
 {
     CMP_INFOTYPEANDVALUE *itav = NULL;
@@ -3926,6 +4628,9 @@ static int get_opts(int argc, char **argv)
             if ((opt_totaltimeout = opt_nat()) < 0)
                 goto opt_err;
             break;
+        case OPT_TIMING:
+            opt_timing = opt_str("timing");
+            break;
 
         case OPT_TLS_USED:
             opt_tls_used = 1;
@@ -4103,6 +4808,13 @@ static int get_opts(int argc, char **argv)
         case OPT_CERTOUT:
             opt_certout = opt_str("certout");
             break;
+        case OPT_JOBS:
+            opt_jobs = opt_str("jobs");
+            break;
+        case OPT_PARALLEL:
+            if ((opt_parallel = opt_nat()) < 0)
+                goto opt_err;
+            break;
 
         case OPT_OLDCERT:
             opt_oldcert = opt_str("oldcert");
@@ -4111,6 +4823,13 @@ static int get_opts(int argc, char **argv)
             if (!opt_int(opt_arg(), &opt_revreason))
                 goto opt_err;
             break;
+        case OPT_REVCERTS:
+            opt_revcerts = opt_str("revcerts");
+            break;
+        case OPT_REVBATCH:
+            if (!opt_int(opt_arg(), &opt_revbatch))
+                goto opt_err;
+            break;
 
         case OPT_OWNFORM:
             opt_ownform_s = opt_str("ownform");
@@ -4152,6 +4871,18 @@ static int get_opts(int argc, char **argv)
         case OPT_MOCK_SRV:
             opt_mock_srv = 1;
             break;
+        case OPT_PORT:
+            if ((opt_port = opt_nat()) < 0)
+                goto opt_err;
+            break;
+        case OPT_SRV_THREADS:
+            if ((opt_srv_threads = opt_nat()) < 0)
+                goto opt_err;
+            break;
+        case OPT_SRV_TIMEOUT:
+            if ((opt_srv_timeout = opt_nat()) < 0)
+                goto opt_err;
+            break;
         case OPT_SRV_REF:
             opt_srv_ref = opt_str("srv_ref");
             break;
@@ -4416,12 +5147,29 @@ int cmp_main(int argc, char **argv)
 
     if (opt_engine)
         e = setup_engine_no_default(opt_engine, 0);
+#ifndef NDEBUG
+    if (opt_port > 0) {
+# ifndef OPENSSL_NO_SOCK
+        if (setup_srv_ctx(e))
+            (void)run_server();
+# else
+        BIO_puts(bio_err, "error: -port is not supported without sockets\n");
+# endif
+        goto err;
+    }
+#endif
     cmp_ctx = CMP_CTX_create();
     if (cmp_ctx == NULL || !setup_ctx(cmp_ctx, e)) {
         BIO_puts(bio_err, "error setting up CMP context\n");
         goto err;
     }
 
+    if (opt_jobs != NULL) {
+        if (run_batch_jobs(e))
+            ret = 0;
+        goto err;
+    }
+
     /*
      * everything is ready, now connect and perform the command!
      */
@@ -4447,8 +5195,21 @@ int cmp_main(int argc, char **argv)
             goto err;
         break;
     case CMP_RR:
-        if (!CMP_exec_RR_ses(cmp_ctx))
+        if (!CMP_exec_RR_ses(cmp_ctx)) {
+            STACK_OF(CMP_PKISTATUSINFO) *sis = CMP_CTX_get0_revStatus(cmp_ctx);
+            int i;
+
+            /* -oldcert, if given, is the first one, followed by -revcerts */
+            for (i = 0; sk_CMP_PKISTATUSINFO_num(sis) > 1
+                     && i < sk_CMP_PKISTATUSINFO_num(sis); i++)
+                if (CMP_PKISTATUSINFO_PKIStatus_get(
+                        sk_CMP_PKISTATUSINFO_value(sis, i))
+                    == CMP_PKISTATUS_rejection)
+                    BIO_printf(bio_err,
+                               "revocation of certificate #%d rejected\n",
+                               i + 1);
             goto err;
+        }
         break;
     case CMP_GENM:
         {
@@ -4490,15 +5251,8 @@ int cmp_main(int argc, char **argv)
         sk_X509_pop_free(certs, X509_free);
     }
 
-    if (opt_certout && newcert) {
-        STACK_OF(X509) *certs = sk_X509_new_null();
-        if (certs == NULL || !sk_X509_push(certs, X509_dup(newcert)) ||
-            save_certs(certs, opt_certout, "enrolled") < 0) {
-            sk_X509_pop_free(certs, X509_free);
-            goto err;
-        }
-        sk_X509_pop_free(certs, X509_free);
-    }
+    if (opt_certout && newcert && !save_newcert(newcert, opt_certout))
+        goto err;
 
     ret = 0;
  err:
@@ -4515,6 +5269,10 @@ int cmp_main(int argc, char **argv)
         OPENSSL_cleanse(opt_srv_secret, strlen(opt_srv_secret));
 #endif
     CMP_CTX_delete(cmp_ctx);
+    if (timing_bio != NULL) {
+        BIO_puts(timing_bio, "\n]\n");
+        BIO_free_all(timing_bio);
+    }
     X509_VERIFY_PARAM_free(vpm);
     release_engine(e);
 
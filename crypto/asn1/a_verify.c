@@ -88,34 +88,71 @@ int ASN1_item_verify(const ASN1_ITEM *it, X509_ALGOR *a,
     unsigned char *buf_in = NULL;
     int ret = -1, inl = 0;
 
-    int mdnid, pknid;
-
     if (!pkey) {
         ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ERR_R_PASSED_NULL_PARAMETER);
         return -1;
     }
 
-    if (signature->type == V_ASN1_BIT_STRING && signature->flags & 0x7) {
-        ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ASN1_R_INVALID_BIT_STRING_BITS_LEFT);
-        return -1;
-    }
-
     ctx = EVP_MD_CTX_new();
     if (ctx == NULL) {
         ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ERR_R_MALLOC_FAILURE);
         goto err;
     }
 
+    inl = ASN1_item_i2d(asn, &buf_in, it);
+
+    if (buf_in == NULL) {
+        ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ERR_R_MALLOC_FAILURE);
+        goto err;
+    }
+
+    ret = asn1_item_verify_tbs(ctx, it, a, signature, asn, buf_in, inl, pkey);
+ err:
+    OPENSSL_clear_free(buf_in, (unsigned int)inl);
+    EVP_MD_CTX_free(ctx);
+    return ret;
+}
+
+/*
+ * Like ASN1_item_verify() but with the signed data |tbs| already encoded,
+ * e.g., as retained from decoding |asn|, and using the given context, which
+ * is reset first, such that it can be reused for verifying many items.
+ */
+int asn1_item_verify_tbs(EVP_MD_CTX *ctx, const ASN1_ITEM *it, X509_ALGOR *a,
+                         ASN1_BIT_STRING *signature, void *asn,
+                         const unsigned char *tbs, size_t tbslen,
+                         EVP_PKEY *pkey)
+{
+    int ret = -1;
+    int mdnid, pknid;
+
+    if (!pkey || ctx == NULL || tbs == NULL) {
+        ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS, ERR_R_PASSED_NULL_PARAMETER);
+        return -1;
+    }
+
+    if (signature->type == V_ASN1_BIT_STRING && signature->flags & 0x7) {
+        ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS,
+                ASN1_R_INVALID_BIT_STRING_BITS_LEFT);
+        return -1;
+    }
+
+    if (!EVP_MD_CTX_reset(ctx)) {
+        ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS, ERR_R_EVP_LIB);
+        return -1;
+    }
+
     /* Convert signature OID into digest and public key OIDs */
     if (!OBJ_find_sigid_algs(OBJ_obj2nid(a->algorithm), &mdnid, &pknid)) {
-        ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ASN1_R_UNKNOWN_SIGNATURE_ALGORITHM);
-        goto err;
+        ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS,
+                ASN1_R_UNKNOWN_SIGNATURE_ALGORITHM);
+        return -1;
     }
     if (mdnid == NID_undef) {
         if (!pkey->ameth || !pkey->ameth->item_verify) {
-            ASN1err(ASN1_F_ASN1_ITEM_VERIFY,
+            ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS,
                     ASN1_R_UNKNOWN_SIGNATURE_ALGORITHM);
-            goto err;
+            return -1;
         }
         ret = pkey->ameth->item_verify(ctx, it, asn, a, signature, pkey);
         /*
@@ -124,47 +161,34 @@ int ASN1_item_verify(const ASN1_ITEM *it, X509_ALGOR *a,
          * routine handles all verification.
          */
         if (ret != 2)
-            goto err;
-        ret = -1;
+            return ret;
     } else {
         const EVP_MD *type;
         type = EVP_get_digestbynid(mdnid);
         if (type == NULL) {
-            ASN1err(ASN1_F_ASN1_ITEM_VERIFY,
+            ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS,
                     ASN1_R_UNKNOWN_MESSAGE_DIGEST_ALGORITHM);
-            goto err;
+            return -1;
         }
 
         /* Check public key OID matches public key type */
         if (EVP_PKEY_type(pknid) != pkey->ameth->pkey_id) {
-            ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ASN1_R_WRONG_PUBLIC_KEY_TYPE);
-            goto err;
+            ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS, ASN1_R_WRONG_PUBLIC_KEY_TYPE);
+            return -1;
         }
 
         if (!EVP_DigestVerifyInit(ctx, NULL, type, NULL, pkey)) {
-            ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ERR_R_EVP_LIB);
-            ret = 0;
-            goto err;
+            ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS, ERR_R_EVP_LIB);
+            return 0;
         }
 
     }
 
-    inl = ASN1_item_i2d(asn, &buf_in, it);
-
-    if (buf_in == NULL) {
-        ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ERR_R_MALLOC_FAILURE);
-        goto err;
-    }
-
     ret = EVP_DigestVerify(ctx, signature->data, (size_t)signature->length,
-                           buf_in, inl);
+                           tbs, tbslen);
     if (ret <= 0) {
-        ASN1err(ASN1_F_ASN1_ITEM_VERIFY, ERR_R_EVP_LIB);
-        goto err;
+        ASN1err(ASN1_F_ASN1_ITEM_VERIFY_TBS, ERR_R_EVP_LIB);
+        return ret;
     }
-    ret = 1;
- err:
-    OPENSSL_clear_free(buf_in, (unsigned int)inl);
-    EVP_MD_CTX_free(ctx);
-    return ret;
+    return 1;
 }
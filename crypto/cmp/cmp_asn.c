@@ -36,6 +36,13 @@ ASN1_SEQUENCE(CMP_CHALLENGE) = {
 IMPLEMENT_ASN1_FUNCTIONS(CMP_CHALLENGE)
 
 
+ASN1_SEQUENCE(CMP_DHBMPARAMETER) = {
+    ASN1_SIMPLE(CMP_DHBMPARAMETER, owf, X509_ALGOR),
+    ASN1_SIMPLE(CMP_DHBMPARAMETER, mac, X509_ALGOR)
+} ASN1_SEQUENCE_END(CMP_DHBMPARAMETER)
+IMPLEMENT_ASN1_FUNCTIONS(CMP_DHBMPARAMETER)
+
+
 ASN1_ITEM_TEMPLATE(CMP_POPODECKEYCHALLCONTENT) =
     ASN1_EX_TEMPLATE_TYPE(ASN1_TFLG_SEQUENCE_OF, 0, CMP_POPODECKEYCHALLCONTENT,
             CMP_CHALLENGE)
@@ -255,10 +262,11 @@ IMPLEMENT_ASN1_DUP_FUNCTION(CMP_PKISTATUSINFO)
 
 ASN1_SEQUENCE(CMP_CERTSTATUS) = {
     ASN1_SIMPLE(CMP_CERTSTATUS, certHash, ASN1_OCTET_STRING),
-    ASN1_SIMPLE(CMP_CERTSTATUS, certReqId, ASN1_INTEGER),
+    ASN1_EMBED(CMP_CERTSTATUS, certReqId, ASN1_INTEGER),
     ASN1_OPT(CMP_CERTSTATUS, statusInfo, CMP_PKISTATUSINFO)
 } ASN1_SEQUENCE_END(CMP_CERTSTATUS)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_CERTSTATUS)
+IMPLEMENT_ASN1_DUP_FUNCTION(CMP_CERTSTATUS)
 
 ASN1_ITEM_TEMPLATE(CMP_CERTCONFIRMCONTENT) =
     ASN1_EX_TEMPLATE_TYPE(ASN1_TFLG_SEQUENCE_OF, 0, CMP_CERTCONFIRMCONTENT,
@@ -266,7 +274,7 @@ ASN1_ITEM_TEMPLATE(CMP_CERTCONFIRMCONTENT) =
 ASN1_ITEM_TEMPLATE_END(CMP_CERTCONFIRMCONTENT)
 
 ASN1_SEQUENCE(CMP_CERTRESPONSE) = {
-    ASN1_SIMPLE(CMP_CERTRESPONSE, certReqId, ASN1_INTEGER),
+    ASN1_EMBED(CMP_CERTRESPONSE, certReqId, ASN1_INTEGER),
     ASN1_SIMPLE(CMP_CERTRESPONSE, status, CMP_PKISTATUSINFO),
     ASN1_OPT(CMP_CERTRESPONSE, certifiedKeyPair, CMP_CERTIFIEDKEYPAIR),
     ASN1_OPT(CMP_CERTRESPONSE, rspInfo, ASN1_OCTET_STRING)
@@ -274,7 +282,7 @@ ASN1_SEQUENCE(CMP_CERTRESPONSE) = {
 IMPLEMENT_ASN1_FUNCTIONS(CMP_CERTRESPONSE)
 
 ASN1_SEQUENCE(CMP_POLLREQ) = {
-    ASN1_SIMPLE(CMP_POLLREQ, certReqId, ASN1_INTEGER)
+    ASN1_EMBED(CMP_POLLREQ, certReqId, ASN1_INTEGER)
 } ASN1_SEQUENCE_END(CMP_POLLREQ)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_POLLREQ)
 
@@ -284,8 +292,8 @@ ASN1_ITEM_TEMPLATE(CMP_POLLREQCONTENT) =
 ASN1_ITEM_TEMPLATE_END(CMP_POLLREQCONTENT)
 
 ASN1_SEQUENCE(CMP_POLLREP) = {
-    ASN1_SIMPLE(CMP_POLLREP, certReqId, ASN1_INTEGER),
-    ASN1_SIMPLE(CMP_POLLREP, checkAfter, ASN1_INTEGER),
+    ASN1_EMBED(CMP_POLLREP, certReqId, ASN1_INTEGER),
+    ASN1_EMBED(CMP_POLLREP, checkAfter, ASN1_INTEGER),
     ASN1_SEQUENCE_OF_OPT(CMP_POLLREP, reason, ASN1_UTF8STRING),
 } ASN1_SEQUENCE_END(CMP_POLLREP)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_POLLREP)
@@ -348,7 +356,7 @@ ASN1_CHOICE(CMP_PKIBODY) = {
 IMPLEMENT_ASN1_FUNCTIONS(CMP_PKIBODY)
 
 ASN1_SEQUENCE(CMP_PKIHEADER) = {
-    ASN1_SIMPLE(CMP_PKIHEADER, pvno, ASN1_INTEGER),
+    ASN1_EMBED(CMP_PKIHEADER, pvno, ASN1_INTEGER),
     ASN1_SIMPLE(CMP_PKIHEADER, sender, GENERAL_NAME),
     ASN1_SIMPLE(CMP_PKIHEADER, recipient, GENERAL_NAME),
     ASN1_EXP_OPT(CMP_PKIHEADER, messageTime, ASN1_GENERALIZEDTIME, 0),
@@ -369,21 +377,27 @@ ASN1_SEQUENCE(CMP_PKIHEADER) = {
 IMPLEMENT_ASN1_FUNCTIONS(CMP_PKIHEADER)
 
 ASN1_SEQUENCE(CMP_PROTECTEDPART) = {
-    ASN1_SIMPLE(CMP_PKIMESSAGE, header, CMP_PKIHEADER),
-    ASN1_SIMPLE(CMP_PKIMESSAGE, body, CMP_PKIBODY)
+    ASN1_SIMPLE(CMP_PROTECTEDPART, header, CMP_PKIHEADER),
+    ASN1_SIMPLE(CMP_PROTECTEDPART, body, CMP_PKIBODY)
 } ASN1_SEQUENCE_END(CMP_PROTECTEDPART)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
 
-ASN1_SEQUENCE(CMP_PKIMESSAGE) = {
-    ASN1_SIMPLE(CMP_PKIMESSAGE, header, CMP_PKIHEADER),
+/* retain the DER encoding, such that it need not be redone for protection */
+ASN1_SEQUENCE_enc(CMP_PKIMESSAGE, enc, 0) = {
+    ASN1_EMBED(CMP_PKIMESSAGE, header, CMP_PKIHEADER),
     ASN1_SIMPLE(CMP_PKIMESSAGE, body, CMP_PKIBODY),
     ASN1_EXP_OPT(CMP_PKIMESSAGE, protection, ASN1_BIT_STRING, 0),
     /* CMP_CMPCERTIFICATE is effectively X509 so it is used directly */
     ASN1_EXP_SEQUENCE_OF_OPT(CMP_PKIMESSAGE, extraCerts, X509, 1)
-} ASN1_SEQUENCE_END(CMP_PKIMESSAGE)
+} ASN1_SEQUENCE_END_enc(CMP_PKIMESSAGE, CMP_PKIMESSAGE)
 IMPLEMENT_ASN1_FUNCTIONS(CMP_PKIMESSAGE)
 IMPLEMENT_ASN1_DUP_FUNCTION(CMP_PKIMESSAGE)
 
+ASN1_SEQUENCE(CMP_PKIMESSAGE_TAIL) = {
+    ASN1_EXP_OPT(CMP_PKIMESSAGE_TAIL, protection, ASN1_BIT_STRING, 0),
+    ASN1_EXP_SEQUENCE_OF_OPT(CMP_PKIMESSAGE_TAIL, extraCerts, X509, 1)
+} ASN1_SEQUENCE_END(CMP_PKIMESSAGE_TAIL)
+
 ASN1_ITEM_TEMPLATE(CMP_PKIMESSAGES) =
     ASN1_EX_TEMPLATE_TYPE(ASN1_TFLG_SEQUENCE_OF, 0, CMP_PKIMESSAGES,
                           CMP_PKIMESSAGE)
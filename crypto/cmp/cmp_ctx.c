@@ -22,8 +22,12 @@
 #include <openssl/crypto.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
 #ifndef _WIN32
 #include <dirent.h>
+#include <sys/time.h>
+#else
+#include <windows.h>
 #endif
 
 #include "cmp_int.h"
@@ -58,6 +62,7 @@ ASN1_SEQUENCE(CMP_CTX) = {
     ASN1_SEQUENCE_OF_OPT(CMP_CTX, caPubs, X509),
     ASN1_SEQUENCE_OF_OPT(CMP_CTX, lastStatusString, ASN1_UTF8STRING),
     ASN1_OPT(CMP_CTX, newClCert, X509),
+    ASN1_SEQUENCE_OF_OPT(CMP_CTX, newClCerts, X509),
     ASN1_OPT(CMP_CTX, recipient, X509_NAME),
     ASN1_OPT(CMP_CTX, expected_sender, X509_NAME),
     ASN1_OPT(CMP_CTX, transactionID, ASN1_OCTET_STRING),
@@ -95,11 +100,15 @@ int CMP_CTX_set0_trustedStore(CMP_CTX *ctx, X509_STORE *store)
 
 /*
  * Get current list of non-trusted intermediate certs
+ * Since the caller may modify the list, the clCert chain built from it
+ * is no longer trusted to be up to date and will be built anew.
  */
 STACK_OF(X509) *CMP_CTX_get0_untrusted_certs(CMP_CTX *ctx)
 {
     if (ctx == NULL)
         return NULL;
+    sk_X509_pop_free(ctx->clCert_chain, X509_free);
+    ctx->clCert_chain = NULL;
     return ctx->untrusted_certs;
 }
 
@@ -112,6 +121,8 @@ int CMP_CTX_set1_untrusted_certs(CMP_CTX *ctx, const STACK_OF(X509) *certs)
 {
     if (ctx->untrusted_certs)
         sk_X509_pop_free(ctx->untrusted_certs, X509_free);
+    sk_X509_pop_free(ctx->clCert_chain, X509_free);
+    ctx->clCert_chain = NULL;
     ctx->untrusted_certs = sk_X509_new_null();
     return CMP_sk_X509_add1_certs(ctx->untrusted_certs, certs, 0, 1/*no dups*/);
 }
@@ -136,11 +147,22 @@ int CMP_CTX_init(CMP_CTX *ctx)
     /* all other elements are initialized through ASN1 macros */
     ctx->pkey = NULL;
     ctx->newPkey = NULL;
+    ctx->certReqs = NULL;
+    ctx->revDetails = NULL;
+    ctx->revStatus = NULL;
 
     ctx->pbm_slen = 16;
     ctx->pbm_owf = NID_sha256;
     ctx->pbm_itercnt = 500;
     ctx->pbm_mac = NID_hmac_sha1;
+    if ((ctx->pbm_cache = CRMF_PBM_CACHE_new()) == NULL)
+        goto err;
+    ctx->pbm_reuse_salt = 0;
+    ctx->pbm_algor = NULL;
+    ctx->dhbm = 0;
+    ctx->dhbm_peer = NULL;
+    ctx->dhbm_basekey_len = 0;
+    ctx->pbm_algor_tid = NULL;
 
     ctx->days = 0;
     ctx->SubjectAltName_nodefault = 0;
@@ -149,6 +171,7 @@ int CMP_CTX_init(CMP_CTX *ctx)
     ctx->digest = NID_sha256;
     ctx->popoMethod = CRMF_POPO_SIGNATURE;
     ctx->revocationReason = CRL_REASON_NONE;
+    ctx->revocationBatch = 256;
     ctx->permitTAInExtraCertsForIR = 0;
     ctx->implicitConfirm = 0;
     ctx->disableConfirm = 0;
@@ -185,12 +208,29 @@ int CMP_CTX_init(CMP_CTX *ctx)
         NULL;
 #endif
     ctx->transfer_cb_arg = NULL;
+    ctx->keep_alive = 0;
+    ctx->keep_alive_idle = 30;
+    ctx->keep_alive_maxreq = 100;
+    ctx->http_conn = NULL;
+    ctx->http_conn_peer = NULL;
+    ctx->http_conn_last_used = 0;
+    ctx->http_conn_requests = 0;
     return 1;
 
  err:
     return 0;
 }
 
+static void CMP_CERTREQ_free(CMP_CERTREQ *creq)
+{
+    if (creq == NULL)
+        return;
+    EVP_PKEY_free(creq->pkey);
+    X509_NAME_free(creq->subject);
+    sk_X509_EXTENSION_pop_free(creq->exts, X509_EXTENSION_free);
+    OPENSSL_free(creq);
+}
+
 /*
  * frees CMP_CTX variables allocated in CMP_CTX_init and calls CMP_CTX_free
  */
@@ -198,12 +238,20 @@ void CMP_CTX_delete(CMP_CTX *ctx)
 {
     if (ctx == NULL)
         return;
+    CMP_CTX_http_conn_close(ctx);
     if (ctx->pkey)
         EVP_PKEY_free(ctx->pkey);
     if (ctx->newPkey)
         EVP_PKEY_free(ctx->newPkey);
+    sk_CMP_CERTREQ_pop_free(ctx->certReqs, CMP_CERTREQ_free);
+    sk_CMP_REVDETAILS_pop_free(ctx->revDetails, CMP_REVDETAILS_free);
+    sk_CMP_PKISTATUSINFO_pop_free(ctx->revStatus, CMP_PKISTATUSINFO_free);
+    CMP_CTX_sig_reset(ctx);
     if (ctx->secretValue)
         OPENSSL_cleanse(ctx->secretValue->data, ctx->secretValue->length);
+    CRMF_PBM_CACHE_free(ctx->pbm_cache);
+    X509_ALGOR_free(ctx->pbm_algor);
+    ASN1_OCTET_STRING_free(ctx->pbm_algor_tid);
 
     if (ctx->serverName)
         OPENSSL_free(ctx->serverName);
@@ -215,9 +263,30 @@ void CMP_CTX_delete(CMP_CTX *ctx)
         X509_STORE_free(ctx->trusted_store);
     if (ctx->untrusted_certs)
         sk_X509_pop_free(ctx->untrusted_certs, X509_free);
+    CMP_SRVCERT_CACHE_free(ctx->srvcert_cache);
+    CMP_CERTREQ_TEMPLATE_free(ctx->certReqTemplate);
+    sk_X509_pop_free(ctx->clCert_chain, X509_free);
     CMP_CTX_free(ctx);
 }
 
+/*
+ * internal function
+ *
+ * discards the state prepared for signature-based and DHBasedMac protection,
+ * which needs to be done whenever clCert, pkey, or the digest algorithm change
+ */
+void CMP_CTX_sig_reset(CMP_CTX *ctx)
+{
+    ctx->sig_key_checked = 0;
+    ctx->sig_alg_nid = 0;
+    EVP_MD_CTX_free(ctx->sig_md_ctx);
+    ctx->sig_md_ctx = NULL;
+    X509_free(ctx->dhbm_peer);
+    ctx->dhbm_peer = NULL;
+    OPENSSL_cleanse(ctx->dhbm_basekey, sizeof(ctx->dhbm_basekey));
+    ctx->dhbm_basekey_len = 0;
+}
+
 /*
  * creates and initializes a CMP_CTX structure
  * returns pointer to created CMP_CTX on success, NULL on error
@@ -239,6 +308,188 @@ CMP_CTX *CMP_CTX_create(void)
     return NULL;
 }
 
+/*
+ * internal function
+ *
+ * creates a CMP_CTX sharing the credentials, trust anchors, and message
+ * protection settings of the given template, but with its own, empty
+ * transaction state (transactionID, nonces, recipient, and PBM cache).
+ * Certificates, keys, the trust store, any validated server cert cache, and
+ * any certificate request template are shared by reference counting.
+ * returns pointer to created CMP_CTX on success, NULL on error
+ */
+CMP_CTX *CMP_CTX_derive(const CMP_CTX *tmpl)
+{
+    CMP_CTX *ctx = NULL;
+
+    if (tmpl == NULL) {
+        CMPerr(CMP_F_CMP_CTX_DERIVE, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    if ((ctx = CMP_CTX_create()) == NULL)
+        goto err;
+
+    if ((tmpl->referenceValue != NULL &&
+         (ctx->referenceValue =
+          ASN1_OCTET_STRING_dup(tmpl->referenceValue)) == NULL) ||
+        (tmpl->secretValue != NULL &&
+         !CMP_CTX_set1_secretValue(ctx, tmpl->secretValue->data,
+                                   tmpl->secretValue->length)) ||
+        (tmpl->subjectName != NULL &&
+         (ctx->subjectName = X509_NAME_dup(tmpl->subjectName)) == NULL) ||
+        (tmpl->extraCertsOut != NULL &&
+         (ctx->extraCertsOut = X509_chain_up_ref(tmpl->extraCertsOut))
+         == NULL))
+        goto err;
+    if (tmpl->clCert != NULL) {
+        if (!X509_up_ref(tmpl->clCert))
+            goto err;
+        ctx->clCert = tmpl->clCert;
+    }
+    if (tmpl->pkey != NULL) {
+        if (!EVP_PKEY_up_ref(tmpl->pkey))
+            goto err;
+        ctx->pkey = tmpl->pkey;
+    }
+    if (tmpl->trusted_store != NULL) {
+        if (!X509_STORE_up_ref(tmpl->trusted_store))
+            goto err;
+        X509_STORE_free(ctx->trusted_store);
+        ctx->trusted_store = tmpl->trusted_store;
+    }
+    if (tmpl->untrusted_certs != NULL) {
+        sk_X509_pop_free(ctx->untrusted_certs, X509_free);
+        sk_X509_pop_free(ctx->clCert_chain, X509_free);
+        ctx->clCert_chain = NULL;
+        if ((ctx->untrusted_certs = X509_chain_up_ref(tmpl->untrusted_certs))
+            == NULL)
+            goto err;
+    }
+    if (tmpl->srvcert_cache != NULL) {
+        if (!CMP_SRVCERT_CACHE_up_ref(tmpl->srvcert_cache))
+            goto err;
+        ctx->srvcert_cache = tmpl->srvcert_cache;
+    }
+    if (tmpl->certReqTemplate != NULL) {
+        if (!CMP_CERTREQ_TEMPLATE_up_ref(tmpl->certReqTemplate))
+            goto err;
+        ctx->certReqTemplate = tmpl->certReqTemplate;
+    }
+
+    ctx->pbm_slen = tmpl->pbm_slen;
+    ctx->pbm_owf = tmpl->pbm_owf;
+    ctx->pbm_itercnt = tmpl->pbm_itercnt;
+    ctx->pbm_mac = tmpl->pbm_mac;
+    ctx->pbm_reuse_salt = tmpl->pbm_reuse_salt;
+    ctx->dhbm = tmpl->dhbm;
+    ctx->digest = tmpl->digest;
+    ctx->permitTAInExtraCertsForIR = tmpl->permitTAInExtraCertsForIR;
+    ctx->implicitConfirm = tmpl->implicitConfirm;
+    ctx->unprotectedSend = tmpl->unprotectedSend;
+    ctx->unprotectedErrors = tmpl->unprotectedErrors;
+    ctx->ignore_keyusage = tmpl->ignore_keyusage;
+    ctx->log_cb = tmpl->log_cb;
+    ctx->phase_cb = tmpl->phase_cb;
+    ctx->phase_cb_arg = tmpl->phase_cb_arg;
+    ctx->transfer_cb = NULL;
+    return ctx;
+
+ err:
+    CMPerr(CMP_F_CMP_CTX_DERIVE, CMP_R_OUT_OF_MEMORY);
+    CMP_CTX_delete(ctx);
+    return NULL;
+}
+
+/*
+ * creates a CMP_CTX with the same settings as the given template, such as the
+ * server address, credentials, trust anchors, certificate template, options,
+ * and callbacks, for performing a further transaction in parallel.
+ * Transaction state and results, any further certificate requests added with
+ * CMP_CTX_certReq_push1(), and genm ITAVs are not copied.
+ * Certificates, keys, and the trust store are shared by reference counting,
+ * while the callback arguments are shared as they are.
+ * returns pointer to created CMP_CTX on success, NULL on error
+ */
+CMP_CTX *CMP_CTX_dup(const CMP_CTX *tmpl)
+{
+    CMP_CTX *ctx;
+
+    if (tmpl == NULL) {
+        CMPerr(CMP_F_CMP_CTX_DUP, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    if ((ctx = CMP_CTX_derive(tmpl)) == NULL)
+        return NULL;
+
+    if ((tmpl->srvCert != NULL && !CMP_CTX_set1_srvCert(ctx, tmpl->srvCert)) ||
+        (tmpl->oldClCert != NULL &&
+         !CMP_CTX_set1_oldClCert(ctx, tmpl->oldClCert)) ||
+        (tmpl->p10CSR != NULL && !CMP_CTX_set1_p10CSR(ctx, tmpl->p10CSR)) ||
+        (tmpl->newPkey != NULL && !CMP_CTX_set1_newPkey(ctx, tmpl->newPkey)) ||
+        (tmpl->issuer != NULL && !CMP_CTX_set1_issuer(ctx, tmpl->issuer)) ||
+        (tmpl->recipient != NULL &&
+         !CMP_CTX_set1_recipient(ctx, tmpl->recipient)) ||
+        (tmpl->expected_sender != NULL &&
+         !CMP_CTX_set1_expected_sender(ctx, tmpl->expected_sender)))
+        goto err;
+    if ((tmpl->subjectAltNames != NULL &&
+         (ctx->subjectAltNames =
+          sk_GENERAL_NAME_deep_copy(tmpl->subjectAltNames,
+                                    (sk_GENERAL_NAME_copyfunc)GENERAL_NAME_dup,
+                                    GENERAL_NAME_free)) == NULL) ||
+        (tmpl->policies != NULL &&
+         (ctx->policies =
+          ASN1_item_dup(ASN1_ITEM_rptr(CERTIFICATEPOLICIES), tmpl->policies))
+         == NULL) ||
+        (tmpl->reqExtensions != NULL &&
+         (ctx->reqExtensions =
+          ASN1_item_dup(ASN1_ITEM_rptr(X509_EXTENSIONS), tmpl->reqExtensions))
+         == NULL) ||
+        (tmpl->geninfo_itavs != NULL &&
+         (ctx->geninfo_itavs =
+          sk_CMP_INFOTYPEANDVALUE_deep_copy(tmpl->geninfo_itavs,
+                  (sk_CMP_INFOTYPEANDVALUE_copyfunc)CMP_INFOTYPEANDVALUE_dup,
+                                            CMP_INFOTYPEANDVALUE_free))
+         == NULL))
+        goto err;
+    if ((tmpl->serverName != NULL &&
+         !CMP_CTX_set1_serverName(ctx, tmpl->serverName)) ||
+        (tmpl->serverPath != NULL &&
+         !CMP_CTX_set1_serverPath(ctx, tmpl->serverPath)) ||
+        (tmpl->proxyName != NULL &&
+         !CMP_CTX_set1_proxyName(ctx, tmpl->proxyName)))
+        goto err;
+
+    ctx->serverPort = tmpl->serverPort;
+    ctx->proxyPort = tmpl->proxyPort;
+    ctx->msgtimeout = tmpl->msgtimeout;
+    ctx->totaltimeout = tmpl->totaltimeout;
+    ctx->http_cb = tmpl->http_cb;
+    ctx->http_cb_arg = tmpl->http_cb_arg;
+    ctx->transfer_cb = tmpl->transfer_cb;
+    ctx->transfer_cb_arg = tmpl->transfer_cb_arg;
+    ctx->keep_alive = tmpl->keep_alive;
+    ctx->keep_alive_idle = tmpl->keep_alive_idle;
+    ctx->keep_alive_maxreq = tmpl->keep_alive_maxreq;
+    ctx->certConf_cb = tmpl->certConf_cb;
+    ctx->certConf_cb_arg = tmpl->certConf_cb_arg;
+    ctx->days = tmpl->days;
+    ctx->SubjectAltName_nodefault = tmpl->SubjectAltName_nodefault;
+    ctx->setSubjectAltNameCritical = tmpl->setSubjectAltNameCritical;
+    ctx->setPoliciesCritical = tmpl->setPoliciesCritical;
+    ctx->popoMethod = tmpl->popoMethod;
+    ctx->revocationReason = tmpl->revocationReason;
+    ctx->revocationBatch = tmpl->revocationBatch;
+    ctx->disableConfirm = tmpl->disableConfirm;
+    ctx->async = tmpl->async;
+    return ctx;
+
+ err:
+    CMPerr(CMP_F_CMP_CTX_DUP, CMP_R_OUT_OF_MEMORY);
+    CMP_CTX_delete(ctx);
+    return NULL;
+}
+
 /*
  * returns the PKIStatus from the last CertRepMessage
  * or Revocation Response, -1 on error
@@ -299,6 +550,98 @@ void *CMP_CTX_get_certConf_cb_arg(CMP_CTX *ctx)
     return ctx->certConf_cb_arg;
 }
 
+/*
+ * Set callback function that is invoked at the end of each phase of a
+ * message exchange, such as protecting, encoding, transferring, decoding,
+ * and validating messages, with the monotonic start and end times of the
+ * phase in microseconds and the number of bytes processed, if applicable.
+ * returns 1 on success, 0 on error
+ */
+int CMP_CTX_set_phase_cb(CMP_CTX *ctx, cmp_phase_cb_t cb)
+{
+    if (ctx == NULL)
+        goto err;
+    ctx->phase_cb = cb;
+    return 1;
+ err:
+    return 0;
+}
+
+/*
+ * Set argument, respecively a pointer to a structure containing arguments,
+ * optionally to be used by the phase callback
+ * returns 1 on success, 0 on error
+ */
+int CMP_CTX_set_phase_cb_arg(CMP_CTX *ctx, void *arg)
+{
+    if (ctx == NULL)
+        goto err;
+    ctx->phase_cb_arg = arg;
+    return 1;
+ err:
+    return 0;
+}
+
+/*
+ * Get argument, respecively the pointer to a structure containing arguments,
+ * optionally to be used by the phase callback
+ * returns callback argument set previously (NULL if not set or on error)
+ */
+void *CMP_CTX_get_phase_cb_arg(CMP_CTX *ctx)
+{
+    if (ctx == NULL)
+        return NULL;
+    return ctx->phase_cb_arg;
+}
+
+/* returns a monotonic time in microseconds */
+static uint64_t phase_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER freq, count;
+
+    if (QueryPerformanceFrequency(&freq) && QueryPerformanceCounter(&count))
+        return (uint64_t)(count.QuadPart / freq.QuadPart * 1000000
+                          + count.QuadPart % freq.QuadPart * 1000000
+                            / freq.QuadPart);
+    return (uint64_t)GetTickCount() * 1000;
+#else
+# ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+# endif
+    {
+        struct timeval tv;
+
+        gettimeofday(&tv, NULL);
+        return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+#endif
+}
+
+/*
+ * internal function
+ * returns the start time of a phase to be reported via CMP_CTX_phase_end(),
+ * or 0 if there is no phase callback, such that timing costs nothing then
+ */
+uint64_t CMP_CTX_phase_start(const CMP_CTX *ctx)
+{
+    return ctx != NULL && ctx->phase_cb != NULL ? phase_now() : 0;
+}
+
+/*
+ * internal function
+ * reports the end of the given phase, which started at the given time and
+ * processed the given number of bytes, to any phase callback
+ */
+void CMP_CTX_phase_end(CMP_CTX *ctx, int phase, uint64_t start, size_t bytes)
+{
+    if (ctx != NULL && ctx->phase_cb != NULL)
+        (*ctx->phase_cb)(ctx, phase, start, phase_now(), bytes);
+}
+
 /*
  * Set a callback function for log messages.
  * returns 1 on success, 0 on error
@@ -341,6 +684,10 @@ int CMP_CTX_set1_secretValue(CMP_CTX *ctx, const unsigned char *sec,
     }
     if (ctx->secretValue)
         OPENSSL_cleanse(ctx->secretValue->data, ctx->secretValue->length);
+    /* do not keep keys derived from the old password any longer */
+    CRMF_PBM_CACHE_free(ctx->pbm_cache);
+    if ((ctx->pbm_cache = CRMF_PBM_CACHE_new()) == NULL)
+        return 0;
     return CMP_ASN1_OCTET_STRING_set1_bytes(&ctx->secretValue, sec, len);
 }
 
@@ -644,6 +991,48 @@ int CMP_CTX_set1_srvCert(CMP_CTX *ctx, const X509 *cert)
     return 0;
 }
 
+/*
+ * Sets a cache of validated server certificates, which may be shared with
+ * other contexts. It is used for validating signature-protected messages
+ * whenever no srvCert is set. The reference count of the cache is incremented.
+ * The cache may be NULL to clear the entry.
+ * returns 1 on success, 0 on error
+ */
+int CMP_CTX_set1_srvCert_cache(CMP_CTX *ctx, CMP_SRVCERT_CACHE *cache)
+{
+    if (ctx == NULL) {
+        CMPerr(CMP_F_CMP_CTX_SET1_SRVCERT_CACHE, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+    if (cache != NULL && !CMP_SRVCERT_CACHE_up_ref(cache))
+        return 0;
+    CMP_SRVCERT_CACHE_free(ctx->srvcert_cache);
+    ctx->srvcert_cache = cache;
+    return 1;
+}
+
+/*
+ * Sets a template for the certificate requests in IR, CR, and KUR messages,
+ * which may be shared with other contexts. The issuer, validity period,
+ * extensions, and POPO parameters are then taken from the template,
+ * while the key, subject, and subjectAltNames are still taken from ctx.
+ * The reference count of the template is incremented.
+ * The template may be NULL to clear the entry.
+ * returns 1 on success, 0 on error
+ */
+int CMP_CTX_set1_certReqTemplate(CMP_CTX *ctx, CMP_CERTREQ_TEMPLATE *tmpl)
+{
+    if (ctx == NULL) {
+        CMPerr(CMP_F_CMP_CTX_SET1_CERTREQTEMPLATE, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+    if (tmpl != NULL && !CMP_CERTREQ_TEMPLATE_up_ref(tmpl))
+        return 0;
+    CMP_CERTREQ_TEMPLATE_free(ctx->certReqTemplate);
+    ctx->certReqTemplate = tmpl;
+    return 1;
+}
+
 /*
  * Set the X509 name of the recipient. Set in the PKIHeader.
  * returns 1 on success, 0 on error
@@ -812,6 +1201,100 @@ int CMP_CTX_subjectAltName_push1(CMP_CTX *ctx, const GENERAL_NAME *name)
     return 0;
 }
 
+/*
+ * Adds a further certificate request to be sent in IR and CR messages along
+ * with the one derived from the other settings in ctx, which are used also for
+ * the further request except that the given key pair is to be certified and
+ * any given subject name and extensions replace subjectName and reqExtensions.
+ * The further requests get consecutive certReqIds following the first one.
+ * returns 1 on success, 0 on error
+ */
+int CMP_CTX_certReq_push1(CMP_CTX *ctx, const EVP_PKEY *pkey,
+                          const X509_NAME *subject,
+                          const X509_EXTENSIONS *exts)
+{
+    CMP_CERTREQ *creq = NULL;
+
+    if (ctx == NULL || pkey == NULL) {
+        CMPerr(CMP_F_CMP_CTX_CERTREQ_PUSH1, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+    if (sk_GENERAL_NAME_num(ctx->subjectAltNames) > 0 && exts != NULL &&
+        X509v3_get_ext_by_NID(exts, NID_subject_alt_name, -1) >= 0) {
+        CMPerr(CMP_F_CMP_CTX_CERTREQ_PUSH1, CMP_R_MULTIPLE_SAN_SOURCES);
+        return 0;
+    }
+
+    if ((creq = OPENSSL_zalloc(sizeof(*creq))) == NULL ||
+        !EVP_PKEY_up_ref((EVP_PKEY *)pkey))
+        goto oom;
+    creq->pkey = (EVP_PKEY *)pkey;
+    if ((subject != NULL &&
+         (creq->subject = X509_NAME_dup((X509_NAME *)subject)) == NULL) ||
+        (exts != NULL &&
+         (creq->exts = sk_X509_EXTENSION_deep_copy(exts,
+                           (sk_X509_EXTENSION_copyfunc)X509_EXTENSION_dup,
+                           X509_EXTENSION_free)) == NULL) ||
+        (ctx->certReqs == NULL &&
+         (ctx->certReqs = sk_CMP_CERTREQ_new_null()) == NULL) ||
+        !sk_CMP_CERTREQ_push(ctx->certReqs, creq))
+        goto oom;
+    return 1;
+
+ oom:
+    CMPerr(CMP_F_CMP_CTX_CERTREQ_PUSH1, CMP_R_OUT_OF_MEMORY);
+    CMP_CERTREQ_free(creq);
+    return 0;
+}
+
+/*
+ * Adds a further certificate, identified by its issuer and serial number, to be
+ * revoked in RR messages along with ctx->oldClCert, if set, using the same
+ * revocation reason. All of them are sent in a single RR message.
+ * returns 1 on success, 0 on error
+ */
+int CMP_CTX_revCert_push1(CMP_CTX *ctx, const X509_NAME *issuer,
+                          const ASN1_INTEGER *serial)
+{
+    CMP_REVDETAILS *rd = NULL;
+    CRMF_CERTTEMPLATE *certTpl;
+
+    if (ctx == NULL || issuer == NULL || serial == NULL) {
+        CMPerr(CMP_F_CMP_CTX_REVCERT_PUSH1, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+
+    if ((rd = CMP_REVDETAILS_new()) == NULL)
+        goto oom;
+    certTpl = rd->certDetails;
+    if (!X509_NAME_set(&certTpl->issuer, (X509_NAME *)issuer) ||
+        (certTpl->serialNumber = ASN1_INTEGER_dup(serial)) == NULL ||
+        (ctx->revDetails == NULL &&
+         (ctx->revDetails = sk_CMP_REVDETAILS_new_null()) == NULL) ||
+        !sk_CMP_REVDETAILS_push(ctx->revDetails, rd))
+        goto oom;
+    return 1;
+
+ oom:
+    CMPerr(CMP_F_CMP_CTX_REVCERT_PUSH1, CMP_R_OUT_OF_MEMORY);
+    CMP_REVDETAILS_free(rd);
+    return 0;
+}
+
+/*
+ * Returns the PKIStatusInfo received in the last RP for each certificate
+ * requested to be revoked, in the order they were given in the RR.
+ * returns NULL on error or if no RP has been received
+ */
+STACK_OF(CMP_PKISTATUSINFO) *CMP_CTX_get0_revStatus(const CMP_CTX *ctx)
+{
+    if (ctx == NULL) {
+        CMPerr(CMP_F_CMP_CTX_GET0_REVSTATUS, CMP_R_INVALID_ARGS);
+        return NULL;
+    }
+    return ctx->revStatus;
+}
+
 /*
  * Set our own client certificate, used for example in KUR and when
  * doing the IR with existing certificate.
@@ -828,6 +1311,9 @@ int CMP_CTX_set1_clCert(CMP_CTX *ctx, const X509 *cert)
         X509_free(ctx->clCert);
         ctx->clCert = NULL;
     }
+    sk_X509_pop_free(ctx->clCert_chain, X509_free);
+    ctx->clCert_chain = NULL;
+    CMP_CTX_sig_reset(ctx);
 
     if ((ctx->clCert = X509_dup((X509 *)cert)) == NULL) {
         CMPerr(CMP_F_CMP_CTX_SET1_CLCERT, CMP_R_OUT_OF_MEMORY);
@@ -920,8 +1406,8 @@ int CMP_CTX_set1_newClCert(CMP_CTX *ctx, const X509 *cert)
 }
 
 /*
- * Get the (newly received in IP/KUP/CP) client certificate from the context
- * TODO: this only permits for one client cert to be received...
+ * Get the (newly received in IP/KUP/CP) client certificate from the context,
+ * which is the one for the first certificate request
  */
 X509 *CMP_CTX_get0_newClCert(CMP_CTX *ctx)
 {
@@ -930,6 +1416,22 @@ X509 *CMP_CTX_get0_newClCert(CMP_CTX *ctx)
     return ctx->newClCert;
 }
 
+/*
+ * Returns a duplicate of the stack of all client certificates newly received
+ * in IP/KUP/CP, in the order of the certificate requests they belong to.
+ * returns NULL on error or if no certificate has been received
+ */
+STACK_OF(X509) *CMP_CTX_newClCerts_get1(CMP_CTX *ctx)
+{
+    if (ctx == NULL) {
+        CMPerr(CMP_F_CMP_CTX_NEWCLCERTS_GET1, CMP_R_INVALID_ARGS);
+        return NULL;
+    }
+    if (ctx->newClCerts == NULL)
+        return NULL;
+    return X509_chain_up_ref(ctx->newClCerts);
+}
+
 /*
  * Set the client's private key. This creates a duplicate of the key
  * so the given pointer is not used directly.
@@ -970,6 +1472,7 @@ int CMP_CTX_set0_pkey(CMP_CTX *ctx, const EVP_PKEY *pkey)
         EVP_PKEY_free(ctx->pkey);
         ctx->pkey = NULL;
     }
+    CMP_CTX_sig_reset(ctx);
 
     ctx->pkey = (EVP_PKEY *)pkey;
     return 1;
@@ -1397,6 +1900,8 @@ int CMP_CTX_set_option(CMP_CTX *ctx, const int opt, const int val) {
         ctx->popoMethod = val;
         break;
     case CMP_CTX_OPT_DIGEST_ALGNID:
+        if (ctx->digest != val)
+            CMP_CTX_sig_reset(ctx);
         ctx->digest = val;
         break;
     case CMP_CTX_OPT_MSGTIMEOUT:
@@ -1411,6 +1916,31 @@ int CMP_CTX_set_option(CMP_CTX *ctx, const int opt, const int val) {
     case CMP_CTX_OPT_REVOCATION_REASON:
         ctx->revocationReason = val;
         break;
+    case CMP_CTX_OPT_REVOCATION_BATCH:
+        if (val < 0)
+            goto err;
+        ctx->revocationBatch = val;
+        break;
+    case CMP_CTX_OPT_KEEP_ALIVE:
+        ctx->keep_alive = val;
+        if (!val)
+            CMP_CTX_http_conn_close(ctx);
+        break;
+    case CMP_CTX_OPT_KEEP_ALIVE_IDLE:
+        ctx->keep_alive_idle = val;
+        break;
+    case CMP_CTX_OPT_KEEP_ALIVE_MAXREQ:
+        ctx->keep_alive_maxreq = val;
+        break;
+    case CMP_CTX_OPT_PBM_REUSE_SALT:
+        ctx->pbm_reuse_salt = val;
+        break;
+    case CMP_CTX_OPT_ASYNC:
+        ctx->async = val;
+        break;
+    case CMP_CTX_OPT_DHBASEDMAC:
+        ctx->dhbm = val;
+        break;
     default:
         goto err;
     }
@@ -14,19 +14,28 @@
 #ifndef OPENSSL_NO_ERR
 
 static const ERR_STRING_DATA CMP_str_functs[] = {
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CERTREQS_INIT, 0), "certreqs_init"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CHECK_RESPONSE, 0), "check_response"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_ASN1_OCTET_STRING_SET1, 0),
      "CMP_ASN1_OCTET_STRING_set1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_ASN1_OCTET_STRING_SET1_BYTES, 0),
      "CMP_ASN1_OCTET_STRING_set1_bytes"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CALC_DHBMAC, 0), "CMP_calc_dhbmac"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CALC_PROTECTION, 0),
      "CMP_calc_protection"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CALC_PROTECTION_CACHED, 0),
+     "CMP_calc_protection_cached"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTCONF_NEW, 0), "CMP_certConf_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTCONF_NEW_MULTI, 0),
+     "CMP_certConf_new_multi"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1, 0),
      "CMP_CERTORENCCERT_encCert_get1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTREPMESSAGE_CERTRESPONSE_GET0, 0),
      "CMP_CERTREPMESSAGE_certResponse_get0"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTREP_NEW, 0), "CMP_certrep_new"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTREQ_NEW, 0), "CMP_certreq_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTREQ_TEMPLATE_NEW, 0),
+     "CMP_CERTREQ_TEMPLATE_new"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTRESPONSE_GET_CERTIFICATE, 0),
      "CMP_CERTRESPONSE_get_certificate"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CERTRESPONSE_NEW, 0),
@@ -39,7 +48,13 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_CAPUBS_POP, 0), "CMP_CTX_caPubs_pop"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_CAPUBS_SET0, 0),
      "CMP_CTX_caPubs_set0"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_CERTREQ_PUSH1, 0),
+     "CMP_CTX_certReq_push1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_CREATE, 0), "CMP_CTX_create"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_DERIVE, 0), "CMP_CTX_derive"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_DHBM_BASEKEY, 0),
+     "CMP_CTX_dhbm_basekey"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_DUP, 0), "CMP_CTX_dup"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_EXTRACERTSIN_GET1, 0),
      "CMP_CTX_extraCertsIn_get1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_EXTRACERTSIN_NUM, 0),
@@ -50,9 +65,15 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
      "CMP_CTX_extraCertsOut_num"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_EXTRACERTSOUT_PUSH1, 0),
      "CMP_CTX_extraCertsOut_push1"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_GET0_REVSTATUS, 0),
+     "CMP_CTX_get0_revStatus"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_INIT, 0), "CMP_CTX_init"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_NEWCLCERTS_GET1, 0),
+     "CMP_CTX_newClCerts_get1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_PUSH_FREETEXT, 0),
      "CMP_CTX_push_freeText"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_REVCERT_PUSH1, 0),
+     "CMP_CTX_revCert_push1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET0_NEWPKEY, 0),
      "CMP_CTX_set0_newPkey"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET0_PKEY, 0), "CMP_CTX_set0_pkey"},
@@ -62,6 +83,8 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
      "CMP_CTX_set0_tlsBIO"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_CAPUBS, 0),
      "CMP_CTX_set1_caPubs"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_CERTREQTEMPLATE, 0),
+     "CMP_CTX_set1_certReqTemplate"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_CLCERT, 0),
      "CMP_CTX_set1_clCert"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_EXPECTED_SENDER, 0),
@@ -99,6 +122,8 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
      "CMP_CTX_set1_serverPath"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_SRVCERT, 0),
      "CMP_CTX_set1_srvCert"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_SRVCERT_CACHE, 0),
+     "CMP_CTX_set1_srvCert_cache"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_SUBJECTNAME, 0),
      "CMP_CTX_set1_subjectName"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET1_TRANSACTIONID, 0),
@@ -107,9 +132,15 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
      "CMP_CTX_set_proxyPort"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SET_SERVERPORT, 0),
      "CMP_CTX_set_serverPort"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SIG_PREPARE, 0),
+     "CMP_CTX_sig_prepare"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_CTX_SUBJECTALTNAME_PUSH1, 0),
      "CMP_CTX_subjectAltName_push1"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_ENCCERT_NEW, 0), "CMP_encCert_new"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_ERROR_NEW, 0), "CMP_error_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXCHANGE_CERTCONF, 0),
+     "CMP_exchange_certConf"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXCHANGE_ERROR, 0), "CMP_exchange_error"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXEC_CR_SES, 0), "CMP_exec_CR_ses"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXEC_GENM_SES, 0), "CMP_exec_GENM_ses"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXEC_IR_SES, 0), "CMP_exec_IR_ses"},
@@ -142,6 +173,8 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
      "CMP_PKIMESSAGE_genm_items_push1"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_PKIMESSAGE_GENM_ITEM_PUSH0, 0),
      "CMP_PKIMESSAGE_genm_item_push0"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_PKIMESSAGE_HTTP_NBIO, 0),
+     "CMP_PKIMESSAGE_http_nbio"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, 0),
      "CMP_PKIMESSAGE_http_perform"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_PKIMESSAGE_POLLRESPONSE_GET0, 0),
@@ -158,42 +191,79 @@ static const ERR_STRING_DATA CMP_str_functs[] = {
      "CMP_POLLREPCONTENT_pollRep_get0"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POLLREP_NEW, 0), "CMP_pollrep_new"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POLLREQ_NEW, 0), "CMP_pollReq_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POLLREQ_NEW_MULTI, 0),
+     "CMP_pollReq_new_multi"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POPO_BATCH_ADD, 0), "CMP_POPO_BATCH_add"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POPO_BATCH_GET_RESULT, 0),
+     "CMP_POPO_BATCH_get_result"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POPO_BATCH_NEW, 0), "CMP_POPO_BATCH_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_POPO_BATCH_VERIFY, 0),
+     "CMP_POPO_BATCH_verify"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_PROCESS_CERT_REQUEST, 0),
      "CMP_process_cert_request"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_REVREPCONTENT_PKISTATUSINFO_GET, 0),
      "CMP_REVREPCONTENT_PKIStatusInfo_get"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_RP_NEW, 0), "CMP_rp_new"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_RR_NEW, 0), "CMP_rr_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_RR_NEW_RANGE, 0), "CMP_rr_new_range"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SES_SCHED_ADD, 0), "CMP_SES_SCHED_add"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SES_SCHED_NEW, 0), "CMP_SES_SCHED_new"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SES_SCHED_REMOVE, 0),
+     "CMP_SES_SCHED_remove"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SES_SCHED_RUN, 0), "CMP_SES_SCHED_run"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SES_START, 0), "CMP_SES_start"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SES_STEP, 0), "CMP_SES_step"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SRVCERT_CACHE_NEW, 0),
+     "CMP_SRVCERT_CACHE_new"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SRV_CTX_CREATE, 0), "CMP_SRV_CTX_create"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SRV_HTTP_SERVE, 0), "CMP_SRV_http_serve"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_SRV_PROCESS_REQUEST, 0),
+     "CMP_SRV_process_request"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_VALIDATE_CERT_PATH, 0),
      "CMP_validate_cert_path"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_VALIDATE_MSG, 0), "CMP_validate_msg"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_VERIFY_DHBMAC, 0), "CMP_verify_DHBMAC"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_VERIFY_PBMAC, 0), "CMP_verify_PBMAC"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_VERIFY_POPO, 0), "cmp_verify_popo"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_VERIFY_SIGNATURE, 0),
      "CMP_verify_signature"},
-    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXCHANGE_CERTCONF, 0),
-     "CMP_exchange_certConf"},
-    {ERR_PACK(ERR_LIB_CMP, CMP_F_CMP_EXCHANGE_ERROR, 0), "CMP_exchange_error"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_CRM_NEW_FROM_TEMPLATE, 0),
+     "crm_new_from_template"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_FIND_SRVCERT, 0), "find_srvcert"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_GET_CERT_STATUS, 0), "get_cert_status"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_GET_CHECKAFTER, 0), "get_checkAfter"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_POLLFORRESPONSE, 0), "pollForResponse"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_POPO_ITEM_PREPARE, 0), "popo_item_prepare"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_CERTCONF, 0), "process_certConf"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_CERT_RESPONSES, 0),
+     "process_cert_responses"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_ERROR, 0), "process_error"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_GENM, 0), "process_genm"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_POLLREQ, 0), "process_pollReq"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_REQUEST, 0), "process_request"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_PROCESS_RR, 0), "process_rr"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_RR_EXCHANGE, 0), "rr_exchange"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_SEND_RECEIVE_CHECK, 0), "send_receive_check"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_SES_EXCHANGE, 0), "ses_exchange"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_SES_HANDLE_RESPONSE, 0),
+     "ses_handle_response"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_SES_RUN, 0), "ses_run"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_SES_SEND, 0), "ses_send"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_SET1_AOSTR_ELSE_RANDOM, 0),
      "set1_aostr_else_random"},
     {ERR_PACK(ERR_LIB_CMP, CMP_F_SET1_GENERAL_NAME, 0), "set1_general_name"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_TRANSACTION_ACQUIRE, 0),
+     "transaction_acquire"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_TRANSACTION_CHECK_SENDER, 0),
+     "transaction_check_sender"},
+    {ERR_PACK(ERR_LIB_CMP, CMP_F_TRANSACTION_NEW, 0), "transaction_new"},
     {0, NULL}
 };
 
 static const ERR_STRING_DATA CMP_str_reasons[] = {
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_ALGORITHM_NOT_SUPPORTED),
     "algorithm not supported"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_ASYNC_JOB_FAILED), "async job failed"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_CERTIFICATE_NOT_ACCEPTED),
     "certificate not accepted"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_CERTIFICATE_NOT_FOUND),
@@ -250,6 +320,8 @@ static const ERR_STRING_DATA CMP_str_reasons[] = {
     "error decrypting key"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_ERROR_DECRYPTING_SYMMETRIC_KEY),
     "error decrypting symmetric key"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_ERROR_ENCRYPTING_CERTIFICATE),
+    "error encrypting certificate"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_ERROR_LEARNING_TRANSACTIONID),
     "error learning transactionid"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_ERROR_PARSING_PKISTATUS),
@@ -292,9 +364,17 @@ static const ERR_STRING_DATA CMP_str_reasons[] = {
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_INVALID_KEY), "invalid key"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_INVALID_PARAMETERS), "invalid parameters"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_IP_NOT_RECEIVED), "ip not received"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_KEY_AGREEMENT_FAILED),
+    "key agreement failed"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_KUP_NOT_RECEIVED), "kup not received"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MISSING_CONTENT_LENGTH),
+    "missing content length"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MISSING_KEY_INPUT_FOR_CREATING_PROTECTION),
     "missing key input for creating protection"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MISSING_KEY_USAGE_DIGITALSIGNATUE),
+    "missing key usage digitalsignature"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MISSING_KEY_USAGE_KEYAGREEMENT),
+    "missing key usage keyagreement"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MISSING_PROTECTION), "missing protection"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MULTIPLE_SAN_SOURCES),
     "multiple san sources"},
@@ -322,6 +402,7 @@ static const ERR_STRING_DATA CMP_str_reasons[] = {
     "request not accepted"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_REQUEST_REJECTED_BY_CA),
     "request rejected by ca"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_REQUEST_TOO_LARGE), "request too large"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_RP_NOT_RECEIVED), "rp not received"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_SENDER_GENERALNAME_TYPE_NOT_SUPPORTED),
     "sender generalname type not supported"},
@@ -348,14 +429,13 @@ static const ERR_STRING_DATA CMP_str_reasons[] = {
     "unsupported key type"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_UNSUPPORTED_POPO_METHOD),
     "unsupported popo method"},
-    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_UNSUPPORTED_PROTECTION_ALG_DHBASEDMAC),
-    "unsupported protection alg dhbasedmac"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_WRONG_ALGORITHM_OID),
     "wrong algorithm oid"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_WRONG_CERT_HASH), "wrong cert hash"},
-    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_MISSING_KEY_USAGE_DIGITALSIGNATUE),
-    "missing key usage digitalsignature"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_WRONG_DHBM_VALUE), "wrong dhbm value"},
     {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_WRONG_PBM_VALUE), "wrong pbm value"},
+    {ERR_PACK(ERR_LIB_CMP, 0, CMP_R_WRONG_RP_COMPONENT_COUNT),
+    "wrong rp component count"},
     {0, NULL}
 };
 
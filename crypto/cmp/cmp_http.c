@@ -30,6 +30,9 @@
 #ifndef _WIN32
 #include <unistd.h>
 #endif
+#ifdef OPENSSL_SYS_UNIX
+#include <poll.h>
+#endif
 
 #include "cmp_int.h"
 
@@ -149,6 +152,8 @@ int bio_http(BIO *bio/* could be removed if we could access rctx->io */,
     do {
         rc = (*fn)(rctx, resp);
         if (rc != -1) {
+            if (rc == 1)
+                rv = 1;
             if (rc == 0) { /* an error occurred */
                 if (sending && !blocking)
                     rv = -3; /* send error */
@@ -178,17 +183,22 @@ int bio_http(BIO *bio/* could be removed if we could access rctx->io */,
     return rv;
 }
 
-/* one declaration and three defines copied from ocsp_ht.c; keep in sync! */
-/* dummy declaration to get access to internal state variable */
+/* one declaration and six defines copied from ocsp_ht.c; keep in sync! */
+/* dummy declaration to get access to internal state variables */
 struct ocsp_req_ctx_st {
     int state;                  /* Current I/O state */
     unsigned char *iobuf;       /* Line buffer */
     int iobuflen;               /* Line buffer length */
     BIO *io;                    /* BIO to perform I/O with */
     BIO *mem;                   /* Memory BIO response is built into */
+    unsigned long asn1_len;     /* ASN1 length of response */
 };
 #define OHS_NOREAD              0x1000
+#define OHS_ERROR               (0 | OHS_NOREAD)
+#define OHS_FIRSTLINE           1
 #define OHS_ASN1_WRITE_INIT     (5 | OHS_NOREAD)
+#define OHS_ASN1_WRITE          (6 | OHS_NOREAD)
+#define OHS_ASN1_FLUSH          (7 | OHS_NOREAD)
 
 /*
  * adapted from OCSP_REQ_CTX_i2d in crypto/ocsp/ocsp_ht.c -
@@ -206,6 +216,28 @@ static int OCSP_REQ_CTX_i2d_hdr(OCSP_REQ_CTX *rctx, const char *req_hdr,
     return 1;
 }
 
+/*
+ * internal function
+ * returns 1 if the exchange via rctx failed before any byte of the request
+ * went out, i.e., before writing started or when the very first write failed,
+ * leaving the whole request in rctx->mem. Only then a request on a reused
+ * connection may be resent on a new one. Any later failure, even on EOF
+ * awaiting the response, is taken as the request possibly having been
+ * delivered, since the server may already have processed it.
+ */
+static int CMP_http_nothing_sent(const OCSP_REQ_CTX *rctx)
+{
+    switch (rctx->state) {
+    case OHS_ASN1_WRITE_INIT:
+        return 1;
+    case OHS_ERROR:
+        return rctx->asn1_len > 0
+            && rctx->asn1_len == (unsigned long)BIO_ctrl_pending(rctx->mem);
+    default:
+        return 0;
+    }
+}
+
 
 
 static void add_conn_error_hint(const CMP_CTX *ctx, unsigned long errdetail)
@@ -291,12 +323,22 @@ static BIO *CMP_new_http_bio(const CMP_CTX *ctx)
     return cbio;
 }
 
+/* default limit of OCSP_REQ_CTX on the length of the response */
+# define CMP_MAX_RESP_LEN (100 * 1024)
+/* response length additionally allowed per certificate asked to be revoked */
+# define CMP_MAX_REVSTATUS_LEN 1024
+
 static OCSP_REQ_CTX *CMP_sendreq_new(BIO *io, const char *path,
-                                     const CMP_PKIMESSAGE *req, int maxline)
+                                     const CMP_PKIMESSAGE *req, int maxline,
+                                     int keep_alive)
 {
     static const char req_hdr[] =
         "Content-Type: application/pkixcmp\r\n"
         "Cache-Control: no-cache\r\n" "Content-Length: %d\r\n\r\n";
+    static const char req_hdr_keep_alive[] =
+        "Connection: keep-alive\r\n"
+        "Content-Type: application/pkixcmp\r\n"
+        "Cache-Control: no-cache\r\n" "Content-Length: %d\r\n\r\n";
     OCSP_REQ_CTX *rctx = NULL;
 
     rctx = OCSP_REQ_CTX_new(io, maxline);
@@ -306,11 +348,20 @@ static OCSP_REQ_CTX *CMP_sendreq_new(BIO *io, const char *path,
     if (!OCSP_REQ_CTX_http(rctx, "POST", path))
         goto err;
 
-    if (req && !OCSP_REQ_CTX_i2d_hdr(rctx, req_hdr,
+    if (req && !OCSP_REQ_CTX_i2d_hdr(rctx, keep_alive ? req_hdr_keep_alive
+                                                      : req_hdr,
                                      ASN1_ITEM_rptr(CMP_PKIMESSAGE),
                                      (ASN1_VALUE *)req))
         goto err;
 
+    /* an RP holds a PKIStatusInfo for each of the certs in the RR */
+    if (req != NULL && CMP_PKIMESSAGE_get_bodytype(req) == V_CMP_PKIBODY_RR) {
+        int num = sk_CMP_REVDETAILS_num(req->body->value.rr);
+
+        OCSP_set_max_response_length(rctx, CMP_MAX_RESP_LEN
+                                     + CMP_MAX_REVSTATUS_LEN * num);
+    }
+
     return rctx;
 
  err:
@@ -319,38 +370,294 @@ static OCSP_REQ_CTX *CMP_sendreq_new(BIO *io, const char *path,
 }
 
 /*
- * Exchange CMP request/response via HTTP on (non-)blocking BIO
+ * internal function
+ * determines the path to use in the HTTP request line for ctx
+ * returns the newly allocated string, or NULL on out of memory
+ */
+static char *CMP_http_path(const CMP_CTX *ctx)
+{
+    char *path;
+    size_t pos = 0, pathlen;
+
+    pathlen = strlen(ctx->serverName) + strlen(ctx->serverPath) + 33;
+    path = (char *)OPENSSL_malloc(pathlen);
+    if (path == NULL)
+        return NULL;
+
+    /*
+     * Section 5.1.2 of RFC 1945 states that the absoluteURI form is only
+     * allowed when using a proxy
+     */
+    if (ctx->proxyName && ctx->proxyPort)
+        pos = BIO_snprintf(path, pathlen-1, "http://%s:%d",
+                           ctx->serverName, ctx->serverPort);
+
+    /* make sure path includes a forward slash */
+    if (ctx->serverPath[0] != '/')
+        path[pos++] = '/';
+
+    BIO_snprintf(path + pos, pathlen - pos - 1, "%s", ctx->serverPath);
+    return path;
+}
+
+/*
+ * internal function
+ * creates the HTTP request for req, timed as encoding phase
+ * returns the request context, or NULL on error
+ */
+static OCSP_REQ_CTX *CMP_sendreq_encode(CMP_CTX *ctx, BIO *io,
+                                        const CMP_PKIMESSAGE *req)
+{
+    uint64_t start = CMP_CTX_phase_start(ctx);
+    OCSP_REQ_CTX *rctx;
+    char *path;
+
+    if ((path = CMP_http_path(ctx)) == NULL)
+        return NULL;
+    rctx = CMP_sendreq_new(io, path, req, -1, ctx->keep_alive);
+    OPENSSL_free(path);
+    if (rctx != NULL)
+        CMP_CTX_phase_end(ctx, CMP_PHASE_ENCODE, start,
+                          BIO_pending(OCSP_REQ_CTX_get0_mem_bio(rctx)));
+    return rctx;
+}
+
+/*
+ * Exchange CMP request and read the response via HTTP on (non-)blocking BIO,
+ * leaving the response in the memory BIO of rctx for CMP_http_decode()
  * returns 1 on success, 0 on error, -1 on BIO_should_retry
  */
-static int CMP_http_nbio(OCSP_REQ_CTX *rctx, ASN1_VALUE **resp)
+static int CMP_http_read(OCSP_REQ_CTX *rctx, ASN1_VALUE **resp)
 {
-    return OCSP_REQ_CTX_nbio_d2i(rctx, resp, ASN1_ITEM_rptr(CMP_PKIMESSAGE));
+    return OCSP_REQ_CTX_nbio(rctx);
+}
+
+/*
+ * internal function
+ * reports the transfer phase, which started at the given time, and decodes
+ * the response read by CMP_http_read()
+ * returns 1 on success, 0 on parse error
+ */
+static int CMP_http_decode(CMP_CTX *ctx, OCSP_REQ_CTX *rctx, uint64_t start,
+                           CMP_PKIMESSAGE **resp)
+{
+    const unsigned char *p;
+    long len = BIO_get_mem_data(OCSP_REQ_CTX_get0_mem_bio(rctx), &p);
+
+    CMP_CTX_phase_end(ctx, CMP_PHASE_TRANSFER, start, len);
+    start = CMP_CTX_phase_start(ctx);
+    if ((*resp = d2i_CMP_PKIMESSAGE(NULL, &p, len)) == NULL)
+        return 0;
+    CMP_CTX_phase_end(ctx, CMP_PHASE_DECODE, start, len);
+    return 1;
 }
 
 /*
  * Send out CMP request and get response on blocking or non-blocking BIO
+ * On send or receive error, *unsent tells if no byte of the request went out.
  * returns -4: other, -3: send, -2: receive, or -1: parse error, 0: timeout,
  * 1: success and then provides the received message via the *resp argument
  */
-static int CMP_sendreq(BIO *bio, const char *path, const CMP_PKIMESSAGE *req,
-                       CMP_PKIMESSAGE **resp, time_t max_time)
+static int CMP_sendreq(CMP_CTX *ctx, BIO *bio, const CMP_PKIMESSAGE *req,
+                       CMP_PKIMESSAGE **resp, time_t max_time,
+                       int *unsent)
 {
     OCSP_REQ_CTX *rctx;
+    ASN1_VALUE *dummy;
+    uint64_t start;
     int rv;
 
-    if ((rctx = CMP_sendreq_new(bio, path, req, -1)) == NULL)
+    *resp = NULL;
+    *unsent = 0;
+    if ((rctx = CMP_sendreq_encode(ctx, bio, req)) == NULL)
         return -4;
 
-    rv = bio_http(bio, rctx, CMP_http_nbio, (ASN1_VALUE **)resp, max_time);
+    start = CMP_CTX_phase_start(ctx);
+    rv = bio_http(bio, rctx, CMP_http_read, &dummy, max_time);
  /* This indirectly calls ERR_clear_error(); */
+    if (rv == 1 && !CMP_http_decode(ctx, rctx, start, resp))
+        rv = -1;
+    if (rv == -3 || rv == -2)
+        *unsent = CMP_http_nothing_sent(rctx);
 
     OCSP_REQ_CTX_free(rctx);
 
     return rv;
 }
 
+/*
+ * internal function
+ * returns 1 if nothing (not even EOF) is pending on the given idle socket
+ * poll() is used where available since with many cached connections
+ * the socket may exceed the range that can be given to select()
+ */
+static int socket_idle(int fd)
+{
+# ifdef OPENSSL_SYS_UNIX
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+# else
+    fd_set rfds;
+    struct timeval tv;
+
+#  ifndef OPENSSL_SYS_WINDOWS
+    if (fd >= FD_SETSIZE)
+        return 0; /* cannot check, so do not reuse the connection */
+#  endif
+    FD_ZERO(&rfds);
+    openssl_fdset(fd, &rfds);
+    tv.tv_usec = 0;
+    tv.tv_sec = 0;
+    return select(fd + 1, &rfds, NULL, NULL, &tv) == 0;
+# endif
+}
+
+/*
+ * internal function
+ * shuts down and frees the given connection
+ * returns 1 on success, 0 if ctx->http_cb failed
+ */
+static int CMP_http_disconnect(CMP_CTX *ctx, BIO *hbio)
+{
+    int ok = 1;
+
+    (void)BIO_reset(hbio); /* notify/alert peer */
+    if (ctx->http_cb && (*ctx->http_cb)(ctx, hbio, 0) == NULL)
+        ok = 0;
+    BIO_free_all(hbio); /* also frees any BIOs linked with hbio */
+    return ok;
+}
+
+/*
+ * internal function
+ * takes the keep-alive connection cached in ctx if it is bound to peer and
+ * is still usable, i.e., has not been idle for too long and has not been
+ * closed by the server in the meantime; otherwise closes any cached connection
+ * The socket is switched to non-blocking mode if nbio is set, else to blocking.
+ * returns the connection taken from ctx, or NULL
+ */
+static BIO *CMP_http_conn_get(CMP_CTX *ctx, const char *peer, int nbio)
+{
+    BIO *hbio = ctx->http_conn;
+    int fd;
+
+    if (hbio == NULL)
+        return NULL;
+    if (strcmp(ctx->http_conn_peer, peer) != 0
+            || (ctx->keep_alive_idle > 0 &&
+                time(NULL) - ctx->http_conn_last_used > ctx->keep_alive_idle)
+            || BIO_get_fd(hbio, &fd) <= 0 || !socket_idle(fd)
+            || !BIO_socket_nbio(fd, nbio)) {
+        (void)CMP_CTX_http_conn_close(ctx);
+        return NULL;
+    }
+    ctx->http_conn = NULL; /* peer and request count are kept */
+    return hbio;
+}
+
+/*
+ * internal function
+ * hands the connection used for a finished exchange back to ctx, where it is
+ * kept for reuse if keep-alive is enabled, no error occurred (err == 0), and
+ * the limit on requests per connection has not been reached;
+ * otherwise the connection is closed.
+ * On first use of the connection, the string *peer is moved to ctx.
+ * returns 1 on success, 0 if ctx->http_cb failed
+ */
+static int CMP_http_conn_put(CMP_CTX *ctx, BIO *hbio, char **peer, int err)
+{
+    ctx->http_conn = hbio;
+    if (ctx->http_conn_peer == NULL) {
+        ctx->http_conn_peer = *peer;
+        *peer = NULL;
+    }
+    ctx->http_conn_requests++;
+    ctx->http_conn_last_used = time(NULL);
+    if (err || !ctx->keep_alive || ctx->http_conn_peer == NULL ||
+        (ctx->keep_alive_maxreq > 0 &&
+         ctx->http_conn_requests >= ctx->keep_alive_maxreq))
+        return CMP_CTX_http_conn_close(ctx);
+    return 1;
+}
+
+/*
+ * internal function
+ * determines the host:port the connection for ctx leads to, also reflecting
+ * whether TLS is used
+ * returns the newly allocated string, or NULL on out of memory
+ */
+static char *CMP_http_peer(const CMP_CTX *ctx)
+{
+    const char *host = ctx->proxyName;
+    int port = ctx->proxyPort;
+    size_t peerlen;
+    char *peer;
+
+    if (host == NULL || !port) {
+        host = ctx->serverName;
+        port = ctx->serverPort;
+    }
+    peerlen = strlen(host) + 20;
+    if ((peer = (char *)OPENSSL_malloc(peerlen)) != NULL)
+        BIO_snprintf(peer, peerlen, "%s:%d%s", host, port,
+                     ctx->http_cb ? "/tls" : "");
+    return peer;
+}
+
+/*
+ * internal function
+ * creates a new (not yet connected) BIO for ctx, including any TLS BIO
+ * returns the BIO, or NULL on error
+ */
+static BIO *CMP_http_new_conn(CMP_CTX *ctx)
+{
+    BIO *bio, *hbio;
+
+    if ((hbio = CMP_new_http_bio(ctx)) == NULL)
+        return NULL;
+    if (ctx->http_cb) {
+        if ((bio = (*ctx->http_cb)(ctx, hbio, 1)) == NULL) {
+            BIO_free_all(hbio);
+            return NULL;
+        }
+        hbio = bio;
+    }
+    return hbio;
+}
+
+/*
+ * internal function
+ * connects hbio within ctx->msgtimeout, reporting the TCP connection and
+ * any TLS handshake as separate phases if there is a phase callback
+ * returns -1 on error, 0 on timeout, 1 on success
+ */
+static int CMP_http_connect(CMP_CTX *ctx, BIO *hbio)
+{
+    BIO *cbio = BIO_find_type(hbio, BIO_TYPE_CONNECT);
+    int tls = cbio != NULL && cbio != hbio;
+    uint64_t start = CMP_CTX_phase_start(ctx);
+    int rv;
+
+    if (tls && ctx->phase_cb != NULL) {
+        if ((rv = bio_connect(cbio, ctx->msgtimeout)) <= 0)
+            return rv;
+        CMP_CTX_phase_end(ctx, CMP_PHASE_CONNECT, start, 0);
+        start = CMP_CTX_phase_start(ctx);
+    }
+    if ((rv = bio_connect(hbio, ctx->msgtimeout)) > 0)
+        CMP_CTX_phase_end(ctx, tls ? CMP_PHASE_TLS : CMP_PHASE_CONNECT,
+                          start, 0);
+    return rv;
+}
+
 /*
  * Send the PKIMessage req and on success place the response in *res.
+ * With ctx->keep_alive the connection is kept open in ctx for use by
+ * subsequent calls to the same server (or proxy), as long as the server agrees.
  * Any previous error is likely to be removed by ERR_clear_error().
  * returns 0 on success, else a CMP error reason code defined in cmp.h
  */
@@ -358,9 +665,10 @@ int CMP_PKIMESSAGE_http_perform(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
                                 CMP_PKIMESSAGE **res)
 {
     int rv;
-    char *path = NULL;
-    size_t pos = 0, pathlen = 0;
-    BIO *bio, *hbio = NULL;
+    char *peer = NULL;
+    BIO *hbio = NULL;
+    int reused = 0;
+    int unsent;
     int err = CMP_R_OUT_OF_MEMORY;
     time_t max_time;
 
@@ -370,53 +678,59 @@ int CMP_PKIMESSAGE_http_perform(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
 
     max_time = ctx->msgtimeout > 0 ? time(NULL) + ctx->msgtimeout : 0;
 
-    if ((hbio = CMP_new_http_bio(ctx)) == NULL)
-        goto err;
-    if (ctx->http_cb) {
-        if ((bio = (*ctx->http_cb)(ctx, hbio, 1)) == NULL)
+    if (ctx->keep_alive) {
+        if ((peer = CMP_http_peer(ctx)) == NULL)
             goto err;
-        hbio = bio;
+        hbio = CMP_http_conn_get(ctx, peer, ctx->msgtimeout > 0);
+        reused = hbio != NULL;
     }
 
-    /* TODO: it looks like bio_connect() is superflous except for maybe 
-       better error/timeout handling and reporting? Remove next 9 lines? */
-    /* tentatively set error, which allows accumulating diagnostic info */
-    (void)ERR_set_mark();
-    CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_ERROR_CONNECTING);
-    rv = bio_connect(hbio, ctx->msgtimeout);
-    if (rv <= 0) {
-        err = (rv == 0) ? CMP_R_CONNECT_TIMEOUT : CMP_R_ERROR_CONNECTING;
-        goto err;
-    } else
-        (void)ERR_pop_to_mark(); /* discard diagnostic info */
-
-    pathlen = strlen(ctx->serverName) + strlen(ctx->serverPath) + 33;
-    path = (char *)OPENSSL_malloc(pathlen);
-    if (path == NULL)
-        goto err;
-
-    /*
-     * Section 5.1.2 of RFC 1945 states that the absoluteURI form is only
-     * allowed when using a proxy
-     */
-    if (ctx->proxyName && ctx->proxyPort)
-        pos = BIO_snprintf(path, pathlen-1, "http://%s:%d",
-                           ctx->serverName, ctx->serverPort);
-
-    /* make sure path includes a forward slash */
-    if (ctx->serverPath[0] != '/')
-        path[pos++] = '/';
+ connect:
+    if (hbio == NULL) {
+        if ((hbio = CMP_http_new_conn(ctx)) == NULL)
+            goto err;
 
-    BIO_snprintf(path + pos, pathlen - pos - 1, "%s", ctx->serverPath);
+        /* TODO: it looks like bio_connect() is superflous except for maybe 
+           better error/timeout handling and reporting? Remove next 9 lines? */
+        /* tentatively set error, which allows accumulating diagnostic info */
+        (void)ERR_set_mark();
+        CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM, CMP_R_ERROR_CONNECTING);
+        rv = CMP_http_connect(ctx, hbio);
+        if (rv <= 0) {
+            err = (rv == 0) ? CMP_R_CONNECT_TIMEOUT : CMP_R_ERROR_CONNECTING;
+            goto err;
+        } else
+            (void)ERR_pop_to_mark(); /* discard diagnostic info */
+    }
 
-    rv = CMP_sendreq(hbio, path, req, res, max_time);
-    OPENSSL_free(path);
+    if (reused)
+        (void)ERR_set_mark();
+    rv = CMP_sendreq(ctx, hbio, req, res, max_time, &unsent);
+    if (reused) {
+        if (unsent) {
+            /*
+             * the cached connection has failed before any byte of
+             * the request was sent; retry with a new one, discarding
+             * the errors
+             */
+            (void)ERR_pop_to_mark();
+            ctx->http_conn = hbio;
+            hbio = NULL;
+            if (!CMP_CTX_http_conn_close(ctx))
+                goto err;
+            reused = 0;
+            goto connect;
+        }
+        (void)ERR_clear_last_mark();
+    }
     if (rv == -3)
         err = CMP_R_FAILED_TO_SEND_REQUEST;
     else if (rv == -2)
         err = CMP_R_FAILED_TO_RECEIVE_PKIMESSAGE;
     else if (rv == -1)
         err = CMP_R_ERROR_DECODING_MESSAGE;
+    else if (rv < 0)
+        err = CMP_R_ERROR_SENDING_REQUEST;
     else if (rv == 0) { /* timeout */
         /* We should notify/alert the peer when we abort;
          * TODO: does the below BIO_reset suffice?
@@ -442,12 +756,170 @@ int CMP_PKIMESSAGE_http_perform(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
             add_conn_error_hint(ctx, ERR_peek_error());
     }
 
-    (void)BIO_reset(hbio); /* notify/alert peer */
-    if (ctx->http_cb && (*ctx->http_cb)(ctx, hbio, 0) == NULL)
+    if (hbio != NULL && !CMP_http_conn_put(ctx, hbio, &peer, err))
         err = CMP_R_OUT_OF_MEMORY;
-    BIO_free_all(hbio); /* also frees any BIOs linked with hbio */
+    OPENSSL_free(peer);
 
     return err;
 }
 
+/*
+ * internal function
+ * Non-blocking variant of CMP_PKIMESSAGE_http_perform(): performs as much of
+ * the exchange of req via HTTP as possible without blocking. It must be called
+ * again with the same arguments when st->hbio is ready for I/O.
+ * *st must be zeroed before the first call and be released by
+ * CMP_HTTP_NBIO_cleanup() after the last one. Timeouts are up to the caller.
+ * returns 1 on success and then provides the response in *res,
+ * -1 if the exchange is to be continued once st->hbio is ready for reading
+ * (if BIO_should_read(st->hbio)) or for writing (otherwise),
+ * or 0 on error and then places a CMP error reason code in *err
+ */
+int CMP_PKIMESSAGE_http_nbio(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                             CMP_HTTP_NBIO *st, CMP_PKIMESSAGE **res, int *err)
+{
+    int rv;
+
+    *err = CMP_R_NULL_ARGUMENT;
+    if (ctx == NULL || req == NULL || st == NULL || res == NULL ||
+        ctx->serverName == NULL || ctx->serverPath == NULL || !ctx->serverPort)
+        goto err;
+
+    *err = CMP_R_OUT_OF_MEMORY;
+    if (st->hbio == NULL) {
+        if (ctx->keep_alive) {
+            if (st->peer == NULL && (st->peer = CMP_http_peer(ctx)) == NULL)
+                goto err;
+            st->hbio = CMP_http_conn_get(ctx, st->peer, 1);
+            st->reused = st->hbio != NULL;
+        }
+        if (st->hbio == NULL) {
+            if ((st->hbio = CMP_http_new_conn(ctx)) == NULL)
+                goto err;
+            BIO_set_nbio(st->hbio, 1);
+            st->start = CMP_CTX_phase_start(ctx);
+        }
+    }
+
+    if (st->rctx == NULL) {
+        if (!st->reused) {
+            BIO *cbio = BIO_find_type(st->hbio, BIO_TYPE_CONNECT);
+            int tls = cbio != NULL && cbio != st->hbio;
+
+            /* with phase callback, connect TCP first to time TLS separately */
+            if (tls && ctx->phase_cb != NULL && !st->tcp_connected) {
+                if (BIO_do_connect(cbio) <= 0) {
+                    if (BIO_should_retry(cbio)) {
+                        *err = 0;
+                        return -1;
+                    }
+                    *err = CMP_R_ERROR_CONNECTING;
+                    goto err;
+                }
+                CMP_CTX_phase_end(ctx, CMP_PHASE_CONNECT, st->start, 0);
+                st->start = CMP_CTX_phase_start(ctx);
+                st->tcp_connected = 1;
+            }
+            if ((rv = BIO_do_connect(st->hbio)) <= 0) {
+                if (BIO_should_retry(st->hbio)) {
+                    *err = 0;
+                    return -1;
+                }
+                *err = CMP_R_ERROR_CONNECTING;
+                goto err;
+            }
+            CMP_CTX_phase_end(ctx, tls ? CMP_PHASE_TLS : CMP_PHASE_CONNECT,
+                              st->start, 0);
+        }
+        if ((st->rctx = CMP_sendreq_encode(ctx, st->hbio, req)) == NULL)
+            goto err;
+        st->start = CMP_CTX_phase_start(ctx);
+    }
+
+    *res = NULL;
+    if (st->reused)
+        (void)ERR_set_mark();
+    rv = CMP_http_read(st->rctx, NULL);
+    if (st->reused) {
+        if (rv == 0 && CMP_http_nothing_sent(st->rctx)) {
+            /*
+             * the cached connection has failed before any byte of
+             * the request was sent; use a new one, discarding the errors
+             */
+            (void)ERR_pop_to_mark();
+            OCSP_REQ_CTX_free(st->rctx);
+            st->rctx = NULL;
+            ctx->http_conn = st->hbio;
+            st->hbio = NULL;
+            st->reused = 0;
+            if (!CMP_CTX_http_conn_close(ctx))
+                goto err;
+            return CMP_PKIMESSAGE_http_nbio(ctx, req, st, res, err);
+        }
+        (void)ERR_clear_last_mark();
+    }
+    if (rv == -1) {
+        *err = 0;
+        return -1;
+    }
+    if (rv == 0) {
+        *err = CMP_R_FAILED_TO_RECEIVE_PKIMESSAGE;
+    } else if (CMP_http_decode(ctx, st->rctx, st->start, res)) {
+        *err = 0;
+        return 1;
+    } else {
+        *err = CMP_R_ERROR_DECODING_MESSAGE;
+    }
+
+ err:
+    put_cert_verify_err(CMP_F_CMP_PKIMESSAGE_HTTP_NBIO);
+    if (ERR_GET_LIB(ERR_peek_error()) == ERR_LIB_SSL)
+        *err = CMP_R_TLS_ERROR;
+    CMPerr(CMP_F_CMP_PKIMESSAGE_HTTP_NBIO, *err);
+    if (ctx != NULL && (*err == CMP_R_TLS_ERROR
+                        || *err == CMP_R_ERROR_CONNECTING))
+        add_conn_error_hint(ctx, ERR_peek_error());
+    return 0;
+}
+
+/*
+ * internal function
+ * releases the state of a non-blocking HTTP exchange, where the connection is
+ * kept in ctx for reuse if keep-alive is enabled and err is 0 (no error)
+ * returns 1 on success, 0 if ctx->http_cb failed
+ */
+int CMP_HTTP_NBIO_cleanup(CMP_CTX *ctx, CMP_HTTP_NBIO *st, int err)
+{
+    int ok = 1;
+
+    OCSP_REQ_CTX_free(st->rctx);
+    if (st->hbio != NULL)
+        ok = CMP_http_conn_put(ctx, st->hbio, &st->peer, err);
+    OPENSSL_free(st->peer);
+    memset(st, 0, sizeof(*st));
+    return ok;
+}
+
 #endif /* !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK) */
+
+/*
+ * internal function
+ * closes the keep-alive HTTP connection cached in ctx, if any
+ * returns 1 on success, 0 if ctx->http_cb failed
+ */
+int CMP_CTX_http_conn_close(CMP_CTX *ctx)
+{
+    int ok = 1;
+
+    if (ctx == NULL)
+        return 1;
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    if (ctx->http_conn != NULL)
+        ok = CMP_http_disconnect(ctx, ctx->http_conn);
+#endif
+    ctx->http_conn = NULL;
+    OPENSSL_free(ctx->http_conn_peer);
+    ctx->http_conn_peer = NULL;
+    ctx->http_conn_requests = 0;
+    return ok;
+}
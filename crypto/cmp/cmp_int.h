@@ -33,6 +33,55 @@ extern "C" {
  * ##########################################################################
  */
 
+/*
+ * further certificate request to be sent in IR/CR along with the one
+ * derived from the other CMP_CTX fields, see CMP_CTX_certReq_push1()
+ */
+typedef struct cmp_certreq_st {
+    EVP_PKEY *pkey; /* key pair to be certified */
+    X509_NAME *subject; /* subject name, or NULL to use the default one */
+    X509_EXTENSIONS *exts; /* extensions, or NULL to use reqExtensions */
+} CMP_CERTREQ;
+DEFINE_STACK_OF(CMP_CERTREQ)
+
+/*
+ * profile for certificate requests that differ only in key, subject, and
+ * subjectAltNames, see CMP_CERTREQ_TEMPLATE_new()
+ */
+struct cmp_certreq_template_st {
+    X509_NAME *issuer; /* issuer to include, or NULL */
+    X509_EXTENSIONS *exts; /* reqExtensions and policies, already encoded */
+    int has_san; /* whether exts contains subjectAltNames */
+    int san_pos; /* position in exts for any subjectAltNames to be added */
+    int days; /* validity period to request, or 0 */
+    int sanCritical; /* whether subjectAltNames are to be marked critical */
+    int digest; /* NID of digest used for the POPO */
+    int popoMethod; /* POPO method to use */
+    int references;
+    CRYPTO_RWLOCK *lock;
+} /* CMP_CERTREQ_TEMPLATE */;
+
+/*
+ * cache of server certificates validated against a given trust store,
+ * which may be shared among CMP_CTX instances, see CMP_SRVCERT_CACHE_new()
+ */
+# define CMP_SRVCERT_CACHE_SIZE 8
+typedef struct cmp_srvcert_cache_entry_st {
+    X509 *cert; /* validated server cert, NULL if entry is unused */
+    X509_STORE *store; /* trust store the cert has been validated against */
+    X509_NAME *sender; /* sender name of the msg the cert has been found for */
+    ASN1_OCTET_STRING *kid; /* senderKID of that msg, or NULL */
+    time_t expires; /* time the entry becomes stale, or 0 for no limit */
+} CMP_SRVCERT_CACHE_ENTRY;
+
+struct cmp_srvcert_cache_st {
+    CMP_SRVCERT_CACHE_ENTRY entries[CMP_SRVCERT_CACHE_SIZE];
+    int next; /* entry to be replaced next */
+    long ttl; /* max seconds an entry may be used, 0: no limit */
+    int references;
+    CRYPTO_RWLOCK *lock;
+} /* CMP_SRVCERT_CACHE */;
+
 /*
  * this structure is used to store the context for CMP sessions
  * partly using OpenSSL ASN.1 types in order to ease handling it - such
@@ -67,7 +116,9 @@ struct cmp_ctx_st {
 #endif
     CMP_PKIFREETEXT *lastStatusString;
     X509 *newClCert; /* *new* CLIENT certificate received from the CA
-     * TODO: this should be a stack since there could be more than one */
+                        for the first certificate request */
+    STACK_OF(X509) *newClCerts; /* all certificates received from the CA,
+                                   in the order of the certificate requests */
     X509_NAME *recipient; /* to set in recipient in pkiheader */
     X509_NAME *expected_sender; /* expected sender in pkiheader of response */
     ASN1_OCTET_STRING *transactionID; /* the current transaction ID */
@@ -81,12 +132,33 @@ struct cmp_ctx_st {
                         * Note: this is not an ASN.1 type */
     EVP_PKEY *newPkey; /* EVP_PKEY holding the *new* key pair
                         * Note: this is not an ASN.1 type */
+    STACK_OF(CMP_CERTREQ) *certReqs; /* further requests to send in IR/CR */
+    STACK_OF(CMP_REVDETAILS) *revDetails; /* further certs to revoke in RR */
+    STACK_OF(CMP_PKISTATUSINFO) *revStatus; /* per-cert results of last RR */
+    CMP_CERTREQ_TEMPLATE *certReqTemplate; /* profile for requests, or NULL */
+
+    /* signature protection state derived from clCert, pkey, and digest */
+    int sig_key_checked; /* clCert and pkey have been checked to match */
+    int sig_alg_nid; /* signature algorithm for pkey and digest, or 0 */
+    EVP_MD_CTX *sig_md_ctx; /* prepared for signing with pkey, or NULL */
+
+    /* DHBasedMac protection state derived from pkey and the peer's DH cert */
+    int dhbm; /* protect with DHBasedMac rather than with a signature */
+    X509 *dhbm_peer; /* cert with the public key dhbm_basekey is agreed with */
+    int dhbm_owf; /* NID of the OWF applied to the agreed secret */
+    unsigned char dhbm_basekey[EVP_MAX_MD_SIZE];
+    unsigned int dhbm_basekey_len; /* 0 if the base key is not yet derived */
 
     /* PBMParameters */
     size_t pbm_slen;
     int pbm_owf;
     long pbm_itercnt;
     int pbm_mac;
+    CRMF_PBM_CACHE *pbm_cache; /* base keys derived from secretValue */
+    int pbm_reuse_salt; /* use the same PBM salt for a whole transaction */
+    int async; /* let CMP_SES_step() run as ASYNC_JOB to allow offloading */
+    X509_ALGOR *pbm_algor; /* PBM protectionAlg to reuse, or NULL */
+    ASN1_OCTET_STRING *pbm_algor_tid; /* transactionID pbm_algor is for */
 
     int days; /* Number of days new certificates are asked to be valid for */
     int SubjectAltName_nodefault;
@@ -96,6 +168,7 @@ struct cmp_ctx_st {
     int popoMethod;  /* Proof-of-posession mechanism used.
                         Defaults to signature (POPOsigningKey) */
     int revocationReason; /* Revocation reason code to be included in RR */
+    int revocationBatch; /* max. number of certs per RR, or 0 for unlimited */
     int permitTAInExtraCertsForIR; /* whether to include root certs from
                      extracerts when validating? Used for 3GPP-style E.7 */
 
@@ -113,9 +186,16 @@ struct cmp_ctx_st {
     cmp_certConf_cb_t certConf_cb;   /* callback for letting the user check
                            the received certificate and reject if necessary */
     void *certConf_cb_arg; /* allows to store an argument individual to cb */
+    cmp_phase_cb_t phase_cb; /* callback for timing the phases of exchanges */
+    void *phase_cb_arg; /* allows to store an argument individual to cb */
     X509_STORE *trusted_store;    /* store for trusted (root) certificates and
                                      possibly CRLs and cert verify callback */
     STACK_OF(X509) *untrusted_certs;  /* untrusted (intermediate) certs */
+    CMP_SRVCERT_CACHE *srvcert_cache; /* validated server certs, or NULL */
+    STACK_OF(X509) *clCert_chain; /* chain of clCert built from
+                                     untrusted_certs for use in extraCerts */
+    int clCert_chain_untrusted_num; /* number of untrusted_certs it is for,
+                                       detecting internal additions */
 
     /* HTTP transfer related settings */
     char *serverName;
@@ -132,6 +212,13 @@ struct cmp_ctx_st {
     void *http_cb_arg; /* allows to store optional argument to cb */
     cmp_transfer_cb_t transfer_cb;
     void *transfer_cb_arg; /* allows to store optional argument to cb */
+    int keep_alive; /* ask server to keep the HTTP connection open for reuse */
+    int keep_alive_idle; /* max seconds a cached connection may stay idle */
+    int keep_alive_maxreq; /* max number of requests per connection, 0: any */
+    BIO *http_conn; /* cached keep-alive connection, or NULL */
+    char *http_conn_peer; /* host:port the cached connection is bound to */
+    time_t http_conn_last_used; /* time the cached connection was last used */
+    int http_conn_requests; /* number of requests sent over http_conn */
 } /* CMP_CTX */;
 
 /*-
@@ -376,10 +463,11 @@ DECLARE_ASN1_FUNCTIONS(CMP_ERRORMSGCONTENT)
  */
 struct cmp_certstatus_st {
     ASN1_OCTET_STRING *certHash;
-    ASN1_INTEGER *certReqId;
+    ASN1_INTEGER certReqId; /* embedded */
     CMP_PKISTATUSINFO *statusInfo;
 } /* CMP_CERTSTATUS */;
 DECLARE_ASN1_FUNCTIONS(CMP_CERTSTATUS)
+CMP_CERTSTATUS *CMP_CERTSTATUS_dup(CMP_CERTSTATUS *certStatus);
 
 typedef STACK_OF(CMP_CERTSTATUS) CMP_CERTCONFIRMCONTENT;
 
@@ -397,7 +485,7 @@ typedef STACK_OF(CMP_CERTSTATUS) CMP_CERTCONFIRMCONTENT;
  *   }
  */
 struct cmp_certresponse_st {
-    ASN1_INTEGER *certReqId;
+    ASN1_INTEGER certReqId; /* embedded */
     CMP_PKISTATUSINFO *status;
     CMP_CERTIFIEDKEYPAIR *certifiedKeyPair;
     ASN1_OCTET_STRING *rspInfo;
@@ -423,7 +511,7 @@ DECLARE_ASN1_FUNCTIONS(CMP_CERTREPMESSAGE)
  *   }
  */
 typedef struct cmp_pollreq_st {
-    ASN1_INTEGER *certReqId;
+    ASN1_INTEGER certReqId; /* embedded */
 } CMP_POLLREQ;
 DECLARE_ASN1_FUNCTIONS(CMP_POLLREQ)
 DEFINE_STACK_OF(CMP_POLLREQ)
@@ -438,8 +526,8 @@ DECLARE_ASN1_FUNCTIONS(CMP_POLLREQCONTENT)
  * }
  */
 struct cmp_pollrep_st {
-    ASN1_INTEGER *certReqId;
-    ASN1_INTEGER *checkAfter;
+    ASN1_INTEGER certReqId; /* embedded */
+    ASN1_INTEGER checkAfter; /* embedded */
     CMP_PKIFREETEXT *reason;
 } /* CMP_POLLREP */;
 DECLARE_ASN1_FUNCTIONS(CMP_POLLREP)
@@ -482,7 +570,7 @@ DECLARE_ASN1_FUNCTIONS(CMP_POLLREPCONTENT)
  *   }
  */
 struct cmp_pkiheader_st {
-    ASN1_INTEGER *pvno;
+    ASN1_INTEGER pvno; /* embedded */
     GENERAL_NAME *sender;
     GENERAL_NAME *recipient;
     ASN1_GENERALIZEDTIME *messageTime; /* 0 */
@@ -644,14 +732,26 @@ DECLARE_ASN1_FUNCTIONS(CMP_PKIBODY)
  *   }
  */
 struct cmp_pkimessage_st {
-    CMP_PKIHEADER *header;
+    CMP_PKIHEADER header; /* embedded */
     CMP_PKIBODY *body;
     ASN1_BIT_STRING *protection; /* 0 */
     /* CMP_CMPCERTIFICATE is effectively X509 so it is used directly */
     STACK_OF(X509) *extraCerts; /* 1 */
+    ASN1_ENCODING enc; /* DER as received or as produced when protecting;
+                          invalidated by CMP_PKIMESSAGE_modified() */
 } /* CMP_PKIMESSAGE */;
 DECLARE_ASN1_FUNCTIONS(CMP_PKIMESSAGE)
 
+/*
+ * the fields following the ProtectedPart in a PKIMessage, used for composing
+ * the DER encoding of a message from the one of its ProtectedPart
+ */
+typedef struct cmp_pkimessage_tail_st {
+    ASN1_BIT_STRING *protection; /* 0 */
+    STACK_OF(X509) *extraCerts; /* 1 */
+} CMP_PKIMESSAGE_TAIL;
+DECLARE_ASN1_ITEM(CMP_PKIMESSAGE_TAIL)
+
 /*-
  * ProtectedPart ::= SEQUENCE {
  * header    PKIHeader,
@@ -664,6 +764,20 @@ typedef struct cmp_protectedpart_st {
 } CMP_PROTECTEDPART;
 DECLARE_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
 
+/*
+ * DER encoding of the ProtectedPart of a message: prefix followed by der.
+ * If the encoding of header and body could be taken from the one retained
+ * in the message, prefix holds the SEQUENCE tag and length, else prefix is
+ * empty and der points to a fresh encoding of the whole ProtectedPart.
+ */
+typedef struct cmp_protectedpart_der_st {
+    unsigned char prefix[8];
+    size_t prefix_len;
+    const unsigned char *der;
+    size_t der_len;
+    unsigned char *buf; /* allocated encoding, if any */
+} CMP_PROTECTEDPART_DER;
+
 /*-
  *  this is not defined here as it is already in CRMF:
  *   id-PasswordBasedMac OBJECT IDENTIFIER ::= {1 2 840 113533 7 66 13}
@@ -684,8 +798,6 @@ DECLARE_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
  *   }       -- or HMAC [RFC2104, RFC2202])
  */
 /*-
- *  TODO: this is not yet defined here - but DH is anyway not used yet
- *
  *   id-DHBasedMac OBJECT IDENTIFIER ::= {1 2 840 113533 7 66 30}
  *   DHBMParameter ::= SEQUENCE {
  *           owf                 AlgorithmIdentifier,
@@ -694,6 +806,11 @@ DECLARE_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
  *           -- the MAC AlgId (e.g., DES-MAC, Triple-DES-MAC [PKCS11],
  *   }       -- or HMAC [RFC2104, RFC2202])
  */
+typedef struct cmp_dhbmparameter_st {
+    X509_ALGOR *owf;
+    X509_ALGOR *mac;
+} CMP_DHBMPARAMETER;
+DECLARE_ASN1_FUNCTIONS(CMP_DHBMPARAMETER)
 /*-
  * The following is not cared for, because it is described in section 5.2.5
  * that this is beyond the scope of CMP
@@ -712,7 +829,10 @@ DECLARE_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
  * constants
  */
 
-/* certReqId for the first - and so far only - certificate request */
+/*
+ * certReqId for the first certificate request,
+ * further ones sent in the same message are numbered consecutively
+ */
 # define CERTREQID 0L
 /* sequence id for the first - and so far only - revocation request */
 # define REVREQSID 0L
@@ -729,10 +849,57 @@ DECLARE_ASN1_FUNCTIONS(CMP_PROTECTEDPART)
 /* See also, e.g., https://en.wikipedia.org/wiki/Variadic_macro */
 int log_printf(const char *file, int line, severity level, const char *fmt,...);
 int CMP_CTX_error_cb(const char *str, size_t len, void *u);
+CMP_CTX *CMP_CTX_derive(const CMP_CTX *tmpl);
+void CMP_CTX_sig_reset(CMP_CTX *ctx);
+uint64_t CMP_CTX_phase_start(const CMP_CTX *ctx);
+void CMP_CTX_phase_end(CMP_CTX *ctx, int phase, uint64_t start, size_t bytes);
+
+/* from cmp_msg.c */
+CMP_CERTSTATUS *CMP_certStatus_new(CMP_CTX *ctx, long certReqId,
+                                   const X509 *cert,
+                                   int failure, const char *text);
+CMP_PKIMESSAGE *CMP_certConf_new_multi(CMP_CTX *ctx,
+                                   const STACK_OF(CMP_CERTSTATUS) *certStatus);
+CMP_PKIMESSAGE *CMP_pollReq_new_multi(CMP_CTX *ctx,
+                                      const long *certReqIds, int num);
+int CMP_CTX_revCerts_num(const CMP_CTX *ctx);
+CMP_PKIMESSAGE *CMP_rr_new_range(CMP_CTX *ctx, int first, int num);
+
+/* from cmp_lib.c */
+ASN1_BIT_STRING *CMP_calc_protection_cached(const CMP_PKIMESSAGE *msg,
+                                            const CMP_PROTECTEDPART_DER *ppd,
+                                            const ASN1_OCTET_STRING *secret,
+                                            const EVP_PKEY *pkey,
+                                            CRMF_PBM_CACHE *cache,
+                                            const EVP_MD_CTX *sig_ctx);
+ASN1_BIT_STRING *CMP_calc_dhbmac(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
+                                 const CMP_PROTECTEDPART_DER *ppd,
+                                 const X509 *peer);
+int CMP_PKIMESSAGE_share_certs(CMP_CTX *ctx, CMP_PKIMESSAGE *msg);
+int CMP_PROTECTEDPART_DER_init(CMP_PROTECTEDPART_DER *ppd,
+                               const CMP_PKIMESSAGE *msg);
+void CMP_PROTECTEDPART_DER_cleanup(CMP_PROTECTEDPART_DER *ppd);
 
 /* from cmp_vfy.c */
 void put_cert_verify_err(int func);
 
+/* from cmp_http.c */
+int CMP_CTX_http_conn_close(CMP_CTX *ctx);
+# if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+/* state of a non-blocking HTTP exchange, see CMP_PKIMESSAGE_http_nbio() */
+typedef struct cmp_http_nbio_st {
+    BIO *hbio; /* the connection, or NULL if not yet established */
+    OCSP_REQ_CTX *rctx; /* the HTTP request, or NULL if not yet connected */
+    char *peer; /* host:port of the connection, used for keep-alive */
+    int reused; /* whether hbio has been taken from the keep-alive cache */
+    int tcp_connected; /* whether the TCP connection below TLS is established */
+    uint64_t start; /* start time of the current phase, for the phase cb */
+} CMP_HTTP_NBIO;
+int CMP_PKIMESSAGE_http_nbio(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                             CMP_HTTP_NBIO *st, CMP_PKIMESSAGE **res, int *err);
+int CMP_HTTP_NBIO_cleanup(CMP_CTX *ctx, CMP_HTTP_NBIO *st, int err);
+# endif
+
 /* from cmp_ses.c */
 /* exported just for testing:
 int CMP_exchange_certConf(CMP_CTX *ctx, int failure, const char *txt);
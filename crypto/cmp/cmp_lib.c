@@ -33,9 +33,11 @@
 #include <openssl/x509.h>
 #include <openssl/rand.h>
 #include <openssl/safestack.h>
+#include <openssl/lhash.h>
 #include <openssl/crypto.h>
 #include <openssl/engine.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/objects.h>
 #include <openssl/rand.h>
 /* for bio_err */
@@ -109,13 +111,12 @@ void CMP_add_error_txt(const char *separator, const char *txt)
 /*
  * returns the header of the given CMP message
  * returns NULL on error
+ * When changing the header via the pointer returned, the caller must invoke
+ * CMP_PKIMESSAGE_modified() such that the retained DER encoding is not used.
  */
 CMP_PKIHEADER *CMP_PKIMESSAGE_get0_header(const CMP_PKIMESSAGE *msg)
 {
-    if (!msg)
-        return NULL;
-
-    return msg->header;
+    return msg == NULL ? NULL : (CMP_PKIHEADER *)&msg->header;
 }
 
 /* returns the transactionID of the given PKIHeader or NULL on error */
@@ -147,7 +148,7 @@ int CMP_PKIHEADER_set_version(CMP_PKIHEADER *hdr, int version)
         goto err;
     }
 
-    if (!ASN1_INTEGER_set(hdr->pvno, version)) {
+    if (!ASN1_INTEGER_set(&hdr->pvno, version)) {
         CMPerr(CMP_F_CMP_PKIHEADER_SET_VERSION, CMP_R_OUT_OF_MEMORY);
         goto err;
     }
@@ -539,7 +540,7 @@ int CMP_PKIHEADER_init(CMP_CTX *ctx, CMP_PKIHEADER *hdr)
  *
  * Either secret or pkey must be set, the other must be NULL. Attempts doing
  * PBMAC in case 'secret' is set and signature if 'pkey' is set - but will only
- * do the protection already marked in msg->header->protectionAlg.
+ * do the protection already marked in msg->header.protectionAlg.
  *
  * returns pointer to ASN1_BIT_STRING containing protection on success, NULL on
  * error
@@ -548,15 +549,150 @@ ASN1_BIT_STRING *CMP_calc_protection(const CMP_PKIMESSAGE *msg,
                                      const ASN1_OCTET_STRING *secret,
                                      const EVP_PKEY *pkey)
 {
-    ASN1_BIT_STRING *prot = NULL;
+    return CMP_calc_protection_cached(msg, NULL, secret, pkey, NULL, NULL);
+}
+
+/*
+ * Marks the given message as changed, such that its retained DER encoding is
+ * no more used, neither for protection nor by i2d_CMP_PKIMESSAGE().
+ * Must be called after changing header, body, or extraCerts of a message
+ * that may have been decoded or protected before, e.g., via the pointer
+ * obtained from CMP_PKIMESSAGE_get0_header().
+ */
+void CMP_PKIMESSAGE_modified(CMP_PKIMESSAGE *msg)
+{
+    if (msg != NULL)
+        msg->enc.modified = 1;
+}
+
+/*
+ * internal function
+ *
+ * Provides the DER encoding of the ProtectedPart of the given message.
+ * If the message holds its unmodified DER encoding, as retained when decoding
+ * it or protecting it with CMP_PKIMESSAGE_protect(), the encoding of header
+ * and body is referenced from there, and just the SEQUENCE tag and length are
+ * put in ppd->prefix. Otherwise, the ProtectedPart is encoded into ppd->buf.
+ *
+ * returns 1 on success, 0 on error
+ */
+int CMP_PROTECTEDPART_DER_init(CMP_PROTECTEDPART_DER *ppd,
+                               const CMP_PKIMESSAGE *msg)
+{
     CMP_PROTECTEDPART prot_part;
+    const unsigned char *start, *p, *end;
+    unsigned char *pp;
+    long len;
+    int tag, xclass, l;
+
+    memset(ppd, 0, sizeof(*ppd));
+    if (msg == NULL)
+        return 0;
+
+    if (msg->enc.enc != NULL && !msg->enc.modified) {
+        /* skip the tag and length of the outer SEQUENCE */
+        start = msg->enc.enc;
+        if (ASN1_get_object(&start, &len, &tag, &xclass, msg->enc.len)
+                != V_ASN1_CONSTRUCTED || tag != V_ASN1_SEQUENCE)
+            goto encode;
+        end = start + len;
+        /* skip header */
+        p = start;
+        if (ASN1_get_object(&p, &len, &tag, &xclass, end - p)
+                != V_ASN1_CONSTRUCTED)
+            goto encode;
+        p += len;
+        /* skip body */
+        if (ASN1_get_object(&p, &len, &tag, &xclass, end - p)
+                != V_ASN1_CONSTRUCTED)
+            goto encode;
+        p += len;
+
+        ppd->der = start;
+        ppd->der_len = p - start;
+        l = ASN1_object_size(1, (int)ppd->der_len, V_ASN1_SEQUENCE);
+        if (l <= 0 || (size_t)l - ppd->der_len > sizeof(ppd->prefix))
+            goto encode;
+        pp = ppd->prefix;
+        ASN1_put_object(&pp, 1, (int)ppd->der_len, V_ASN1_SEQUENCE,
+                        V_ASN1_UNIVERSAL);
+        ppd->prefix_len = pp - ppd->prefix;
+        return 1;
+    }
+
+ encode:
+    memset(ppd, 0, sizeof(*ppd));
+    prot_part.header = (CMP_PKIHEADER *)&msg->header;
+    prot_part.body = msg->body;
+    l = i2d_CMP_PROTECTEDPART(&prot_part, &ppd->buf);
+    if (l < 0 || ppd->buf == NULL)
+        return 0;
+    ppd->der = ppd->buf;
+    ppd->der_len = (size_t)l;
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * frees the data allocated by CMP_PROTECTEDPART_DER_init(), if any
+ */
+void CMP_PROTECTEDPART_DER_cleanup(CMP_PROTECTEDPART_DER *ppd)
+{
+    if (ppd == NULL)
+        return;
+    OPENSSL_free(ppd->buf);
+    memset(ppd, 0, sizeof(*ppd));
+}
+
+/*
+ * internal function
+ *
+ * creates the protection bit string holding the given MAC or signature value
+ * returns pointer to ASN1_BIT_STRING on success, NULL on error
+ */
+static ASN1_BIT_STRING *CMP_protection_new(const unsigned char *mac,
+                                           unsigned int mac_len)
+{
+    ASN1_BIT_STRING *prot;
+
+    if ((prot = ASN1_BIT_STRING_new()) == NULL)
+        return NULL;
+    /* OpenSSL defaults all bit strings to be encoded as ASN.1 NamedBitList */
+    prot->flags &= ~(ASN1_STRING_FLAG_BITS_LEFT | 0x07);
+    prot->flags |= ASN1_STRING_FLAG_BITS_LEFT;
+    if (!ASN1_BIT_STRING_set(prot, (unsigned char *)mac, mac_len)) {
+        ASN1_BIT_STRING_free(prot);
+        return NULL;
+    }
+    return prot;
+}
+
+/*
+ * internal function
+ *
+ * same as CMP_calc_protection(), but for PBMAC takes the base key derived
+ * from the secret from the given cache, or adds it there, if cache is not NULL.
+ * For signatures, uses a copy of sig_ctx if not NULL, which must have been
+ * initialized with EVP_DigestSignInit() for pkey and the digest of the
+ * algorithm given in the protectionAlg of msg.
+ * If ppd is not NULL, it must hold the DER encoding of the ProtectedPart of msg
+ */
+ASN1_BIT_STRING *CMP_calc_protection_cached(const CMP_PKIMESSAGE *msg,
+                                            const CMP_PROTECTEDPART_DER *ppd,
+                                            const ASN1_OCTET_STRING *secret,
+                                            const EVP_PKEY *pkey,
+                                            CRMF_PBM_CACHE *cache,
+                                            const EVP_MD_CTX *sig_ctx)
+{
+    ASN1_BIT_STRING *prot = NULL;
+    CMP_PROTECTEDPART_DER own_ppd;
 #if OPENSSL_VERSION_NUMBER >= 0x1010001fL
     const
 #endif
     ASN1_OBJECT *algorOID = NULL;
 
-    int l;
-    size_t prot_part_der_len;
+    size_t prot_part_der_len, sig_len;
     unsigned int mac_len;
     unsigned char *prot_part_der = NULL;
     unsigned char *mac = NULL;
@@ -576,16 +712,15 @@ ASN1_BIT_STRING *CMP_calc_protection(const CMP_PKIMESSAGE *msg,
     const EVP_MD *md = NULL;
 
 
-    /* construct data to be signed */
-    prot_part.header = msg->header;
-    prot_part.body = msg->body;
-
-    l = i2d_CMP_PROTECTEDPART(&prot_part, &prot_part_der);
-    if (l < 0 || prot_part_der == NULL)
-        goto err;
-    prot_part_der_len = (size_t) l;
+    memset(&own_ppd, 0, sizeof(own_ppd));
+    /* get data to be signed */
+    if (ppd == NULL) {
+        if (!CMP_PROTECTEDPART_DER_init(&own_ppd, msg))
+            goto err;
+        ppd = &own_ppd;
+    }
 
-    X509_ALGOR_get0(&algorOID, &pptype, &ppval, msg->header->protectionAlg);
+    X509_ALGOR_get0(&algorOID, &pptype, &ppval, msg->header.protectionAlg);
 
     if (secret != NULL && pkey == NULL) {
         if (NID_id_PasswordBasedMAC == OBJ_obj2nid(algorOID)) {
@@ -596,67 +731,369 @@ ASN1_BIT_STRING *CMP_calc_protection(const CMP_PKIMESSAGE *msg,
             pbm_str_uc = (unsigned char *)pbm_str->data;
             pbm = d2i_CRMF_PBMPARAMETER(NULL, &pbm_str_uc, pbm_str->length);
 
-            if (!(CRMF_passwordBasedMac_new(pbm, prot_part_der,
-                                            prot_part_der_len, secret->data,
-                                            secret->length, &mac, &mac_len)))
+            /* the MAC is calculated in one go, so join prefix and the rest */
+            prot_part_der_len = ppd->prefix_len + ppd->der_len;
+            if ((prot_part_der = OPENSSL_malloc(prot_part_der_len)) == NULL)
+                goto err;
+            memcpy(prot_part_der, ppd->prefix, ppd->prefix_len);
+            memcpy(prot_part_der + ppd->prefix_len, ppd->der, ppd->der_len);
+
+            if (!(CRMF_passwordBasedMac_new_ex(pbm, prot_part_der,
+                                               prot_part_der_len, secret->data,
+                                               secret->length, cache,
+                                               &mac, &mac_len)))
                 goto err;
         } else {
-            CMPerr(CMP_F_CMP_CALC_PROTECTION, CMP_R_WRONG_ALGORITHM_OID);
+            CMPerr(CMP_F_CMP_CALC_PROTECTION_CACHED, CMP_R_WRONG_ALGORITHM_OID);
             goto err;
         }
     } else if (secret == NULL && pkey != NULL) {
-        /* EVP_SignFinal() will check that pkey type is correct for the alg */
+        /* EVP_DigestSignInit() checks that pkey type is correct for the alg */
 
         if (OBJ_find_sigid_algs(OBJ_obj2nid(algorOID), &md_NID, NULL)
             && (md = EVP_get_digestbynid(md_NID))) {
-            mac = OPENSSL_malloc(EVP_PKEY_size((EVP_PKEY *)pkey));
+            sig_len = EVP_PKEY_size((EVP_PKEY *)pkey);
+            mac = OPENSSL_malloc(sig_len);
             if (mac == NULL)
                 goto err;
 
             evp_ctx = EVP_MD_CTX_create();
             if (evp_ctx == NULL)
                 goto err;
-            if (!(EVP_SignInit_ex(evp_ctx, md, NULL)))
+            if (sig_ctx != NULL) {
+                /* copying saves setting up the key context for each msg */
+                if (!EVP_MD_CTX_copy_ex(evp_ctx, sig_ctx))
+                    goto err;
+            } else if (!EVP_DigestSignInit(evp_ctx, NULL, md, NULL,
+                                           (EVP_PKEY *)pkey)) {
+                goto err;
+            }
+            if (ppd->prefix_len > 0 &&
+                !(EVP_DigestSignUpdate(evp_ctx, ppd->prefix, ppd->prefix_len)))
                 goto err;
-            if (!(EVP_SignUpdate(evp_ctx, prot_part_der, prot_part_der_len)))
+            if (!(EVP_DigestSignUpdate(evp_ctx, ppd->der, ppd->der_len)))
                 goto err;
-            if (!(EVP_SignFinal(evp_ctx, mac, &mac_len, (EVP_PKEY *)pkey)))
+            if (!(EVP_DigestSignFinal(evp_ctx, mac, &sig_len)))
                 goto err;
+            mac_len = (unsigned int)sig_len;
         } else {
-            CMPerr(CMP_F_CMP_CALC_PROTECTION, CMP_R_UNKNOWN_ALGORITHM_ID);
+            CMPerr(CMP_F_CMP_CALC_PROTECTION_CACHED, CMP_R_UNKNOWN_ALGORITHM_ID);
             goto err;
         }
     } else {
-        CMPerr(CMP_F_CMP_CALC_PROTECTION, CMP_R_INVALID_ARGS);
+        CMPerr(CMP_F_CMP_CALC_PROTECTION_CACHED, CMP_R_INVALID_ARGS);
         goto err;
     }
 
-    if ((prot = ASN1_BIT_STRING_new()) == NULL)
-        goto err;
-    /* OpenSSL defaults all bit strings to be encoded as ASN.1 NamedBitList */
-    prot->flags &= ~(ASN1_STRING_FLAG_BITS_LEFT | 0x07);
-    prot->flags |= ASN1_STRING_FLAG_BITS_LEFT;
-    ASN1_BIT_STRING_set(prot, mac, mac_len);
+    prot = CMP_protection_new(mac, mac_len);
 
  err:
     if (prot == NULL)
-        CMPerr(CMP_F_CMP_CALC_PROTECTION, CMP_R_ERROR_CALCULATING_PROTECTION);
+        CMPerr(CMP_F_CMP_CALC_PROTECTION_CACHED,
+               CMP_R_ERROR_CALCULATING_PROTECTION);
 
     /* cleanup */
     CRMF_PBMPARAMETER_free(pbm);
     EVP_MD_CTX_destroy(evp_ctx);
     OPENSSL_free(mac);
     OPENSSL_free(prot_part_der);
+    CMP_PROTECTEDPART_DER_cleanup(&own_ppd);
     return prot;
 }
 
+/*
+ * internal function
+ *
+ * Provides in ctx the base key for DHBasedMac protection, which is the given
+ * OWF applied to the secret agreed between ctx->pkey and the public key in the
+ * given certificate of the peer. The key agreement, which is by far the most
+ * costly step, is done only once as long as pkey and the peer's certificate
+ * remain the same, which is typically the case for a whole transaction.
+ *
+ * returns 1 on success, 0 on error
+ */
+static int CMP_CTX_dhbm_basekey(CMP_CTX *ctx, const X509 *peer,
+                                const EVP_MD *owf)
+{
+    EVP_PKEY_CTX *pctx = NULL;
+    EVP_PKEY *peer_key;
+    unsigned char *secret = NULL;
+    size_t secret_len = 0;
+    int ret = 0;
+
+    if (ctx->dhbm_basekey_len > 0 && ctx->dhbm_owf == EVP_MD_type(owf) &&
+        X509_cmp(ctx->dhbm_peer, peer) == 0)
+        return 1;
+
+    X509_free(ctx->dhbm_peer);
+    ctx->dhbm_peer = NULL;
+    ctx->dhbm_basekey_len = 0;
+    if (ctx->pkey == NULL) {
+        CMPerr(CMP_F_CMP_CTX_DHBM_BASEKEY,
+               CMP_R_MISSING_KEY_INPUT_FOR_CREATING_PROTECTION);
+        return 0;
+    }
+    if ((peer_key = X509_get0_pubkey(peer)) == NULL ||
+        (pctx = EVP_PKEY_CTX_new(ctx->pkey, NULL)) == NULL ||
+        EVP_PKEY_derive_init(pctx) <= 0 ||
+        EVP_PKEY_derive_set_peer(pctx, peer_key) <= 0 ||
+        EVP_PKEY_derive(pctx, NULL, &secret_len) <= 0 ||
+        (secret = OPENSSL_malloc(secret_len)) == NULL ||
+        EVP_PKEY_derive(pctx, secret, &secret_len) <= 0) {
+        CMPerr(CMP_F_CMP_CTX_DHBM_BASEKEY, CMP_R_KEY_AGREEMENT_FAILED);
+        goto err;
+    }
+    if (!EVP_Digest(secret, secret_len, ctx->dhbm_basekey,
+                    &ctx->dhbm_basekey_len, owf, NULL)) {
+        ctx->dhbm_basekey_len = 0;
+        goto err;
+    }
+    X509_up_ref((X509 *)peer);
+    ctx->dhbm_peer = (X509 *)peer;
+    ctx->dhbm_owf = EVP_MD_type(owf);
+    ret = 1;
+ err:
+    OPENSSL_clear_free(secret, secret_len);
+    EVP_PKEY_CTX_free(pctx);
+    return ret;
+}
+
+/*
+ * internal function
+ *
+ * calculates the DHBasedMac protection (RFC 4210 section 5.1.3.2) of msg
+ * using the OWF and MAC algorithms given in its protectionAlg and the base key
+ * agreed between ctx->pkey and the public key in the certificate of the peer.
+ * If ppd is not NULL, it must hold the DER encoding of the ProtectedPart of msg
+ *
+ * returns pointer to ASN1_BIT_STRING containing protection on success, NULL on
+ * error
+ */
+ASN1_BIT_STRING *CMP_calc_dhbmac(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
+                                 const CMP_PROTECTEDPART_DER *ppd,
+                                 const X509 *peer)
+{
+    ASN1_BIT_STRING *prot = NULL;
+    CMP_PROTECTEDPART_DER own_ppd;
+#if OPENSSL_VERSION_NUMBER >= 0x1010001fL
+    const
+#endif
+    ASN1_OBJECT *algorOID = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x1010001fL
+    const
+#endif
+    void *ppval = NULL;
+    int pptype = 0;
+    const ASN1_STRING *param;
+    const unsigned char *param_uc;
+    CMP_DHBMPARAMETER *dhbm = NULL;
+    const EVP_MD *owf, *md;
+    int mac_md_nid;
+    HMAC_CTX *hmac_ctx = NULL;
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int mac_len;
+
+    memset(&own_ppd, 0, sizeof(own_ppd));
+    if (ctx == NULL || msg == NULL || peer == NULL) {
+        CMPerr(CMP_F_CMP_CALC_DHBMAC, CMP_R_NULL_ARGUMENT);
+        goto err;
+    }
+
+    X509_ALGOR_get0(&algorOID, &pptype, &ppval, msg->header.protectionAlg);
+    if (OBJ_obj2nid(algorOID) != NID_id_DHBasedMac ||
+        pptype != V_ASN1_SEQUENCE || ppval == NULL) {
+        CMPerr(CMP_F_CMP_CALC_DHBMAC, CMP_R_WRONG_ALGORITHM_OID);
+        goto err;
+    }
+    param = (const ASN1_STRING *)ppval;
+    param_uc = param->data;
+    if ((dhbm = d2i_CMP_DHBMPARAMETER(NULL, &param_uc, param->length))
+        == NULL)
+        goto err;
+    if ((owf = EVP_get_digestbyobj(dhbm->owf->algorithm)) == NULL ||
+        !EVP_PBE_find(EVP_PBE_TYPE_PRF, OBJ_obj2nid(dhbm->mac->algorithm),
+                      NULL, &mac_md_nid, NULL) ||
+        (md = EVP_get_digestbynid(mac_md_nid)) == NULL) {
+        CMPerr(CMP_F_CMP_CALC_DHBMAC, CMP_R_ALGORITHM_NOT_SUPPORTED);
+        goto err;
+    }
+    if (!CMP_CTX_dhbm_basekey(ctx, peer, owf))
+        goto err;
+
+    /* get data to be protected */
+    if (ppd == NULL) {
+        if (!CMP_PROTECTEDPART_DER_init(&own_ppd, msg))
+            goto err;
+        ppd = &own_ppd;
+    }
+    if ((hmac_ctx = HMAC_CTX_new()) == NULL ||
+        !HMAC_Init_ex(hmac_ctx, ctx->dhbm_basekey, (int)ctx->dhbm_basekey_len,
+                      md, NULL) ||
+        (ppd->prefix_len > 0 &&
+         !HMAC_Update(hmac_ctx, ppd->prefix, ppd->prefix_len)) ||
+        !HMAC_Update(hmac_ctx, ppd->der, ppd->der_len) ||
+        !HMAC_Final(hmac_ctx, mac, &mac_len))
+        goto err;
+
+    prot = CMP_protection_new(mac, mac_len);
+
+ err:
+    if (prot == NULL)
+        CMPerr(CMP_F_CMP_CALC_DHBMAC, CMP_R_ERROR_CALCULATING_PROTECTION);
+    HMAC_CTX_free(hmac_ctx);
+    OPENSSL_cleanse(mac, sizeof(mac));
+    CMP_DHBMPARAMETER_free(dhbm);
+    CMP_PROTECTEDPART_DER_cleanup(&own_ppd);
+    return prot;
+}
+
+/*
+ * internal function
+ *
+ * Retains the DER encoding of the given freshly protected message, composed of
+ * the given encoding of its ProtectedPart followed by its protection and
+ * extraCerts, such that i2d_CMP_PKIMESSAGE() need not encode it once more.
+ *
+ * returns 1 on success, 0 on error
+ */
+static int CMP_PKIMESSAGE_retain_der(CMP_PKIMESSAGE *msg,
+                                     const CMP_PROTECTEDPART_DER *ppd)
+{
+    CMP_PKIMESSAGE_TAIL tail;
+    const unsigned char *content, *tail_content;
+    unsigned char *tail_der = NULL, *der = NULL, *p;
+    long content_len, tail_len;
+    int tag, xclass, l, total;
+
+    /* get the encoding of header and body without the enclosing SEQUENCE */
+    content = ppd->der;
+    content_len = (long)ppd->der_len;
+    if (ppd->prefix_len == 0 &&
+        ASN1_get_object(&content, &content_len, &tag, &xclass,
+                        (long)ppd->der_len) != V_ASN1_CONSTRUCTED)
+        goto err;
+
+    tail.protection = msg->protection;
+    tail.extraCerts = msg->extraCerts;
+    if ((l = ASN1_item_i2d((ASN1_VALUE *)&tail, &tail_der,
+                           ASN1_ITEM_rptr(CMP_PKIMESSAGE_TAIL))) <= 0)
+        goto err;
+    tail_content = tail_der;
+    if (ASN1_get_object(&tail_content, &tail_len, &tag, &xclass, l)
+            != V_ASN1_CONSTRUCTED)
+        goto err;
+
+    total = ASN1_object_size(1, content_len + tail_len, V_ASN1_SEQUENCE);
+    if (total <= 0 || (der = OPENSSL_malloc(total)) == NULL)
+        goto err;
+    p = der;
+    ASN1_put_object(&p, 1, content_len + tail_len, V_ASN1_SEQUENCE,
+                    V_ASN1_UNIVERSAL);
+    memcpy(p, content, content_len);
+    memcpy(p + content_len, tail_content, tail_len);
+
+    OPENSSL_free(msg->enc.enc);
+    msg->enc.enc = der;
+    msg->enc.len = total;
+    msg->enc.modified = 0;
+    OPENSSL_free(tail_der);
+    return 1;
+ err:
+    OPENSSL_free(tail_der);
+    return 0;
+}
+
+/*
+ * internal function
+ *
+ * Calculates the protection of the given message and sets it, encoding the
+ * ProtectedPart only once for both the protection and the whole message.
+ *
+ * returns 1 on success, 0 on error
+ */
+static int CMP_PKIMESSAGE_set_protection(CMP_CTX *ctx, CMP_PKIMESSAGE *msg,
+                                         const ASN1_OCTET_STRING *secret,
+                                         const EVP_PKEY *pkey,
+                                         const X509 *dh_peer)
+{
+    CMP_PROTECTEDPART_DER ppd;
+    ASN1_BIT_STRING *prot;
+
+    /* header and body have just been changed, so they need to be encoded */
+    CMP_PKIMESSAGE_modified(msg);
+    if (!CMP_PROTECTEDPART_DER_init(&ppd, msg))
+        return 0;
+    if (dh_peer != NULL)
+        prot = CMP_calc_dhbmac(ctx, msg, &ppd, dh_peer);
+    else
+        prot = CMP_calc_protection_cached(msg, &ppd, secret, pkey,
+                                          ctx->pbm_cache,
+                                          pkey != NULL ? ctx->sig_md_ctx
+                                                       : NULL);
+    if (prot != NULL) {
+        ASN1_BIT_STRING_free(msg->protection);
+        msg->protection = prot;
+        /* failing to retain the encoding just means it is done again later */
+        (void)CMP_PKIMESSAGE_retain_der(msg, &ppd);
+    }
+    CMP_PROTECTEDPART_DER_cleanup(&ppd);
+    return prot != NULL;
+}
+
+/*
+ * internal function
+ *
+ * Prepares signature-based protection with ctx->clCert and ctx->pkey unless
+ * done before, which is reset when any of them or the digest is changed:
+ * checks that key and certificate match, determines the signature algorithm,
+ * and sets up a signing context that is copied for each message to protect.
+ *
+ * returns 1 on success, 0 on error
+ */
+static int CMP_CTX_sig_prepare(CMP_CTX *ctx)
+{
+    const EVP_MD *md;
+
+    if (!ctx->sig_key_checked) {
+        if (!X509_check_private_key(ctx->clCert, ctx->pkey)) {
+            CMPerr(CMP_F_CMP_CTX_SIG_PREPARE, CMP_R_CERT_AND_KEY_DO_NOT_MATCH);
+            return 0;
+        }
+        ctx->sig_key_checked = 1;
+    }
+    if (ctx->sig_alg_nid == 0 &&
+        !OBJ_find_sigid_by_algs(&ctx->sig_alg_nid, ctx->digest,
+                                EVP_PKEY_id(ctx->pkey))) {
+        ctx->sig_alg_nid = 0;
+        CMPerr(CMP_F_CMP_CTX_SIG_PREPARE, CMP_R_UNSUPPORTED_KEY_TYPE);
+        return 0;
+    }
+    if (ctx->sig_md_ctx == NULL) {
+        /* not fatal: the signing context is then set up for each message */
+        (void)ERR_set_mark();
+        if ((md = EVP_get_digestbynid(ctx->digest)) == NULL ||
+            (ctx->sig_md_ctx = EVP_MD_CTX_new()) == NULL ||
+            !EVP_DigestSignInit(ctx->sig_md_ctx, NULL, md, NULL, ctx->pkey)) {
+            EVP_MD_CTX_free(ctx->sig_md_ctx);
+            ctx->sig_md_ctx = NULL;
+        }
+        (void)ERR_pop_to_mark();
+    }
+    return 1;
+}
+
 /*
  * internal function
  * Create an X509_ALGOR structure for PasswordBasedMAC protection based on
- * the pbm settings in the context
+ * the pbm settings in the context.
+ * If the CMP_CTX_OPT_PBM_REUSE_SALT option is set, the algorithm (including
+ * its salt) generated for the first message of a transaction is reused for
+ * all further messages with the same transactionID, such that the base key
+ * needs to be derived only once per transaction.
  * returns pointer to X509_ALGOR on success, NULL on error
  */
-static X509_ALGOR *CMP_create_pbmac_algor(CMP_CTX *ctx)
+static X509_ALGOR *CMP_create_pbmac_algor(CMP_CTX *ctx,
+                                          const ASN1_OCTET_STRING *tid)
 {
     X509_ALGOR *alg = NULL;
     CRMF_PBMPARAMETER *pbm = NULL;
@@ -664,6 +1101,11 @@ static X509_ALGOR *CMP_create_pbmac_algor(CMP_CTX *ctx)
     int pbm_der_len;
     ASN1_STRING *pbm_str = NULL;
 
+    if (ctx->pbm_reuse_salt && ctx->pbm_algor != NULL && tid != NULL &&
+        ctx->pbm_algor_tid != NULL &&
+        ASN1_OCTET_STRING_cmp(ctx->pbm_algor_tid, tid) == 0)
+        return X509_ALGOR_dup(ctx->pbm_algor);
+
     if ((alg = X509_ALGOR_new()) == NULL)
         goto err;
     if ((pbm = CRMF_pbmp_new(ctx->pbm_slen, ctx->pbm_owf,
@@ -680,6 +1122,14 @@ static X509_ALGOR *CMP_create_pbmac_algor(CMP_CTX *ctx)
     X509_ALGOR_set0(alg, OBJ_nid2obj(NID_id_PasswordBasedMAC),
                     V_ASN1_SEQUENCE, pbm_str);
 
+    if (ctx->pbm_reuse_salt && tid != NULL) {
+        X509_ALGOR_free(ctx->pbm_algor);
+        ctx->pbm_algor = NULL;
+        if (!CMP_ASN1_OCTET_STRING_set1(&ctx->pbm_algor_tid, tid) ||
+            (ctx->pbm_algor = X509_ALGOR_dup(alg)) == NULL)
+            goto err;
+    }
+
     CRMF_PBMPARAMETER_free(pbm);
     return alg;
  err:
@@ -690,6 +1140,36 @@ static X509_ALGOR *CMP_create_pbmac_algor(CMP_CTX *ctx)
     return NULL;
 }
 
+/*
+ * internal function
+ * Create an X509_ALGOR structure for DHBasedMac protection, using the same
+ * OWF and MAC algorithms as for PasswordBasedMAC.
+ * returns pointer to X509_ALGOR on success, NULL on error
+ */
+static X509_ALGOR *CMP_create_dhbmac_algor(const CMP_CTX *ctx)
+{
+    X509_ALGOR *alg = NULL;
+    CMP_DHBMPARAMETER *dhbm = NULL;
+    ASN1_STRING *dhbm_str = NULL;
+
+    if ((dhbm = CMP_DHBMPARAMETER_new()) == NULL ||
+        !X509_ALGOR_set0(dhbm->owf, OBJ_nid2obj(ctx->pbm_owf), V_ASN1_UNDEF,
+                         NULL) ||
+        !X509_ALGOR_set0(dhbm->mac, OBJ_nid2obj(ctx->pbm_mac), V_ASN1_UNDEF,
+                         NULL) ||
+        (dhbm_str = ASN1_item_pack(dhbm, ASN1_ITEM_rptr(CMP_DHBMPARAMETER),
+                                   NULL)) == NULL ||
+        (alg = X509_ALGOR_new()) == NULL ||
+        !X509_ALGOR_set0(alg, OBJ_nid2obj(NID_id_DHBasedMac), V_ASN1_SEQUENCE,
+                         dhbm_str)) {
+        ASN1_STRING_free(dhbm_str);
+        X509_ALGOR_free(alg);
+        alg = NULL;
+    }
+    CMP_DHBMPARAMETER_free(dhbm);
+    return alg;
+}
+
 /*
  * Determines which kind of protection should be created, based on the ctx.
  * Sets this into the protectionAlg field in the message header.
@@ -699,19 +1179,25 @@ static X509_ALGOR *CMP_create_pbmac_algor(CMP_CTX *ctx)
  */
 int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
 {
+    uint64_t start;
+
     if (ctx == NULL)
         goto err;
     if (msg == NULL)
         goto err;
+    CMP_PKIMESSAGE_modified(msg);
     if (ctx->unprotectedSend)
         return 1;
+    start = CMP_CTX_phase_start(ctx);
 
     /* use PasswordBasedMac according to 5.1.3.1 if secretValue is given */
     if (ctx->secretValue) {
-        if ((msg->header->protectionAlg = CMP_create_pbmac_algor(ctx)) == NULL)
+        X509_ALGOR_free(msg->header.protectionAlg);
+        if ((msg->header.protectionAlg =
+             CMP_create_pbmac_algor(ctx, msg->header.transactionID)) == NULL)
             goto err;
         if (ctx->referenceValue &&
-            !CMP_PKIHEADER_set1_senderKID(msg->header, ctx->referenceValue))
+            !CMP_PKIHEADER_set1_senderKID(&msg->header, ctx->referenceValue))
             goto err;
 
         /*
@@ -721,9 +1207,36 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
          */
         CMP_PKIMESSAGE_add_extraCerts(ctx, msg);
 
-        if ((msg->protection =
-              CMP_calc_protection(msg, ctx->secretValue, NULL)) == NULL)
+        if (!CMP_PKIMESSAGE_set_protection(ctx, msg, ctx->secretValue, NULL,
+                                           NULL))
+            goto err;
+    } else if (ctx->dhbm) {
+        /*
+         * use DHBasedMac according to 5.1.3.2 with our DH certificate and
+         * private key and the DH certificate of the recipient, which is
+         * ctx->srvCert or else the one the last message was validated with
+         */
+        const X509 *peer = ctx->srvCert != NULL ? ctx->srvCert
+                                                : ctx->validatedSrvCert;
+        const ASN1_OCTET_STRING *subjKeyIDStr = NULL;
 
+        if (ctx->clCert == NULL || ctx->pkey == NULL || peer == NULL) {
+            CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT,
+                   CMP_R_MISSING_KEY_INPUT_FOR_CREATING_PROTECTION);
+            goto err;
+        }
+        X509_ALGOR_free(msg->header.protectionAlg);
+        if ((msg->header.protectionAlg = CMP_create_dhbmac_algor(ctx)) == NULL)
+            goto err;
+        subjKeyIDStr = X509_get0_subject_key_id(ctx->clCert);
+        if (subjKeyIDStr &&
+            !CMP_PKIHEADER_set1_senderKID(&msg->header, subjKeyIDStr))
+            goto err;
+
+        /* the recipient needs our DH certificate to verify the protection */
+        CMP_PKIMESSAGE_add_extraCerts(ctx, msg);
+
+        if (!CMP_PKIMESSAGE_set_protection(ctx, msg, NULL, NULL, peer))
             goto err;
     } else {
         /*
@@ -732,27 +1245,16 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
          */
         if (ctx->clCert && ctx->pkey) {
             const ASN1_OCTET_STRING *subjKeyIDStr = NULL;
-            int algNID = 0;
             ASN1_OBJECT *alg = NULL;
 
-            /* make sure that key and certificate match */
-            if (!X509_check_private_key(ctx->clCert, ctx->pkey)) {
-                CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT,
-                        CMP_R_CERT_AND_KEY_DO_NOT_MATCH);
+            if (!CMP_CTX_sig_prepare(ctx))
                 goto err;
-            }
 
-            if (msg->header->protectionAlg == NULL)
-                msg->header->protectionAlg = X509_ALGOR_new();
+            if (msg->header.protectionAlg == NULL)
+                msg->header.protectionAlg = X509_ALGOR_new();
 
-            if (!OBJ_find_sigid_by_algs(&algNID, ctx->digest,
-                        EVP_PKEY_id(ctx->pkey))) {
-                CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT,
-                        CMP_R_UNSUPPORTED_KEY_TYPE);
-                goto err;
-            }
-            alg = OBJ_nid2obj(algNID);
-            X509_ALGOR_set0(msg->header->protectionAlg, alg, V_ASN1_UNDEF,NULL);
+            alg = OBJ_nid2obj(ctx->sig_alg_nid);
+            X509_ALGOR_set0(msg->header.protectionAlg, alg, V_ASN1_UNDEF,NULL);
 
             /*
              * set senderKID to  keyIdentifier of the used certificate according
@@ -760,15 +1262,15 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
              */
             subjKeyIDStr = X509_get0_subject_key_id(ctx->clCert);
             if (subjKeyIDStr &&
-                !CMP_PKIHEADER_set1_senderKID(msg->header, subjKeyIDStr))
+                !CMP_PKIHEADER_set1_senderKID(&msg->header, subjKeyIDStr))
                 goto err;
 
             /* Add ctx->extraCertsOut, the ctx->clCert,
              * and the chain built upwards from ctx->untrusted_certs */
             CMP_PKIMESSAGE_add_extraCerts(ctx, msg);
 
-            if ((msg->protection =
-                 CMP_calc_protection(msg, NULL, ctx->pkey)) == NULL)
+            if (!CMP_PKIMESSAGE_set_protection(ctx, msg, NULL, ctx->pkey,
+                                               NULL))
                 goto err;
         } else {
             CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT,
@@ -777,6 +1279,7 @@ int CMP_PKIMESSAGE_protect(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
         }
     }
 
+    CMP_CTX_phase_end(ctx, CMP_PHASE_PROTECT, start, 0);
     return 1;
  err:
     CMPerr(CMP_F_CMP_PKIMESSAGE_PROTECT, CMP_R_ERROR_PROTECTING_MESSAGE);
@@ -803,6 +1306,7 @@ int CMP_PKIMESSAGE_add_extraCerts(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
         goto err;
     if (msg == NULL)
         goto err;
+    CMP_PKIMESSAGE_modified(msg);
     if (msg->extraCerts == NULL && !(msg->extraCerts = sk_X509_new_null()))
         goto err;
 
@@ -813,12 +1317,23 @@ int CMP_PKIMESSAGE_add_extraCerts(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
          * our own
          */
         if (ctx->untrusted_certs) {
-            STACK_OF(X509) *chain =
-                CMP_build_cert_chain(ctx->untrusted_certs, ctx->clCert);
+            /*
+             * build the chain only once for all messages sent, unless further
+             * untrusted certs have been added, which may extend the chain;
+             * direct modifications via CMP_CTX_get0_untrusted_certs() and
+             * setting the certs anew drop the chain
+             */
+            if (ctx->clCert_chain == NULL || ctx->clCert_chain_untrusted_num
+                                          != sk_X509_num(ctx->untrusted_certs)) {
+                sk_X509_pop_free(ctx->clCert_chain, X509_free);
+                ctx->clCert_chain =
+                    CMP_build_cert_chain(ctx->untrusted_certs, ctx->clCert);
+                ctx->clCert_chain_untrusted_num =
+                    sk_X509_num(ctx->untrusted_certs);
+            }
             /* Our own cert will be sent first */
-            res = CMP_sk_X509_add1_certs(msg->extraCerts, chain,
+            res = CMP_sk_X509_add1_certs(msg->extraCerts, ctx->clCert_chain,
                                          1/* no self-signed */, 1);
-            sk_X509_pop_free(chain, X509_free);
         } else {
             /* Make sure that at least our own cert gets sent */
             X509_up_ref(ctx->clCert);
@@ -890,7 +1405,8 @@ int CMP_PKIMESSAGE_set_implicitConfirm(CMP_PKIMESSAGE *msg)
     if ((itav = CMP_ITAV_new(OBJ_nid2obj(NID_id_it_implicitConfirm),
                              (const ASN1_TYPE *)ASN1_NULL_new())) == NULL)
         goto err;
-    if (!CMP_PKIHEADER_generalInfo_item_push0(msg->header, itav))
+    CMP_PKIMESSAGE_modified(msg);
+    if (!CMP_PKIHEADER_generalInfo_item_push0(&msg->header, itav))
         goto err;
     return 1;
  err:
@@ -913,10 +1429,10 @@ int CMP_PKIMESSAGE_check_implicitConfirm(CMP_PKIMESSAGE *msg)
     if (msg == NULL)
         return 0;
 
-    itavCount = sk_CMP_INFOTYPEANDVALUE_num(msg->header->generalInfo);
+    itavCount = sk_CMP_INFOTYPEANDVALUE_num(msg->header.generalInfo);
 
     for (i = 0; i < itavCount; i++) {
-        itav = sk_CMP_INFOTYPEANDVALUE_value(msg->header->generalInfo, i);
+        itav = sk_CMP_INFOTYPEANDVALUE_value(msg->header.generalInfo, i);
         if (OBJ_obj2nid(itav->infoType) == NID_id_it_implicitConfirm)
             return 1;
     }
@@ -954,9 +1470,10 @@ int CMP_PKIMESSAGE_generalInfo_items_push1(CMP_PKIMESSAGE *msg,
     if (msg == NULL)
         goto err;
 
+    CMP_PKIMESSAGE_modified(msg);
     for (i = 0; i < sk_CMP_INFOTYPEANDVALUE_num(itavs); i++) {
         itav = CMP_INFOTYPEANDVALUE_dup(sk_CMP_INFOTYPEANDVALUE_value(itavs,i));
-        if (!CMP_PKIHEADER_generalInfo_item_push0(msg->header, itav)) {
+        if (!CMP_PKIHEADER_generalInfo_item_push0(&msg->header, itav)) {
             CMP_INFOTYPEANDVALUE_free(itav);
             goto err;
         }
@@ -984,6 +1501,7 @@ int CMP_PKIMESSAGE_genm_item_push0(CMP_PKIMESSAGE *msg,
     if (bodytype != V_CMP_PKIBODY_GENM && bodytype != V_CMP_PKIBODY_GENP)
         goto err;
 
+    CMP_PKIMESSAGE_modified(msg);
     if (!CMP_INFOTYPEANDVALUE_stack_item_push0(&msg->body->value.genm, itav))
         goto err;
     return 1;
@@ -1343,7 +1861,7 @@ CMP_POLLREP *CMP_POLLREPCONTENT_pollRep_get0(CMP_POLLREPCONTENT *prc, long rid)
     for (i = 0; i < sk_CMP_POLLREP_num(prc); i++) {
         pollRep = sk_CMP_POLLREP_value(prc, i);
         /* is it the right CertReqId? */
-        if (rid == -1 || rid == ASN1_INTEGER_get(pollRep->certReqId))
+        if (rid == -1 || rid == ASN1_INTEGER_get(&pollRep->certReqId))
             return pollRep;
     }
 
@@ -1374,7 +1892,7 @@ CMP_CERTRESPONSE *CMP_CERTREPMESSAGE_certResponse_get0(CMP_CERTREPMESSAGE
     for (i = 0; i < sk_CMP_CERTRESPONSE_num(crepmsg->response); i++) {
         crep = sk_CMP_CERTRESPONSE_value(crepmsg->response, i);
         /* is it the right CertReqId? */
-        if (rid == -1 || rid == ASN1_INTEGER_get(crep->certReqId))
+        if (rid == -1 || rid == ASN1_INTEGER_get(&crep->certReqId))
             return crep;
     }
 
@@ -1391,6 +1909,11 @@ CMP_CERTRESPONSE *CMP_CERTREPMESSAGE_certResponse_get0(CMP_CERTREPMESSAGE
  * Decrypts the certificate in the given CertOrEncCert
  * this is needed for the indirect PoP method as in section 5.2.8.2
  *
+ * The encrypted value is decrypted in one go into a scratch buffer, from
+ * which the resulting DER encoding is decoded directly. coec is left as
+ * received, such that the message can still be re-encoded and the
+ * certificate can be retrieved again.
+ *
  * returns a pointer to the decrypted certificate
  * returns NULL on error or if no Certificate available
  */
@@ -1401,74 +1924,62 @@ static X509 *CMP_CERTORENCCERT_encCert_get1(CMP_CERTORENCCERT *coec,
     X509 *cert = NULL; /* decrypted certificate */
     EVP_CIPHER_CTX *evp_ctx = NULL; /* context for symmetric encryption */
     unsigned char *ek = NULL; /* decrypted symmetric encryption key */
+    size_t eksize = 0;
     const EVP_CIPHER *cipher = NULL; /* used cipher */
-    unsigned char *iv = NULL; /* initial vector for symmetric encryption */
-    unsigned char *outbuf = NULL; /* decryption output buffer */
+    unsigned char *buf = NULL; /* the decrypted value */
+    int buflen = 0;
     const unsigned char *p = NULL; /* needed for decoding ASN1 */
-    int symmAlg = 0; /* NIDs for symmetric algorithm */
     int n, outlen = 0;
     EVP_PKEY_CTX *pkctx = NULL; /* private key context */
 
-    if (coec == NULL)
+    if (coec == NULL || pkey == NULL)
         goto err;
     if ((ecert = coec->value.encryptedCert) == NULL)
         goto err;
-    if (ecert->symmAlg == NULL)
-        goto err;
-    if (!(symmAlg = OBJ_obj2nid(ecert->symmAlg->algorithm)))
+    if (ecert->symmAlg == NULL || ecert->encSymmKey == NULL ||
+        ecert->encValue == NULL)
         goto err;
 
     /* first the symmetric key needs to be decrypted */
-    if ((pkctx = EVP_PKEY_CTX_new(pkey, NULL)) && EVP_PKEY_decrypt_init(pkctx)){
-        ASN1_BIT_STRING *encKey = ecert->encSymmKey;
-        size_t eksize = 0;
-
-        if (encKey == NULL)
-            goto err;
-
-        if (EVP_PKEY_decrypt(pkctx, NULL, &eksize, encKey->data, encKey->length)
-                <= 0
-            || (ek = OPENSSL_malloc(eksize)) == NULL
-            || EVP_PKEY_decrypt(pkctx, ek, &eksize, encKey->data,
-                                encKey->length) <= 0) {
-            CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
-                   CMP_R_ERROR_DECRYPTING_SYMMETRIC_KEY);
-            goto err;
-        }
-    } else {
+    if ((pkctx = EVP_PKEY_CTX_new(pkey, NULL)) == NULL ||
+        EVP_PKEY_decrypt_init(pkctx) <= 0) {
         CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
                CMP_R_ERROR_DECRYPTING_KEY);
         goto err;
     }
+    if (EVP_PKEY_decrypt(pkctx, NULL, &eksize, ecert->encSymmKey->data,
+                         ecert->encSymmKey->length) <= 0
+        || (ek = OPENSSL_malloc(eksize)) == NULL
+        || EVP_PKEY_decrypt(pkctx, ek, &eksize, ecert->encSymmKey->data,
+                            ecert->encSymmKey->length) <= 0) {
+        CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
+               CMP_R_ERROR_DECRYPTING_SYMMETRIC_KEY);
+        goto err;
+    }
 
     /* select symmetric cipher based on algorithm given in message */
-    if ((cipher = EVP_get_cipherbynid(symmAlg)) == NULL) {
+    if ((cipher = EVP_get_cipherbyobj(ecert->symmAlg->algorithm)) == NULL) {
         CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
                CMP_R_UNSUPPORTED_CIPHER);
         goto err;
     }
-    if ((iv = OPENSSL_malloc(EVP_CIPHER_iv_length(cipher))) == NULL)
-        goto err;
-    ASN1_TYPE_get_octetstring(ecert->symmAlg->parameter, iv,
-                              EVP_CIPHER_iv_length(cipher));
 
     /*
-     * d2i_X509 changes the given pointer, so use p for decoding the message and
-     * keep the original pointer in outbuf so the memory can be freed later
+     * The value is decrypted into a separate buffer rather than in place,
+     * as the received message must stay unchanged. The padding is left in
+     * place since the DER encoding determines the length of the certificate.
      */
-    if (ecert->encValue == NULL)
-        goto err;
-    if ((p = outbuf = OPENSSL_malloc(ecert->encValue->length +
-                                     EVP_CIPHER_block_size(cipher))) == NULL)
-        goto err;
-    evp_ctx = EVP_CIPHER_CTX_new();
-    EVP_CIPHER_CTX_set_padding(evp_ctx, 0);
-
-    if (!EVP_DecryptInit(evp_ctx, cipher, ek, iv)
-        || !EVP_DecryptUpdate(evp_ctx, outbuf, &outlen,
-                              ecert->encValue->data,
+    buflen = ecert->encValue->length + EVP_CIPHER_block_size(cipher);
+    if ((buf = OPENSSL_malloc(buflen)) == NULL
+        || (evp_ctx = EVP_CIPHER_CTX_new()) == NULL
+        || !EVP_DecryptInit_ex(evp_ctx, cipher, NULL, NULL, NULL)
+        || EVP_CIPHER_asn1_to_param(evp_ctx, ecert->symmAlg->parameter) <= 0
+        || eksize != (size_t)EVP_CIPHER_CTX_key_length(evp_ctx)
+        || !EVP_DecryptInit_ex(evp_ctx, NULL, NULL, ek, NULL)
+        || !EVP_CIPHER_CTX_set_padding(evp_ctx, 0)
+        || !EVP_DecryptUpdate(evp_ctx, buf, &outlen, ecert->encValue->data,
                               ecert->encValue->length)
-        || !EVP_DecryptFinal(evp_ctx, outbuf + outlen, &n)) {
+        || !EVP_DecryptFinal_ex(evp_ctx, buf + outlen, &n)) {
         CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
                CMP_R_ERROR_DECRYPTING_CERTIFICATE);
         goto err;
@@ -1476,6 +1987,7 @@ static X509 *CMP_CERTORENCCERT_encCert_get1(CMP_CERTORENCCERT *coec,
     outlen += n;
 
     /* convert decrypted certificate from DER to internal ASN.1 structure */
+    p = buf;
     if ((cert = d2i_X509(NULL, &p, outlen)) == NULL) {
         CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
                CMP_R_ERROR_DECODING_CERTIFICATE);
@@ -1483,19 +1995,17 @@ static X509 *CMP_CERTORENCCERT_encCert_get1(CMP_CERTORENCCERT *coec,
     }
 
     EVP_PKEY_CTX_free(pkctx);
-    OPENSSL_free(outbuf);
     EVP_CIPHER_CTX_free(evp_ctx);
-    OPENSSL_free(ek);
-    OPENSSL_free(iv);
+    OPENSSL_clear_free(ek, eksize);
+    OPENSSL_clear_free(buf, buflen);
     return cert;
  err:
     CMPerr(CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1,
            CMP_R_ERROR_DECRYPTING_ENCCERT);
     EVP_PKEY_CTX_free(pkctx);
-    OPENSSL_free(outbuf);
     EVP_CIPHER_CTX_free(evp_ctx);
-    OPENSSL_free(ek);
-    OPENSSL_free(iv);
+    OPENSSL_clear_free(ek, eksize);
+    OPENSSL_clear_free(buf, buflen);
     return NULL;
 }
 
@@ -1508,6 +2018,7 @@ int CMP_PKIMESSAGE_set_bodytype(CMP_PKIMESSAGE *msg, int type)
     if (msg == NULL || msg->body == NULL)
         return 0;
 
+    CMP_PKIMESSAGE_modified(msg);
     msg->body->type = type;
 
     return 1;
@@ -1570,7 +2081,11 @@ char *CMP_PKISTATUSINFO_snprint(CMP_PKISTATUSINFO *si, char *buf, int bufsize)
 }
 
 /*
- * Retrieve a copy of the certificate, if any, from the given CertResponse.
+ * Retrieve the certificate, if any, from the given CertResponse.
+ * A plain certificate is shared with the message by incrementing its
+ * reference count rather than copied, which would mean encoding and decoding.
+ * An encrypted certificate is decrypted with ctx->newPkey, or ctx->pkey if
+ * not set, and then takes the place of the encrypted value in crep.
  * returns NULL if not found or on error
  */
 X509 *CMP_CERTRESPONSE_get_certificate(CMP_CTX *ctx, CMP_CERTRESPONSE *crep)
@@ -1587,11 +2102,13 @@ X509 *CMP_CERTRESPONSE_get_certificate(CMP_CTX *ctx, CMP_CERTRESPONSE *crep)
         (coec = crep->certifiedKeyPair->certOrEncCert)) {
         switch (coec->type) {
         case CMP_CERTORENCCERT_CERTIFICATE:
-            crt = X509_dup(coec->value.certificate);
+            if (X509_up_ref(coec->value.certificate))
+                crt = coec->value.certificate;
             break;
         case CMP_CERTORENCCERT_ENCRYPTEDCERT:
         /* cert encrypted for indirect PoP; RFC 4210, 5.2.8.2 */
-            crt = CMP_CERTORENCCERT_encCert_get1(coec, ctx->newPkey);
+            crt = CMP_CERTORENCCERT_encCert_get1(coec, ctx->newPkey != NULL
+                                                 ? ctx->newPkey : ctx->pkey);
             break;
         default:
             CMPerr(CMP_F_CMP_CERTRESPONSE_GET_CERTIFICATE,
@@ -1610,6 +2127,20 @@ X509 *CMP_CERTRESPONSE_get_certificate(CMP_CTX *ctx, CMP_CERTRESPONSE *crep)
     return NULL;
 }
 
+/*
+ * internal function
+ * checks if the given cert is contained in the given stack
+ */
+static int cert_in_sk(const STACK_OF(X509) *sk, const X509 *cert)
+{
+    int i;
+
+    for (i = 0; i < sk_X509_num(sk); i++)
+        if (X509_cmp(sk_X509_value(sk, i), cert) == 0)
+            return 1;
+    return 0;
+}
+
 /*
  * Builds up the certificate chain of certs as high up as possible using
  * the given list of certs containing all possible intermediate certificates and
@@ -1623,7 +2154,7 @@ X509 *CMP_CERTRESPONSE_get_certificate(CMP_CTX *ctx, CMP_CERTRESPONSE *crep)
  * NOTE: This allocates a stack and increments the reference count of each cert,
  * so when not needed any more the stack and all its elements should be freed.
  * NOTE: in case there is more than one possibility for the chain,
- * OpenSSL seems to take the first one, check X509_verify_cert() for details.
+ * the first matching issuer cert found in certs is taken.
  *
  * returns a pointer to a stack of (up_ref'ed) X509 certificates containing:
  *      - the EE certificate given in the function arguments (cert)
@@ -1634,69 +2165,83 @@ X509 *CMP_CERTRESPONSE_get_certificate(CMP_CTX *ctx, CMP_CERTRESPONSE *crep)
 STACK_OF(X509) *CMP_build_cert_chain(const STACK_OF(X509) *certs,
                                      const X509 *cert)
 {
-    STACK_OF(X509) *chain = NULL, *result = NULL;
-    X509_STORE *store = X509_STORE_new();
-    X509_STORE_CTX *csc = NULL;
-
-    if (certs == NULL || cert == NULL || store == NULL)
-        goto err;
-
-    csc = X509_STORE_CTX_new();
-    if (csc == NULL)
-        goto err;
+    STACK_OF(X509) *result = NULL;
+    X509 *curr = (X509 *)cert;
+    int i;
 
-    CMP_X509_STORE_add1_certs(store, (STACK_OF(X509) *)certs, 0);
-    if (!X509_STORE_CTX_init(csc, store, (X509 *)cert, NULL))
-        goto err;
+    if (certs == NULL || cert == NULL)
+        return NULL;
+    if ((result = sk_X509_new_null()) == NULL)
+        return NULL;
 
-    (void)ERR_set_mark();
     /*
-     * ignore return value as it would fail without trust anchor given in store
+     * Go up the chain by name and key identifier matching only, like
+     * X509_verify_cert() does when building the chain, but without setting
+     * up a store and verification context and without any further checks,
+     * which would fail anyway for lack of a trust anchor.
+     * The length is bounded as each cert can be used only once.
      */
-    (void)X509_verify_cert(csc);
+    while (X509_check_issued(curr, curr) != X509_V_OK) {
+        X509 *issuer = NULL;
 
-    /* don't leave any new errors in the queue */
-    (void)ERR_pop_to_mark();
-
-    chain = X509_STORE_CTX_get0_chain(csc);
+        if (!CMP_sk_X509_add1_cert(result, curr, 0))
+            goto err;
+        for (i = 0; issuer == NULL && i < sk_X509_num(certs); i++) {
+            X509 *candidate = sk_X509_value(certs, i);
 
-    /* result list to store the up_ref'ed not self-signed certificates */
-    if ((result = sk_X509_new_null()) == NULL)
-        goto err;
-    CMP_sk_X509_add1_certs(result, chain, 1/* no self-signed */,
-                           1/* no dups */);
+            if (X509_check_issued(candidate, curr) == X509_V_OK &&
+                !cert_in_sk(result, candidate))
+                issuer = candidate;
+        }
+        if (issuer == NULL)
+            break;
+        curr = issuer;
+    }
+    return result;
 
  err:
-    X509_STORE_free(store);
-    X509_STORE_CTX_free(csc);
-    return result;
+    sk_X509_pop_free(result, X509_free);
+    return NULL;
 }
 
 /*
  * Add certificate to given stack, optionally only if not already contained
  * returns 1 on success, 0 on error
  */
-static int X509_cmp_from_ptrs(const struct x509_st *const *a,
-                              const struct x509_st *const *b)
-{
-    return X509_cmp(*a, *b);
-}
 int CMP_sk_X509_add1_cert(STACK_OF(X509) *sk, X509 *cert, int not_duplicate)
 {
-    if (not_duplicate) {
-        sk_X509_set_cmp_func(sk, &X509_cmp_from_ptrs);
-        if (sk_X509_find(sk, cert) >= 0)
-            return 1;
-    }
+    /* linear search, as sk_X509_find() would sort the stack each time */
+    if (not_duplicate && cert_in_sk(sk, cert))
+        return 1;
     if (!sk_X509_push(sk, cert))
         return 0;
     return X509_up_ref(cert);
 }
 
+DEFINE_LHASH_OF(X509);
+
+/*
+ * internal function
+ * hash function consistent with X509_cmp(), which compares the certs'
+ * fingerprints: equal certs have equal serial numbers, which are usually
+ * random and already available in decoded form
+ */
+static unsigned long X509_serial_hash(const X509 *cert)
+{
+    const ASN1_INTEGER *serial = X509_get0_serialNumber(cert);
+    unsigned long hash = 5381;
+    int i;
+
+    for (i = 0; i < serial->length; i++)
+        hash = ((hash << 5) + hash) ^ serial->data[i];
+    return hash;
+}
+
 /*
  * Add certificates from 'certs' to given stack,
  * optionally only if not self-signed and
  * optionally only if not already contained* certs parameter may be NULL.
+ * The order of certs in the stack is preserved.
  * returns 1 on success, 0 on error
  */
 int CMP_sk_X509_add1_certs(STACK_OF(X509) *sk, const STACK_OF(X509) *certs,
@@ -1707,18 +2252,99 @@ int CMP_sk_X509_add1_certs(STACK_OF(X509) *sk, const STACK_OF(X509) *certs,
     if (sk == NULL)
         return 0;
 
-    if (certs == NULL)
-        return 1;
     for (i = 0; i < sk_X509_num(certs); i++) {
         X509 *cert = sk_X509_value(certs, i);
-        if (!no_self_signed || X509_check_issued(cert, cert) != X509_V_OK) {
-            if (!CMP_sk_X509_add1_cert(sk, cert, no_duplicates))
+
+        if (no_self_signed && X509_check_issued(cert, cert) == X509_V_OK)
+            continue;
+        if (!CMP_sk_X509_add1_cert(sk, cert, no_duplicates))
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * replaces each certificate in the given stack that equals one in the index
+ * by a reference to that one, and adds all others to the index
+ * returns 1 on success, 0 on error
+ */
+static int share_certs(LHASH_OF(X509) *index, STACK_OF(X509) *certs)
+{
+    int i;
+
+    for (i = 0; i < sk_X509_num(certs); i++) {
+        X509 *cert = sk_X509_value(certs, i);
+        X509 *known = lh_X509_retrieve(index, cert);
+
+        if (known == NULL) {
+            (void)lh_X509_insert(index, cert);
+            if (lh_X509_error(index))
                 return 0;
+        } else if (known != cert && X509_up_ref(known)) {
+            (void)sk_X509_set(certs, i, known);
+            X509_free(cert);
         }
     }
     return 1;
 }
 
+/*
+ * internal function
+ *
+ * Lets the certificates in the extraCerts and caPubs of the given freshly
+ * received message share memory with equal ones already held in ctx, i.e.,
+ * the untrusted certificates, srvCert, clCert, and the extraCerts and caPubs
+ * received before, as well as with equal ones in the same message.
+ * Trusted certificates are not shared as they may carry trust settings.
+ * Since the shared certificates are identical, including their encoding,
+ * the encoding of the message is not changed.
+ * This way the certificate chain that a server sends with each response of
+ * each transaction is kept only once in memory rather than once per message.
+ * returns 1 on success, 0 on error
+ */
+int CMP_PKIMESSAGE_share_certs(CMP_CTX *ctx, CMP_PKIMESSAGE *msg)
+{
+    LHASH_OF(X509) *index = NULL;
+    STACK_OF(X509) *caPubs = NULL;
+    const STACK_OF(X509) *known[3];
+    int i, j, ret;
+
+    if (ctx == NULL || msg == NULL)
+        return 0;
+    switch (CMP_PKIMESSAGE_get_bodytype(msg)) {
+    case V_CMP_PKIBODY_IP:
+    case V_CMP_PKIBODY_CP:
+    case V_CMP_PKIBODY_KUP:
+    case V_CMP_PKIBODY_CCP:
+        caPubs = msg->body->value.ip->caPubs; /* same for cp, kup, ccp */
+        break;
+    default:
+        break;
+    }
+    if (sk_X509_num(msg->extraCerts) + sk_X509_num(caPubs) == 0)
+        return 1;
+
+    if ((index = lh_X509_new(X509_serial_hash, X509_cmp)) == NULL)
+        return 0;
+    if (ctx->srvCert != NULL)
+        (void)lh_X509_insert(index, ctx->srvCert);
+    if (ctx->clCert != NULL)
+        (void)lh_X509_insert(index, ctx->clCert);
+    known[0] = ctx->untrusted_certs;
+    known[1] = ctx->extraCertsIn;
+    known[2] = ctx->caPubs;
+    /* failing to index some of the known certs just leads to less sharing */
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < sk_X509_num(known[i]); j++)
+            (void)lh_X509_insert(index, sk_X509_value(known[i], j));
+
+    ret = share_certs(index, msg->extraCerts) && share_certs(index, caPubs);
+    lh_X509_free(index);
+    return ret;
+}
+
 /*
  * Add all or self-signed certificates from the given stack to given store.
  * certs parameter may be NULL.
@@ -1802,13 +2428,16 @@ int CMP_PKIMESSAGE_check_received(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
     }
 
     /* validate message protection */
-    if (msg->header->protectionAlg) {
+    if (msg->header.protectionAlg) {
+        uint64_t start = CMP_CTX_phase_start(ctx);
+
         if (!CMP_validate_msg(ctx, msg)) {
             /* validation failed */
              CMPerr(CMP_F_CMP_PKIMESSAGE_CHECK_RECEIVED,
                     CMP_R_ERROR_VALIDATING_PROTECTION);
              return -1;
          }
+        CMP_CTX_phase_end(ctx, CMP_PHASE_VALIDATE, start, 0);
     } else {
         /* detect explicitly permitted exceptions */
         if (allow_unprotected == NULL ||
@@ -1822,9 +2451,9 @@ int CMP_PKIMESSAGE_check_received(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
 
     /* compare received transactionID with the expected one in previous msg */
     if (ctx->transactionID != NULL &&
-        (msg->header->transactionID == NULL ||
+        (msg->header.transactionID == NULL ||
             ASN1_OCTET_STRING_cmp(ctx->transactionID,
-                                  msg->header->transactionID) != 0)) {
+                                  msg->header.transactionID) != 0)) {
         CMPerr(CMP_F_CMP_PKIMESSAGE_CHECK_RECEIVED,
                CMP_R_TRANSACTIONID_UNMATCHED);
         return -1;
@@ -1832,9 +2461,9 @@ int CMP_PKIMESSAGE_check_received(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
 
     /* compare received nonce with the one we sent */
     if (ctx->last_senderNonce != NULL &&
-        (msg->header->recipNonce == NULL ||
+        (msg->header.recipNonce == NULL ||
          ASN1_OCTET_STRING_cmp(ctx->last_senderNonce,
-                               msg->header->recipNonce) != 0)) {
+                               msg->header.recipNonce) != 0)) {
         CMPerr(CMP_F_CMP_PKIMESSAGE_CHECK_RECEIVED,
                CMP_R_RECIPNONCE_UNMATCHED);
         return -1;
@@ -1843,12 +2472,12 @@ int CMP_PKIMESSAGE_check_received(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
      * RFC 4210 section 5.1.1 states: the recipNonce is copied from
      * the senderNonce of the previous message in the transaction.
      * --> Store for setting in next message */
-    if (!CMP_CTX_set1_recipNonce(ctx, msg->header->senderNonce))
+    if (!CMP_CTX_set1_recipNonce(ctx, msg->header.senderNonce))
         return -1;
 
     /* if not yet present, learn transactionID */
     if (ctx->transactionID == NULL &&
-        !CMP_CTX_set1_transactionID(ctx, msg->header->transactionID))
+        !CMP_CTX_set1_transactionID(ctx, msg->header.transactionID))
         return -1;
 
     return rcvd_type;
@@ -73,24 +73,19 @@ static int add_policy_extensions(X509_EXTENSIONS **exts,
 }
 
 /*
- * Adds a CRL revocation reason code to an extension stack (which may be NULL)
- * returns 1 on success, 0 on error
+ * Creates a CRL revocation reason code extension
+ * returns pointer to the extension on success, NULL on error
  */
-static int add_crl_reason_extension(X509_EXTENSIONS **exts, int reason_code)
+static X509_EXTENSION *crl_reason_extension_new(int reason_code)
 {
     ASN1_ENUMERATED *val = NULL;
     X509_EXTENSION *ext = NULL;
-    int ret = 0;
 
-    if (exts != NULL &&
-        (val = ASN1_ENUMERATED_new()) &&
-        ASN1_ENUMERATED_set(val, reason_code) &&
-        (ext = X509V3_EXT_i2d(NID_crl_reason, 0, val)) &&
-        X509v3_add_ext(exts, ext, 0))
-        ret = 1;
-    X509_EXTENSION_free(ext);
+    if ((val = ASN1_ENUMERATED_new()) != NULL &&
+        ASN1_ENUMERATED_set(val, reason_code))
+        ext = X509V3_EXT_i2d(NID_crl_reason, 0, val);
     ASN1_ENUMERATED_free(val);
-    return ret;
+    return ext;
 }
 
 
@@ -110,7 +105,7 @@ CMP_PKIMESSAGE *CMP_PKIMESSAGE_create(CMP_CTX *ctx, int bodytype)
 
     if ((msg = CMP_PKIMESSAGE_new()) == NULL)
         goto oom;
-    if (!CMP_PKIHEADER_init(ctx, msg->header) ||
+    if (!CMP_PKIHEADER_init(ctx, &msg->header) ||
         !CMP_PKIMESSAGE_set_bodytype(msg, bodytype) ||
         (ctx->geninfo_itavs &&
          !CMP_PKIMESSAGE_generalInfo_items_push1(msg, ctx->geninfo_itavs)))
@@ -208,14 +203,15 @@ static X509_EXTENSIONS *exts_dup(X509_EXTENSIONS *extin /* may be NULL */)
     return NULL;
 }
 
-#define HAS_SAN(ctx) (sk_GENERAL_NAME_num((ctx)->subjectAltNames) > 0 || \
-                      CMP_CTX_reqExtensions_have_SAN(ctx))
-static X509_NAME *determine_subj(CMP_CTX *ctx, X509 *refcert, int bodytype) {
+#define HAS_SAN(ctx, exts) (sk_GENERAL_NAME_num((ctx)->subjectAltNames) > 0 \
+                 || X509v3_get_ext_by_NID(exts, NID_subject_alt_name, -1) >= 0)
+static X509_NAME *determine_subj(CMP_CTX *ctx, X509 *refcert, int bodytype,
+                                 X509_EXTENSIONS *reqExts) {
     if (ctx->subjectName) {
         return ctx->subjectName;
     }
     if (refcert &&
-        (bodytype == V_CMP_PKIBODY_KUR || !HAS_SAN(ctx)))
+        (bodytype == V_CMP_PKIBODY_KUR || !HAS_SAN(ctx, reqExts)))
         /*
          * For KUR, copy subjectName from reference certificate.
          * For IR or CR, do the same only if there is no subjectAltName.
@@ -224,18 +220,40 @@ static X509_NAME *determine_subj(CMP_CTX *ctx, X509 *refcert, int bodytype) {
     return NULL;
 }
 
+/*
+ * internal function
+ *
+ * determines the subjectAltNames to take over from the reference certificate,
+ * which is done unless switched off or any SANs are given via ctx or exts
+ * returns the SANs, or NULL if there are none to take over
+ */
+static STACK_OF(GENERAL_NAME) *get_default_sans(const CMP_CTX *ctx,
+                                                const X509 *refcert,
+                                                const X509_EXTENSIONS *exts)
+{
+    if (refcert == NULL || ctx->SubjectAltName_nodefault || HAS_SAN(ctx, exts))
+        return NULL;
+    return X509V3_get_d2i(X509_get0_extensions(refcert),
+                          NID_subject_alt_name, NULL, NULL);
+}
+
 /*
  * Create CRMF certificate request message for IR/CR/KUR
+ * where any further request creq given overrides subject and extensions
  * returns a pointer to the CRMF_CERTREQMSG on success, NULL on error
  */
-static CRMF_CERTREQMSG *crm_new(CMP_CTX *ctx, int bodytype,
-                                long rid, EVP_PKEY *rkey)
+static CRMF_CERTREQMSG *crm_new_from_ctx(CMP_CTX *ctx, int bodytype,
+                                         long rid, EVP_PKEY *rkey,
+                                         const CMP_CERTREQ *creq)
 {
     CRMF_CERTREQMSG *crm = NULL;
     X509 *refcert = ctx->oldClCert ? ctx->oldClCert : ctx->clCert;
        /* refcert defaults to current client cert */
     STACK_OF(GENERAL_NAME) *default_sans = NULL;
-    X509_NAME *subject = determine_subj(ctx, refcert, bodytype);
+    X509_EXTENSIONS *reqExts = creq != NULL && creq->exts != NULL ?
+        creq->exts : ctx->reqExtensions;
+    X509_NAME *subject = creq != NULL && creq->subject != NULL ?
+        creq->subject : determine_subj(ctx, refcert, bodytype, reqExts);
     int crit = ctx->setSubjectAltNameCritical || subject == NULL;
     /* RFC5280: subjectAltName MUST be critical if subject is null */
     X509_EXTENSIONS *exts = NULL;
@@ -262,14 +280,12 @@ static CRMF_CERTREQMSG *crm_new(CMP_CTX *ctx, int bodytype,
     }
 
     /* extensions */
-    if (refcert && !ctx->SubjectAltName_nodefault)
-        default_sans = X509V3_get_d2i(X509_get0_extensions(refcert),
-                                      NID_subject_alt_name, NULL, NULL);
+    default_sans = get_default_sans(ctx, refcert, reqExts);
     /* exts are copied from ctx to allow reuse */
-    if ((exts = exts_dup(ctx->reqExtensions)) == NULL ||
+    if ((exts = exts_dup(reqExts)) == NULL ||
         (sk_GENERAL_NAME_num(ctx->subjectAltNames) > 0 &&
          !add_subjectaltnames_extension(&exts, ctx->subjectAltNames, crit)) ||
-        (!HAS_SAN(ctx) && default_sans != NULL &&
+        (default_sans != NULL &&
          !add_subjectaltnames_extension(&exts, default_sans, crit)) ||
         (ctx->policies && !add_policy_extensions(&exts, ctx->policies,
                                                  ctx->setPoliciesCritical)) ||
@@ -293,8 +309,201 @@ static CRMF_CERTREQMSG *crm_new(CMP_CTX *ctx, int bodytype,
     return NULL;
 }
 
+/*
+ * creates a template for certificate requests from the issuer, validity
+ * period, reqExtensions, policies, digest, and POPO method given in ctx.
+ * It is meant for enrolling many certificates with the same profile, where the
+ * requests differ only in key, subject, and subjectAltNames.
+ * Since the template is not modified after creation, it may be shared among
+ * contexts, also across threads.
+ * returns pointer to the template on success, NULL on error
+ */
+CMP_CERTREQ_TEMPLATE *CMP_CERTREQ_TEMPLATE_new(const CMP_CTX *ctx)
+{
+    CMP_CERTREQ_TEMPLATE *tmpl = NULL;
+
+    if (ctx == NULL) {
+        CMPerr(CMP_F_CMP_CERTREQ_TEMPLATE_NEW, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    if ((tmpl = OPENSSL_zalloc(sizeof(*tmpl))) == NULL ||
+        (tmpl->lock = CRYPTO_THREAD_lock_new()) == NULL ||
+        (ctx->issuer != NULL &&
+         (tmpl->issuer = X509_NAME_dup(ctx->issuer)) == NULL) ||
+        (tmpl->exts = exts_dup(ctx->reqExtensions)) == NULL ||
+        (ctx->policies != NULL &&
+         !add_policy_extensions(&tmpl->exts, ctx->policies,
+                                ctx->setPoliciesCritical)))
+        goto oom;
+    tmpl->has_san =
+        X509v3_get_ext_by_NID(tmpl->exts, NID_subject_alt_name, -1) >= 0;
+    /* like in crm_new_from_ctx(), subjectAltNames go after any policies */
+    tmpl->san_pos = ctx->policies != NULL;
+    tmpl->days = ctx->days;
+    tmpl->sanCritical = ctx->setSubjectAltNameCritical;
+    tmpl->digest = ctx->digest;
+    tmpl->popoMethod = ctx->popoMethod;
+    tmpl->references = 1;
+    return tmpl;
+
+ oom:
+    CMPerr(CMP_F_CMP_CERTREQ_TEMPLATE_NEW, CMP_R_OUT_OF_MEMORY);
+    if (tmpl != NULL) {
+        X509_NAME_free(tmpl->issuer);
+        sk_X509_EXTENSION_pop_free(tmpl->exts, X509_EXTENSION_free);
+        CRYPTO_THREAD_lock_free(tmpl->lock);
+        OPENSSL_free(tmpl);
+    }
+    return NULL;
+}
+
+/*
+ * increments the reference count of the given template
+ * returns 1 on success, 0 on error
+ */
+int CMP_CERTREQ_TEMPLATE_up_ref(CMP_CERTREQ_TEMPLATE *tmpl)
+{
+    int refs;
+
+    if (tmpl == NULL)
+        return 0;
+    return CRYPTO_atomic_add(&tmpl->references, 1, &refs, tmpl->lock) &&
+        refs > 1;
+}
+
+/*
+ * decrements the reference count of the given template and frees it
+ * when no more references are left
+ */
+void CMP_CERTREQ_TEMPLATE_free(CMP_CERTREQ_TEMPLATE *tmpl)
+{
+    int refs;
+
+    if (tmpl == NULL ||
+        !CRYPTO_atomic_add(&tmpl->references, -1, &refs, tmpl->lock) ||
+        refs > 0)
+        return;
+    X509_NAME_free(tmpl->issuer);
+    sk_X509_EXTENSION_pop_free(tmpl->exts, X509_EXTENSION_free);
+    CRYPTO_THREAD_lock_free(tmpl->lock);
+    OPENSSL_free(tmpl);
+}
+
+/*
+ * internal function
+ *
+ * creates a certificate request without POPO from the template, where the
+ * extensions are copied from their encoded values rather than duplicated
+ * returns a pointer to the CRMF_CERTREQMSG on success, NULL on error
+ */
+static CRMF_CERTREQMSG *crm_stamp(const CMP_CERTREQ_TEMPLATE *tmpl, long rid,
+                                  EVP_PKEY *pkey, const X509_NAME *subject,
+                                  const STACK_OF(GENERAL_NAME) *sans)
+{
+    CRMF_CERTREQMSG *crm = NULL;
+    X509_EXTENSIONS *exts = NULL;
+    X509_EXTENSION *ext;
+    int i, n = sk_X509_EXTENSION_num(tmpl->exts);
+
+    if ((crm = CRMF_CERTREQMSG_new()) == NULL ||
+        !CRMF_CERTREQMSG_set_certReqId(crm, rid) ||
+        !CRMF_CERTREQMSG_set1_publicKey(crm, pkey) ||
+        (subject != NULL &&
+         !CRMF_CERTREQMSG_set1_subject(crm, (X509_NAME *)subject)) ||
+        (tmpl->issuer != NULL &&
+         !CRMF_CERTREQMSG_set1_issuer(crm, tmpl->issuer)))
+        goto err;
+    if (tmpl->days) {
+        time_t notBefore, notAfter;
+        notBefore = time(NULL);
+        notAfter = notBefore + 60 * 60 * 24 * tmpl->days;
+        if (!CRMF_CERTREQMSG_set_validity(crm, notBefore, notAfter))
+            goto err;
+    }
+
+    if ((exts = sk_X509_EXTENSION_new_reserve(NULL, n + 1)) == NULL)
+        goto err;
+    for (i = 0; i <= n; i++) {
+        X509_EXTENSION *e;
+
+        if (i == tmpl->san_pos && sk_GENERAL_NAME_num(sans) > 0) {
+            /* RFC5280: subjectAltName MUST be critical if subject is null */
+            if ((ext = X509V3_EXT_i2d(NID_subject_alt_name,
+                                      tmpl->sanCritical || subject == NULL,
+                                      (STACK_OF(GENERAL_NAME) *)sans)) == NULL)
+                goto err;
+            (void)sk_X509_EXTENSION_push(exts, ext); /* space is reserved */
+        }
+        if (i == n)
+            break;
+        e = sk_X509_EXTENSION_value(tmpl->exts, i);
+        if ((ext = X509_EXTENSION_create_by_OBJ(NULL,
+                                                X509_EXTENSION_get_object(e),
+                                                X509_EXTENSION_get_critical(e),
+                                                X509_EXTENSION_get_data(e)))
+            == NULL)
+            goto err;
+        (void)sk_X509_EXTENSION_push(exts, ext);
+    }
+    if (!CRMF_CERTREQMSG_set0_extensions(crm, exts))
+        goto err;
+    return crm;
+
+ err:
+    sk_X509_EXTENSION_pop_free(exts, X509_EXTENSION_free);
+    CRMF_CERTREQMSG_free(crm);
+    return NULL;
+}
+
+/*
+ * Create CRMF certificate request message for IR/CR/KUR from the template
+ * set in ctx, taking from ctx just the subject and subjectAltNames, where
+ * like in crm_new_from_ctx() the subjectAltNames default to the ones of the
+ * reference certificate
+ * returns a pointer to the CRMF_CERTREQMSG on success, NULL on error
+ */
+static CRMF_CERTREQMSG *crm_new_from_template(CMP_CTX *ctx, int bodytype,
+                                              long rid, EVP_PKEY *rkey,
+                                              const CMP_CERTREQ *creq)
+{
+    const CMP_CERTREQ_TEMPLATE *tmpl = ctx->certReqTemplate;
+    X509 *refcert = ctx->oldClCert ? ctx->oldClCert : ctx->clCert;
+    X509_NAME *subject = creq != NULL && creq->subject != NULL ?
+        creq->subject : determine_subj(ctx, refcert, bodytype, tmpl->exts);
+    STACK_OF(GENERAL_NAME) *default_sans = NULL;
+    CRMF_CERTREQMSG *crm = NULL;
+
+    if (tmpl->has_san && sk_GENERAL_NAME_num(ctx->subjectAltNames) > 0) {
+        CMPerr(CMP_F_CRM_NEW_FROM_TEMPLATE, CMP_R_MULTIPLE_SAN_SOURCES);
+        return NULL;
+    }
+    default_sans = get_default_sans(ctx, refcert, tmpl->exts);
+    crm = crm_stamp(tmpl, rid, rkey, subject, default_sans != NULL ?
+                    default_sans : ctx->subjectAltNames);
+    sk_GENERAL_NAME_pop_free(default_sans, GENERAL_NAME_free);
+    if (crm == NULL)
+        return NULL;
+    /* for KUR, set OldCertId according to D.6 */
+    if (bodytype == V_CMP_PKIBODY_KUR &&
+        !CRMF_CERTREQMSG_set1_regCtrl_oldCertID_from_cert(crm, refcert)) {
+        CRMF_CERTREQMSG_free(crm);
+        return NULL;
+    }
+    return crm;
+}
+
+static CRMF_CERTREQMSG *crm_new(CMP_CTX *ctx, int bodytype,
+                                long rid, EVP_PKEY *rkey,
+                                const CMP_CERTREQ *creq /* may be NULL */)
+{
+    if (ctx->certReqTemplate != NULL && (creq == NULL || creq->exts == NULL))
+        return crm_new_from_template(ctx, bodytype, rid, rkey, creq);
+    return crm_new_from_ctx(ctx, bodytype, rid, rkey, creq);
+}
+
 /*
  * Create certificate request PKIMessage for IR/CR/KUR/P10CR
+ * For IR and CR, any further requests added to ctx are included as well.
  * returns a pointer to the PKIMessage on success, NULL on error
  */
 CMP_PKIMESSAGE *CMP_certreq_new(CMP_CTX *ctx, int bodytype, int err_code)
@@ -324,15 +533,32 @@ CMP_PKIMESSAGE *CMP_certreq_new(CMP_CTX *ctx, int bodytype, int err_code)
      if (bodytype != V_CMP_PKIBODY_P10CR) {
         EVP_PKEY *rkey = ctx->newPkey ? ctx->newPkey
             : ctx->pkey; /* default is currenty client key */
+        int digest = ctx->certReqTemplate != NULL ?
+            ctx->certReqTemplate->digest : ctx->digest;
+        int popoMethod = ctx->certReqTemplate != NULL ?
+            ctx->certReqTemplate->popoMethod : ctx->popoMethod;
+        int i;
 
-        if ((crm = crm_new(ctx, bodytype, CERTREQID, rkey)) == NULL ||
-            !CRMF_CERTREQMSG_create_popo(crm, rkey, ctx->digest,
-                                         ctx->popoMethod) ||
+        if ((crm = crm_new(ctx, bodytype, CERTREQID, rkey, NULL)) == NULL ||
+            !CRMF_CERTREQMSG_create_popo(crm, rkey, digest, popoMethod) ||
                       /* value.ir is same for cr and kur */
             !sk_CRMF_CERTREQMSG_push(msg->body->value.ir, crm))
             goto err;
         crm = NULL;
-        /* TODO: here optional 2nd certreqmsg could be pushed to the stack */
+
+        /* KUR refers to a single old certificate, so no further requests */
+        for (i = 0; bodytype != V_CMP_PKIBODY_KUR &&
+                 i < sk_CMP_CERTREQ_num(ctx->certReqs); i++) {
+            CMP_CERTREQ *creq = sk_CMP_CERTREQ_value(ctx->certReqs, i);
+
+            if ((crm = crm_new(ctx, bodytype, CERTREQID + 1 + i,
+                               creq->pkey, creq)) == NULL ||
+                !CRMF_CERTREQMSG_create_popo(crm, creq->pkey, digest,
+                                             popoMethod) ||
+                !sk_CRMF_CERTREQMSG_push(msg->body->value.ir, crm))
+                goto err;
+            crm = NULL;
+        }
     }
 
     if (!CMP_PKIMESSAGE_protect(ctx, msg))
@@ -352,81 +578,166 @@ CMP_PKIMESSAGE *CMP_certreq_new(CMP_CTX *ctx, int bodytype, int err_code)
  * returns a pointer to the PKIMessage on success, NULL on error
  */
 CMP_PKIMESSAGE *CMP_pollReq_new(CMP_CTX *ctx, int reqId)
+{
+    long rid = reqId;
+    CMP_PKIMESSAGE *msg = CMP_pollReq_new_multi(ctx, &rid, 1);
+
+    if (msg == NULL)
+        CMPerr(CMP_F_CMP_POLLREQ_NEW, CMP_R_ERROR_CREATING_POLLREQ);
+    return msg;
+}
+
+/*
+ * Creates a new polling request PKIMessage for the num given request IDs
+ * returns a pointer to the PKIMessage on success, NULL on error
+ */
+CMP_PKIMESSAGE *CMP_pollReq_new_multi(CMP_CTX *ctx,
+                                      const long *certReqIds, int num)
 {
     CMP_PKIMESSAGE *msg = NULL;
     CMP_POLLREQ *preq = NULL;
+    int i;
 
-    if (ctx == NULL ||
+    if (ctx == NULL || certReqIds == NULL || num <= 0 ||
         (msg = CMP_PKIMESSAGE_create(ctx, V_CMP_PKIBODY_POLLREQ)) == NULL)
         goto err;
 
-    /* TODO support multiple cert request IDs to poll */
-    if ((preq = CMP_POLLREQ_new()) == NULL ||
-        !ASN1_INTEGER_set(preq->certReqId, reqId) ||
-        !sk_CMP_POLLREQ_push(msg->body->value.pollReq, preq))
-        goto err;
+    for (i = 0; i < num; i++) {
+        if ((preq = CMP_POLLREQ_new()) == NULL ||
+            !ASN1_INTEGER_set(&preq->certReqId, certReqIds[i]) ||
+            !sk_CMP_POLLREQ_push(msg->body->value.pollReq, preq))
+            goto err;
+        preq = NULL;
+    }
 
-    preq = NULL;
     if (!CMP_PKIMESSAGE_protect(ctx, msg))
         goto err;
 
     return msg;
 
  err:
-    CMPerr(CMP_F_CMP_POLLREQ_NEW, CMP_R_ERROR_CREATING_POLLREQ);
+    CMPerr(CMP_F_CMP_POLLREQ_NEW_MULTI, CMP_R_ERROR_CREATING_POLLREQ);
     CMP_POLLREQ_free(preq);
     CMP_PKIMESSAGE_free(msg);
     return NULL;
 }
 
 /*
- * Creates a new Revocation Request PKIMessage for ctx->oldClCert based on
- * the settings in ctx.
+ * internal function
+ * returns the number of certificates CMP_rr_new() requests to revoke,
+ * i.e., ctx->oldClCert, if set, plus those added with CMP_CTX_revCert_push1()
+ */
+int CMP_CTX_revCerts_num(const CMP_CTX *ctx)
+{
+    int num = sk_CMP_REVDETAILS_num(ctx->revDetails);
+
+    return (ctx->oldClCert != NULL) + (num > 0 ? num : 0);
+}
+
+/*
+ * Creates a new Revocation Request PKIMessage for ctx->oldClCert, if set,
+ * and for any further certificates added with CMP_CTX_revCert_push1(),
+ * in this order, based on the settings in ctx.
  * returns a pointer to the PKIMessage on success, NULL on error
  */
 CMP_PKIMESSAGE *CMP_rr_new(CMP_CTX *ctx)
+{
+    CMP_PKIMESSAGE *msg;
+
+    if (ctx == NULL || (msg = CMP_rr_new_range(ctx, 0,
+                                               CMP_CTX_revCerts_num(ctx)))
+        == NULL) {
+        CMPerr(CMP_F_CMP_RR_NEW, CMP_R_ERROR_CREATING_RR);
+        return NULL;
+    }
+    return msg;
+}
+
+/*
+ * Creates a new Revocation Request PKIMessage for the num certificates
+ * starting at index first of those CMP_rr_new() would request to revoke.
+ * returns a pointer to the PKIMessage on success, NULL on error
+ */
+CMP_PKIMESSAGE *CMP_rr_new_range(CMP_CTX *ctx, int first, int num)
 {
     CMP_PKIMESSAGE *msg = NULL;
     CRMF_CERTTEMPLATE *certTpl = NULL;
     X509_NAME *subject = NULL;
     EVP_PKEY *pubkey = NULL;
     CMP_REVDETAILS *rd = NULL;
+    CMP_REVREQCONTENT *rr;
+    X509_EXTENSION *reason = NULL;
+    int i;
 
-    if (ctx == NULL || ctx->oldClCert == NULL) {
-        CMPerr(CMP_F_CMP_RR_NEW, CMP_R_INVALID_ARGS);
+    if (ctx == NULL || first < 0 || num <= 0 ||
+        first + num > CMP_CTX_revCerts_num(ctx)) {
+        CMPerr(CMP_F_CMP_RR_NEW_RANGE, CMP_R_INVALID_ARGS);
         return NULL;
     }
 
     if ((msg = CMP_PKIMESSAGE_create(ctx, V_CMP_PKIBODY_RR)) == NULL)
         goto err;
+    rr = msg->body->value.rr;
 
-    if ((rd = CMP_REVDETAILS_new()) == NULL)
-        goto err;
-    sk_CMP_REVDETAILS_push(msg->body->value.rr, rd);
+    if (ctx->oldClCert != NULL) {
+        if (first == 0) {
+            if ((rd = CMP_REVDETAILS_new()) == NULL)
+                goto err;
+            if (!sk_CMP_REVDETAILS_push(rr, rd)) {
+                CMP_REVDETAILS_free(rd);
+                goto err;
+            }
+
+            /*
+             * Fill the template from the contents of the certificate to be
+             * revoked; TODO: maybe add further fields
+             */
+            certTpl = rd->certDetails;
+            if ((subject = X509_get_subject_name(ctx->oldClCert)) == NULL)
+                goto err;
+            X509_NAME_set(&certTpl->subject, subject);
 
-    /*
-     * Fill the template from the contents of the certificate to be revoked;
-     * TODO: maybe add further fields
-     */
-    certTpl = rd->certDetails;
-    if ((subject = X509_get_subject_name(ctx->oldClCert)) == NULL)
-        goto err;
-    X509_NAME_set(&certTpl->subject, subject);
+            if ((pubkey = X509_get_pubkey(ctx->oldClCert)) == NULL)
+                goto err;
+            X509_PUBKEY_set(&certTpl->publicKey, pubkey);
+            EVP_PKEY_free(pubkey);
 
-    if ((pubkey = X509_get_pubkey(ctx->oldClCert)) == NULL)
-        goto err;
-    X509_PUBKEY_set(&certTpl->publicKey, pubkey);
-    EVP_PKEY_free(pubkey);
+            if ((certTpl->serialNumber =
+                 ASN1_INTEGER_dup(X509_get_serialNumber(ctx->oldClCert)))
+                == NULL)
+                goto err;
+            X509_NAME_set(&certTpl->issuer,
+                          X509_get_issuer_name(ctx->oldClCert));
+            num--;
+        } else {
+            first--;
+        }
+    }
 
-    if ((certTpl->serialNumber =
-          ASN1_INTEGER_dup(X509_get_serialNumber(ctx->oldClCert))) == NULL)
-        goto err;
-    X509_NAME_set(&certTpl->issuer, X509_get_issuer_name(ctx->oldClCert));
+    /* the further certificates are identified by issuer and serial number */
+    for (i = first; i < first + num; i++) {
+        if ((rd = ASN1_item_dup(ASN1_ITEM_rptr(CMP_REVDETAILS),
+                                sk_CMP_REVDETAILS_value(ctx->revDetails, i)))
+            == NULL)
+            goto err;
+        if (!sk_CMP_REVDETAILS_push(rr, rd)) {
+            CMP_REVDETAILS_free(rd);
+            goto err;
+        }
+    }
 
-    /* revocation reason code is optional */
-    if (ctx->revocationReason != CRL_REASON_NONE &&
-        !add_crl_reason_extension(&rd->crlEntryDetails, ctx->revocationReason))
-        goto err;
+    /* revocation reason code is optional; it is encoded just once */
+    if (ctx->revocationReason != CRL_REASON_NONE) {
+        if ((reason = crl_reason_extension_new(ctx->revocationReason)) == NULL)
+            goto err;
+        for (i = 0; i < sk_CMP_REVDETAILS_num(rr); i++) {
+            rd = sk_CMP_REVDETAILS_value(rr, i);
+            if (!X509v3_add_ext(&rd->crlEntryDetails, reason, 0))
+                goto err;
+        }
+        X509_EXTENSION_free(reason);
+        reason = NULL;
+    }
 
     /*
      * TODO: the Revocation Passphrase according to section 5.3.19.9 could be
@@ -439,42 +750,36 @@ CMP_PKIMESSAGE *CMP_rr_new(CMP_CTX *ctx)
     return msg;
 
  err:
-    CMPerr(CMP_F_CMP_RR_NEW, CMP_R_ERROR_CREATING_RR);
+    CMPerr(CMP_F_CMP_RR_NEW_RANGE, CMP_R_ERROR_CREATING_RR);
+    X509_EXTENSION_free(reason);
     CMP_PKIMESSAGE_free(msg);
 
     return NULL;
 }
 
 /*
- * Creates a new Certificate Confirmation PKIMessage
- * returns a pointer to the PKIMessage on success, NULL on error
- * TODO: handle both possible certificates when signing and encrypting
- * certificates have been requested/received
+ * Creates a CertStatus for the newly enrolled certificate with the given
+ * certReqId, which indicates rejection if failure >= 0, else acceptance.
+ * cert may be NULL only for rejecting a request that did not yield any.
+ * returns a pointer to the CertStatus on success, NULL on error
  */
-CMP_PKIMESSAGE *CMP_certConf_new(CMP_CTX *ctx, int failure, const char *text)
+CMP_CERTSTATUS *CMP_certStatus_new(CMP_CTX *ctx, long certReqId,
+                                   const X509 *cert,
+                                   int failure, const char *text)
 {
-    CMP_PKIMESSAGE *msg = NULL;
     CMP_CERTSTATUS *certStatus = NULL;
 
-    if (ctx == NULL || ctx->newClCert == NULL) {
-        CMPerr(CMP_F_CMP_CERTCONF_NEW, CMP_R_INVALID_ARGS);
-        return NULL;
-    }
-
-    if ((msg = CMP_PKIMESSAGE_create(ctx, V_CMP_PKIBODY_CERTCONF)) == NULL)
-        goto err;
-
-    if ((certStatus = CMP_CERTSTATUS_new()) == NULL)
+    if ((certStatus = CMP_CERTSTATUS_new()) == NULL ||
+        /* set the # of the certReq */
+        !ASN1_INTEGER_set(&certStatus->certReqId, certReqId))
         goto err;
-    if (!sk_CMP_CERTSTATUS_push(msg->body->value.certConf, certStatus))
-        goto err;
-    /* set the # of the certReq */
-    ASN1_INTEGER_set(certStatus->certReqId, CERTREQID);
     /*
      * -- the hash of the certificate, using the same hash algorithm
      * -- as is used to create and verify the certificate signature
+     * which is left empty when rejecting a request that did not yield any
      */
-    if (!CMP_CERTSTATUS_set_certHash(certStatus, ctx->newClCert))
+    if (cert == NULL ? failure < 0
+        : !CMP_CERTSTATUS_set_certHash(certStatus, cert))
         goto err;
     /*
      * For any particular CertStatus, omission of the statusInfo field
@@ -491,6 +796,74 @@ CMP_PKIMESSAGE *CMP_certConf_new(CMP_CTX *ctx, int failure, const char *text)
         certStatus->statusInfo = sinfo;
         CMP_printf(ctx, FL_INFO, "rejecting newly enrolled certificate");
     }
+    return certStatus;
+
+ err:
+    CMP_CERTSTATUS_free(certStatus);
+    return NULL;
+}
+
+/*
+ * Creates a new Certificate Confirmation PKIMessage for the (first)
+ * newly enrolled certificate in ctx
+ * returns a pointer to the PKIMessage on success, NULL on error
+ */
+CMP_PKIMESSAGE *CMP_certConf_new(CMP_CTX *ctx, int failure, const char *text)
+{
+    CMP_PKIMESSAGE *msg = NULL;
+    STACK_OF(CMP_CERTSTATUS) *certStatus = NULL;
+    CMP_CERTSTATUS *status = NULL;
+
+    if (ctx == NULL || ctx->newClCert == NULL) {
+        CMPerr(CMP_F_CMP_CERTCONF_NEW, CMP_R_INVALID_ARGS);
+        return NULL;
+    }
+
+    if ((certStatus = sk_CMP_CERTSTATUS_new_null()) == NULL ||
+        (status = CMP_certStatus_new(ctx, CERTREQID, ctx->newClCert,
+                                     failure, text)) == NULL ||
+        !sk_CMP_CERTSTATUS_push(certStatus, status)) {
+        CMP_CERTSTATUS_free(status);
+        goto err;
+    }
+    if ((msg = CMP_certConf_new_multi(ctx, certStatus)) == NULL)
+        goto err;
+    sk_CMP_CERTSTATUS_pop_free(certStatus, CMP_CERTSTATUS_free);
+    return msg;
+
+ err:
+    CMPerr(CMP_F_CMP_CERTCONF_NEW, CMP_R_ERROR_CREATING_CERTCONF);
+    sk_CMP_CERTSTATUS_pop_free(certStatus, CMP_CERTSTATUS_free);
+    return NULL;
+}
+
+/*
+ * Creates a new Certificate Confirmation PKIMessage containing copies of the
+ * given CertStatus entries, typically one per newly enrolled certificate
+ * returns a pointer to the PKIMessage on success, NULL on error
+ */
+CMP_PKIMESSAGE *CMP_certConf_new_multi(CMP_CTX *ctx,
+                                    const STACK_OF(CMP_CERTSTATUS) *certStatus)
+{
+    CMP_PKIMESSAGE *msg = NULL;
+    CMP_CERTSTATUS *status = NULL;
+    int i;
+
+    if (ctx == NULL || sk_CMP_CERTSTATUS_num(certStatus) <= 0) {
+        CMPerr(CMP_F_CMP_CERTCONF_NEW_MULTI, CMP_R_INVALID_ARGS);
+        return NULL;
+    }
+
+    if ((msg = CMP_PKIMESSAGE_create(ctx, V_CMP_PKIBODY_CERTCONF)) == NULL)
+        goto err;
+
+    for (i = 0; i < sk_CMP_CERTSTATUS_num(certStatus); i++) {
+        if ((status = CMP_CERTSTATUS_dup(sk_CMP_CERTSTATUS_value(certStatus,
+                                                                 i))) == NULL
+            || !sk_CMP_CERTSTATUS_push(msg->body->value.certConf, status))
+            goto err;
+        status = NULL;
+    }
 
     if (!CMP_PKIMESSAGE_protect(ctx, msg))
         goto err;
@@ -498,7 +871,8 @@ CMP_PKIMESSAGE *CMP_certConf_new(CMP_CTX *ctx, int failure, const char *text)
     return msg;
 
  err:
-    CMPerr(CMP_F_CMP_CERTCONF_NEW, CMP_R_ERROR_CREATING_CERTCONF);
+    CMPerr(CMP_F_CMP_CERTCONF_NEW_MULTI, CMP_R_ERROR_CREATING_CERTCONF);
+    CMP_CERTSTATUS_free(status);
     CMP_PKIMESSAGE_free(msg);
 
     return NULL;
@@ -19,9 +19,13 @@
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/err.h>
+#include <openssl/async.h>
 
 #ifndef _WIN32
 #include <unistd.h>
+# ifdef OPENSSL_SYS_UNIX
+#include <poll.h>
+# endif
 #else
 #include <windows.h>
 #define sleep(x) Sleep((x) * 1000)
@@ -98,6 +102,21 @@ static void message_add_error_data(CMP_PKIMESSAGE *msg)
 #define IS_ENOLLMENT(t) \
     (t == V_CMP_PKIBODY_IP || t == V_CMP_PKIBODY_CP || t == V_CMP_PKIBODY_KUP)
 
+/*
+ * returns 1 if all revocations in the given RevRepContent have been rejected
+ */
+static int rp_all_rejected(CMP_REVREPCONTENT *rrep)
+{
+    int i, n = sk_CMP_PKISTATUSINFO_num(rrep->status);
+
+    for (i = 0; i < n; i++)
+        if (CMP_PKISTATUSINFO_PKIStatus_get(
+                sk_CMP_PKISTATUSINFO_value(rrep->status, i))
+            != CMP_PKISTATUS_rejection)
+            return 0;
+    return n > 0;
+}
+
 /*
  * evaluate whether there's an standard-violating exception configured for
  * handling unprotected errors
@@ -115,9 +134,7 @@ static int unprotected_exception(const CMP_CTX *ctx, int expected_type,
             exception = 1;
         }
         if (rcvd_type == V_CMP_PKIBODY_RP &&
-            CMP_PKISTATUSINFO_PKIStatus_get(
-            CMP_REVREPCONTENT_PKIStatusInfo_get(rep->body->value.rp, REVREQSID))
-                == CMP_PKISTATUS_rejection) {
+            rp_all_rejected(rep->body->value.rp)) {
             CMP_printf(ctx, FL_WARN,
 "ignoring missing protection of revocation response message with rejection status");
             exception = 1;
@@ -128,26 +145,104 @@ static int unprotected_exception(const CMP_CTX *ctx, int expected_type,
             exception = 1;
         }
         if (rcvd_type == expected_type && IS_ENOLLMENT(rcvd_type)) {
-            CMP_CERTRESPONSE *crep =
-                CMP_CERTREPMESSAGE_certResponse_get0(rep->body->value.ip, -1);
-            /*
-             * TODO: handle multiple CertResponses in CertRepMsg, in case
-             *       multiple requests have been sent --> Feature Request #13
-             */
-            if (!crep)
+            STACK_OF(CMP_CERTRESPONSE) *creps = rep->body->value.ip->response;
+            int i, num = sk_CMP_CERTRESPONSE_num(creps);
+
+            /* the exception applies only if all requests have been rejected */
+            for (i = 0; i < num; i++)
+                if (CMP_PKISTATUSINFO_PKIStatus_get(
+                        sk_CMP_CERTRESPONSE_value(creps, i)->status) !=
+                    CMP_PKISTATUS_rejection)
+                    break;
+            if (num <= 0 || i < num)
                 return 0;
-            if (CMP_PKISTATUSINFO_PKIStatus_get(crep->status) ==
-                CMP_PKISTATUS_rejection) {
-                CMP_printf(ctx, FL_WARN,
+            CMP_printf(ctx, FL_WARN,
          "ignoring missing protection of CertRepMessage with rejection status");
-                exception = 1;
-            }
+            exception = 1;
         }
     }
     return exception;
 }
 
 
+/*
+ * internal function
+ *
+ * determines the number of seconds (or 0 for infinite) the round trip of a
+ * message expecting a response of the given type may take,
+ * taking into account any total timeout set in ctx
+ * returns -1 if the total timeout has already been reached
+ */
+static int msg_timeout(const CMP_CTX *ctx, int expected_type)
+{
+    int msgtimeout = ctx->msgtimeout;
+
+    if ((expected_type == V_CMP_PKIBODY_POLLREP || IS_ENOLLMENT(expected_type))
+        && ctx->totaltimeout != 0) { /* total timeout is not infinite */
+        long time_left = (long)(ctx->end_time - time(NULL));
+        if (time_left <= 0)
+            return -1;
+        if (msgtimeout == 0 || time_left < msgtimeout)
+            msgtimeout = time_left;
+    }
+    return msgtimeout;
+}
+
+/*
+ * internal function
+ *
+ * checks the received response rep, in particular its type
+ * returns 1 on success, 0 on error
+ */
+static int check_response(CMP_CTX *ctx, CMP_PKIMESSAGE *rep, int expected_type)
+{
+    int rcvd_type;
+
+    CMP_printf(ctx, FL_INFO, "got response");
+    if (!CMP_PKIMESSAGE_share_certs(ctx, rep))
+        return 0;
+    if((rcvd_type = CMP_PKIMESSAGE_check_received(ctx, rep, expected_type,
+                                                  unprotected_exception)) < 0)
+        return 0;
+
+    /* catch if received message type isn't one of expected ones (e.g. error) */
+    if (rcvd_type != expected_type &&
+        /* as an answer to polling, there could be IP/CP/KUP */
+        !(expected_type == V_CMP_PKIBODY_POLLREP && IS_ENOLLMENT(rcvd_type))) {
+        CMPerr(CMP_F_CHECK_RESPONSE, rcvd_type == V_CMP_PKIBODY_ERROR ?
+                CMP_R_RECEIVED_ERROR :
+                CMP_R_UNEXPECTED_PKIBODY); /* in next line for mkerr.pl */
+        message_add_error_data(rep);
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * calls ctx->transfer_cb, timing it as transfer phase unless it is the HTTP
+ * transfer, which reports its phases itself
+ * returns 0 on success, else a CMP error reason code
+ */
+static int transfer(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                    CMP_PKIMESSAGE **rep)
+{
+    uint64_t start;
+    int err;
+
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    if (ctx->transfer_cb == CMP_PKIMESSAGE_http_perform)
+        return (ctx->transfer_cb)(ctx, req, rep);
+#endif
+    start = CMP_CTX_phase_start(ctx);
+    err = (ctx->transfer_cb)(ctx, req, rep);
+    if (err == 0)
+        CMP_CTX_phase_end(ctx, CMP_PHASE_TRANSFER, start, 0);
+    return err;
+}
+
 /*
  * internal function
  *
@@ -161,22 +256,17 @@ static int send_receive_check(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
                               int not_received)
 {
     int msgtimeout = ctx->msgtimeout; /* backup original value */
-    int err, rcvd_type;
+    int err;
 
-    if ((expected_type == V_CMP_PKIBODY_POLLREP || IS_ENOLLMENT(expected_type))
-        && ctx->totaltimeout != 0) { /* total timeout is not infinite */
-        long time_left = (long)(ctx->end_time - time(NULL));
-        if (time_left <= 0) {
-            CMPerr(CMP_F_SEND_RECEIVE_CHECK, CMP_R_TOTAL_TIMEOUT);
-            return 0;
-        }
-        if (ctx->msgtimeout == 0 || time_left < ctx->msgtimeout)
-            ctx->msgtimeout = time_left;
+    if ((ctx->msgtimeout = msg_timeout(ctx, expected_type)) < 0) {
+        ctx->msgtimeout = msgtimeout;
+        CMPerr(CMP_F_SEND_RECEIVE_CHECK, CMP_R_TOTAL_TIMEOUT);
+        return 0;
     }
 
     CMP_printf(ctx, FL_INFO, "sending %s", type_string);
     if (ctx->transfer_cb != NULL)
-        err = (ctx->transfer_cb)(ctx, req, rep);
+        err = transfer(ctx, req, rep);
         /* may produce, e.g., CMP_R_ERROR_TRANSFERRING_OUT
          *                 or CMP_R_ERROR_TRANSFERRING_IN
          * DO NOT DELETE the two error reason codes in this comment, they are
@@ -200,22 +290,209 @@ static int send_receive_check(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
         return 0;
     }
 
-    CMP_printf(ctx, FL_INFO, "got response");
-    if((rcvd_type = CMP_PKIMESSAGE_check_received(ctx, *rep, expected_type,
-                                                  unprotected_exception)) < 0)
+    return check_response(ctx, *rep, expected_type);
+}
+
+/*
+ * state of a certificate request sent in IR/CR/KUR/P10CR
+ */
+typedef struct {
+    long rid; /* certReqId, -1 for P10CR until learned from the response */
+    EVP_PKEY *pkey; /* the key pair to be certified, not owned */
+    X509 *cert; /* the newly enrolled certificate, or NULL if none (yet) */
+    int failure; /* failure info bit number for certConf, or -1 */
+    const char *txt; /* failure text for certConf, or NULL */
+} CERTREQ_STATE;
+
+/*
+ * state of all certificate requests sent in one IR/CR/KUR/P10CR message,
+ * which may be answered in several IP/CP/KUP messages due to polling
+ * and are confirmed together in one certConf message
+ */
+typedef struct {
+    int num; /* number of certificate requests */
+    int pending; /* number of them not having got a final response yet */
+    CERTREQ_STATE *reqs;
+} CERTREQS;
+
+/*
+ * internal function
+ *
+ * initializes the state of the certificate requests contained in req
+ * returns 1 on success, 0 on error
+ */
+static int certreqs_init(CMP_CTX *ctx, CERTREQS *crs, const CMP_PKIMESSAGE *req)
+{
+    EVP_PKEY *rkey = ctx->newPkey ? ctx->newPkey : ctx->pkey;
+    int p10cr = CMP_PKIMESSAGE_get_bodytype(req) == V_CMP_PKIBODY_P10CR;
+    int i;
+
+    crs->num = p10cr ? 1 : sk_CRMF_CERTREQMSG_num(req->body->value.ir);
+    crs->pending = crs->num;
+    if (crs->num <= 0 ||
+        (crs->reqs = OPENSSL_zalloc(crs->num * sizeof(*crs->reqs))) == NULL) {
+        CMPerr(CMP_F_CERTREQS_INIT, CMP_R_OUT_OF_MEMORY);
         return 0;
+    }
+    for (i = 0; i < crs->num; i++) {
+        CERTREQ_STATE *st = &crs->reqs[i];
+
+        /* further requests are in the order of ctx->certReqs */
+        st->pkey = i == 0 ? rkey :
+            sk_CMP_CERTREQ_value(ctx->certReqs, i - 1)->pkey;
+        st->rid = p10cr ? -1 : CRMF_CERTREQMSG_get_certReqId(
+                          sk_CRMF_CERTREQMSG_value(req->body->value.ir, i));
+        st->failure = -1;
+    }
 
-    /* catch if received message type isn't one of expected ones (e.g. error) */
-    if (rcvd_type != expected_type &&
-        /* as an answer to polling, there could be IP/CP/KUP */
-        !(expected_type == V_CMP_PKIBODY_POLLREP && IS_ENOLLMENT(rcvd_type))) {
-        CMPerr(CMP_F_SEND_RECEIVE_CHECK, rcvd_type == V_CMP_PKIBODY_ERROR ?
-                CMP_R_RECEIVED_ERROR :
-                CMP_R_UNEXPECTED_PKIBODY); /* in next line for mkerr.pl */
-        message_add_error_data(*rep);
+    sk_X509_pop_free(ctx->newClCerts, X509_free);
+    ctx->newClCerts = NULL;
+    return 1;
+}
+
+static void certreqs_free(CERTREQS *crs)
+{
+    int i;
+
+    for (i = 0; crs->reqs != NULL && i < crs->num; i++)
+        X509_free(crs->reqs[i].cert);
+    OPENSSL_free(crs->reqs);
+    crs->reqs = NULL;
+    crs->num = crs->pending = 0;
+}
+
+/* a request is pending until it got a certificate or has been rejected */
+#define CERTREQ_IS_PENDING(st) ((st)->cert == NULL && (st)->failure < 0)
+
+/* returns the state of the request with the given rid if pending, else NULL */
+static CERTREQ_STATE *certreqs_pending(const CERTREQS *crs, long rid)
+{
+    int i;
+
+    for (i = 0; i < crs->num; i++)
+        if (CERTREQ_IS_PENDING(&crs->reqs[i]) &&
+            (crs->reqs[i].rid == -1 || crs->reqs[i].rid == rid))
+            return &crs->reqs[i];
+    return NULL;
+}
+
+/*
+ * internal function
+ *
+ * creates a pollReq for all pending certificate requests
+ * returns pointer to the message on success, NULL on error
+ */
+static CMP_PKIMESSAGE *certreqs_pollReq(CMP_CTX *ctx, const CERTREQS *crs)
+{
+    CMP_PKIMESSAGE *msg = NULL;
+    long *rids;
+    int i, n = 0;
+
+    if ((rids = OPENSSL_malloc(crs->num * sizeof(*rids))) == NULL)
+        return NULL;
+    for (i = 0; i < crs->num; i++)
+        if (CERTREQ_IS_PENDING(&crs->reqs[i]))
+            rids[n++] = crs->reqs[i].rid;
+    msg = CMP_pollReq_new_multi(ctx, rids, n);
+    OPENSSL_free(rids);
+    return msg;
+}
+
+/*
+ * internal function
+ *
+ * creates a certConf confirming or rejecting all newly enrolled certificates,
+ * which includes a rejection for each request that did not yield any
+ * returns pointer to the message on success, NULL on error
+ */
+static CMP_PKIMESSAGE *certreqs_certConf(CMP_CTX *ctx, const CERTREQS *crs)
+{
+    CMP_PKIMESSAGE *msg = NULL;
+    STACK_OF(CMP_CERTSTATUS) *certStatus;
+    CMP_CERTSTATUS *status;
+    int i;
+
+    if ((certStatus = sk_CMP_CERTSTATUS_new_null()) == NULL)
+        return NULL;
+    for (i = 0; i < crs->num; i++) {
+        const CERTREQ_STATE *st = &crs->reqs[i];
+
+        if ((status = CMP_certStatus_new(ctx, st->rid, st->cert,
+                                         st->failure, st->txt)) == NULL)
+            goto end;
+        if (!sk_CMP_CERTSTATUS_push(certStatus, status)) {
+            CMP_CERTSTATUS_free(status);
+            goto end;
+        }
+    }
+    msg = CMP_certConf_new_multi(ctx, certStatus);
+ end:
+    sk_CMP_CERTSTATUS_pop_free(certStatus, CMP_CERTSTATUS_free);
+    return msg;
+}
+
+/* returns the first certificate request with negative decision, or NULL */
+static const CERTREQ_STATE *certreqs_rejected(const CERTREQS *crs)
+{
+    int i;
+
+    for (i = 0; i < crs->num; i++)
+        if (crs->reqs[i].failure >= 0)
+            return &crs->reqs[i];
+    return NULL;
+}
+
+/*
+ * internal function
+ *
+ * evaluates the pollRep entries for the pending requests contained in the
+ * given message prep and determines in *checkAfter the minimum number of
+ * seconds to wait before polling again, which is shortened such that the total
+ * timeout, if any, is not exceeded
+ * returns 1 on success, 0 on error or if the total timeout has been reached
+ */
+static int get_checkAfter(CMP_CTX *ctx, const CMP_PKIMESSAGE *prep,
+                          const CERTREQS *crs, long *checkAfter)
+{
+    CMP_POLLREPCONTENT *prc = prep->body->value.pollRep;
+    CMP_POLLREP *pollRep;
+    long value;
+    int i;
+
+    *checkAfter = -1;
+    for (i = 0; i < sk_CMP_POLLREP_num(prc); i++) {
+        pollRep = sk_CMP_POLLREP_value(prc, i);
+        if (certreqs_pending(crs, ASN1_INTEGER_get(&pollRep->certReqId)) == NULL)
+            continue;
+        if ((value = ASN1_INTEGER_get(&pollRep->checkAfter)) < 0) {
+            CMPerr(CMP_F_GET_CHECKAFTER,
+                   CMP_R_RECEIVED_NEGATIVE_CHECKAFTER_IN_POLLREP);
+            return 0;
+        }
+        if (*checkAfter < 0 || value < *checkAfter)
+            *checkAfter = value;
+    }
+    if (*checkAfter < 0) {
+        CMPerr(CMP_F_GET_CHECKAFTER, CMP_R_CERTRESPONSE_NOT_FOUND);
         return 0;
     }
+    /* TODO: print OPTIONAL reason (PKIFreeText) from message */
+    CMP_printf(ctx, FL_INFO,
+               "received polling response, waiting checkAfter =  "
+               "%ld sec before next polling request", *checkAfter);
 
+    if (ctx->totaltimeout != 0) { /* total timeout is not infinite */
+        const int exp = 5; /* expected max time per msg round trip */
+        long time_left = (long)(ctx->end_time - exp - time(NULL));
+        if (time_left <= 0) {
+            CMPerr(CMP_F_GET_CHECKAFTER, CMP_R_TOTAL_TIMEOUT);
+            return 0;
+        }
+        if (time_left < *checkAfter) {
+            *checkAfter = time_left;
+            /* poll one last time just when timeout was reached */
+        }
+    }
     return 1;
 }
 
@@ -223,7 +500,8 @@ static int send_receive_check(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
  * internal function
  *
  * When a 'waiting' PKIStatus has been received, this function is used to
- * attempt to poll for a response message.
+ * attempt to poll for a response message, using one pollReq for all pending
+ * certificate requests.
  *
  * A total timeout may have been set in the context.  The function will continue
  * to poll until the timeout is reached and then poll a last time even when that
@@ -232,19 +510,17 @@ static int send_receive_check(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
  *
  * returns 1 on success, returns received PKIMESSAGE in *msg argument
  * returns 0 on error or when timeout is reached without a received message
- *
- * TODO: handle multiple poll requests for multiple certificates --> FR #13
  */
-static int pollForResponse(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **out)
+static int pollForResponse(CMP_CTX *ctx, const CERTREQS *crs,
+                           CMP_PKIMESSAGE **out)
 {
     CMP_PKIMESSAGE *preq = NULL;
     CMP_PKIMESSAGE *prep = NULL;
-    CMP_POLLREP *pollRep = NULL;
 
     CMP_printf(ctx, FL_INFO,
                "received 'waiting' PKIStatus, starting to poll for response");
     for (;;) {
-        if (!(preq = CMP_pollReq_new(ctx, rid)))
+        if (!(preq = certreqs_pollReq(ctx, crs)))
             goto err;
 
         if (!send_receive_check(ctx, preq, "pollReq", CMP_F_POLLFORRESPONSE,
@@ -255,32 +531,8 @@ static int pollForResponse(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **out)
         /* handle potential pollRep */
         if (CMP_PKIMESSAGE_get_bodytype(prep) == V_CMP_PKIBODY_POLLREP) {
             long checkAfter;
-            if (!(pollRep = CMP_POLLREPCONTENT_pollRep_get0(
-                                               prep->body->value.pollRep, rid)))
-                goto err;
-            checkAfter = ASN1_INTEGER_get(pollRep->checkAfter);
-            if (checkAfter < 0) {
-                CMPerr(CMP_F_POLLFORRESPONSE,
-                       CMP_R_RECEIVED_NEGATIVE_CHECKAFTER_IN_POLLREP);
+            if (!get_checkAfter(ctx, prep, crs, &checkAfter))
                 goto err;
-            }
-            /* TODO: print OPTIONAL reason (PKIFreeText) from message */
-            CMP_printf(ctx, FL_INFO,
-                       "received polling response, waiting checkAfter =  "
-                       "%ld sec before next polling request", checkAfter);
-
-            if (ctx->totaltimeout != 0) { /* total timeout is not infinite */
-                const int exp = 5; /* expected max time per msg round trip */
-                long time_left = (long)(ctx->end_time - exp - time(NULL));
-                if (time_left <= 0) {
-                    CMPerr(CMP_F_POLLFORRESPONSE, CMP_R_TOTAL_TIMEOUT);
-                    goto err;
-                }
-                if (time_left < checkAfter) {
-                    checkAfter = time_left;
-                    /* poll one last time just when timeout was reached */
-                }
-            }
 
             CMP_PKIMESSAGE_free(preq);
             preq = NULL;
@@ -476,52 +728,33 @@ static X509 *get_cert_status(CMP_CTX *ctx, int bodytype, CMP_CERTRESPONSE *crep)
 /*
  * internal function
  *
- * performs the generic handling of certificate responses for IR/CR/KUR/P10CR
+ * evaluates the final (i.e., not 'waiting') CertResponse crep of resp:
+ * places the new certificate as well as any caPubs and extraCerts in ctx and
+ * determines, also using any ctx->certConf_cb, whether to accept the new cert,
+ * which must match the private key rkey,
+ * giving any failure info bit number and text in *failure and *txt.
+ * If no certificate can be obtained, e.g., because the request has been
+ * rejected, ctx->newClCert is NULL and *failure and *txt are set as well.
  * returns 1 on success, 0 on error
- * Regardless of success, caller is responsible for freeing *resp (unless NULL).
  */
-static int cert_response(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **resp,
-                         int func, int not_received)
+static int process_cert_response(CMP_CTX *ctx, const CMP_PKIMESSAGE *resp,
+                                 CMP_CERTRESPONSE *crep, EVP_PKEY *rkey,
+                                 int *failure, const char **txt)
 {
-    int failure = -1; /* no failure */
-    const char *txt = NULL;
-    CMP_CERTREPMESSAGE *body;
-    CMP_CERTRESPONSE *crep;
+    CMP_CERTREPMESSAGE *body = resp->body->value.ip; /* same for cp and kup */
     STACK_OF(X509) *extracerts;
-    int ret = 1;
-
- retry:
-    body = (*resp)->body->value.ip; /* same for cp and kup */
-
-    /*
-     * TODO handle multiple CertResponses in CertRepMsg (in case multiple
-     * requests have been sent) --> Feature Request #13
-     */
-    crep = CMP_CERTREPMESSAGE_certResponse_get0(body, rid);
-    if (crep == NULL)
-        return 0;
-    if (rid == -1) /* for V_CMP_PKIBODY_P10CR, learn CertReqId from response */
-        rid = ASN1_INTEGER_get(crep->certReqId);
-
-    if (CMP_PKISTATUSINFO_PKIStatus_get(crep->status) == CMP_PKISTATUS_waiting){
-        CMP_PKIMESSAGE_free(*resp);
-        if (pollForResponse(ctx, rid, resp)) {
-            goto retry; /* got rp/cp/kup which might still indicate 'waiting' */
-        } else {
-            CMPerr(func, not_received);
-            ERR_add_error_data(1,
-                             "received 'waiting' pkistatus but polling failed");
-            *resp = NULL;
-            return 0;
-        }
-    }
 
+    *failure = -1; /* no failure */
+    *txt = NULL;
     if (!save_statusInfo(ctx, crep->status))
         return 0;
-    if ((ctx->newClCert = get_cert_status(ctx, (*resp)->body->type,
+    X509_free(ctx->newClCert);
+    if ((ctx->newClCert = get_cert_status(ctx, resp->body->type,
                                           crep)) == NULL) {
         CMP_add_error_data("cannot extract certificate from response");
-        return 0;
+        *failure = CMP_PKIFAILUREINFO_badRequest;
+        *txt = "no certificate received for this request";
+        return 1;
     }
 
     /*
@@ -532,7 +765,7 @@ static int cert_response(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **resp,
         CMP_CTX_set1_caPubs(ctx, body->caPubs);
 
     /* copy received extraCerts to ctx->extraCertsIn so they can be retrieved */
-    if ((extracerts = (*resp)->extraCerts)) {
+    if ((extracerts = resp->extraCerts)) {
         if (!CMP_CTX_set1_extraCertsIn(ctx, extracerts) ||
         /*
          * merge them also into the untrusted certs, such that the peer does
@@ -543,18 +776,17 @@ static int cert_response(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **resp,
             return 0;
     }
 
-    if (!(X509_check_private_key(ctx->newClCert,
-                                 ctx->newPkey ? ctx->newPkey : ctx->pkey))) {
-        failure = CMP_PKIFAILUREINFO_incorrectData;
-        txt = "public key in new certificate does not match our private key";
+    if (!(X509_check_private_key(ctx->newClCert, rkey))) {
+        *failure = CMP_PKIFAILUREINFO_incorrectData;
+        *txt = "public key in new certificate does not match our private key";
 #if 0 /* better leave this for any ctx->certConf_cb to decide */
-        (void)CMP_exchange_error(ctx, CMP_PKISTATUS_rejection, failure, txt);
+        (void)CMP_exchange_error(ctx, CMP_PKISTATUS_rejection, *failure, *txt);
         /*
          * cannot flag failure earlier as send_receive_check() indirectly calls
          * ERR_clear_error()
          */
         CMPerr(func, CMP_R_CERTIFICATE_NOT_ACCEPTED);
-        ERR_add_error_data(1, txt);
+        ERR_add_error_data(1, *txt);
         return 0;
 #endif
     }
@@ -564,25 +796,159 @@ static int cert_response(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **resp,
      * which can determine whether to accept a newly enrolled certificate.
      * It may overrule the pre-decision reflected in 'failure' and '*txt'.
      */
-    if (ctx->certConf_cb && (failure = ctx->certConf_cb(ctx, ctx->newClCert,
-                                                        failure, &txt)) >= 0) {
-        if (txt == NULL)
-            txt = "CMP client application did not accept newly enrolled certificate";
+    if (ctx->certConf_cb) {
+        uint64_t start = CMP_CTX_phase_start(ctx);
+
+        if ((*failure = ctx->certConf_cb(ctx, ctx->newClCert,
+                                         *failure, txt)) >= 0 && *txt == NULL)
+            *txt = "CMP client application did not accept newly enrolled certificate";
+        CMP_CTX_phase_end(ctx, CMP_PHASE_CERTCONF_CB, start, 0);
+    }
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * evaluates the CertResponses for the pending certificate requests contained
+ * in the IP/CP/KUP message resp, where those with 'waiting' status stay pending.
+ * A request not yielding a certificate is recorded as rejected in its state,
+ * such that the certificates for the other requests can still be confirmed.
+ * When all requests have been answered, places the new certificates in ctx,
+ * where ctx->newClCert is the one for the first request, if any.
+ * returns 1 on success, 0 on error or if no request yielded a certificate
+ */
+static int process_cert_responses(CMP_CTX *ctx, CERTREQS *crs,
+                                  const CMP_PKIMESSAGE *resp)
+{
+    STACK_OF(CMP_CERTRESPONSE) *creps = resp->body->value.ip->response;
+    CMP_CERTRESPONSE *crep;
+    CERTREQ_STATE *st;
+    int i, found = 0;
+
+    for (i = 0; i < sk_CMP_CERTRESPONSE_num(creps); i++) {
+        crep = sk_CMP_CERTRESPONSE_value(creps, i);
+        if ((st = certreqs_pending(crs, ASN1_INTEGER_get(&crep->certReqId)))
+            == NULL)
+            continue; /* unexpected or already answered */
+        found = 1;
+        if (st->rid == -1) /* for V_CMP_PKIBODY_P10CR */
+            st->rid = ASN1_INTEGER_get(&crep->certReqId);
+        if (CMP_PKISTATUSINFO_PKIStatus_get(crep->status) ==
+            CMP_PKISTATUS_waiting)
+            continue;
+        if (!process_cert_response(ctx, resp, crep, st->pkey,
+                                   &st->failure, &st->txt))
+            return 0;
+        if (ctx->newClCert != NULL && !X509_up_ref(ctx->newClCert))
+            return 0;
+        st->cert = ctx->newClCert;
+        crs->pending--;
+    }
+    if (!found) {
+        CMPerr(CMP_F_PROCESS_CERT_RESPONSES, CMP_R_CERTRESPONSE_NOT_FOUND);
+        return 0;
+    }
+
+    if (crs->pending == 0) {
+        if ((ctx->newClCerts = sk_X509_new_null()) == NULL)
+            goto oom;
+        for (i = 0; i < crs->num; i++)
+            if (crs->reqs[i].cert != NULL &&
+                !CMP_sk_X509_add1_cert(ctx->newClCerts, crs->reqs[i].cert, 0))
+                goto oom;
+        if (sk_X509_num(ctx->newClCerts) == 0) {
+            /* nothing to confirm, the reason is on the error queue */
+            if (ERR_peek_error() == 0)
+                CMPerr(CMP_F_PROCESS_CERT_RESPONSES,
+                       CMP_R_REQUEST_REJECTED_BY_CA);
+            return 0;
+        }
+        X509_free(ctx->newClCert);
+        ctx->newClCert = NULL;
+        if (crs->reqs[0].cert != NULL &&
+            !CMP_CTX_set1_newClCert(ctx, crs->reqs[0].cert))
+            return 0;
+    }
+    return 1;
+
+ oom:
+    CMPerr(CMP_F_PROCESS_CERT_RESPONSES, CMP_R_OUT_OF_MEMORY);
+    return 0;
+}
+
+/*
+ * internal function
+ *
+ * reports that the certificate request st did not yield an accepted
+ * certificate, either because the server rejected it or the client did not
+ * accept the newly enrolled certificate
+ */
+static void cert_not_accepted(int func, const CERTREQ_STATE *st)
+{
+    char str[20];
+
+    /*
+     * cannot flag failure earlier because send_receive_check()
+     * indirectly calls ERR_clear_error()
+     */
+    BIO_snprintf(str, sizeof(str), "%ld", st->rid);
+    if (st->cert == NULL) {
+        CMPerr(func, CMP_R_REQUEST_REJECTED_BY_CA);
+        ERR_add_error_data(2, "no certificate received for certReqId = ", str);
+        return;
+    }
+    put_cert_verify_err(func);
+    CMPerr(func, CMP_R_CERTIFICATE_NOT_ACCEPTED);
+    ERR_add_error_data(2,
+                  "certConf callback resulted in rejection of new certificate"
+                       " for certReqId = ", str);
+}
+
+/*
+ * internal function
+ *
+ * performs the generic handling of certificate responses for IR/CR/KUR/P10CR,
+ * polling for any pending requests and confirming all certificates at once
+ * returns 1 on success, 0 on error
+ * Regardless of success, caller is responsible for freeing *resp (unless NULL).
+ */
+static int cert_response(CMP_CTX *ctx, CERTREQS *crs, CMP_PKIMESSAGE **resp,
+                         int func, int not_received)
+{
+    CMP_PKIMESSAGE *certConf = NULL;
+    CMP_PKIMESSAGE *PKIconf = NULL;
+    const CERTREQ_STATE *st;
+    int ret = 1;
+
+    for (;;) {
+        if (!process_cert_responses(ctx, crs, *resp))
+            return 0;
+        if (crs->pending == 0)
+            break;
+        /* got rp/cp/kup which still indicates 'waiting' for some request */
+        CMP_PKIMESSAGE_free(*resp);
+        *resp = NULL;
+        if (!pollForResponse(ctx, crs, resp)) {
+            CMPerr(func, not_received);
+            ERR_add_error_data(1,
+                             "received 'waiting' pkistatus but polling failed");
+            return 0;
+        }
     }
 
-    if (!ctx->disableConfirm && !CMP_PKIMESSAGE_check_implicitConfirm(*resp))
-        if (!CMP_exchange_certConf(ctx, failure, txt))
+    if (!ctx->disableConfirm && !CMP_PKIMESSAGE_check_implicitConfirm(*resp)) {
+        if ((certConf = certreqs_certConf(ctx, crs)) == NULL ||
+            !send_receive_check(ctx, certConf, "certConf", func, &PKIconf,
+                                V_CMP_PKIBODY_PKICONF,
+                                CMP_R_PKICONF_NOT_RECEIVED))
             ret = 0;
+        CMP_PKIMESSAGE_free(certConf);
+        CMP_PKIMESSAGE_free(PKIconf);
+    }
 
-    if (failure >= 0) {
-        /*
-         * cannot flag failure earlier because send_receive_check()
-         * indirectly calls ERR_clear_error()
-         */
-        put_cert_verify_err(func);
-        CMPerr(func, CMP_R_CERTIFICATE_NOT_ACCEPTED);
-        ERR_add_error_data(1,
-                  "certConf callback resulted in rejection of new certificate");
+    if ((st = certreqs_rejected(crs)) != NULL) {
+        cert_not_accepted(func, st);
         return 0;
     }
     return ret;
@@ -594,9 +960,9 @@ static int cert_response(CMP_CTX *ctx, long rid, CMP_PKIMESSAGE **resp,
  * Do the full sequence CR/IR/KUR/P10CR, CP/IP/KUP/CP,
  * certConf, PKIconf, and potential polling.
  *
- * All options need to be set in the context.
- *
- * TODO: another function to request two certificates at once should be created
+ * All options need to be set in the context. For IR and CR, this includes
+ * any further certificate requests, whose certificates are then obtained
+ * in the same transaction and are available via CMP_CTX_newClCerts_get1().
  *
  * returns pointer to received certificate, or NULL if none was received
  */
@@ -605,7 +971,7 @@ static X509 *do_certreq_seq(CMP_CTX *ctx, const char *type_string, int fn,
 {
     CMP_PKIMESSAGE *req = NULL;
     CMP_PKIMESSAGE *rep = NULL;
-    long rid = (req_type == V_CMP_PKIBODY_P10CR) ? -1 : CERTREQID;
+    CERTREQS crs = { 0, 0, NULL };
     X509 *result = NULL;
 
     if (ctx == NULL)
@@ -615,17 +981,19 @@ static X509 *do_certreq_seq(CMP_CTX *ctx, const char *type_string, int fn,
     ctx->lastPKIStatus = -1;
 
     /* The check if all necessary options are set is done in CMP_certreq_new */
-    if ((req = CMP_certreq_new(ctx, req_type, req_err)) == NULL)
+    if ((req = CMP_certreq_new(ctx, req_type, req_err)) == NULL ||
+        !certreqs_init(ctx, &crs, req))
         goto err;
 
     if (!send_receive_check(ctx, req, type_string, fn, &rep, rep_type, rep_err))
         goto err;
 
-    if (!cert_response(ctx, rid, &rep, fn, rep_err))
+    if (!cert_response(ctx, &crs, &rep, fn, rep_err))
         goto err;
 
     result = ctx->newClCert;
  err:
+    certreqs_free(&crs);
     CMP_PKIMESSAGE_free(req);
     CMP_PKIMESSAGE_free(rep);
 
@@ -636,14 +1004,9 @@ static X509 *do_certreq_seq(CMP_CTX *ctx, const char *type_string, int fn,
 }
 
 /*
- * do the full sequence for RR, including RR, RP, and potential polling
- *
- * All options need to be set in the context,
- * in particular oldCert, the certificate to be revoked.
- *
- * TODO: this function can only revoke one certificate so far,
- * should be possible for several according to 5.3.9
+ * internal function
  *
+ * evaluates the PKIStatus of a single revocation.
  * The RFC is vague in which PKIStatus should be returned by the server, so we
  * take "accepted, "grantedWithMods", and "revocationWarning" as success,
  * "revocationNotification" is used by some CAs as an indication that the
@@ -651,67 +1014,157 @@ static X509 *do_certreq_seq(CMP_CTX *ctx, const char *type_string, int fn,
  * revocation was rejected, and do not expect "waiting" or "keyUpdateWarning"
  * (which are handled as error).
  *
- * returns 1 on success, 0 on error
+ * returns 1 if the revocation has been accepted, 0 if it has been rejected,
+ * or else the reason code of an unexpected PKIStatus
  */
-int CMP_exec_RR_ses(CMP_CTX *ctx)
+static int rr_status_check(CMP_PKISTATUSINFO *si, const char **text)
 {
-    CMP_PKIMESSAGE *rr = NULL;
-    CMP_PKIMESSAGE *rp = NULL;
-    CMP_PKISTATUSINFO *si = NULL;
-    int result = 0;
-
-    if (ctx == NULL)
-        return 0;
-
-    ctx->lastPKIStatus = -1;
-
-    /* check if all necessary options are set is done in CMP_rr_new */
-    /* create Revocation Request - ir */
-    if ((rr = CMP_rr_new(ctx)) == NULL)
-        goto err;
-
-    if (!send_receive_check(ctx, rr, "rr", CMP_F_CMP_EXEC_RR_SES,
-                            &rp, V_CMP_PKIBODY_RP, CMP_R_RP_NOT_RECEIVED))
-        goto err;
-
-    /* evaluate PKIStatus field */
-    si = CMP_REVREPCONTENT_PKIStatusInfo_get(rp->body->value.rp, REVREQSID);
-    if (!save_statusInfo(ctx, si))
-        goto err;
     switch (CMP_PKISTATUSINFO_PKIStatus_get(si)) {
     case CMP_PKISTATUS_accepted:
-        CMP_printf(ctx, FL_INFO, "revocation accepted (PKIStatus=accepted)");
-        result = 1;
-        break;
+        *text = "accepted";
+        return 1;
     case CMP_PKISTATUS_grantedWithMods:
-        CMP_printf(ctx, FL_INFO,
-                   "revocation accepted (PKIStatus=grantedWithMods)");
-        result = 1;
-        break;
-    case CMP_PKISTATUS_rejection:
-        /* interpretation as warning or error depends on CA */
-        CMP_printf(ctx, FL_WARN, "revocation rejected (PKIStatus=rejection)");
-        CMPerr(CMP_F_CMP_EXEC_RR_SES, CMP_R_REQUEST_REJECTED_BY_CA);
-        goto err;
+        *text = "grantedWithMods";
+        return 1;
     case CMP_PKISTATUS_revocationWarning:
-        CMP_printf(ctx, FL_INFO,
-                   "revocation accepted (PKIStatus=revocationWarning)");
-        result = 1;
-        break;
+        *text = "revocationWarning";
+        return 1;
     case CMP_PKISTATUS_revocationNotification:
         /* interpretation as warning or error depends on CA */
-        CMP_printf(ctx, FL_INFO,
-                   "revocation accepted (PKIStatus=revocationNotification)");
-        result = 1;
-        break;
+        *text = "revocationNotification";
+        return 1;
+    case CMP_PKISTATUS_rejection:
+        /* interpretation as warning or error depends on CA */
+        *text = "rejection";
+        return 0;
     case CMP_PKISTATUS_waiting:
     case CMP_PKISTATUS_keyUpdateWarning:
-        CMPerr(CMP_F_CMP_EXEC_RR_SES, CMP_R_UNEXPECTED_PKISTATUS);
-        goto err;
+        return CMP_R_UNEXPECTED_PKISTATUS;
     default:
-        CMPerr(CMP_F_CMP_EXEC_RR_SES, CMP_R_UNKNOWN_PKISTATUS);
+        return CMP_R_UNKNOWN_PKISTATUS;
+    }
+}
+
+/*
+ * internal function
+ * exchanges an RR for the num certs starting at index first with an RP and
+ * appends the PKIStatusInfo contained in it to ctx->revStatus
+ * returns 1 on success, 0 on error
+ */
+static int rr_exchange(CMP_CTX *ctx, int first, int num)
+{
+    CMP_PKIMESSAGE *rr = NULL;
+    CMP_PKIMESSAGE *rp = NULL;
+    CMP_REVREPCONTENT *rrep;
+    CMP_PKISTATUSINFO *si;
+    int result = 0;
+
+    /* create Revocation Request - rr */
+    if ((rr = CMP_rr_new_range(ctx, first, num)) == NULL)
+        goto err;
+
+    if (!send_receive_check(ctx, rr, "rr", CMP_F_RR_EXCHANGE,
+                            &rp, V_CMP_PKIBODY_RP, CMP_R_RP_NOT_RECEIVED))
+        goto err;
+
+    /* the statuses are given in the same order as the RevDetails */
+    rrep = rp->body->value.rp;
+    if (sk_CMP_PKISTATUSINFO_num(rrep->status) != num) {
+        CMPerr(CMP_F_RR_EXCHANGE, CMP_R_WRONG_RP_COMPONENT_COUNT);
         goto err;
     }
+    /* take over the statuses rather than copying them */
+    if (ctx->revStatus == NULL) {
+        ctx->revStatus = rrep->status;
+        rrep->status = NULL;
+    } else {
+        while ((si = sk_CMP_PKISTATUSINFO_shift(rrep->status)) != NULL)
+            if (!sk_CMP_PKISTATUSINFO_push(ctx->revStatus, si)) {
+                CMP_PKISTATUSINFO_free(si);
+                goto err;
+            }
+    }
+    CMP_PKIMESSAGE_modified(rp);
+    result = 1;
+
+ err:
+    CMP_PKIMESSAGE_free(rr);
+    CMP_PKIMESSAGE_free(rp);
+    return result;
+}
+
+/*
+ * do the full sequence for RR, including RR, RP, and potential polling
+ *
+ * All options need to be set in the context, in particular oldCert and/or
+ * the further certificates added with CMP_CTX_revCert_push1(), which are
+ * requested to be revoked in a single RR as allowed by 5.3.9, or in a
+ * transaction of its own for each batch of CMP_CTX_OPT_REVOCATION_BATCH certs.
+ * The PKIStatusInfo for each of them, in the same order, is kept in ctx
+ * and can be obtained with CMP_CTX_get0_revStatus().
+ *
+ * returns 1 if all revocations have been accepted, 0 on error
+ */
+int CMP_exec_RR_ses(CMP_CTX *ctx)
+{
+    CMP_PKISTATUSINFO *si = NULL;
+    const char *text = NULL;
+    int num, batch, rejected = 0;
+    int result = 0;
+    int i, res;
+
+    if (ctx == NULL)
+        return 0;
+
+    ctx->lastPKIStatus = -1;
+    sk_CMP_PKISTATUSINFO_pop_free(ctx->revStatus, CMP_PKISTATUSINFO_free);
+    ctx->revStatus = NULL;
+
+    /* check if all necessary options are set is done in CMP_rr_new_range */
+    num = CMP_CTX_revCerts_num(ctx);
+    batch = ctx->revocationBatch > 0 ? ctx->revocationBatch : num;
+    for (i = 0; i == 0 || i < num; i += batch) {
+        if (i > 0) { /* each further RR starts a new transaction */
+            ASN1_OCTET_STRING_free(ctx->transactionID);
+            ctx->transactionID = NULL;
+            ASN1_OCTET_STRING_free(ctx->recipNonce);
+            ctx->recipNonce = NULL;
+        }
+        if (!rr_exchange(ctx, i, num - i < batch ? num - i : batch))
+            goto err;
+    }
+
+    /* evaluate PKIStatus fields, reporting the first rejection if any */
+    si = sk_CMP_PKISTATUSINFO_value(ctx->revStatus, REVREQSID);
+    for (i = 0; i < num; i++) {
+        CMP_PKISTATUSINFO *si1 = sk_CMP_PKISTATUSINFO_value(ctx->revStatus, i);
+
+        if ((res = rr_status_check(si1, &text)) > 1) {
+            CMPerr(CMP_F_CMP_EXEC_RR_SES, res);
+            si = si1;
+            goto err;
+        }
+        if (res == 0 && rejected++ == 0)
+            si = si1;
+    }
+    if (!save_statusInfo(ctx, si))
+        goto err;
+
+    if (rejected) {
+        if (num == 1)
+            CMP_printf(ctx, FL_WARN, "revocation rejected (PKIStatus=%s)",
+                       text);
+        else
+            CMP_printf(ctx, FL_WARN, "%d of %d revocations rejected",
+                       rejected, num);
+        CMPerr(CMP_F_CMP_EXEC_RR_SES, CMP_R_REQUEST_REJECTED_BY_CA);
+        goto err;
+    }
+    if (num == 1)
+        CMP_printf(ctx, FL_INFO, "revocation accepted (PKIStatus=%s)", text);
+    else
+        CMP_printf(ctx, FL_INFO, "all %d revocations accepted", num);
+    result = 1;
 
  err:
 
@@ -726,8 +1179,6 @@ int CMP_exec_RR_ses(CMP_CTX *ctx)
         }
         ERR_print_errors_cb(CMP_CTX_error_cb, (void *)ctx);
     }
-    CMP_PKIMESSAGE_free(rr);
-    CMP_PKIMESSAGE_free(rp);
     return result;
 }
 
@@ -782,6 +1233,7 @@ STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_exec_GENM_ses(CMP_CTX *ctx)
     /* received stack of itavs not to be freed with the genp */
     rcvd_itavs = genp->body->value.genp;
     genp->body->value.genp = NULL;
+    CMP_PKIMESSAGE_modified(genp);
 
  err:
     if (genm)
@@ -795,3 +1247,725 @@ STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_exec_GENM_ses(CMP_CTX *ctx)
         ERR_print_errors_cb(CMP_CTX_error_cb, (void *)ctx);
     return rcvd_itavs;
 }
+
+/*
+ * state of a resumable certificate request transaction, see CMP_SES_start()
+ */
+struct cmp_ses_st {
+    CMP_CTX *ctx;
+    int state; /* one of the SES_STATE_* values below */
+    /* parameters of the transaction type */
+    const char *type_string;
+    int req_type;
+    int req_err;
+    int rep_type;
+    int rep_err;
+    CERTREQS crs; /* the certificate requests and their responses */
+    int polling; /* whether a 'waiting' PKIStatus has been received */
+    /* the current message exchange */
+    CMP_PKIMESSAGE *req;
+    CMP_PKIMESSAGE *rep;
+    const char *req_string;
+    int expected_type;
+    int not_received;
+    int msgtimeout; /* maximum seconds (or 0 for infinite) for the exchange */
+    time_t deadline; /* end of the exchange or of checkAfter, or 0 */
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    CMP_HTTP_NBIO io;
+#endif
+    /* with CMP_CTX_OPT_ASYNC, the step paused in a crypto operation, if any */
+    ASYNC_JOB *job;
+    ASYNC_WAIT_CTX *waitctx;
+    int aborted; /* CMP_SES_free() is finishing the paused job */
+    /* while waiting for checkAfter in a scheduler, see CMP_SES_SCHED_add() */
+    CMP_SES_SCHED *sched;
+    CMP_SES *sched_prev;
+    CMP_SES *sched_next;
+    time_t sched_due;
+    void *sched_arg;
+};
+
+#define SES_STATE_CREATE    0 /* the certificate request is to be created */
+#define SES_STATE_SEND      1 /* req is to be sent */
+#define SES_STATE_EXCHANGE  2 /* response to req is pending */
+#define SES_STATE_POLL_WAIT 3 /* waiting for checkAfter to pass */
+#define SES_STATE_DONE      4
+#define SES_STATE_ERROR     5
+
+/*
+ * scheduler of transactions waiting for the checkAfter time of a pollRep,
+ * implemented as hashed timer wheel with slots of one second each
+ */
+#define SCHED_SLOTS 256
+
+struct cmp_ses_sched_st {
+    CMP_SES *slots[SCHED_SLOTS]; /* lists of sessions by due time modulo */
+    time_t next; /* first due time not yet handled by CMP_SES_SCHED_run() */
+    int num; /* number of sessions waiting */
+};
+
+#define SCHED_SLOT(sched, due) ((sched)->slots[(size_t)(due) % SCHED_SLOTS])
+
+/*
+ * internal function
+ *
+ * removes the given session from the timer wheel it is waiting in
+ */
+static void sched_unlink(CMP_SES *ses)
+{
+    CMP_SES_SCHED *sched = ses->sched;
+
+    if (ses->sched_prev != NULL)
+        ses->sched_prev->sched_next = ses->sched_next;
+    else
+        SCHED_SLOT(sched, ses->sched_due) = ses->sched_next;
+    if (ses->sched_next != NULL)
+        ses->sched_next->sched_prev = ses->sched_prev;
+    ses->sched = NULL;
+    ses->sched_prev = ses->sched_next = NULL;
+    sched->num--;
+}
+
+/*
+ * internal function
+ *
+ * prepares sending the given message, expecting a response of the given type
+ */
+static void ses_set_req(CMP_SES *ses, CMP_PKIMESSAGE *req,
+                        const char *req_string,
+                        int expected_type, int not_received)
+{
+    CMP_PKIMESSAGE_free(ses->req);
+    ses->req = req;
+    ses->req_string = req_string;
+    ses->expected_type = expected_type;
+    ses->not_received = not_received;
+    ses->state = SES_STATE_SEND;
+}
+
+/*
+ * internal function
+ *
+ * creates the certificate request, including any POPO signature,
+ * and prepares sending it
+ * returns 1 on success, 0 on error
+ */
+static int ses_create(CMP_SES *ses)
+{
+    CMP_PKIMESSAGE *req;
+
+    /* The check if all necessary options are set is done in CMP_certreq_new */
+    if ((req = CMP_certreq_new(ses->ctx, ses->req_type, ses->req_err)) == NULL)
+        return 0;
+    if (!certreqs_init(ses->ctx, &ses->crs, req)) {
+        CMP_PKIMESSAGE_free(req);
+        return 0;
+    }
+    ses_set_req(ses, req, ses->type_string, ses->rep_type, ses->rep_err);
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * starts sending ses->req
+ * returns 1 on success, 0 on error
+ */
+static int ses_send(CMP_SES *ses)
+{
+    if ((ses->msgtimeout = msg_timeout(ses->ctx, ses->expected_type)) < 0) {
+        CMPerr(CMP_F_SES_SEND, CMP_R_TOTAL_TIMEOUT);
+        return 0;
+    }
+    ses->deadline = ses->msgtimeout > 0 ? time(NULL) + ses->msgtimeout : 0;
+    CMP_PKIMESSAGE_free(ses->rep);
+    ses->rep = NULL;
+    CMP_printf(ses->ctx, FL_INFO, "sending %s", ses->req_string);
+    ses->state = SES_STATE_EXCHANGE;
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * continues exchanging ses->req, using non-blocking I/O for HTTP transfer.
+ * Any other ctx->transfer_cb is called synchronously.
+ * returns CMP_SES_DONE if the response has been received and checked,
+ * CMP_SES_WANT_READ or CMP_SES_WANT_WRITE if I/O is pending,
+ * or CMP_SES_ERROR on error
+ */
+static int ses_exchange(CMP_SES *ses)
+{
+    CMP_CTX *ctx = ses->ctx;
+    int err = 0;
+
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    if (ctx->transfer_cb == CMP_PKIMESSAGE_http_perform) {
+        int rv = CMP_PKIMESSAGE_http_nbio(ctx, ses->req, &ses->io, &ses->rep,
+                                          &err);
+
+        if (rv == -1) {
+            if (ses->deadline == 0 || time(NULL) < ses->deadline)
+                return BIO_should_read(ses->io.hbio) ? CMP_SES_WANT_READ
+                                                     : CMP_SES_WANT_WRITE;
+            err = ses->io.rctx == NULL ? CMP_R_CONNECT_TIMEOUT
+                                       : CMP_R_READ_TIMEOUT;
+        }
+        if (!CMP_HTTP_NBIO_cleanup(ctx, &ses->io, err) && err == 0)
+            err = CMP_R_OUT_OF_MEMORY;
+    } else
+#endif
+    if (ctx->transfer_cb != NULL) {
+        int msgtimeout = ctx->msgtimeout; /* backup original value */
+
+        ctx->msgtimeout = ses->msgtimeout;
+        err = transfer(ctx, ses->req, &ses->rep);
+        ctx->msgtimeout = msgtimeout; /* restore original value */
+    } else
+        err = CMP_R_ERROR_SENDING_REQUEST;
+
+    if (err) {
+        CMPerr(CMP_F_SES_EXCHANGE, err);
+        if (err == CMP_R_FAILED_TO_RECEIVE_PKIMESSAGE ||
+            err == CMP_R_READ_TIMEOUT ||
+            err == CMP_R_ERROR_DECODING_MESSAGE)
+            CMPerr(CMP_F_SES_EXCHANGE, ses->not_received);
+        else {
+            CMPerr(CMP_F_SES_EXCHANGE, CMP_R_ERROR_SENDING_REQUEST);
+            CMP_add_error_data(ses->req_string);
+        }
+        return CMP_SES_ERROR;
+    }
+    return check_response(ctx, ses->rep, ses->expected_type) ? CMP_SES_DONE
+                                                             : CMP_SES_ERROR;
+}
+
+/*
+ * internal function
+ *
+ * handles the response received in the current exchange,
+ * preparing the next message to send or the next polling time, if any
+ * returns 1 on success, 0 on error
+ */
+static int ses_handle_response(CMP_SES *ses)
+{
+    CMP_CTX *ctx = ses->ctx;
+    CMP_PKIMESSAGE *msg;
+    const CERTREQ_STATE *st;
+
+    switch (CMP_PKIMESSAGE_get_bodytype(ses->rep)) {
+    case V_CMP_PKIBODY_POLLREP: {
+        long checkAfter;
+
+        if (!get_checkAfter(ctx, ses->rep, &ses->crs, &checkAfter))
+            return 0;
+        ses->deadline = time(NULL) + checkAfter;
+        ses->state = SES_STATE_POLL_WAIT;
+        return 1;
+    }
+    case V_CMP_PKIBODY_PKICONF:
+        break;
+    default: /* IP/CP/KUP */
+        if (!process_cert_responses(ctx, &ses->crs, ses->rep))
+            return 0;
+        if (ses->crs.pending > 0) {
+            if (!ses->polling)
+                CMP_printf(ctx, FL_INFO,
+                 "received 'waiting' PKIStatus, starting to poll for response");
+            ses->polling = 1;
+            ses->deadline = 0;
+            ses->state = SES_STATE_POLL_WAIT; /* poll immediately */
+            return 1;
+        }
+        if (ses->polling)
+            CMP_printf(ctx, FL_INFO, "got ip/cp/kup after polling");
+        ses->polling = 0;
+        if (!ctx->disableConfirm &&
+            !CMP_PKIMESSAGE_check_implicitConfirm(ses->rep)) {
+            if ((msg = certreqs_certConf(ctx, &ses->crs)) == NULL)
+                return 0;
+            ses_set_req(ses, msg, "certConf",
+                        V_CMP_PKIBODY_PKICONF, CMP_R_PKICONF_NOT_RECEIVED);
+            return 1;
+        }
+        break;
+    }
+
+    if ((st = certreqs_rejected(&ses->crs)) != NULL) {
+        cert_not_accepted(CMP_F_SES_HANDLE_RESPONSE, st);
+        return 0;
+    }
+    ses->state = SES_STATE_DONE;
+    return 1;
+}
+
+/*
+ * Starts a resumable IR, CR, KUR, or P10CR transaction, according to req_type
+ * being V_CMP_PKIBODY_IR, V_CMP_PKIBODY_CR, V_CMP_PKIBODY_KUR, or
+ * V_CMP_PKIBODY_P10CR, with the same options and results as the corresponding
+ * CMP_exec_XXX_ses() function. The transaction is driven by CMP_SES_step().
+ * With CMP_CTX_OPT_ASYNC, creating the request is left to CMP_SES_step().
+ * returns pointer to the new transaction state, or NULL on error
+ */
+CMP_SES *CMP_SES_start(CMP_CTX *ctx, int req_type)
+{
+    CMP_SES *ses = NULL;
+
+    if (ctx == NULL) {
+        CMPerr(CMP_F_CMP_SES_START, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    if ((ses = OPENSSL_zalloc(sizeof(*ses))) == NULL) {
+        CMPerr(CMP_F_CMP_SES_START, CMP_R_OUT_OF_MEMORY);
+        goto err;
+    }
+    ses->ctx = ctx;
+    ses->req_type = req_type;
+    switch (req_type) {
+    case V_CMP_PKIBODY_IR:
+        ses->type_string = "ir";
+        ses->req_err = CMP_R_ERROR_CREATING_IR;
+        ses->rep_type = V_CMP_PKIBODY_IP;
+        ses->rep_err = CMP_R_IP_NOT_RECEIVED;
+        break;
+    case V_CMP_PKIBODY_CR:
+        ses->type_string = "cr";
+        ses->req_err = CMP_R_ERROR_CREATING_CR;
+        ses->rep_type = V_CMP_PKIBODY_CP;
+        ses->rep_err = CMP_R_CP_NOT_RECEIVED;
+        break;
+    case V_CMP_PKIBODY_KUR:
+        ses->type_string = "kur";
+        ses->req_err = CMP_R_ERROR_CREATING_KUR;
+        ses->rep_type = V_CMP_PKIBODY_KUP;
+        ses->rep_err = CMP_R_KUP_NOT_RECEIVED;
+        break;
+    case V_CMP_PKIBODY_P10CR:
+        ses->type_string = "p10cr";
+        ses->req_err = CMP_R_ERROR_CREATING_P10CR;
+        ses->rep_type = V_CMP_PKIBODY_CP;
+        ses->rep_err = CMP_R_CP_NOT_RECEIVED;
+        break;
+    default:
+        CMPerr(CMP_F_CMP_SES_START, CMP_R_INVALID_ARGS);
+        goto err;
+    }
+
+    ctx->end_time = time(NULL) + ctx->totaltimeout;
+    ctx->lastPKIStatus = -1;
+
+    if (ctx->async)
+        ses->state = SES_STATE_CREATE;
+    else if (!ses_create(ses))
+        goto err;
+    return ses;
+
+ err:
+    if (ses != NULL)
+        certreqs_free(&ses->crs);
+    OPENSSL_free(ses);
+    /* print out OpenSSL and CMP errors via the log callback or CMP_puts */
+    ERR_print_errors_cb(CMP_CTX_error_cb, (void *)ctx);
+    return NULL;
+}
+
+/*
+ * internal function
+ *
+ * puts the transaction into the error state and reports the errors
+ * returns CMP_SES_ERROR
+ */
+static int ses_fail(CMP_SES *ses)
+{
+    ses->state = SES_STATE_ERROR;
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    (void)CMP_HTTP_NBIO_cleanup(ses->ctx, &ses->io, 1);
+#endif
+    /* print out OpenSSL and CMP errors via the log callback or CMP_puts */
+    ERR_print_errors_cb(CMP_CTX_error_cb, (void *)ses->ctx);
+    return CMP_SES_ERROR;
+}
+
+/*
+ * internal function
+ *
+ * performs as much of the transaction as possible without blocking,
+ * returning the same values as CMP_SES_step() except CMP_SES_WANT_ASYNC
+ */
+static int ses_run(CMP_SES *ses)
+{
+    int rv;
+
+    for (;;) {
+        if (ses->aborted)
+            return CMP_SES_ERROR;
+        switch (ses->state) {
+        case SES_STATE_CREATE:
+            if (!ses_create(ses))
+                goto err;
+            break;
+        case SES_STATE_SEND:
+            if (!ses_send(ses))
+                goto err;
+            break;
+        case SES_STATE_EXCHANGE:
+            if ((rv = ses_exchange(ses)) == CMP_SES_ERROR)
+                goto err;
+            if (rv != CMP_SES_DONE)
+                return rv;
+            if (!ses_handle_response(ses))
+                goto err;
+            break;
+        case SES_STATE_POLL_WAIT:
+            if (ses->deadline != 0 && time(NULL) < ses->deadline)
+                return CMP_SES_WANT_TIMER;
+            ses_set_req(ses, certreqs_pollReq(ses->ctx, &ses->crs), "pollReq",
+                        V_CMP_PKIBODY_POLLREP, CMP_R_POLLREP_NOT_RECEIVED);
+            if (ses->req == NULL)
+                goto err;
+            break;
+        case SES_STATE_DONE:
+            return CMP_SES_DONE;
+        default:
+            return CMP_SES_ERROR;
+        }
+    }
+
+ err:
+    if (ses->polling) {
+        CMPerr(CMP_F_SES_RUN, ses->rep_err);
+        ERR_add_error_data(1, "received 'waiting' pkistatus but polling failed");
+    }
+    return ses_fail(ses);
+}
+
+static int ses_run_job(void *arg)
+{
+    return ses_run(*(CMP_SES **)arg);
+}
+
+/*
+ * Performs as much of the transaction as possible without blocking.
+ * With CMP_CTX_OPT_ASYNC, this is done within an ASYNC_JOB such that creating
+ * the messages and their protection, e.g., by an engine, may pause it.
+ * returns CMP_SES_DONE on success, where the new certificate is available via
+ * CMP_CTX_get0_newClCert() and all new ones via CMP_CTX_newClCerts_get1(),
+ * CMP_SES_ERROR on error, or CMP_SES_WANT_READ,
+ * CMP_SES_WANT_WRITE, CMP_SES_WANT_TIMER, or CMP_SES_WANT_ASYNC if the
+ * transaction is to be continued by calling CMP_SES_step() again when the
+ * file descriptor given by CMP_SES_get_fd() is ready for reading or writing,
+ * or when the time given by CMP_SES_get_deadline() has been reached,
+ * or when the paused crypto operation can be continued, respectively.
+ */
+int CMP_SES_step(CMP_SES *ses)
+{
+    int rv;
+
+    if (ses == NULL) {
+        CMPerr(CMP_F_CMP_SES_STEP, CMP_R_NULL_ARGUMENT);
+        return CMP_SES_ERROR;
+    }
+    if (ses->sched != NULL)
+        sched_unlink(ses);
+    if (ses->job == NULL && !ses->ctx->async)
+        return ses_run(ses);
+
+    if (ses->waitctx == NULL && (ses->waitctx = ASYNC_WAIT_CTX_new()) == NULL) {
+        CMPerr(CMP_F_CMP_SES_STEP, CMP_R_OUT_OF_MEMORY);
+        return ses_fail(ses);
+    }
+    switch (ASYNC_start_job(&ses->job, ses->waitctx, &rv,
+                            ses_run_job, &ses, sizeof(ses))) {
+    case ASYNC_FINISH:
+        return rv;
+    case ASYNC_PAUSE:
+        return CMP_SES_WANT_ASYNC;
+    default: /* ASYNC_ERR or ASYNC_NO_JOBS */
+        CMPerr(CMP_F_CMP_SES_STEP, CMP_R_ASYNC_JOB_FAILED);
+        return ses_fail(ses);
+    }
+}
+
+/*
+ * returns the socket to wait on after CMP_SES_step() returned
+ * CMP_SES_WANT_READ or CMP_SES_WANT_WRITE, or the file descriptor signaling
+ * that the paused job can be continued after CMP_SES_WANT_ASYNC, if the
+ * engine provides a single one, else -1
+ */
+int CMP_SES_get_fd(const CMP_SES *ses)
+{
+    int fd = -1;
+
+#ifndef OPENSSL_SYS_WINDOWS
+    if (ses != NULL && ses->job != NULL) {
+        OSSL_ASYNC_FD afd;
+        size_t numfds = 0;
+
+        if (ASYNC_WAIT_CTX_get_all_fds(ses->waitctx, NULL, &numfds)
+                && numfds == 1
+                && ASYNC_WAIT_CTX_get_all_fds(ses->waitctx, &afd, &numfds))
+            fd = afd;
+        return fd;
+    }
+#endif
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    if (ses != NULL && ses->state == SES_STATE_EXCHANGE &&
+        ses->io.hbio != NULL && BIO_get_fd(ses->io.hbio, &fd) <= 0)
+        fd = -1;
+#endif
+    return fd;
+}
+
+/*
+ * returns the time at which CMP_SES_step() is to be called again after it
+ * returned CMP_SES_WANT_TIMER, or when waiting for I/O the time at which the
+ * message exchange times out, or 0 if there is no such time limit
+ */
+time_t CMP_SES_get_deadline(const CMP_SES *ses)
+{
+    return ses != NULL ? ses->deadline : 0;
+}
+
+#define SES_MAX_ASYNC_FDS 8
+
+/*
+ * internal function
+ *
+ * waits until the engine signals via one of the file descriptors registered in
+ * the wait context of the paused job that the job can be continued, but not
+ * beyond the deadline of the exchange. Returns at once if the engine does not
+ * provide such file descriptors.
+ */
+static void ses_wait_async(const CMP_SES *ses)
+{
+    OSSL_ASYNC_FD fds[SES_MAX_ASYNC_FDS];
+    size_t numfds = 0;
+    long timeout = -1; /* in milliseconds, -1 meaning no limit */
+#ifdef OPENSSL_SYS_UNIX
+    struct pollfd pfds[SES_MAX_ASYNC_FDS];
+    size_t i;
+#endif
+
+    if (!ASYNC_WAIT_CTX_get_all_fds(ses->waitctx, NULL, &numfds)
+            || numfds == 0 || numfds > SES_MAX_ASYNC_FDS
+            || !ASYNC_WAIT_CTX_get_all_fds(ses->waitctx, fds, &numfds))
+        return;
+    if (ses->deadline != 0) {
+        time_t now = time(NULL);
+
+        timeout = now < ses->deadline ? (long)(ses->deadline - now) * 1000 : 0;
+    }
+#if defined(OPENSSL_SYS_UNIX)
+    for (i = 0; i < numfds; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    (void)poll(pfds, (nfds_t)numfds, (int)timeout);
+#elif defined(_WIN32)
+    (void)WaitForMultipleObjects((DWORD)numfds, fds, FALSE,
+                                 timeout < 0 ? INFINITE : (DWORD)timeout);
+#endif
+}
+
+/*
+ * frees the given transaction state, aborting the transaction if not finished.
+ * If CMP_SES_step() has returned CMP_SES_WANT_ASYNC, this blocks until the
+ * engine has finished the pending operation.
+ */
+void CMP_SES_free(CMP_SES *ses)
+{
+    int rv;
+
+    if (ses == NULL)
+        return;
+    /* a paused job cannot be discarded, so let it finish without continuing */
+    ses->aborted = 1;
+    if (ses->sched != NULL)
+        sched_unlink(ses);
+    while (ses->job != NULL) {
+        if (ASYNC_start_job(&ses->job, ses->waitctx, &rv,
+                            ses_run_job, &ses, sizeof(ses)) != ASYNC_PAUSE)
+            break;
+        ses_wait_async(ses);
+    }
+    /*
+     * On ASYNC_FINISH and ASYNC_ERR the job has been released. It is kept
+     * only if this thread cannot get an async context, in which case
+     * there is no way to release it, so just drop the reference.
+     */
+    ses->job = NULL;
+    ASYNC_WAIT_CTX_free(ses->waitctx);
+#if !defined(OPENSSL_NO_OCSP) && !defined(OPENSSL_NO_SOCK)
+    (void)CMP_HTTP_NBIO_cleanup(ses->ctx, &ses->io, 1);
+#endif
+    certreqs_free(&ses->crs);
+    CMP_PKIMESSAGE_free(ses->req);
+    CMP_PKIMESSAGE_free(ses->rep);
+    OPENSSL_free(ses);
+}
+
+/*
+ * creates a scheduler for transactions waiting for the checkAfter time given
+ * in a pollRep, such that a single thread can drive polling for many of them
+ * returns pointer to the new scheduler, or NULL on error
+ */
+CMP_SES_SCHED *CMP_SES_SCHED_new(void)
+{
+    CMP_SES_SCHED *sched;
+
+    if ((sched = OPENSSL_zalloc(sizeof(*sched))) == NULL) {
+        CMPerr(CMP_F_CMP_SES_SCHED_NEW, CMP_R_OUT_OF_MEMORY);
+        return NULL;
+    }
+    sched->next = time(NULL);
+    return sched;
+}
+
+/*
+ * adds a transaction for which CMP_SES_step() returned CMP_SES_WANT_TIMER,
+ * to be continued by CMP_SES_SCHED_run() when CMP_SES_get_deadline() has been
+ * reached. The given arg is passed to the callback of CMP_SES_SCHED_run().
+ * returns 1 on success, 0 on error
+ */
+int CMP_SES_SCHED_add(CMP_SES_SCHED *sched, CMP_SES *ses, void *arg)
+{
+    CMP_SES **slot;
+    time_t due;
+
+    if (sched == NULL || ses == NULL) {
+        CMPerr(CMP_F_CMP_SES_SCHED_ADD, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+    if (ses->state != SES_STATE_POLL_WAIT || ses->sched != NULL) {
+        CMPerr(CMP_F_CMP_SES_SCHED_ADD, CMP_R_INVALID_ARGS);
+        return 0;
+    }
+    /* a deadline that has already passed is handled by the next run */
+    due = ses->deadline < sched->next ? sched->next : ses->deadline;
+    slot = &SCHED_SLOT(sched, due);
+    ses->sched = sched;
+    ses->sched_due = due;
+    ses->sched_arg = arg;
+    ses->sched_prev = NULL;
+    ses->sched_next = *slot;
+    if (*slot != NULL)
+        (*slot)->sched_prev = ses;
+    *slot = ses;
+    sched->num++;
+    return 1;
+}
+
+/*
+ * removes the given transaction from the scheduler without continuing it
+ * returns 1 on success, 0 on error
+ */
+int CMP_SES_SCHED_remove(CMP_SES_SCHED *sched, CMP_SES *ses)
+{
+    if (sched == NULL || ses == NULL) {
+        CMPerr(CMP_F_CMP_SES_SCHED_REMOVE, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+    if (ses->sched != sched) {
+        CMPerr(CMP_F_CMP_SES_SCHED_REMOVE, CMP_R_INVALID_ARGS);
+        return 0;
+    }
+    sched_unlink(ses);
+    return 1;
+}
+
+/*
+ * returns the number of transactions waiting in the scheduler, or -1 on error
+ */
+int CMP_SES_SCHED_num(const CMP_SES_SCHED *sched)
+{
+    return sched != NULL ? sched->num : -1;
+}
+
+/*
+ * returns the earliest time at which CMP_SES_SCHED_run() has transactions to
+ * continue, or 0 if there are none
+ */
+time_t CMP_SES_SCHED_next_deadline(const CMP_SES_SCHED *sched)
+{
+    const CMP_SES *ses;
+    time_t t, min = 0;
+
+    if (sched == NULL || sched->num == 0)
+        return 0;
+    /* all due times are >= sched->next, so the first exact match is minimal */
+    for (t = sched->next; t < sched->next + SCHED_SLOTS; t++) {
+        for (ses = SCHED_SLOT(sched, t); ses != NULL; ses = ses->sched_next) {
+            if (ses->sched_due == t)
+                return t;
+            if (min == 0 || ses->sched_due < min)
+                min = ses->sched_due;
+        }
+    }
+    return min; /* all are due later than one turn of the wheel */
+}
+
+/*
+ * continues all transactions whose deadline has been reached by calling
+ * CMP_SES_step(), which sends the pollReq for all their pending certificate
+ * requests. Transactions that are to wait for a further checkAfter time stay
+ * in the scheduler. For all others, cb (if not NULL) is called with the result
+ * of CMP_SES_step() and the arg given to CMP_SES_SCHED_add(); the callback
+ * may free the given transaction, but no other one held by the scheduler.
+ * returns the number of transactions continued, or -1 on error
+ */
+int CMP_SES_SCHED_run(CMP_SES_SCHED *sched, cmp_ses_sched_cb_t cb)
+{
+    CMP_SES *due = NULL, **tail = &due, *ses, *next;
+    time_t now = time(NULL), t, last;
+    int rv, n = 0;
+
+    if (sched == NULL) {
+        CMPerr(CMP_F_CMP_SES_SCHED_RUN, CMP_R_NULL_ARGUMENT);
+        return -1;
+    }
+    if (now < sched->next)
+        return 0;
+
+    /* collect the due transactions first since stepping may add them again */
+    last = now - sched->next >= SCHED_SLOTS ? sched->next + SCHED_SLOTS - 1
+                                             : now;
+    for (t = sched->next; t <= last; t++) {
+        for (ses = SCHED_SLOT(sched, t); ses != NULL; ses = next) {
+            next = ses->sched_next;
+            if (ses->sched_due <= now) {
+                sched_unlink(ses);
+                *tail = ses;
+                tail = &ses->sched_next;
+            }
+        }
+    }
+    sched->next = now + 1;
+
+    for (ses = due; ses != NULL; ses = next) {
+        next = ses->sched_next;
+        ses->sched_next = NULL;
+        n++;
+        if ((rv = CMP_SES_step(ses)) == CMP_SES_WANT_TIMER &&
+            CMP_SES_SCHED_add(sched, ses, ses->sched_arg))
+            continue;
+        if (cb != NULL)
+            cb(ses, rv, ses->sched_arg);
+    }
+    return n;
+}
+
+/*
+ * frees the scheduler; the transactions still waiting in it are not freed
+ */
+void CMP_SES_SCHED_free(CMP_SES_SCHED *sched)
+{
+    int i;
+
+    if (sched == NULL)
+        return;
+    for (i = 0; i < SCHED_SLOTS; i++)
+        while (sched->slots[i] != NULL)
+            sched_unlink(sched->slots[i]);
+    OPENSSL_free(sched);
+}
@@ -12,19 +12,50 @@
  * Martin Peylo, Miikka Viljanen, David von Oheimb, and Tobias Pankert.
  */
 
+#include "e_os.h"
 #include <openssl/cmp.h>
 #include "cmp_int.h"
 #include "../crmf/crmf_int.h"
 #include <openssl/err.h>
 #include <openssl/asn1.h>
 #include <openssl/asn1t.h>
+#include <openssl/lhash.h>
+#include <openssl/objects.h>
+#include <openssl/rand.h>
+#include "internal/asn1_int.h"
+#include "internal/sockets.h"
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+/*
+ * state of a transaction in progress, looked up by its transactionID.
+ * The CMP_CTX holds the nonces and the recipient as well as the PBM state of
+ * the transaction. It is derived from the template given in the CMP_SRV_CTX.
+ */
+typedef struct cmp_srv_transaction_st {
+    ASN1_OCTET_STRING *transactionID; /* key in srv_ctx->transactions */
+    X509_NAME *sender;          /* sender of the first request, or NULL */
+    ASN1_OCTET_STRING *senderKID; /* its senderKID, or NULL if none */
+    CMP_CTX *ctx;               /* per-transaction server cmp context */
+    CMP_PKIMESSAGE *certReq;    /* ir/cr/p10cr/kur saved in case of polling */
+    STACK_OF(ASN1_INTEGER) *certReqIds; /* ids of the last ir/cr/p10cr/kur */
+    STACK_OF(X509) *certsOut;   /* certs issued, in the order of certReqIds */
+    unsigned int pollCount;     /* Number of polls left before cert response */
+    time_t last_used;           /* time the last message was received */
+    int references;             /* number of users, protected by srv_ctx->lock */
+    int listed;                 /* whether contained in srv_ctx->transactions */
+    CRYPTO_RWLOCK *lock;        /* serializes messages of the transaction */
+} CMP_SRV_TRANSACTION;
+
+DEFINE_LHASH_OF(CMP_SRV_TRANSACTION);
 
 typedef CMP_PKIMESSAGE *(*cmp_srv_process_cb_t)
- (CMP_SRV_CTX *ctx, const CMP_PKIMESSAGE *msg);
+ (CMP_SRV_CTX *ctx, CMP_SRV_TRANSACTION *trans, const CMP_PKIMESSAGE *msg);
 
 /*
- * this structure is used to store the context for the CMP mock server
+ * this structure is used to store the context for the CMP server
  * partly using OpenSSL ASN.1 types in order to ease handling it - such ASN.1
  * entries must be given first, in same order as ASN1_SEQUENCE(CMP_SRV_CTX)
  */
@@ -33,9 +64,7 @@ struct cmp_srv_ctx_st {
     STACK_OF(X509) *chainOut;   /* Cert chain useful to validate certOut */
     STACK_OF(X509) *caPubsOut;  /* caPubs for ip */
     CMP_PKISTATUSINFO *pkiStatusOut; /* PKI Status Info to be returned */
-    CMP_PKIMESSAGE *certReq;    /* ir/cr/p10cr/kur saved in case of polling */
-    int certReqId;              /* id saved in case of polling */
-    CMP_CTX *ctx;               /* client cmp context, partly reused for srv */
+    CMP_CTX *ctx;               /* template for the per-transaction contexts */
     unsigned int pollCount;     /* Number of polls before cert response */
     long checkAfterTime;        /* time to wait for the next poll in seconds */
     int grantImplicitConfirm;   /* Grant implicit confirmation if requested */
@@ -43,7 +72,17 @@ struct cmp_srv_ctx_st {
     int sendUnprotectedErrors;  /* Send error and rejection msgs uprotected */
     int acceptUnprotectedRequests; /* Accept unprotected request messages */
     int acceptRAVerified;       /* Accept ir/cr/kur with POPO RAVerified */
-    int encryptcert;            /* Encrypt certs in cert response message */
+    long transactionTimeout;    /* max idle time of a transaction in seconds */
+    long httpTimeout;           /* max time to wait for HTTP input, 0: none */
+    int encodingCheck;          /* en- and decode every n-th message, 0: off */
+    int encodingCheckCount;     /* number of messages exchanged via mock */
+    LHASH_OF(CMP_SRV_TRANSACTION) *transactions; /* keyed by transactionID */
+    CRYPTO_RWLOCK *lock;        /* protects transactions */
+    time_t last_expiry;         /* time of the last check for idle ones */
+    /* backend callbacks, by default the above *Out values are used */
+    cmp_srv_cert_request_cb_t cert_request_cb;
+    cmp_srv_rr_cb_t rr_cb;
+    void *cb_arg;
     /* callbacks for message processing */
     cmp_srv_process_cb_t process_ir_cb;
     cmp_srv_process_cb_t process_cr_cb;
@@ -61,15 +100,231 @@ ASN1_SEQUENCE(CMP_SRV_CTX) = {
     ASN1_OPT(CMP_SRV_CTX, certOut, X509),
         ASN1_SEQUENCE_OF_OPT(CMP_SRV_CTX, chainOut, X509),
         ASN1_SEQUENCE_OF_OPT(CMP_SRV_CTX, caPubsOut, X509),
-        ASN1_SIMPLE(CMP_SRV_CTX, pkiStatusOut, CMP_PKISTATUSINFO),
-        ASN1_OPT(CMP_SRV_CTX, certReq, CMP_PKIMESSAGE)
+        ASN1_SIMPLE(CMP_SRV_CTX, pkiStatusOut, CMP_PKISTATUSINFO)
 } ASN1_SEQUENCE_END(CMP_SRV_CTX)
 IMPLEMENT_STATIC_ASN1_ALLOC_FUNCTIONS(CMP_SRV_CTX)
 
+static unsigned long transaction_hash(const CMP_SRV_TRANSACTION *trans)
+{
+    const ASN1_OCTET_STRING *tid = trans->transactionID;
+    unsigned long hash = 0;
+    int i;
+
+    for (i = 0; i < tid->length; i++)
+        hash = (hash << 5) + hash + tid->data[i];
+    return hash;
+}
+
+static int transaction_cmp(const CMP_SRV_TRANSACTION *a,
+                           const CMP_SRV_TRANSACTION *b)
+{
+    return ASN1_OCTET_STRING_cmp(a->transactionID, b->transactionID);
+}
+
+static void transaction_free(CMP_SRV_TRANSACTION *trans)
+{
+    if (trans == NULL)
+        return;
+    ASN1_OCTET_STRING_free(trans->transactionID);
+    X509_NAME_free(trans->sender);
+    ASN1_OCTET_STRING_free(trans->senderKID);
+    CMP_CTX_delete(trans->ctx);
+    CMP_PKIMESSAGE_free(trans->certReq);
+    sk_ASN1_INTEGER_pop_free(trans->certReqIds, ASN1_INTEGER_free);
+    sk_X509_pop_free(trans->certsOut, X509_free);
+    CRYPTO_THREAD_lock_free(trans->lock);
+    OPENSSL_free(trans);
+}
+
+/*
+ * internal function
+ *
+ * creates the state for a new transaction with the given transactionID,
+ * which may be NULL in case the request does not contain one
+ * returns pointer to the new transaction on success, NULL on error
+ */
+static CMP_SRV_TRANSACTION *transaction_new(const CMP_SRV_CTX *srv_ctx,
+                                            const ASN1_OCTET_STRING *tid)
+{
+    CMP_SRV_TRANSACTION *trans = OPENSSL_zalloc(sizeof(*trans));
+
+    if (trans == NULL ||
+        (tid != NULL && (trans->transactionID = ASN1_OCTET_STRING_dup(tid))
+         == NULL) ||
+        (trans->ctx = CMP_CTX_derive(srv_ctx->ctx)) == NULL ||
+        (trans->lock = CRYPTO_THREAD_lock_new()) == NULL) {
+        CMPerr(CMP_F_TRANSACTION_NEW, CMP_R_OUT_OF_MEMORY);
+        transaction_free(trans);
+        return NULL;
+    }
+    trans->pollCount = srv_ctx->pollCount;
+    return trans;
+}
+
+typedef struct transaction_expiry_st {
+    LHASH_OF(CMP_SRV_TRANSACTION) *transactions;
+    time_t expiry;
+} TRANSACTION_EXPIRY;
+
+static void transaction_expire(CMP_SRV_TRANSACTION *trans,
+                               TRANSACTION_EXPIRY *arg)
+{
+    if (trans->references == 0 && trans->last_used < arg->expiry) {
+        (void)lh_CMP_SRV_TRANSACTION_delete(arg->transactions, trans);
+        transaction_free(trans);
+    }
+}
+
+IMPLEMENT_LHASH_DOALL_ARG(CMP_SRV_TRANSACTION, TRANSACTION_EXPIRY);
+
+/*
+ * internal function
+ *
+ * removes transactions that did not see any message for longer than the
+ * transaction timeout plus the time clients are told to wait when polling.
+ * The caller must hold srv_ctx->lock for writing.
+ */
+static void transactions_expire(CMP_SRV_CTX *srv_ctx, time_t now)
+{
+    TRANSACTION_EXPIRY arg;
+    unsigned long down_load;
+
+    if (srv_ctx->transactionTimeout <= 0 || now == srv_ctx->last_expiry)
+        return;
+    srv_ctx->last_expiry = now;
+    arg.transactions = srv_ctx->transactions;
+    arg.expiry = now - srv_ctx->transactionTimeout - srv_ctx->checkAfterTime;
+    down_load = lh_CMP_SRV_TRANSACTION_get_down_load(srv_ctx->transactions);
+    lh_CMP_SRV_TRANSACTION_set_down_load(srv_ctx->transactions, 0);
+    lh_CMP_SRV_TRANSACTION_doall_TRANSACTION_EXPIRY(srv_ctx->transactions,
+                                                    transaction_expire, &arg);
+    lh_CMP_SRV_TRANSACTION_set_down_load(srv_ctx->transactions, down_load);
+}
+
+/*
+ * internal function
+ *
+ * drops a reference to the transaction, removing it from the list if it has
+ * been finished and freeing it if it is no more used and no more listed.
+ * In the unlikely event of a locking failure the transaction is kept.
+ */
+static void transaction_unref(CMP_SRV_CTX *srv_ctx,
+                              CMP_SRV_TRANSACTION *trans, int finished)
+{
+    if (!CRYPTO_THREAD_write_lock(srv_ctx->lock))
+        return;
+    if (finished && trans->listed) {
+        (void)lh_CMP_SRV_TRANSACTION_delete(srv_ctx->transactions, trans);
+        trans->listed = 0;
+    }
+    if (--trans->references == 0 && !trans->listed)
+        transaction_free(trans);
+    CRYPTO_THREAD_unlock(srv_ctx->lock);
+}
+
+/*
+ * internal function
+ *
+ * looks up the transaction the request belongs to by its transactionID,
+ * creating the transaction state if there is none yet, and locks it
+ * such that messages of different transactions can be processed in parallel
+ * returns pointer to the locked transaction on success, NULL on error
+ */
+static CMP_SRV_TRANSACTION *transaction_acquire(CMP_SRV_CTX *srv_ctx,
+                                                const CMP_PKIMESSAGE *req)
+{
+    CMP_SRV_TRANSACTION key, *trans = NULL;
+    const ASN1_OCTET_STRING *tid = req->header.transactionID;
+    time_t now = time(NULL);
+
+    if (!CRYPTO_THREAD_write_lock(srv_ctx->lock))
+        return NULL;
+    transactions_expire(srv_ctx, now);
+    if (tid != NULL) {
+        key.transactionID = (ASN1_OCTET_STRING *)tid;
+        trans = lh_CMP_SRV_TRANSACTION_retrieve(srv_ctx->transactions, &key);
+    }
+    if (trans == NULL) {
+        if ((trans = transaction_new(srv_ctx, tid)) == NULL)
+            goto err;
+        if (tid != NULL) {
+            (void)lh_CMP_SRV_TRANSACTION_insert(srv_ctx->transactions, trans);
+            if (lh_CMP_SRV_TRANSACTION_error(srv_ctx->transactions)) {
+                CMPerr(CMP_F_TRANSACTION_ACQUIRE, CMP_R_OUT_OF_MEMORY);
+                transaction_free(trans);
+                trans = NULL;
+                goto err;
+            }
+            trans->listed = 1;
+        }
+    }
+    trans->references++;
+    trans->last_used = now;
+ err:
+    CRYPTO_THREAD_unlock(srv_ctx->lock);
+    if (trans != NULL && !CRYPTO_THREAD_write_lock(trans->lock)) {
+        transaction_unref(srv_ctx, trans, 0);
+        trans = NULL;
+    }
+    return trans;
+}
+
+/*
+ * internal function
+ *
+ * unlocks the transaction and removes it if it has been finished
+ */
+static void transaction_release(CMP_SRV_CTX *srv_ctx,
+                                CMP_SRV_TRANSACTION *trans, int finished)
+{
+    CRYPTO_THREAD_unlock(trans->lock);
+    transaction_unref(srv_ctx, trans, finished);
+}
+
+/*
+ * internal function
+ *
+ * binds the transaction to the sender of its first request, such that no other
+ * client can inject further messages like certConf or pollReq into it.
+ * The protection of req must have been validated before.
+ * returns 1 if req is from the sender the transaction is bound to, else 0
+ */
+static int transaction_check_sender(CMP_SRV_TRANSACTION *trans,
+                                    const CMP_PKIMESSAGE *req)
+{
+    X509_NAME *sender = req->header.sender->d.directoryName;
+    const ASN1_OCTET_STRING *kid = req->header.senderKID;
+
+    if (trans->sender == NULL) {
+        if ((trans->sender = X509_NAME_dup(sender)) == NULL ||
+            (kid != NULL &&
+             (trans->senderKID = ASN1_OCTET_STRING_dup(kid)) == NULL)) {
+            CMPerr(CMP_F_TRANSACTION_CHECK_SENDER, CMP_R_OUT_OF_MEMORY);
+            X509_NAME_free(trans->sender);
+            trans->sender = NULL;
+            return 0;
+        }
+        return 1;
+    }
+    if (X509_NAME_cmp(trans->sender, sender) != 0 ||
+        (trans->senderKID == NULL ? kid != NULL
+         : kid == NULL || ASN1_OCTET_STRING_cmp(trans->senderKID, kid) != 0)) {
+        CMPerr(CMP_F_TRANSACTION_CHECK_SENDER, CMP_R_UNEXPECTED_SENDER);
+        CMP_add_error_data("sender differs from the one of the transaction");
+        return 0;
+    }
+    return 1;
+}
+
 void CMP_SRV_CTX_delete(CMP_SRV_CTX *srv_ctx)
 {
     if (srv_ctx == NULL)
         return;
+    if (srv_ctx->transactions != NULL) {
+        lh_CMP_SRV_TRANSACTION_doall(srv_ctx->transactions, transaction_free);
+        lh_CMP_SRV_TRANSACTION_free(srv_ctx->transactions);
+    }
+    CRYPTO_THREAD_lock_free(srv_ctx->lock);
     CMP_CTX_delete(srv_ctx->ctx);
     srv_ctx->ctx = NULL;
     CMP_SRV_CTX_free(srv_ctx);
@@ -177,6 +432,88 @@ int CMP_SRV_CTX_set_accept_raverified(CMP_SRV_CTX *srv_ctx, int raverified)
     return 1;
 }
 
+int CMP_SRV_CTX_set_transaction_timeout(CMP_SRV_CTX *srv_ctx, long seconds)
+{
+    if (srv_ctx == NULL || seconds < 0)
+        return 0;
+    srv_ctx->transactionTimeout = seconds;
+    return 1;
+}
+
+/*
+ * Sets the maximum number of seconds CMP_SRV_http_serve() waits for input
+ * from the client, 0 meaning no timeout.
+ * returns 1 on success, 0 on error
+ */
+int CMP_SRV_CTX_set_http_timeout(CMP_SRV_CTX *srv_ctx, long seconds)
+{
+    if (srv_ctx == NULL || seconds < 0)
+        return 0;
+    srv_ctx->httpTimeout = seconds;
+    return 1;
+}
+
+/*
+ * Sets how often CMP_mock_server_perform() checks the ASN.1 encoding of the
+ * messages exchanged by encoding and decoding them: 1 means for each message,
+ * n > 1 means for every n-th request/response pair, and 0 means never, such
+ * that the message structures are passed on without any copying.
+ * returns 1 on success, 0 on error
+ */
+int CMP_SRV_CTX_set_encoding_check(CMP_SRV_CTX *srv_ctx, int interval)
+{
+    if (srv_ctx == NULL || interval < 0)
+        return 0;
+    srv_ctx->encodingCheck = interval;
+    return 1;
+}
+
+/*
+ * returns the number of transactions in progress, or -1 on error
+ */
+int CMP_SRV_CTX_num_transactions(CMP_SRV_CTX *srv_ctx)
+{
+    int num;
+
+    if (srv_ctx == NULL || !CRYPTO_THREAD_read_lock(srv_ctx->lock))
+        return -1;
+    num = (int)lh_CMP_SRV_TRANSACTION_num_items(srv_ctx->transactions);
+    CRYPTO_THREAD_unlock(srv_ctx->lock);
+    return num;
+}
+
+int CMP_SRV_CTX_set_cert_request_cb(CMP_SRV_CTX *srv_ctx,
+                                    cmp_srv_cert_request_cb_t cb)
+{
+    if (srv_ctx == NULL)
+        return 0;
+    srv_ctx->cert_request_cb = cb;
+    return 1;
+}
+
+int CMP_SRV_CTX_set_rr_cb(CMP_SRV_CTX *srv_ctx, cmp_srv_rr_cb_t cb)
+{
+    if (srv_ctx == NULL)
+        return 0;
+    srv_ctx->rr_cb = cb;
+    return 1;
+}
+
+int CMP_SRV_CTX_set_cb_arg(CMP_SRV_CTX *srv_ctx, void *arg)
+{
+    if (srv_ctx == NULL)
+        return 0;
+    srv_ctx->cb_arg = arg;
+    return 1;
+}
+
+void *CMP_SRV_CTX_get_cb_arg(const CMP_SRV_CTX *srv_ctx)
+{
+    if (srv_ctx == NULL)
+        return NULL;
+    return srv_ctx->cb_arg;
+}
+
 /*
  * Creates a pkiconf message.
  */
@@ -196,31 +533,36 @@ static CMP_PKIMESSAGE *CMP_pkiconf_new(CMP_CTX *ctx)
 
 /* TODO start: later move these _new functions to cmp_msg.c */
 /*
- * Creates a revocation response message to a given revocation request.
- * Only handles the first given request. Consumes certId.
+ * Creates a revocation response message with the given PKIStatusInfo and
+ * CertId for each of the certificates requested to be revoked, in the same
+ * order. Consumes sis and certIds.
  */
-static CMP_PKIMESSAGE *CMP_rp_new(CMP_CTX *ctx, CMP_PKISTATUSINFO *si,
-                                  CRMF_CERTID *certId, int unprotectedErrors)
+static CMP_PKIMESSAGE *CMP_rp_new(CMP_CTX *ctx,
+                                  STACK_OF(CMP_PKISTATUSINFO) *sis,
+                                  STACK_OF(CRMF_CERTID) *certIds,
+                                  int unprotectedErrors)
 {
     CMP_REVREPCONTENT *rep = NULL;
-    CMP_PKISTATUSINFO *si1 = NULL;
     CMP_PKIMESSAGE *msg = NULL;
+    int i, rejected = 0;
 
     if ((msg = CMP_PKIMESSAGE_create(ctx, V_CMP_PKIBODY_RP)) == NULL)
         goto oom;
     rep = msg->body->value.rp;
 
-    if ((si1 = CMP_PKISTATUSINFO_dup(si)) == NULL)
-        goto oom;
-    sk_CMP_PKISTATUSINFO_push(rep->status, si1);
-
-    if ((rep->certId = sk_CRMF_CERTID_new_null()) == NULL)
-        goto oom;
-    sk_CRMF_CERTID_push(rep->certId, certId);
-    certId = NULL;
-
-    if (!(unprotectedErrors &&
-          CMP_PKISTATUSINFO_PKIStatus_get(si) == CMP_PKISTATUS_rejection) &&
+    for (i = 0; i < sk_CMP_PKISTATUSINFO_num(sis); i++)
+        if (CMP_PKISTATUSINFO_PKIStatus_get(sk_CMP_PKISTATUSINFO_value(sis, i))
+            == CMP_PKISTATUS_rejection)
+            rejected++;
+    sk_CMP_PKISTATUSINFO_free(rep->status);
+    rep->status = sis;
+    sis = NULL;
+    rep->certId = certIds;
+    certIds = NULL;
+
+    /* only a response rejecting all revocations may be left unprotected */
+    if (!(unprotectedErrors && rejected > 0 &&
+          rejected == sk_CMP_PKISTATUSINFO_num(rep->status)) &&
         !CMP_PKIMESSAGE_protect(ctx, msg))
         goto err;
     return msg;
@@ -229,79 +571,230 @@ static CMP_PKIMESSAGE *CMP_rp_new(CMP_CTX *ctx, CMP_PKISTATUSINFO *si,
     CMPerr(CMP_F_CMP_RP_NEW, CMP_R_OUT_OF_MEMORY);
  err:
     CMPerr(CMP_F_CMP_RP_NEW, CMP_R_ERROR_CREATING_RP);
-    CRMF_CERTID_free(certId);
+    sk_CMP_PKISTATUSINFO_pop_free(sis, CMP_PKISTATUSINFO_free);
+    sk_CRMF_CERTID_pop_free(certIds, CRMF_CERTID_free);
     CMP_PKIMESSAGE_free(msg);
     return NULL;
 }
 
 /*
- * Create certificate response PKIMessage for IP/CP/KUP
+ * internal function
+ *
+ * returns 1 if the given request asks for the certificate to be returned
+ * encrypted, for indirect POP as in RFC 4210 section 5.2.8.2, else 0
+ */
+static int popo_encrcert(const CRMF_CERTREQMSG *req)
+{
+    return req != NULL && req->popo != NULL &&
+        req->popo->type == CRMF_PROOFOFPOSESSION_KEYENCIPHERMENT &&
+        req->popo->value.keyEncipherment->type
+            == CRMF_POPOPRIVKEY_SUBSEQUENTMESSAGE &&
+        ASN1_INTEGER_get(req->popo->value.keyEncipherment->value.
+                         subsequentMessage) == CRMF_SUBSEQUENTMESSAGE_ENCRCERT;
+}
+
+/*
+ * internal function
+ *
+ * returns 1 if a symmetric key can be encrypted for the given public key
+ */
+static int pubkey_can_encrypt(EVP_PKEY *pkey)
+{
+    EVP_PKEY_CTX *pkctx;
+    int ret;
+
+    if (pkey == NULL || (pkctx = EVP_PKEY_CTX_new(pkey, NULL)) == NULL)
+        return 0;
+    (void)ERR_set_mark();
+    ret = EVP_PKEY_encrypt_init(pkctx) > 0;
+    (void)ERR_pop_to_mark();
+    EVP_PKEY_CTX_free(pkctx);
+    return ret;
+}
+
+/*
+ * Encrypts the given certificate for indirect POP (RFC 4210 section 5.2.8.2)
+ * such that it can be decrypted only with the private key it certifies:
+ * its DER encoding is encrypted in place with a fresh AES-256-CBC key,
+ * which is transported encrypted with the public key of the certificate.
+ * returns pointer to CRMF_ENCRYPTEDVALUE on success, NULL on error
+ */
+static CRMF_ENCRYPTEDVALUE *CMP_encCert_new(X509 *cert)
+{
+    const EVP_CIPHER *cipher = EVP_aes_256_cbc();
+    CRMF_ENCRYPTEDVALUE *ev = NULL;
+    EVP_CIPHER_CTX *evp_ctx = NULL;
+    EVP_PKEY_CTX *pkctx = NULL;
+    X509_ALGOR *keyAlg = NULL;
+    unsigned char key[EVP_MAX_KEY_LENGTH], iv[EVP_MAX_IV_LENGTH];
+    unsigned char *buf = NULL, *ek = NULL, *p;
+    size_t eklen = 0;
+    int keylen = EVP_CIPHER_key_length(cipher);
+    int len, outlen, n;
+    int ret = 0;
+
+    if ((len = i2d_X509(cert, NULL)) <= 0 ||
+        (buf = OPENSSL_malloc(len + EVP_CIPHER_block_size(cipher))) == NULL)
+        goto err;
+    p = buf;
+    if (i2d_X509(cert, &p) != len)
+        goto err;
+
+    if (RAND_priv_bytes(key, keylen) <= 0 ||
+        RAND_bytes(iv, EVP_CIPHER_iv_length(cipher)) <= 0)
+        goto err;
+    if ((ev = CRMF_ENCRYPTEDVALUE_new()) == NULL ||
+        (ev->symmAlg = X509_ALGOR_new()) == NULL ||
+        (ev->symmAlg->parameter = ASN1_TYPE_new()) == NULL ||
+        (ev->encSymmKey = ASN1_BIT_STRING_new()) == NULL)
+        goto err;
+
+    /* encrypt the DER encoding in place, which leaves room for the padding */
+    if ((evp_ctx = EVP_CIPHER_CTX_new()) == NULL ||
+        !EVP_EncryptInit_ex(evp_ctx, cipher, NULL, key, iv) ||
+        EVP_CIPHER_param_to_asn1(evp_ctx, ev->symmAlg->parameter) <= 0 ||
+        !EVP_EncryptUpdate(evp_ctx, buf, &outlen, buf, len) ||
+        !EVP_EncryptFinal_ex(evp_ctx, buf + outlen, &n))
+        goto err;
+    ev->symmAlg->algorithm = OBJ_nid2obj(EVP_CIPHER_type(cipher));
+    /* the bit string must keep any trailing zero bits of the cipher text */
+    ev->encValue->flags &= ~(ASN1_STRING_FLAG_BITS_LEFT | 0x07);
+    ev->encValue->flags |= ASN1_STRING_FLAG_BITS_LEFT;
+    ASN1_STRING_set0(ev->encValue, buf, outlen + n);
+    buf = NULL;
+
+    /* encrypt the symmetric key for the key certified */
+    if ((pkctx = EVP_PKEY_CTX_new(X509_get0_pubkey(cert), NULL)) == NULL ||
+        EVP_PKEY_encrypt_init(pkctx) <= 0 ||
+        EVP_PKEY_encrypt(pkctx, NULL, &eklen, key, keylen) <= 0 ||
+        (ek = OPENSSL_malloc(eklen)) == NULL ||
+        EVP_PKEY_encrypt(pkctx, ek, &eklen, key, keylen) <= 0)
+        goto err;
+    ev->encSymmKey->flags &= ~(ASN1_STRING_FLAG_BITS_LEFT | 0x07);
+    ev->encSymmKey->flags |= ASN1_STRING_FLAG_BITS_LEFT;
+    ASN1_STRING_set0(ev->encSymmKey, ek, (int)eklen);
+    ek = NULL;
+    if (!X509_PUBKEY_get0_param(NULL, NULL, NULL, &keyAlg,
+                                X509_get_X509_PUBKEY(cert)) ||
+        (ev->keyAlg = X509_ALGOR_dup(keyAlg)) == NULL)
+        goto err;
+    ret = 1;
+
+ err:
+    if (!ret) {
+        CMPerr(CMP_F_CMP_ENCCERT_NEW, CMP_R_ERROR_ENCRYPTING_CERTIFICATE);
+        CRMF_ENCRYPTEDVALUE_free(ev);
+        ev = NULL;
+    }
+    OPENSSL_cleanse(key, sizeof(key));
+    OPENSSL_free(buf);
+    OPENSSL_free(ek);
+    EVP_CIPHER_CTX_free(evp_ctx);
+    EVP_PKEY_CTX_free(pkctx);
+    return ev;
+}
+
+/*
+ * Create certificate response PKIMessage for IP/CP/KUP with one CertResponse
+ * per given certReqId, using the PKIStatusInfo and the (optional) certificate
+ * at the same position in sis and certs. A certificate is returned encrypted
+ * if the request at the same position in certReq asks for indirect POP.
  * returns a pointer to the PKIMessage on success, NULL on error
  */
 static CMP_PKIMESSAGE *CMP_certrep_new(CMP_CTX *ctx, int bodytype,
-                                       int certReqId, CMP_PKISTATUSINFO *si,
-                                       X509 *cert, STACK_OF(X509) *chain,
-                                       STACK_OF(X509) *caPubs, int encrypted,
-                                       int unprotectedErrors)
+                                   const STACK_OF(ASN1_INTEGER) *certReqIds,
+                                   const STACK_OF(CMP_PKISTATUSINFO) *sis,
+                                   const STACK_OF(X509) *certs,
+                                   STACK_OF(X509) *chain,
+                                   STACK_OF(X509) *caPubs,
+                                   const CMP_PKIMESSAGE *certReq,
+                                   int unprotectedErrors)
 {
     CMP_PKIMESSAGE *msg = NULL;
     CMP_CERTREPMESSAGE *repMsg = NULL;
     CMP_CERTRESPONSE *resp = NULL;
+    CMP_CERTORENCCERT *coec;
+    CMP_PKISTATUSINFO *si;
+    X509 *cert;
     int status = -1;
+    int rejected = 1;
+    int encrypted = 0;
+    int i;
 
-    if (ctx == NULL || si == NULL) {
+    if (ctx == NULL || certReqIds == NULL) {
         CMPerr(CMP_F_CMP_CERTREP_NEW, CMP_R_NULL_ARGUMENT);
         goto err;
     }
+    if (sk_ASN1_INTEGER_num(certReqIds) <= 0 ||
+        sk_CMP_PKISTATUSINFO_num(sis) != sk_ASN1_INTEGER_num(certReqIds) ||
+        sk_X509_num(certs) != sk_ASN1_INTEGER_num(certReqIds)) {
+        CMPerr(CMP_F_CMP_CERTREP_NEW, CMP_R_INVALID_ARGS);
+        goto err;
+    }
 
     if ((msg = CMP_PKIMESSAGE_create(ctx, bodytype)) == NULL)
         goto oom;
     repMsg = msg->body->value.ip; /* value.ip is same for cp and kup */
 
-    /* header */
-    if (ctx->implicitConfirm && !CMP_PKIMESSAGE_set_implicitConfirm(msg))
-        goto oom;
-
     /* body */
-    if ((resp = CMP_CERTRESPONSE_new()) == NULL)
-        goto oom;
-    CMP_PKISTATUSINFO_free(resp->status);
-    if ((resp->status = CMP_PKISTATUSINFO_dup(si)) == NULL ||
-        !ASN1_INTEGER_set(resp->certReqId, certReqId)) {
-        goto oom;
-    }
+    for (i = 0; i < sk_ASN1_INTEGER_num(certReqIds); i++) {
+        si = sk_CMP_PKISTATUSINFO_value(sis, i);
+        cert = sk_X509_value(certs, i);
+        if ((resp = CMP_CERTRESPONSE_new()) == NULL)
+            goto oom;
+        CMP_PKISTATUSINFO_free(resp->status);
+        if ((resp->status = CMP_PKISTATUSINFO_dup(si)) == NULL ||
+            !ASN1_STRING_copy(&resp->certReqId,
+                              sk_ASN1_INTEGER_value(certReqIds, i)))
+            goto oom;
 
-    status = CMP_PKISTATUSINFO_PKIStatus_get(resp->status);
-    if (status != CMP_PKISTATUS_rejection &&
-        status != CMP_PKISTATUS_waiting && cert != NULL) {
-        if (encrypted) {
-            CMPerr(CMP_F_CMP_CERTREP_NEW, CMP_R_INVALID_PARAMETERS);
-            /*TODO implement (not urgent) */
-            goto err;
-        } else {
+        status = CMP_PKISTATUSINFO_PKIStatus_get(resp->status);
+        if (status != CMP_PKISTATUS_rejection)
+            rejected = 0;
+        if (status != CMP_PKISTATUS_rejection &&
+            status != CMP_PKISTATUS_waiting && cert != NULL) {
             if ((resp->certifiedKeyPair = CMP_CERTIFIEDKEYPAIR_new()) == NULL)
                 goto oom;
-            resp->certifiedKeyPair->certOrEncCert->type =
-                CMP_CERTORENCCERT_CERTIFICATE;
-            if (!X509_up_ref(cert))
-                goto err;
-            resp->certifiedKeyPair->certOrEncCert->value.certificate = cert;
+            coec = resp->certifiedKeyPair->certOrEncCert;
+            if (certReq->body->type != V_CMP_PKIBODY_P10CR &&
+                popo_encrcert(sk_CRMF_CERTREQMSG_value(certReq->body->value.cr,
+                                                       i))) {
+                if ((coec->value.encryptedCert = CMP_encCert_new(cert))
+                    == NULL)
+                    goto err;
+                coec->type = CMP_CERTORENCCERT_ENCRYPTEDCERT;
+                encrypted = 1;
+            } else {
+                if (!X509_up_ref(cert))
+                    goto err;
+                coec->type = CMP_CERTORENCCERT_CERTIFICATE;
+                coec->value.certificate = cert;
+            }
         }
+
+        if (!sk_CMP_CERTRESPONSE_push(repMsg->response, resp))
+            goto oom;
+        resp = NULL;
     }
 
-    if (!sk_CMP_CERTRESPONSE_push(repMsg->response, resp))
+    /*
+     * header: implicit confirmation would skip the certConf that gives the
+     * proof of possession of the key for which a certificate was encrypted
+     */
+    if (ctx->implicitConfirm && !encrypted &&
+        !CMP_PKIMESSAGE_set_implicitConfirm(msg))
         goto oom;
-    resp = NULL;
-    /* TODO: here optional 2nd certrep could be pushed to the stack */
 
     if (bodytype == V_CMP_PKIBODY_IP && caPubs &&
         (repMsg->caPubs = X509_chain_up_ref(caPubs)) == NULL)
         goto oom;
-    if (chain && !CMP_sk_X509_add1_certs(msg->extraCerts, chain, 0, 1))
+    if (chain != NULL &&
+        ((msg->extraCerts == NULL &&
+          (msg->extraCerts = sk_X509_new_null()) == NULL) ||
+         !CMP_sk_X509_add1_certs(msg->extraCerts, chain, 0, 1)))
         goto oom;
 
-    if (!(unprotectedErrors &&
-          CMP_PKISTATUSINFO_PKIStatus_get(si) == CMP_PKISTATUS_rejection) &&
+    if (!(unprotectedErrors && rejected) &&
         !CMP_PKIMESSAGE_protect(ctx, msg))
         goto err;
 
@@ -317,26 +810,34 @@ static CMP_PKIMESSAGE *CMP_certrep_new(CMP_CTX *ctx, int bodytype,
 }
 
 /*
- * Creates a new poll response message for the given request id
+ * Creates a new poll response message for the request ids given in pollReq
  * returns a poll response on success and NULL on error
  */
-static CMP_PKIMESSAGE *CMP_pollrep_new(CMP_CTX *ctx, long certReqId,
+static CMP_PKIMESSAGE *CMP_pollrep_new(CMP_CTX *ctx,
+                                       const CMP_POLLREQCONTENT *pollReq,
                                        long pollAfter)
 {
     CMP_PKIMESSAGE *msg;
     CMP_POLLREP *pollRep;
+    int i;
 
-    if (ctx == NULL) {
+    if (ctx == NULL || pollReq == NULL) {
         CMPerr(CMP_F_CMP_POLLREP_NEW, CMP_R_NULL_ARGUMENT);
         return NULL;
     }
     if ((msg = CMP_PKIMESSAGE_create(ctx, V_CMP_PKIBODY_POLLREP)) == NULL)
         goto err;
-    if ((pollRep = CMP_POLLREP_new()) == NULL)
-        goto err;
-    sk_CMP_POLLREP_push(msg->body->value.pollRep, pollRep);
-    ASN1_INTEGER_set(pollRep->certReqId, certReqId);
-    ASN1_INTEGER_set(pollRep->checkAfter, pollAfter);
+    for (i = 0; i < sk_CMP_POLLREQ_num(pollReq); i++) {
+        if ((pollRep = CMP_POLLREP_new()) == NULL)
+            goto err;
+        if (!sk_CMP_POLLREP_push(msg->body->value.pollRep, pollRep)) {
+            CMP_POLLREP_free(pollRep);
+            goto err;
+        }
+        ASN1_INTEGER_set(&pollRep->certReqId, ASN1_INTEGER_get(
+                         &sk_CMP_POLLREQ_value(pollReq, i)->certReqId));
+        ASN1_INTEGER_set(&pollRep->checkAfter, pollAfter);
+    }
 
     if (!CMP_PKIMESSAGE_protect(ctx, msg))
         goto err;
@@ -395,30 +896,106 @@ static int CMP_X509_PUBKEY_cmp(X509_PUBKEY *a, X509_PUBKEY *b)
     return EVP_PKEY_cmp(X509_PUBKEY_get0(a), X509_PUBKEY_get0(b));
 }
 
-static int cmp_verify_popo(CMP_SRV_CTX *srv_ctx, const CMP_PKIMESSAGE *msg)
+/*
+ * state of the POPO check of a single certificate request.
+ * Pointers into the request message are valid as long as the message is.
+ */
+typedef struct cmp_popo_item_st {
+    int result;                 /* 1: accepted, 0: rejected, -1: to verify */
+    int pkey_id;                /* key type, for grouping similar keys */
+    const ASN1_ITEM *it;        /* type of the signed part */
+    void *asn;                  /* signed part, in the request message */
+    X509_ALGOR *alg;            /* signature algorithm, in the message */
+    ASN1_BIT_STRING *sig;       /* signature, in the message */
+    EVP_PKEY *pkey;             /* key to verify with, up-ref'd */
+    X509_REQ *p10cr;            /* PKCS#10 request, verified as a whole */
+    unsigned char *tbs;         /* DER encoding of the signed part */
+    int tbslen;
+} CMP_POPO_ITEM;
+
+struct cmp_popo_batch_st {
+    CMP_SRV_CTX *srv_ctx;       /* gives the policy on RAVerified POPOs */
+    CMP_POPO_ITEM *items;       /* in the order of the requests added */
+    int num;                    /* number of items */
+    int size;                   /* number of items allocated */
+    CMP_POPO_ITEM **order;      /* items to verify, grouped by key type */
+    int num_order;              /* number of items to verify */
+    int next;                   /* position in order of the next to claim */
+    CRYPTO_RWLOCK *lock;
+} /* CMP_POPO_BATCH */ ;
+
+static void popo_item_clear(CMP_POPO_ITEM *item)
 {
+    EVP_PKEY_free(item->pkey);
+    OPENSSL_free(item->tbs);
+    memset(item, 0, sizeof(*item));
+}
 
-    if (srv_ctx == NULL || msg == NULL || msg->body == NULL) {
-        CMPerr(CMP_F_CMP_VERIFY_POPO, CMP_R_NULL_ARGUMENT);
+/*
+ * internal function
+ *
+ * sets up the signature check of the signed part asn of type it,
+ * encoding the signed part once such that it can be verified later
+ * returns 1 on success, 0 on error
+ */
+static int popo_item_set_sig(CMP_POPO_ITEM *item, const ASN1_ITEM *it,
+                             void *asn, X509_ALGOR *alg, ASN1_BIT_STRING *sig,
+                             EVP_PKEY *pkey)
+{
+    if (pkey == NULL || alg == NULL || sig == NULL)
         return 0;
-    }
+    if ((item->tbslen = ASN1_item_i2d(asn, &item->tbs, it)) <= 0 ||
+        !EVP_PKEY_up_ref(pkey))
+        return 0;
+    item->it = it;
+    item->asn = asn;
+    item->alg = alg;
+    item->sig = sig;
+    item->pkey = pkey;
+    item->pkey_id = EVP_PKEY_id(pkey);
+    item->result = -1;
+    return 1;
+}
 
+/*
+ * internal function
+ *
+ * checks the POPO of the certificate request at position idx in msg as far as
+ * possible without verifying any signature. Where a signature is to be
+ * verified, item->result is set to -1, else to the result of the check.
+ * returns 1 on success, 0 if there is no request at position idx
+ */
+static int popo_item_prepare(CMP_SRV_CTX *srv_ctx, const CMP_PKIMESSAGE *msg,
+                             int idx, CMP_POPO_ITEM *item)
+{
+    memset(item, 0, sizeof(*item));
     if (msg->body->type == V_CMP_PKIBODY_P10CR) {
         X509_REQ *req = msg->body->value.p10cr;
-        if (X509_REQ_verify(req, X509_REQ_get0_pubkey(req)) > 0)
-            return 1;
+        EVP_PKEY *pkey = X509_REQ_get0_pubkey(req);
+
+        /* X509_REQ_verify() uses the encoding retained from decoding */
+        if (pkey == NULL || !EVP_PKEY_up_ref(pkey))
+            goto rejected;
+        item->p10cr = req;
+        item->pkey = pkey;
+        item->pkey_id = EVP_PKEY_id(pkey);
+        item->result = -1;
     } else {
         X509_PUBKEY *pubkey = NULL;
         CRMF_POPOSIGNINGKEY *sig = NULL;
         CRMF_CERTREQMSG *req =
-            sk_CRMF_CERTREQMSG_value(msg->body->value.ir, CERTREQID);
+            sk_CRMF_CERTREQMSG_value(msg->body->value.ir, idx);
+
+        if (req == NULL) {
+            CMPerr(CMP_F_POPO_ITEM_PREPARE, CMP_R_CERTREQMSG_NOT_FOUND);
+            return 0;
+        }
         switch (req->popo->type) {
         case CRMF_PROOFOFPOSESSION_RAVERIFIED:
-            if (srv_ctx->acceptRAVerified)
-                return 1;
-            break;
+            item->result = srv_ctx->acceptRAVerified;
+            return 1;
         case CRMF_PROOFOFPOSESSION_SIGNATURE:
-            pubkey = req->certReq->certTemplate->publicKey;
+            pubkey = req->certReq.certTemplate.publicKey;
             sig = req->popo->value.signature;
             if (sig->poposkInput != NULL) {
 /* According to RFC 4211:
@@ -428,61 +1005,324 @@ This MUST be exactly the same value as is contained in the certificate template.
                 if (pubkey == NULL ||
                     sig->poposkInput->publicKey == NULL ||
                     CMP_X509_PUBKEY_cmp(pubkey, sig->poposkInput->publicKey) ||
-                    ASN1_item_verify(ASN1_ITEM_rptr(CRMF_POPOSIGNINGKEYINPUT),
-                                     sig->algorithmIdentifier, sig->signature,
-                                     sig->poposkInput,
-                                     X509_PUBKEY_get0(pubkey)) < 1)
-                    break;
+                    !popo_item_set_sig(item,
+                                       ASN1_ITEM_rptr(CRMF_POPOSIGNINGKEYINPUT),
+                                       sig->poposkInput,
+                                       sig->algorithmIdentifier, sig->signature,
+                                       X509_PUBKEY_get0(pubkey)))
+                    goto rejected;
             } else {
                 if (pubkey == NULL ||
-                    req->certReq->certTemplate->subject == NULL ||
-                    ASN1_item_verify(ASN1_ITEM_rptr(CRMF_CERTREQUEST),
-                                     sig->algorithmIdentifier, sig->signature,
-                                     req->certReq,
-                                     X509_PUBKEY_get0(pubkey)) < 1)
-                    break;
+                    req->certReq.certTemplate.subject == NULL ||
+                    !popo_item_set_sig(item, ASN1_ITEM_rptr(CRMF_CERTREQUEST),
+                                       &req->certReq,
+                                       sig->algorithmIdentifier, sig->signature,
+                                       X509_PUBKEY_get0(pubkey)))
+                    goto rejected;
             }
             return 1;
         case CRMF_PROOFOFPOSESSION_KEYENCIPHERMENT:
-            if (req->popo->value.keyEncipherment->type
-                != CRMF_POPOPRIVKEY_SUBSEQUENTMESSAGE)
+            /*
+             * indirect POP: the certificate is returned encrypted for the
+             * requested key, which the client proves by sending its hash
+             */
+            if (!popo_encrcert(req))
                 goto unsupported;
-            if (ASN1_INTEGER_get
-                (req->popo->value.keyEncipherment->value.subsequentMessage) !=
-                CRMF_SUBSEQUENTMESSAGE_ENCRCERT)
+            pubkey = req->certReq.certTemplate.publicKey;
+            if (!pubkey_can_encrypt(pubkey == NULL ? NULL
+                                    : X509_PUBKEY_get0(pubkey)))
                 goto unsupported;
-#if 0 /* TODO enable code when implemented in CMP_certrep_new() */
-            srv_ctx->encryptcert = 1;
+            item->result = 1;
             return 1;
-#else
-            goto unsupported;
-#endif
         case CRMF_PROOFOFPOSESSION_KEYAGREEMENT:
         default:
  unsupported:
-            CMPerr(CMP_F_CMP_VERIFY_POPO, CMP_R_UNSUPPORTED_POPO_METHOD);
+            CMPerr(CMP_F_POPO_ITEM_PREPARE, CMP_R_UNSUPPORTED_POPO_METHOD);
+            return 1;
+        }
+    }
+    return 1;
+
+ rejected:
+    popo_item_clear(item);
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * verifies the signature of the given item on its encoded signed part,
+ * reusing the given digest context. The outcome is reported via the result
+ * of the item, so any errors queued while verifying are discarded.
+ * returns 1 if the signature is valid, 0 otherwise
+ */
+static int popo_item_verify(EVP_MD_CTX *mctx, const CMP_POPO_ITEM *item)
+{
+    int res;
+
+    (void)ERR_set_mark();
+    if (item->p10cr != NULL)
+        res = X509_REQ_verify(item->p10cr, item->pkey) > 0;
+    else
+        res = asn1_item_verify_tbs(mctx, item->it, item->alg, item->sig,
+                                   item->asn, item->tbs, (size_t)item->tbslen,
+                                   item->pkey) > 0;
+    (void)ERR_pop_to_mark();
+    return res;
+}
+
+/*
+ * Verifies the POPO of the certificate request at position idx in msg
+ * returns 1 on success, 0 on error
+ */
+static int cmp_verify_popo(CMP_SRV_CTX *srv_ctx, const CMP_PKIMESSAGE *msg,
+                           int idx)
+{
+    CMP_POPO_ITEM item;
+    EVP_MD_CTX *mctx = NULL;
+    int res;
+
+    if (srv_ctx == NULL || msg == NULL || msg->body == NULL) {
+        CMPerr(CMP_F_CMP_VERIFY_POPO, CMP_R_NULL_ARGUMENT);
+        return 0;
+    }
+
+    if (!popo_item_prepare(srv_ctx, msg, idx, &item))
+        return 0;
+    if ((res = item.result) < 0) {
+        if ((mctx = EVP_MD_CTX_new()) == NULL) {
+            popo_item_clear(&item);
+            CMPerr(CMP_F_CMP_VERIFY_POPO, CMP_R_OUT_OF_MEMORY);
             return 0;
         }
+        res = popo_item_verify(mctx, &item);
+        EVP_MD_CTX_free(mctx);
+        popo_item_clear(&item);
     }
+    if (res > 0)
+        return 1;
     CMPerr(CMP_F_CMP_VERIFY_POPO, CMP_R_REQUEST_NOT_ACCEPTED);
     return 0;
 }
 
 /*
- * Processes an ir/cr/p10cr/kur and returns a certification response.
- * Only handles the first certification request contained in certReq
+ * creates a batch for verifying the POPOs of many certificate requests,
+ * using the policy of the given server context
+ * returns pointer to the new batch on success, NULL on error
+ */
+CMP_POPO_BATCH *CMP_POPO_BATCH_new(CMP_SRV_CTX *srv_ctx)
+{
+    CMP_POPO_BATCH *batch = NULL;
+
+    if (srv_ctx == NULL) {
+        CMPerr(CMP_F_CMP_POPO_BATCH_NEW, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    if ((batch = OPENSSL_zalloc(sizeof(*batch))) == NULL ||
+        (batch->lock = CRYPTO_THREAD_lock_new()) == NULL) {
+        OPENSSL_free(batch);
+        CMPerr(CMP_F_CMP_POPO_BATCH_NEW, CMP_R_OUT_OF_MEMORY);
+        return NULL;
+    }
+    batch->srv_ctx = srv_ctx;
+    return batch;
+}
+
+/*
+ * adds all certificate requests contained in the given ir, cr, kur, or p10cr
+ * to the batch, doing all checks on them that do not involve a signature and
+ * encoding the signed parts of the others for verification
+ * returns the index of the result for the first request on success, -1 on error
+ */
+int CMP_POPO_BATCH_add(CMP_POPO_BATCH *batch, const CMP_PKIMESSAGE *req)
+{
+    CMP_POPO_ITEM *items;
+    int i, n, first;
+
+    if (batch == NULL || req == NULL || req->body == NULL) {
+        CMPerr(CMP_F_CMP_POPO_BATCH_ADD, CMP_R_NULL_ARGUMENT);
+        return -1;
+    }
+    if (batch->order != NULL) {
+        CMPerr(CMP_F_CMP_POPO_BATCH_ADD, CMP_R_INVALID_ARGS);
+        return -1;
+    }
+    switch (req->body->type) {
+    case V_CMP_PKIBODY_P10CR:
+        n = 1;
+        break;
+    case V_CMP_PKIBODY_IR:
+    case V_CMP_PKIBODY_CR:
+    case V_CMP_PKIBODY_KUR:
+        n = sk_CRMF_CERTREQMSG_num(req->body->value.ir);
+        break;
+    default:
+        CMPerr(CMP_F_CMP_POPO_BATCH_ADD, CMP_R_UNEXPECTED_PKIBODY);
+        return -1;
+    }
+    if (n <= 0) {
+        CMPerr(CMP_F_CMP_POPO_BATCH_ADD, CMP_R_CERTREQMSG_NOT_FOUND);
+        return -1;
+    }
+
+    if (batch->num + n > batch->size) {
+        int size = batch->size == 0 ? 16 : batch->size;
+
+        while (size < batch->num + n)
+            size *= 2;
+        if ((items = OPENSSL_realloc(batch->items,
+                                     size * sizeof(*items))) == NULL) {
+            CMPerr(CMP_F_CMP_POPO_BATCH_ADD, CMP_R_OUT_OF_MEMORY);
+            return -1;
+        }
+        batch->items = items;
+        batch->size = size;
+    }
+
+    first = batch->num;
+    /* unsupported POPO methods just lead to rejection of the request */
+    ERR_set_mark();
+    for (i = 0; i < n; i++)
+        (void)popo_item_prepare(batch->srv_ctx, req, i,
+                                &batch->items[first + i]);
+    ERR_pop_to_mark();
+    batch->num += n;
+    return first;
+}
+
+/*
+ * returns the number of requests added to the batch, or -1 on error
+ */
+int CMP_POPO_BATCH_num(const CMP_POPO_BATCH *batch)
+{
+    return batch == NULL ? -1 : batch->num;
+}
+
+static int popo_order_cmp(const void *a, const void *b)
+{
+    const CMP_POPO_ITEM *ia = *(const CMP_POPO_ITEM *const *)a;
+    const CMP_POPO_ITEM *ib = *(const CMP_POPO_ITEM *const *)b;
+
+    if (ia->pkey_id != ib->pkey_id)
+        return ia->pkey_id < ib->pkey_id ? -1 : 1;
+    return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * internal function
+ *
+ * determines the order in which the signatures are verified, grouping them
+ * by key type such that a thread keeps using the same algorithm.
+ * The caller must hold batch->lock for writing.
+ * returns 1 on success, 0 on error
+ */
+static int popo_batch_order(CMP_POPO_BATCH *batch)
+{
+    int i;
+
+    if (batch->order != NULL)
+        return 1;
+    batch->order = OPENSSL_malloc((batch->num + 1) * sizeof(*batch->order));
+    if (batch->order == NULL)
+        return 0;
+    for (i = 0; i < batch->num; i++)
+        if (batch->items[i].result < 0)
+            batch->order[batch->num_order++] = &batch->items[i];
+    qsort(batch->order, batch->num_order, sizeof(*batch->order),
+          popo_order_cmp);
+    return 1;
+}
+
+/*
+ * verifies the signatures of the requests in the batch that still need to be.
+ * The function may be called by several threads at the same time, which then
+ * share the work. It returns when no more requests are left to be verified,
+ * while other threads may still be busy with the last ones.
+ * returns the number of requests verified by this call, -1 on error
+ */
+int CMP_POPO_BATCH_verify(CMP_POPO_BATCH *batch)
+{
+    EVP_MD_CTX *mctx = NULL;
+    int pos, done = 0;
+
+    if (batch == NULL) {
+        CMPerr(CMP_F_CMP_POPO_BATCH_VERIFY, CMP_R_NULL_ARGUMENT);
+        return -1;
+    }
+    if (!CRYPTO_THREAD_write_lock(batch->lock))
+        goto oom;
+    pos = popo_batch_order(batch);
+    CRYPTO_THREAD_unlock(batch->lock);
+    if (!pos || (mctx = EVP_MD_CTX_new()) == NULL)
+        goto oom;
+
+    while (CRYPTO_atomic_add(&batch->next, 1, &pos, batch->lock) &&
+           pos <= batch->num_order) {
+        CMP_POPO_ITEM *item = batch->order[pos - 1];
+
+        item->result = popo_item_verify(mctx, item);
+        done++;
+    }
+    EVP_MD_CTX_free(mctx);
+    return done;
+
+ oom:
+    CMPerr(CMP_F_CMP_POPO_BATCH_VERIFY, CMP_R_OUT_OF_MEMORY);
+    return -1;
+}
+
+/*
+ * gives the result for the request at position idx in the batch, where the
+ * requests are numbered in the order they have been added
+ * returns 1 if the POPO has been verified, 0 if it has been rejected,
+ * -1 if it has not been verified yet or on error
+ */
+int CMP_POPO_BATCH_get_result(const CMP_POPO_BATCH *batch, int idx)
+{
+    if (batch == NULL || idx < 0 || idx >= batch->num) {
+        CMPerr(CMP_F_CMP_POPO_BATCH_GET_RESULT, CMP_R_INVALID_ARGS);
+        return -1;
+    }
+    return batch->items[idx].result;
+}
+
+/*
+ * frees the batch, but not the request messages added to it
+ */
+void CMP_POPO_BATCH_free(CMP_POPO_BATCH *batch)
+{
+    int i;
+
+    if (batch == NULL)
+        return;
+    for (i = 0; i < batch->num; i++)
+        popo_item_clear(&batch->items[i]);
+    OPENSSL_free(batch->items);
+    OPENSSL_free(batch->order);
+    CRYPTO_THREAD_lock_free(batch->lock);
+    OPENSSL_free(batch);
+}
+
+/*
+ * Processes an ir/cr/p10cr/kur and returns a certification response
+ * containing one CertResponse for each certification request in certReq
  * returns an ip/cp/kup on success and NULL on error
  */
 static CMP_PKIMESSAGE *CMP_process_cert_request(CMP_SRV_CTX *srv_ctx,
+                                                CMP_SRV_TRANSACTION *trans,
                                                 const CMP_PKIMESSAGE *certReq)
 {
     CMP_PKIMESSAGE *msg = NULL;
     CMP_PKISTATUSINFO *si = NULL;
+    STACK_OF(CMP_PKISTATUSINFO) *sis = NULL;
+    ASN1_INTEGER *rid = NULL;
     X509 *certOut = NULL;
     STACK_OF(X509) *chainOut = NULL, *caPubs = NULL;
-    CRMF_CERTREQMSG *certRequestMsg = NULL;
     int bodytype;
-    if (srv_ctx == NULL || certReq == NULL) {
+    int waiting;
+    int i, num;
+
+    if (srv_ctx == NULL || trans == NULL || certReq == NULL) {
         CMPerr(CMP_F_CMP_PROCESS_CERT_REQUEST, CMP_R_INVALID_ARGS);
         return NULL;
     }
@@ -502,129 +1342,261 @@ static CMP_PKIMESSAGE *CMP_process_cert_request(CMP_SRV_CTX *srv_ctx,
         return NULL;
     }
 
-    if (certReq->body->type == V_CMP_PKIBODY_P10CR) {
-        srv_ctx->certReqId = CERTREQID;
-    } else {
-        if ((certRequestMsg =
-             sk_CRMF_CERTREQMSG_value(certReq->body->value.cr, 0)) == NULL) {
-            CMPerr(CMP_F_CMP_PROCESS_CERT_REQUEST, CMP_R_CERTREQMSG_NOT_FOUND);
-            return NULL;
-        }
-        srv_ctx->certReqId =
-            ASN1_INTEGER_get(certRequestMsg->certReq->certReqId);
+    num = certReq->body->type == V_CMP_PKIBODY_P10CR ? 1
+        : sk_CRMF_CERTREQMSG_num(certReq->body->value.cr);
+    if (num <= 0) {
+        CMPerr(CMP_F_CMP_PROCESS_CERT_REQUEST, CMP_R_CERTREQMSG_NOT_FOUND);
+        return NULL;
     }
+    sk_ASN1_INTEGER_pop_free(trans->certReqIds, ASN1_INTEGER_free);
+    sk_X509_pop_free(trans->certsOut, X509_free);
+    if ((trans->certReqIds = sk_ASN1_INTEGER_new_null()) == NULL ||
+        (trans->certsOut = sk_X509_new_null()) == NULL ||
+        (sis = sk_CMP_PKISTATUSINFO_new_null()) == NULL)
+        goto oom;
 
-    if (!cmp_verify_popo(srv_ctx, certReq)) {
-        /* Proof of possession could not be verified */
-        if ((si = CMP_statusInfo_new(CMP_PKISTATUS_rejection,
-                                     1 << CMP_PKIFAILUREINFO_badPOP,
-                                     NULL)) == NULL)
-            goto oom;
-    } else if (srv_ctx->pollCount > 0) {
-        srv_ctx->pollCount--;
-        if ((si = CMP_statusInfo_new(CMP_PKISTATUS_waiting, 0, NULL)) == NULL)
-            goto oom;
-        CMP_PKIMESSAGE_free(srv_ctx->certReq);
-        if ((srv_ctx->certReq = CMP_PKIMESSAGE_dup((CMP_PKIMESSAGE *)certReq))
+    if ((waiting = trans->pollCount > 0)) {
+        trans->pollCount--;
+        CMP_PKIMESSAGE_free(trans->certReq);
+        if ((trans->certReq = CMP_PKIMESSAGE_dup((CMP_PKIMESSAGE *)certReq))
             == NULL)
             goto oom;
     } else {
-        certOut = srv_ctx->certOut;
         chainOut = srv_ctx->chainOut;
         caPubs = srv_ctx->caPubsOut;
         if (CMP_PKIMESSAGE_check_implicitConfirm((CMP_PKIMESSAGE *) certReq) &&
             srv_ctx->grantImplicitConfirm)
-            CMP_CTX_set_option(srv_ctx->ctx, CMP_CTX_OPT_IMPLICITCONFIRM, 1);
-        if ((si = CMP_PKISTATUSINFO_dup(srv_ctx->pkiStatusOut)) == NULL)
+            CMP_CTX_set_option(trans->ctx, CMP_CTX_OPT_IMPLICITCONFIRM, 1);
+    }
+
+    for (i = 0; i < num; i++) {
+        if ((rid = ASN1_INTEGER_new()) == NULL ||
+            !ASN1_INTEGER_set(rid, certReq->body->type == V_CMP_PKIBODY_P10CR
+                              ? CERTREQID : CRMF_CERTREQMSG_get_certReqId(
+                              sk_CRMF_CERTREQMSG_value(certReq->body->value.cr,
+                                                       i))) ||
+            !sk_ASN1_INTEGER_push(trans->certReqIds, rid))
+            goto oom;
+        rid = NULL;
+
+        if (!cmp_verify_popo(srv_ctx, certReq, i)) {
+            /* Proof of possession could not be verified */
+            si = CMP_statusInfo_new(CMP_PKISTATUS_rejection,
+                                    1 << CMP_PKIFAILUREINFO_badPOP, NULL);
+        } else if (waiting) {
+            si = CMP_statusInfo_new(CMP_PKISTATUS_waiting, 0, NULL);
+        } else if (srv_ctx->cert_request_cb != NULL) {
+            /* let the CA backend decide on the request */
+            if (!srv_ctx->cert_request_cb(srv_ctx, certReq, i, &si, &certOut)
+                || si == NULL) {
+                CMPerr(CMP_F_CMP_PROCESS_CERT_REQUEST,
+                       CMP_R_ERROR_PROCESSING_CERTREQ);
+                goto err;
+            }
+        } else {
+            si = CMP_PKISTATUSINFO_dup(srv_ctx->pkiStatusOut);
+            if (srv_ctx->certOut != NULL && X509_up_ref(srv_ctx->certOut))
+                certOut = srv_ctx->certOut;
+        }
+        if (si == NULL || !sk_CMP_PKISTATUSINFO_push(sis, si))
             goto oom;
+        si = NULL;
+        if (!sk_X509_push(trans->certsOut, certOut))
+            goto oom;
+        certOut = NULL;
     }
 
-    msg = CMP_certrep_new(srv_ctx->ctx, bodytype, srv_ctx->certReqId, si,
-                          certOut, chainOut, caPubs, srv_ctx->encryptcert,
+    msg = CMP_certrep_new(trans->ctx, bodytype, trans->certReqIds, sis,
+                          trans->certsOut, chainOut, caPubs, certReq,
                           srv_ctx->sendUnprotectedErrors);
     if (msg == NULL)
         CMPerr(CMP_F_CMP_PROCESS_CERT_REQUEST, CMP_R_ERROR_CREATING_CERTREP);
 
-    CMP_PKISTATUSINFO_free(si);
+    sk_CMP_PKISTATUSINFO_pop_free(sis, CMP_PKISTATUSINFO_free);
     return msg;
 
  oom:
     CMPerr(CMP_F_CMP_PROCESS_CERT_REQUEST, CMP_R_OUT_OF_MEMORY);
+ err:
+    ASN1_INTEGER_free(rid);
+    X509_free(certOut);
     CMP_PKISTATUSINFO_free(si);
+    sk_CMP_PKISTATUSINFO_pop_free(sis, CMP_PKISTATUSINFO_free);
+    return NULL;
+}
+
+/*
+ * internal function
+ *
+ * creates the CertId for the certificate given in the RevDetails
+ * returns pointer to the CertId on success, NULL on error
+ */
+static CRMF_CERTID *revdetails_certId(const CMP_REVDETAILS *details)
+{
+    CRMF_CERTID *certId;
+    X509_NAME *issuer;
+
+    if ((certId = CRMF_CERTID_new()) == NULL ||
+        (issuer = X509_NAME_dup(details->certDetails->issuer)) == NULL)
+        goto err;
+    GENERAL_NAME_set0_value(certId->issuer, GEN_DIRNAME, issuer);
+    ASN1_INTEGER_free(certId->serialNumber);
+    if ((certId->serialNumber =
+         ASN1_INTEGER_dup(details->certDetails->serialNumber)) == NULL)
+        goto err;
+    return certId;
+
+ err:
+    CRMF_CERTID_free(certId);
     return NULL;
 }
 
+/*
+ * handles all RevDetails in the rr, giving a PKIStatusInfo for each of them
+ */
 static CMP_PKIMESSAGE *process_rr(CMP_SRV_CTX *srv_ctx,
+                                  CMP_SRV_TRANSACTION *trans,
                                   const CMP_PKIMESSAGE *req)
 {
-    CMP_PKIMESSAGE *msg;
+    CMP_PKIMESSAGE *msg = NULL;
     CMP_REVDETAILS *details;
-    CRMF_CERTID *certId;
+    STACK_OF(CMP_PKISTATUSINFO) *sis = NULL;
+    STACK_OF(CRMF_CERTID) *certIds = NULL;
+    CRMF_CERTID *certId = NULL;
+    CMP_PKISTATUSINFO *si = NULL;
+    int i, num;
 
-    if (srv_ctx == NULL || req == NULL) {
+    if (srv_ctx == NULL || trans == NULL || req == NULL) {
         CMPerr(CMP_F_PROCESS_RR, CMP_R_NULL_ARGUMENT);
         return NULL;
     }
 
-    if ((details = sk_CMP_REVDETAILS_value(req->body->value.rr,
-                                           REVREQSID)) == NULL) {
+    if ((num = sk_CMP_REVDETAILS_num(req->body->value.rr)) <= 0) {
         CMPerr(CMP_F_PROCESS_RR, CMP_R_ERROR_PROCESSING_MSG);
         return NULL;
     }
+    if ((sis = sk_CMP_PKISTATUSINFO_new_reserve(NULL, num)) == NULL ||
+        (certIds = sk_CRMF_CERTID_new_reserve(NULL, num)) == NULL)
+        goto oom;
 
-    /* accept revocation only for the certificate we send in ir/cr/kur */
-    if (ASN1_INTEGER_cmp(details->certDetails->serialNumber,
-                         X509_get0_serialNumber(srv_ctx->certOut)) != 0 ||
-        X509_NAME_cmp(details->certDetails->issuer,
-                      X509_get_issuer_name(srv_ctx->certOut)) != 0) {
-        CMPerr(CMP_F_PROCESS_RR, CMP_R_REQUEST_NOT_ACCEPTED);
-        return NULL;
-    }
+    for (i = 0; i < num; i++) {
+        details = sk_CMP_REVDETAILS_value(req->body->value.rr, i);
+        if (details->certDetails->issuer == NULL ||
+            details->certDetails->serialNumber == NULL) {
+            CMPerr(CMP_F_PROCESS_RR, CMP_R_ERROR_PROCESSING_MSG);
+            goto err;
+        }
 
-    if ((certId = CRMF_CERTID_new()) == NULL) {
-        CMPerr(CMP_F_PROCESS_RR, CMP_R_OUT_OF_MEMORY);
-        return NULL;
+        if (srv_ctx->rr_cb != NULL) {
+            /* let the CA backend decide on the request */
+            if (!srv_ctx->rr_cb(srv_ctx, details->certDetails->issuer,
+                                details->certDetails->serialNumber, &si) ||
+                si == NULL) {
+                CMPerr(CMP_F_PROCESS_RR, CMP_R_REQUEST_NOT_ACCEPTED);
+                goto err;
+            }
+        } else if (ASN1_INTEGER_cmp(details->certDetails->serialNumber,
+                                    X509_get0_serialNumber(srv_ctx->certOut))
+                   == 0 &&
+                   X509_NAME_cmp(details->certDetails->issuer,
+                                 X509_get_issuer_name(srv_ctx->certOut)) == 0) {
+            /* accept revocation only for the certificate sent in ir/cr/kur */
+            if ((si = CMP_PKISTATUSINFO_dup(srv_ctx->pkiStatusOut)) == NULL)
+                goto oom;
+        } else if ((si = CMP_statusInfo_new(CMP_PKISTATUS_rejection,
+                                            1 << CMP_PKIFAILUREINFO_badCertId,
+                                            NULL)) == NULL) {
+            goto oom;
+        }
+
+        if ((certId = revdetails_certId(details)) == NULL)
+            goto oom;
+        /* cannot fail due to the reservation above */
+        (void)sk_CMP_PKISTATUSINFO_push(sis, si);
+        (void)sk_CRMF_CERTID_push(certIds, certId);
+        si = NULL;
+        certId = NULL;
     }
-    GENERAL_NAME_set0_value(certId->issuer, GEN_DIRNAME,
-                            X509_NAME_dup(details->certDetails->issuer));
-    ASN1_INTEGER_free(certId->serialNumber);
-    certId->serialNumber = ASN1_INTEGER_dup(details->certDetails->serialNumber);
 
-    if ((msg = CMP_rp_new(srv_ctx->ctx, srv_ctx->pkiStatusOut, certId,
+    if ((msg = CMP_rp_new(trans->ctx, sis, certIds,
                           srv_ctx->sendUnprotectedErrors)) == NULL)
         CMPerr(CMP_F_PROCESS_RR, CMP_R_ERROR_CREATING_RR);
     return msg;
+
+ oom:
+    CMPerr(CMP_F_PROCESS_RR, CMP_R_OUT_OF_MEMORY);
+ err:
+    CMP_PKISTATUSINFO_free(si);
+    sk_CMP_PKISTATUSINFO_pop_free(sis, CMP_PKISTATUSINFO_free);
+    sk_CRMF_CERTID_pop_free(certIds, CRMF_CERTID_free);
+    return NULL;
+}
+
+/*
+ * returns 1 if rid is among the ids of the last certification request of the
+ * transaction, which defaults to the single id CERTREQID, and in this case
+ * assigns to *cert the certificate issued for this request id
+ */
+static int expected_certReqId(const CMP_SRV_CTX *srv_ctx,
+                              const CMP_SRV_TRANSACTION *trans, long rid,
+                              X509 **cert)
+{
+    int i;
+
+    if (trans->certReqIds == NULL) {
+        *cert = srv_ctx->certOut;
+        return rid == CERTREQID;
+    }
+    for (i = 0; i < sk_ASN1_INTEGER_num(trans->certReqIds); i++)
+        if (ASN1_INTEGER_get(sk_ASN1_INTEGER_value(trans->certReqIds, i))
+            == rid) {
+            *cert = sk_X509_value(trans->certsOut, i);
+            return 1;
+        }
+    return 0;
 }
 
 static CMP_PKIMESSAGE *process_certConf(CMP_SRV_CTX *srv_ctx,
+                                        CMP_SRV_TRANSACTION *trans,
                                         const CMP_PKIMESSAGE *req)
 {
     CMP_PKIMESSAGE *msg = NULL;
     CMP_CERTSTATUS *status = NULL;
     ASN1_OCTET_STRING *tmp = NULL;
-    int res = -1;
-    int num = sk_CMP_CERTSTATUS_num(req->body->value.certConf);
+    X509 *cert = NULL;
+    int res;
+    int i, num = sk_CMP_CERTSTATUS_num(req->body->value.certConf);
 
-    if (num == 0) {
-        CMP_printf(srv_ctx->ctx, FL_ERROR, "Certificate rejected by client");
-    } else {
-        if (num > 1)
-            CMP_printf(srv_ctx->ctx, FL_WARN,
-                       "All CertStatus but the first will be ignored");
-        status = sk_CMP_CERTSTATUS_value(req->body->value.certConf, CERTREQID);
-    }
+    if (num == 0)
+        CMP_printf(trans->ctx, FL_ERROR, "Certificate rejected by client");
+
+    for (i = 0; i < num; i++) {
+        status = sk_CMP_CERTSTATUS_value(req->body->value.certConf, i);
 
-    if (status != NULL) {
         /* check cert request id */
-        if (ASN1_INTEGER_get(status->certReqId) != srv_ctx->certReqId) {
+        if (!expected_certReqId(srv_ctx, trans,
+                                ASN1_INTEGER_get(&status->certReqId), &cert)) {
             CMPerr(CMP_F_PROCESS_CERTCONF, CMP_R_UNEXPECTED_REQUEST_ID);
             return NULL;
         }
 
+        /* a request that did not yield a cert can only be rejected */
+        if (cert == NULL) {
+            if (status->statusInfo == NULL ||
+                CMP_PKISTATUSINFO_PKIStatus_get(status->statusInfo)
+                != CMP_PKISTATUS_rejection) {
+                CMPerr(CMP_F_PROCESS_CERTCONF, CMP_R_UNEXPECTED_REQUEST_ID);
+                ERR_add_error_data(1, "no certificate issued for certReqId");
+                return NULL;
+            }
+            continue;
+        }
+
         /* check cert hash by recalculating it in place */
+        res = -1;
         tmp = status->certHash;
         status->certHash = NULL;
-        if (CMP_CERTSTATUS_set_certHash(status, srv_ctx->certOut))
+        if (CMP_CERTSTATUS_set_certHash(status, cert))
             res = status->certHash == NULL ? 0 /* avoiding SCA false positive */
                   : ASN1_OCTET_STRING_cmp(tmp, status->certHash) == 0;
         ASN1_OCTET_STRING_free(status->certHash);
@@ -640,16 +1612,16 @@ static CMP_PKIMESSAGE *process_certConf(CMP_SRV_CTX *srv_ctx,
             char *tmpbuf = OPENSSL_malloc(CMP_PKISTATUSINFO_BUFLEN);
             if (tmpbuf == NULL)
                 goto oom;
-            CMP_printf(srv_ctx->ctx, FL_INFO,
+            CMP_printf(trans->ctx, FL_INFO,
                        "Certificate rejected by client:");
             if (CMP_PKISTATUSINFO_snprint(status->statusInfo, tmpbuf,
                                           CMP_PKISTATUSINFO_BUFLEN) != NULL)
-                CMP_printf(srv_ctx->ctx, FL_INFO, "%s", tmpbuf);
+                CMP_printf(trans->ctx, FL_INFO, "%s", tmpbuf);
             OPENSSL_free(tmpbuf);
         }
     }
 
-    if ((msg = CMP_pkiconf_new(srv_ctx->ctx)) == NULL) {
+    if ((msg = CMP_pkiconf_new(trans->ctx)) == NULL) {
         CMPerr(CMP_F_PROCESS_CERTCONF, CMP_R_ERROR_CREATING_PKICONF);
         return NULL;
     }
@@ -662,9 +1634,10 @@ static CMP_PKIMESSAGE *process_certConf(CMP_SRV_CTX *srv_ctx,
 }
 
 static CMP_PKIMESSAGE *process_error(CMP_SRV_CTX *srv_ctx,
+                                     CMP_SRV_TRANSACTION *trans,
                                      const CMP_PKIMESSAGE *req)
 {
-    CMP_PKIMESSAGE *msg = CMP_pkiconf_new(srv_ctx->ctx);
+    CMP_PKIMESSAGE *msg = CMP_pkiconf_new(trans->ctx);
 
     if (msg == NULL) {
         CMPerr(CMP_F_PROCESS_ERROR, CMP_R_ERROR_CREATING_PKICONF);
@@ -675,19 +1648,21 @@ static CMP_PKIMESSAGE *process_error(CMP_SRV_CTX *srv_ctx,
 }
 
 static CMP_PKIMESSAGE *process_pollReq(CMP_SRV_CTX *srv_ctx,
+                                       CMP_SRV_TRANSACTION *trans,
                                        const CMP_PKIMESSAGE *req)
 {
     CMP_PKIMESSAGE *msg = NULL;
-    if (!srv_ctx || !srv_ctx->certReq) {
+    if (!srv_ctx || !trans || !trans->certReq) {
         CMPerr(CMP_F_PROCESS_POLLREQ, CMP_R_NULL_ARGUMENT);
         return NULL;
     }
-    if (srv_ctx->pollCount == 0) {
-        if ((msg = CMP_process_cert_request(srv_ctx, srv_ctx->certReq)) == NULL)
+    if (trans->pollCount == 0) {
+        if ((msg = CMP_process_cert_request(srv_ctx, trans, trans->certReq))
+            == NULL)
             CMPerr(CMP_F_PROCESS_POLLREQ, CMP_R_ERROR_PROCESSING_CERTREQ);
     } else {
-        srv_ctx->pollCount--;
-        if ((msg = CMP_pollrep_new(srv_ctx->ctx, srv_ctx->certReqId,
+        trans->pollCount--;
+        if ((msg = CMP_pollrep_new(trans->ctx, req->body->value.pollReq,
                                    srv_ctx->checkAfterTime)) == NULL)
             CMPerr(CMP_F_PROCESS_POLLREQ, CMP_R_ERROR_CREATING_POLLREP);
     }
@@ -699,22 +1674,23 @@ static CMP_PKIMESSAGE *process_pollReq(CMP_SRV_CTX *srv_ctx,
  * incoming message
  */
 static CMP_PKIMESSAGE *process_genm(CMP_SRV_CTX *srv_ctx,
+                                    CMP_SRV_TRANSACTION *trans,
                                     const CMP_PKIMESSAGE *req)
 {
     CMP_PKIMESSAGE *msg = NULL;
     STACK_OF(CMP_INFOTYPEANDVALUE) *tmp = NULL;
 
-    if (srv_ctx == NULL || srv_ctx->ctx == NULL || req == NULL) {
+    if (srv_ctx == NULL || trans == NULL || req == NULL) {
         CMPerr(CMP_F_PROCESS_GENM, CMP_R_NULL_ARGUMENT);
         return NULL;
     }
     /* Back up potential genm_itavs */
-    tmp = srv_ctx->ctx->genm_itavs;
-    srv_ctx->ctx->genm_itavs = req->body->value.genm;
-    if ((msg = CMP_genp_new(srv_ctx->ctx)) == NULL)
+    tmp = trans->ctx->genm_itavs;
+    trans->ctx->genm_itavs = req->body->value.genm;
+    if ((msg = CMP_genp_new(trans->ctx)) == NULL)
         CMPerr(CMP_F_PROCESS_GENM, CMP_R_OUT_OF_MEMORY);
     /* restore genm_itavs */
-    srv_ctx->ctx->genm_itavs = tmp;
+    trans->ctx->genm_itavs = tmp;
     return msg;
 }
 
@@ -738,29 +1714,29 @@ static int unprotected_exception(const CMP_CTX *ctx,
 }
 
 /*
- * Mocks the server/responder.
+ * Processes the request within the given transaction.
  * srv_ctx is the context of the server
  * returns 1 if a message was created and 0 on error
  */
-static int process_request(CMP_SRV_CTX *srv_ctx, const CMP_PKIMESSAGE *req,
-                           CMP_PKIMESSAGE **rsp)
+static int process_request(CMP_SRV_CTX *srv_ctx, CMP_SRV_TRANSACTION *trans,
+                           const CMP_PKIMESSAGE *req, CMP_PKIMESSAGE **rsp)
 {
     cmp_srv_process_cb_t process_cb = NULL;
     CMP_CTX *ctx;
 
-    if (srv_ctx == NULL || srv_ctx->ctx == NULL || req == NULL || rsp == NULL) {
+    if (srv_ctx == NULL || trans == NULL || req == NULL || rsp == NULL) {
         CMPerr(CMP_F_PROCESS_REQUEST, CMP_R_NULL_ARGUMENT);
         return 0;
     }
-    ctx = srv_ctx->ctx;
+    ctx = trans->ctx;
     *rsp = NULL;
 
-    if (req->header->sender->type != GEN_DIRNAME) {
+    if (req->header.sender->type != GEN_DIRNAME) {
         CMPerr(CMP_F_PROCESS_REQUEST,
                CMP_R_SENDER_GENERALNAME_TYPE_NOT_SUPPORTED);
         return 0;
     }
-    if (!X509_NAME_set(&ctx->recipient, req->header->sender->d.directoryName)) {
+    if (!X509_NAME_set(&ctx->recipient, req->header.sender->d.directoryName)) {
         CMPerr(CMP_F_PROCESS_REQUEST, CMP_R_OUT_OF_MEMORY);
         return 0;
     }
@@ -771,6 +1747,8 @@ static int process_request(CMP_SRV_CTX *srv_ctx, const CMP_PKIMESSAGE *req,
         CMPerr(CMP_F_PROCESS_REQUEST, CMP_R_FAILED_TO_RECEIVE_PKIMESSAGE);
         return 0;
     }
+    if (!transaction_check_sender(trans, req))
+        return 0;
     if (srv_ctx->sendError) {
         if ((*rsp = CMP_error_new(ctx, srv_ctx->pkiStatusOut, -1, NULL,
                                   srv_ctx->sendUnprotectedErrors)))
@@ -813,12 +1791,73 @@ static int process_request(CMP_SRV_CTX *srv_ctx, const CMP_PKIMESSAGE *req,
     }
     if (process_cb == NULL)
         return 0;
-    if ((*rsp = process_cb(srv_ctx, req)) == NULL)
+    if ((*rsp = process_cb(srv_ctx, trans, req)) == NULL)
         return 0;
 
     return 1;
 }
 
+/*
+ * returns 1 if the transaction ends with the given response, i.e., no further
+ * request from the client is expected, else 0
+ */
+static int transaction_finished(const CMP_PKIMESSAGE *rsp)
+{
+    switch (CMP_PKIMESSAGE_get_bodytype(rsp)) {
+    case V_CMP_PKIBODY_IP:
+    case V_CMP_PKIBODY_CP:
+    case V_CMP_PKIBODY_KUP:
+        /* unless confirmed implicitly, a certConf or pollReq will follow */
+        return CMP_PKIMESSAGE_check_implicitConfirm((CMP_PKIMESSAGE *)rsp);
+    case V_CMP_PKIBODY_POLLREP:
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Processes a request received by the server. The state of the transaction it
+ * belongs to is looked up using the transactionID. Requests of different
+ * transactions may be processed by concurrent threads.
+ * In case the request cannot be processed, an error message is returned.
+ * returns the response message on success, NULL on error
+ */
+CMP_PKIMESSAGE *CMP_SRV_process_request(CMP_SRV_CTX *srv_ctx,
+                                        const CMP_PKIMESSAGE *req)
+{
+    CMP_SRV_TRANSACTION *trans;
+    CMP_PKIMESSAGE *rsp = NULL;
+
+    if (srv_ctx == NULL || srv_ctx->ctx == NULL || req == NULL) {
+        CMPerr(CMP_F_CMP_SRV_PROCESS_REQUEST, CMP_R_NULL_ARGUMENT);
+        return NULL;
+    }
+    if ((trans = transaction_acquire(srv_ctx, req)) == NULL)
+        return NULL;
+
+    if (process_request(srv_ctx, trans, req, &rsp) == 0) {
+        CMP_PKISTATUSINFO *si;
+        const char *data;
+        int flags = 0;
+        unsigned long err = ERR_peek_error_line_data(NULL, NULL, &data, &flags);
+        if ((si = CMP_statusInfo_new(CMP_PKISTATUS_rejection,
+                                     /* TODO make failure bits more specific */
+                                     1 << CMP_PKIFAILUREINFO_badRequest,
+                                     NULL))) {
+            rsp = CMP_error_new(trans->ctx, si,
+                                err != 0 ? ERR_GET_REASON(err): -1,
+                                CMP_PKIFREETEXT_push_str(NULL,
+                                        flags&ERR_TXT_STRING ? data : NULL),
+                                srv_ctx->sendUnprotectedErrors);
+            CMP_PKISTATUSINFO_free(si);
+        }
+    }
+
+    transaction_release(srv_ctx, trans, rsp == NULL || transaction_finished(rsp));
+    return rsp;
+}
+
 /*
  * Mocks the server connection. Works similar to CMP_PKIMESSAGE_http_perform.
  * A CMP_SRV_CTX must be set as transfer_cb_arg
@@ -829,6 +1868,7 @@ int CMP_mock_server_perform(CMP_CTX *cmp_ctx, const CMP_PKIMESSAGE *req,
 {
     CMP_PKIMESSAGE *srv_req = NULL, *srv_rsp = NULL;
     CMP_SRV_CTX *srv_ctx = NULL;
+    int count = 0, check;
     int error = 0;
 
     if (cmp_ctx == NULL || req == NULL || rsp == NULL)
@@ -838,33 +1878,28 @@ int CMP_mock_server_perform(CMP_CTX *cmp_ctx, const CMP_PKIMESSAGE *req,
     if ((srv_ctx = CMP_CTX_get_transfer_cb_arg(cmp_ctx)) == NULL)
         return CMP_R_ERROR_TRANSFERRING_OUT;
 
+    check = srv_ctx->encodingCheck == 1;
+    if (srv_ctx->encodingCheck > 1 &&
+        CRYPTO_atomic_add(&srv_ctx->encodingCheckCount, 1, &count,
+                          srv_ctx->lock))
+        check = count % srv_ctx->encodingCheck == 0;
+
     /* CMP_PKIMESSAGE_dup en- and decodes ASN.1, used for checking encoding */
-    if ((srv_req = CMP_PKIMESSAGE_dup((CMP_PKIMESSAGE *)req)) == NULL)
-        error = CMP_R_ERROR_DECODING_MESSAGE;
+    if (check && (srv_req = CMP_PKIMESSAGE_dup((CMP_PKIMESSAGE *)req)) == NULL)
+        return CMP_R_ERROR_DECODING_MESSAGE;
 
-    if (process_request(srv_ctx, srv_req, &srv_rsp) == 0) {
-        CMP_PKISTATUSINFO *si;
-        const char *data;
-        int flags = 0;
-        unsigned long err = ERR_peek_error_line_data(NULL, NULL, &data, &flags);
-        if ((si = CMP_statusInfo_new(CMP_PKISTATUS_rejection,
-                                     /* TODO make failure bits more specific */
-                                     1 << CMP_PKIFAILUREINFO_badRequest,
-                                     NULL))) {
-            srv_rsp = CMP_error_new(cmp_ctx, si,
-                                    err != 0 ? ERR_GET_REASON(err): -1,
-                                    CMP_PKIFREETEXT_push_str(NULL,
-                                            flags&ERR_TXT_STRING ? data : NULL),
-                                    srv_ctx->sendUnprotectedErrors);
-            CMP_PKISTATUSINFO_free(si);
-        } else {
-            error = CMP_R_ERROR_PROCESSING_MSG;
-        }
+    if ((srv_rsp = CMP_SRV_process_request(srv_ctx, check ? srv_req : req))
+        == NULL) {
+        error = CMP_R_ERROR_PROCESSING_MSG;
         goto end;
     }
 
     /* CMP_PKIMESSAGE_dup en- and decodes ASN.1, used for checking encoding */
-    if ((*rsp = CMP_PKIMESSAGE_dup(srv_rsp)) == NULL) {
+    if (!check) {
+        /* hand over the response as it is */
+        *rsp = srv_rsp;
+        srv_rsp = NULL;
+    } else if ((*rsp = CMP_PKIMESSAGE_dup(srv_rsp)) == NULL) {
         error = CMP_R_ERROR_DECODING_MESSAGE;
         goto end;
     }
@@ -876,6 +1911,265 @@ int CMP_mock_server_perform(CMP_CTX *cmp_ctx, const CMP_PKIMESSAGE *req,
     return error;
 }
 
+#ifndef OPENSSL_NO_SOCK
+# define HTTP_LINE_LEN 1024
+# define HTTP_MAX_REQ_LEN (1024 * 1024) /* max accepted Content-Length */
+
+/* returns 1 if str starts with prefix, ignoring case, else 0 */
+static int http_prefix(const char *str, const char *prefix)
+{
+    for (; *prefix != '\0'; str++, prefix++)
+        if (tolower((unsigned char)*str) != tolower((unsigned char)*prefix))
+            return 0;
+    return 1;
+}
+
+/*
+ * internal function
+ *
+ * reads the request line and header of an HTTP POST request
+ * returns 1 on success, 0 on end of input, and -1 on error.
+ * On success *minor is set to the minor HTTP version number, *keep_alive
+ * to 1 if the client asked to keep the connection open, else 0, and
+ * *content_len to the Content-Length given, or -1 if there is none.
+ */
+static int http_read_post_header(BIO *bio, int *minor, int *keep_alive,
+                                 long *content_len)
+{
+    char line[HTTP_LINE_LEN], *p, *end;
+    int len;
+
+    if ((len = BIO_gets(bio, line, sizeof(line))) <= 0)
+        return 0;
+    if (!http_prefix(line, "POST ") || (p = strstr(line, " HTTP/1.")) == NULL
+        || (p[8] != '0' && p[8] != '1'))
+        return -1;
+    *minor = p[8] - '0';
+    *keep_alive = *minor == 1; /* default for HTTP/1.1 */
+    *content_len = -1;
+
+    for (;;) {
+        if ((len = BIO_gets(bio, line, sizeof(line))) <= 0 ||
+            line[len - 1] != '\n')
+            return -1;
+        if (line[0] == '\r' || line[0] == '\n')
+            return 1;
+        if (http_prefix(line, "Connection:")) {
+            for (p = line + 11; *p == ' ' || *p == '\t'; p++)
+                continue;
+            if (http_prefix(p, "keep-alive"))
+                *keep_alive = 1;
+            else if (http_prefix(p, "close"))
+                *keep_alive = 0;
+        } else if (http_prefix(line, "Content-Length:")) {
+            for (p = line + 15; *p == ' ' || *p == '\t'; p++)
+                continue;
+            if (!isdigit((unsigned char)*p))
+                return -1;
+            *content_len = strtol(p, &end, 10);
+            if (*content_len < 0 || (*end != '\r' && *end != '\n'
+                                     && *end != ' ' && *end != '\t'))
+                return -1;
+        }
+    }
+}
+
+/*
+ * internal function
+ *
+ * makes reads (optname SO_RCVTIMEO) or writes (SO_SNDTIMEO) on the given
+ * socket BIO time out after the given number of seconds, where 0 means no
+ * timeout. Other types of BIO are left alone.
+ * returns 1 on success, 0 on error
+ */
+static int http_set_timeout(BIO *cbio, int optname, long seconds)
+{
+# ifdef OPENSSL_SYS_WINDOWS
+    DWORD tv = (DWORD)(seconds * 1000);
+# else
+    struct timeval tv;
+# endif
+    int fd;
+
+    if (BIO_method_type(cbio) != BIO_TYPE_SOCKET
+            || BIO_get_fd(cbio, &fd) <= 0)
+        return 1;
+# ifndef OPENSSL_SYS_WINDOWS
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+# endif
+    return setsockopt(fd, SOL_SOCKET, optname,
+                      (const void *)&tv, sizeof(tv)) == 0;
+}
+
+/*
+ * internal function
+ *
+ * BIO callback enforcing the deadline its argument points to on the reads
+ * and writes of a request or response as a whole, such that clients sending
+ * or receiving just a few bytes at a time cannot hold a connection for long.
+ * Before each operation, the socket timeout is set to the time left.
+ * Once the deadline has passed, the operation fails as if it timed out.
+ */
+static long http_deadline_cb(BIO *b, int oper, const char *argp, size_t len,
+                             int argi, long argl, int ret, size_t *processed)
+{
+    const time_t *deadline = (const time_t *)BIO_get_callback_arg(b);
+    long left;
+
+    if ((oper != BIO_CB_READ && oper != BIO_CB_WRITE) || *deadline == 0)
+        return ret;
+    if ((left = (long)(*deadline - time(NULL))) <= 0) {
+        BIO_set_flags(b, BIO_FLAGS_SHOULD_RETRY | (oper == BIO_CB_READ ?
+                                                   BIO_FLAGS_READ
+                                                   : BIO_FLAGS_WRITE));
+        return -1;
+    }
+    return http_set_timeout(b, oper == BIO_CB_READ ? SO_RCVTIMEO : SO_SNDTIMEO,
+                            left) ? ret : -1;
+}
+
+/*
+ * Serves CMP requests received via HTTP POST on the connected BIO cbio,
+ * e.g., obtained from an accept BIO, until the client closes the connection
+ * or has not asked to keep it alive. The BIO is not freed.
+ * Requests must give their Content-Length, which is limited to
+ * HTTP_MAX_REQ_LEN. Reading a request, as well as writing a response,
+ * must complete within the HTTP timeout set in srv_ctx.
+ * Different connections may be served in parallel by different threads.
+ * returns the number of requests served, or -1 on error
+ */
+int CMP_SRV_http_serve(CMP_SRV_CTX *srv_ctx, BIO *cbio)
+{
+    BIO *bbio, *bio;
+    CMP_PKIMESSAGE *req = NULL, *rsp = NULL;
+    unsigned char *buf = NULL, *der = NULL;
+    const unsigned char *p;
+    const char *status = NULL;
+    long content_len = 0;
+    int der_len, len, n, minor = 0, keep_alive = 1, rv;
+    int served = 0;
+    time_t deadline = 0;
+    BIO_callback_fn_ex old_cb;
+    char *old_cb_arg;
+
+    if (srv_ctx == NULL || cbio == NULL) {
+        CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_NULL_ARGUMENT);
+        return -1;
+    }
+    if (!http_set_timeout(cbio, SO_RCVTIMEO, srv_ctx->httpTimeout) ||
+        !http_set_timeout(cbio, SO_SNDTIMEO, srv_ctx->httpTimeout)) {
+        CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_ERROR_TRANSFERRING_IN);
+        return -1;
+    }
+    if ((bbio = BIO_new(BIO_f_buffer())) == NULL) {
+        CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_OUT_OF_MEMORY);
+        return -1;
+    }
+    bio = BIO_push(bbio, cbio);
+    old_cb = BIO_get_callback_ex(cbio);
+    old_cb_arg = BIO_get_callback_arg(cbio);
+    BIO_set_callback_ex(cbio, http_deadline_cb);
+    BIO_set_callback_arg(cbio, (char *)&deadline);
+
+    while (keep_alive) {
+        if (srv_ctx->httpTimeout > 0)
+            deadline = time(NULL) + srv_ctx->httpTimeout;
+        rv = http_read_post_header(bio, &minor, &keep_alive, &content_len);
+        if (rv == 0)
+            break;
+        if (rv < 0) {
+            if (BIO_should_retry(bio)) {
+                CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_READ_TIMEOUT);
+                status = "408 Request Timeout";
+            } else {
+                CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_ERROR_DECODING_MESSAGE);
+                status = "400 Bad Request";
+            }
+        } else if (content_len < 0) {
+            CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_MISSING_CONTENT_LENGTH);
+            status = "411 Length Required";
+        } else if (content_len > HTTP_MAX_REQ_LEN) {
+            CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_REQUEST_TOO_LARGE);
+            status = "413 Payload Too Large";
+        } else if ((buf = OPENSSL_malloc(content_len > 0 ? content_len : 1))
+                   == NULL) {
+            CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_OUT_OF_MEMORY);
+            status = "500 Internal Server Error";
+        } else {
+            for (len = 0; len < content_len; len += n)
+                if ((n = BIO_read(bio, buf + len, content_len - len)) <= 0)
+                    break;
+            p = buf;
+            if (len < content_len) {
+                if (BIO_should_retry(bio)) {
+                    CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_READ_TIMEOUT);
+                    status = "408 Request Timeout";
+                } else {
+                    CMPerr(CMP_F_CMP_SRV_HTTP_SERVE,
+                           CMP_R_ERROR_TRANSFERRING_IN);
+                }
+            } else if ((req = d2i_CMP_PKIMESSAGE(NULL, &p, len)) == NULL
+                       || p != buf + len) {
+                CMPerr(CMP_F_CMP_SRV_HTTP_SERVE,
+                       CMP_R_ERROR_DECODING_MESSAGE);
+                status = "400 Bad Request";
+            }
+        }
+        if (req == NULL) {
+            if (srv_ctx->httpTimeout > 0) /* allow for the error response */
+                deadline = time(NULL) + srv_ctx->httpTimeout;
+            if (status != NULL) {
+                (void)BIO_printf(bio, "HTTP/1.%d %s\r\n"
+                                 "Connection: close\r\n\r\n", minor, status);
+                (void)BIO_flush(bio);
+            }
+            served = -1;
+            break;
+        }
+        rsp = CMP_SRV_process_request(srv_ctx, req);
+        if (srv_ctx->httpTimeout > 0)
+            deadline = time(NULL) + srv_ctx->httpTimeout;
+        if (rsp == NULL || (der_len = i2d_CMP_PKIMESSAGE(rsp, &der)) <= 0) {
+            (void)BIO_printf(bio, "HTTP/1.%d 500 Internal Server Error\r\n"
+                             "Connection: close\r\n\r\n", minor);
+            (void)BIO_flush(bio);
+            served = -1;
+            break;
+        }
+        if (BIO_printf(bio, "HTTP/1.%d 200 OK\r\n"
+                       "Content-Type: application/pkixcmp\r\n"
+                       "Content-Length: %d\r\n"
+                       "Connection: %s\r\n\r\n", minor, der_len,
+                       keep_alive ? "keep-alive" : "close") <= 0 ||
+            BIO_write(bio, der, der_len) != der_len || BIO_flush(bio) <= 0) {
+            CMPerr(CMP_F_CMP_SRV_HTTP_SERVE, CMP_R_ERROR_TRANSFERRING_OUT);
+            served = -1;
+            break;
+        }
+        served++;
+        OPENSSL_free(buf);
+        buf = NULL;
+        OPENSSL_free(der);
+        der = NULL;
+        CMP_PKIMESSAGE_free(req);
+        req = NULL;
+        CMP_PKIMESSAGE_free(rsp);
+        rsp = NULL;
+    }
+
+    OPENSSL_free(buf);
+    OPENSSL_free(der);
+    CMP_PKIMESSAGE_free(req);
+    CMP_PKIMESSAGE_free(rsp);
+    (void)BIO_pop(bbio);
+    BIO_free(bbio);
+    BIO_set_callback_ex(cbio, old_cb);
+    BIO_set_callback_arg(cbio, old_cb_arg);
+    return served;
+}
+#endif /* !defined(OPENSSL_NO_SOCK) */
+
 /*
  * creates and initializes a CMP_SRV_CTX structure
  * returns pointer to created CMP_SRV_ on success, NULL on error
@@ -885,18 +2179,28 @@ CMP_SRV_CTX *CMP_SRV_CTX_create(void)
     CMP_SRV_CTX *ctx = NULL;
     if ((ctx = CMP_SRV_CTX_new()) == NULL)
         goto oom;
-    ctx->certReqId = -1;
     if ((ctx->ctx = CMP_CTX_create()) == NULL)
         goto oom;
+    if ((ctx->transactions = lh_CMP_SRV_TRANSACTION_new(transaction_hash,
+                                                        transaction_cmp))
+        == NULL ||
+        (ctx->lock = CRYPTO_THREAD_lock_new()) == NULL)
+        goto oom;
     ctx->pollCount = 0;
     ctx->checkAfterTime = 1;
     ctx->grantImplicitConfirm = 0;
     ctx->sendError = 0;
     ctx->sendUnprotectedErrors = 0;
     ctx->acceptUnprotectedRequests = 0;
-    ctx->encryptcert = 0;
     ctx->acceptRAVerified = 0;
-    ctx->certReqId = CERTREQID;
+    ctx->transactionTimeout = 300;
+    ctx->httpTimeout = 60;
+    ctx->encodingCheck = 1;
+    ctx->encodingCheckCount = 0;
+    ctx->last_expiry = 0;
+    ctx->cert_request_cb = NULL;
+    ctx->rr_cb = NULL;
+    ctx->cb_arg = NULL;
     ctx->process_ir_cb = CMP_process_cert_request;
     ctx->process_cr_cb = CMP_process_cert_request;
     ctx->process_p10cr_cb = CMP_process_cert_request;
@@ -909,6 +2213,6 @@ CMP_SRV_CTX *CMP_SRV_CTX_create(void)
     return ctx;
  oom:
     CMPerr(CMP_F_CMP_SRV_CTX_CREATE, CMP_R_OUT_OF_MEMORY);
-    CMP_SRV_CTX_free(ctx);
+    CMP_SRV_CTX_delete(ctx);
     return NULL;
 }
@@ -17,6 +17,8 @@
 #include <openssl/cmp.h>
 #include <openssl/err.h>
 #include <openssl/x509.h>
+#include <string.h>
+#include <time.h>
 
 #include "cmp_int.h"
 
@@ -31,16 +33,12 @@ static int CMP_verify_signature(const CMP_CTX *cmp_ctx,
                                 const CMP_PKIMESSAGE *msg, const X509 *cert)
 {
     EVP_MD_CTX *ctx = NULL;
-    CMP_PROTECTEDPART prot_part;
+    CMP_PROTECTEDPART_DER ppd;
     int ret = 0;
     int digest_NID;
     EVP_MD *digest = NULL;
     EVP_PKEY *pubkey = NULL;
 
-    int l;
-    size_t prot_part_der_len = 0;
-    unsigned char *prot_part_der = NULL;
-
     if (msg == NULL || cert == NULL)
         goto param_err;
 
@@ -59,35 +57,37 @@ static int CMP_verify_signature(const CMP_CTX *cmp_ctx,
         return 0;
     }
 
-    /* create the DER representation of protected part */
-    prot_part.header = msg->header;
-    prot_part.body = msg->body;
-
-    l = i2d_CMP_PROTECTEDPART(&prot_part, &prot_part_der);
-    if (l < 0 || prot_part_der == NULL)
-        return 0;
-    prot_part_der_len = (size_t) l;
-
     /* verify protection of protected part */
-    if (!OBJ_find_sigid_algs(OBJ_obj2nid(msg->header->protectionAlg->algorithm),
+    if (!OBJ_find_sigid_algs(OBJ_obj2nid(msg->header.protectionAlg->algorithm),
                                          &digest_NID, NULL) ||
         (digest = (EVP_MD *)EVP_get_digestbynid(digest_NID)) == NULL) {
         CMPerr(CMP_F_CMP_VERIFY_SIGNATURE, CMP_R_ALGORITHM_NOT_SUPPORTED);
+        EVP_PKEY_free(pubkey);
+        return 0;
+    }
+
+    /* get the DER representation of protected part, preferably as received */
+    if (!CMP_PROTECTEDPART_DER_init(&ppd, msg)) {
+        EVP_PKEY_free(pubkey);
         return 0;
     }
 
     if ((ctx = EVP_MD_CTX_create()) == NULL) {
         CMPerr(CMP_F_CMP_VERIFY_SIGNATURE, CMP_R_OUT_OF_MEMORY);
+        CMP_PROTECTEDPART_DER_cleanup(&ppd);
+        EVP_PKEY_free(pubkey);
         return 0;
     }
     ret = EVP_VerifyInit_ex(ctx, digest, NULL) &&
-          EVP_VerifyUpdate(ctx, prot_part_der, prot_part_der_len) &&
+          (ppd.prefix_len == 0 ||
+           EVP_VerifyUpdate(ctx, ppd.prefix, ppd.prefix_len)) &&
+          EVP_VerifyUpdate(ctx, ppd.der, ppd.der_len) &&
           EVP_VerifyFinal(ctx, msg->protection->data,
                           msg->protection->length, pubkey) == 1;
 
     /* cleanup */
     EVP_MD_CTX_destroy(ctx);
-    OPENSSL_free(prot_part_der);
+    CMP_PROTECTEDPART_DER_cleanup(&ppd);
     EVP_PKEY_free(pubkey);
 
     if (!ret) {
@@ -116,13 +116,15 @@ static int CMP_verify_signature(const CMP_CTX *cmp_ctx,
  * Verify a message protected with PBMAC
  */
 static int CMP_verify_PBMAC(const CMP_PKIMESSAGE *msg,
-                            const ASN1_OCTET_STRING *secret)
+                            const ASN1_OCTET_STRING *secret,
+                            CRMF_PBM_CACHE *cache)
 {
     ASN1_BIT_STRING *protection = NULL;
     int valid = 0;
 
     /* generate expected protection for the message */
-    if ((protection = CMP_calc_protection(msg, secret, NULL)) == NULL)
+    if ((protection = CMP_calc_protection_cached(msg, NULL, secret, NULL,
+                                                 cache, NULL)) == NULL)
         goto err;               /* failed to generate protection string! */
 
     valid = ASN1_STRING_cmp((const ASN1_STRING *)protection,
@@ -136,6 +138,38 @@ static int CMP_verify_PBMAC(const CMP_PKIMESSAGE *msg,
     return 0;
 }
 
+/*
+ * internal function
+ *
+ * Verify a message protected with DHBasedMac, where cert is the DH certificate
+ * of the sender and ctx->pkey holds our own DH private key
+ */
+static int CMP_verify_DHBMAC(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
+                             const X509 *cert)
+{
+    ASN1_BIT_STRING *protection = NULL;
+    int valid = 0;
+
+    /* verify that keyUsage, if present, contains keyAgreement */
+    if (!ctx->ignore_keyusage &&
+        !(X509_get_key_usage((X509 *)cert) & X509v3_KU_KEY_AGREEMENT)) {
+        CMPerr(CMP_F_CMP_VERIFY_DHBMAC, CMP_R_MISSING_KEY_USAGE_KEYAGREEMENT);
+        return 0;
+    }
+
+    /* generate expected protection for the message */
+    if ((protection = CMP_calc_dhbmac(ctx, msg, NULL, cert)) == NULL)
+        return 0;
+
+    valid = ASN1_STRING_cmp((const ASN1_STRING *)protection,
+                            (const ASN1_STRING *)msg->protection) == 0;
+    ASN1_BIT_STRING_free(protection);
+    if (!valid)
+        CMPerr(CMP_F_CMP_VERIFY_DHBMAC, CMP_R_WRONG_DHBM_VALUE);
+
+    return valid;
+}
+
 /*
  * Attempt to validate certificate and path using given store of trusted certs
  * (possibly including CRLs and a cert verification callback function) and
@@ -379,7 +413,7 @@ static int cert_acceptable(X509 *cert, const CMP_PKIMESSAGE *msg,
         return 0;
     }
 
-    if ((sender_name = msg->header->sender->d.directoryName) != NULL) {
+    if ((sender_name = msg->header.sender->d.directoryName) != NULL) {
         X509_NAME *name = X509_get_subject_name(cert);
 
         /* enforce that the right subject DN is there */
@@ -394,7 +428,7 @@ static int cert_acceptable(X509 *cert, const CMP_PKIMESSAGE *msg,
         }
     }
 
-    if (!check_kid(cert, msg->header->senderKID, 0))
+    if (!check_kid(cert, msg->header.senderKID, 0))
         return 0;
 
     return 1; /* acceptable also if there is no identifier in msg header */
@@ -432,6 +466,26 @@ static int find_acceptable_certs(STACK_OF(X509) *certs,
     return 1;
 }
 
+/*
+ * internal function
+ *
+ * Get the certs with the given subject name from the given store, making use
+ * of the store's index of objects sorted by subject name (and of any lookup
+ * methods of the store) rather than copying all certs held in the store.
+ * returns NULL if there is no such cert or on error
+ */
+static STACK_OF(X509) *store_get1_certs_by_subject(const X509_STORE *ts,
+                                                   X509_NAME *name)
+{
+    X509_STORE_CTX *csc = X509_STORE_CTX_new();
+    STACK_OF(X509) *certs = NULL;
+
+    if (csc != NULL && X509_STORE_CTX_init(csc, (X509_STORE *)ts, NULL, NULL))
+        certs = X509_STORE_CTX_get1_certs(csc, name);
+    X509_STORE_CTX_free(csc);
+    return certs;
+}
+
 /*
  * internal function
  *
@@ -458,7 +512,12 @@ static STACK_OF(X509) *find_server_cert(const X509_STORE *ts,
     if ((found_certs = sk_X509_new_null()) == NULL)
         goto oom;
 
-    trusted = CMP_X509_STORE_get1_certs(ts);
+    /* only certs with subject matching the sender name can be acceptable */
+    if (msg->header.sender->d.directoryName != NULL)
+        trusted = store_get1_certs_by_subject(ts,
+                                    msg->header.sender->d.directoryName);
+    else
+        trusted = CMP_X509_STORE_get1_certs(ts);
     ret = find_acceptable_certs(trusted, msg, ts, found_certs);
     sk_X509_pop_free(trusted, X509_free);
     if (!ret)
@@ -506,11 +565,270 @@ static int srv_cert_valid_3gpp(CMP_CTX *ctx, const X509 *scrt,
     return valid;
 }
 
-static X509 *find_srvcert(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
+/*
+ * creates a cache of validated server certificates, which may be shared among
+ * any number of CMP_CTX instances, also across threads.
+ * ttl gives the maximal number of seconds a cached cert may be used without
+ * being validated again, where 0 means no limit.
+ * returns pointer to CMP_SRVCERT_CACHE on success, NULL on error
+ */
+CMP_SRVCERT_CACHE *CMP_SRVCERT_CACHE_new(long ttl)
+{
+    CMP_SRVCERT_CACHE *cache = NULL;
+
+    if (ttl < 0) {
+        CMPerr(CMP_F_CMP_SRVCERT_CACHE_NEW, CMP_R_INVALID_ARGS);
+        return NULL;
+    }
+    if ((cache = OPENSSL_zalloc(sizeof(*cache))) == NULL ||
+        (cache->lock = CRYPTO_THREAD_lock_new()) == NULL) {
+        OPENSSL_free(cache);
+        CMPerr(CMP_F_CMP_SRVCERT_CACHE_NEW, CMP_R_OUT_OF_MEMORY);
+        return NULL;
+    }
+    cache->ttl = ttl;
+    cache->references = 1;
+    return cache;
+}
+
+/*
+ * increments the reference count of the given cache
+ * returns 1 on success, 0 on error
+ */
+int CMP_SRVCERT_CACHE_up_ref(CMP_SRVCERT_CACHE *cache)
+{
+    int refs;
+
+    if (cache == NULL)
+        return 0;
+    return CRYPTO_atomic_add(&cache->references, 1, &refs, cache->lock) &&
+        refs > 1;
+}
+
+/*
+ * internal function
+ * releases the contents of the given cache entry and marks it as unused
+ */
+static void srvcert_cache_entry_clear(CMP_SRVCERT_CACHE_ENTRY *e)
+{
+    X509_free(e->cert);
+    X509_STORE_free(e->store);
+    X509_NAME_free(e->sender);
+    ASN1_OCTET_STRING_free(e->kid);
+    memset(e, 0, sizeof(*e));
+}
+
+/*
+ * decrements the reference count of the given cache and frees it
+ * when no more references are left
+ */
+void CMP_SRVCERT_CACHE_free(CMP_SRVCERT_CACHE *cache)
+{
+    int i, refs;
+
+    if (cache == NULL ||
+        !CRYPTO_atomic_add(&cache->references, -1, &refs, cache->lock) ||
+        refs > 0)
+        return;
+    for (i = 0; i < CMP_SRVCERT_CACHE_SIZE; i++)
+        srvcert_cache_entry_clear(&cache->entries[i]);
+    CRYPTO_THREAD_lock_free(cache->lock);
+    OPENSSL_free(cache);
+}
+
+/*
+ * removes all entries from the given cache. This needs to be done whenever
+ * certificates have been removed from the trust stores used by the contexts
+ * sharing the cache or whenever revocation information has been updated.
+ */
+void CMP_SRVCERT_CACHE_flush(CMP_SRVCERT_CACHE *cache)
+{
+    int i;
+
+    if (cache == NULL || !CRYPTO_THREAD_write_lock(cache->lock))
+        return;
+    for (i = 0; i < CMP_SRVCERT_CACHE_SIZE; i++)
+        srvcert_cache_entry_clear(&cache->entries[i]);
+    cache->next = 0;
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * internal function
+ * checks if the given cache entry is for the given store, sender, and kid
+ */
+static int srvcert_cache_entry_matches(const CMP_SRVCERT_CACHE_ENTRY *e,
+                                       const X509_STORE *store,
+                                       const X509_NAME *sender,
+                                       const ASN1_OCTET_STRING *kid)
+{
+    if (e->cert == NULL || e->store != store ||
+        X509_NAME_cmp(e->sender, sender) != 0)
+        return 0;
+    if (e->kid == NULL || kid == NULL)
+        return e->kid == kid;
+    return ASN1_OCTET_STRING_cmp(e->kid, kid) == 0;
+}
+
+/*
+ * internal function
+ * looks up a server cert validated against the given store for the sender
+ * and senderKID of the given message, which is not stale and still acceptable
+ * returns the cert with its reference count incremented, or NULL if none
+ */
+static X509 *srvcert_cache_get1(CMP_SRVCERT_CACHE *cache,
+                                const X509_STORE *store,
+                                const CMP_PKIMESSAGE *msg)
+{
+    X509 *cert = NULL;
+    time_t now = time(NULL);
+    int i;
+
+    if (!CRYPTO_THREAD_read_lock(cache->lock))
+        return NULL;
+    for (i = 0; i < CMP_SRVCERT_CACHE_SIZE; i++) {
+        CMP_SRVCERT_CACHE_ENTRY *e = &cache->entries[i];
+
+        if (srvcert_cache_entry_matches(e, store,
+                                        msg->header.sender->d.directoryName,
+                                        msg->header.senderKID)) {
+            if ((e->expires == 0 || now < e->expires) && X509_up_ref(e->cert))
+                cert = e->cert;
+            break;
+        }
+    }
+    CRYPTO_THREAD_unlock(cache->lock);
+    if (cert != NULL && !cert_acceptable(cert, msg, store)) {
+        X509_free(cert);
+        cert = NULL;
+    }
+    return cert;
+}
+
+/*
+ * internal function
+ * removes the entry holding the given cert for the store, sender, and
+ * senderKID of the given message, e.g., because it failed to verify the
+ * message after the server has changed its key
+ */
+static void srvcert_cache_remove(CMP_SRVCERT_CACHE *cache,
+                                 const X509_STORE *store,
+                                 const CMP_PKIMESSAGE *msg, const X509 *cert)
+{
+    int i;
+
+    if (!CRYPTO_THREAD_write_lock(cache->lock))
+        return;
+    for (i = 0; i < CMP_SRVCERT_CACHE_SIZE; i++) {
+        CMP_SRVCERT_CACHE_ENTRY *e = &cache->entries[i];
+
+        if (srvcert_cache_entry_matches(e, store,
+                                        msg->header.sender->d.directoryName,
+                                        msg->header.senderKID)
+                && X509_cmp(e->cert, cert) == 0)
+            srvcert_cache_entry_clear(e);
+    }
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * internal function
+ * determines the number of seconds until the earliest nextUpdate time of
+ * the CRLs held in the given store, after which revocation information
+ * is to be refreshed and cached validation results must not be used anymore
+ * returns -1 if there is no CRL with nextUpdate in the store
+ */
+static long crls_next_update(X509_STORE *store)
+{
+    STACK_OF(X509_OBJECT) *objs;
+    long min = -1;
+    int i;
+
+    if (!X509_STORE_lock(store))
+        return 0;
+    objs = X509_STORE_get0_objects(store);
+    for (i = 0; i < sk_X509_OBJECT_num(objs); i++) {
+        X509_OBJECT *obj = sk_X509_OBJECT_value(objs, i);
+        const ASN1_TIME *next;
+        int days, secs;
+        long diff;
+
+        if (X509_OBJECT_get_type(obj) != X509_LU_CRL ||
+            (next = X509_CRL_get0_nextUpdate(X509_OBJECT_get0_X509_CRL(obj)))
+            == NULL)
+            continue;
+        if (!ASN1_TIME_diff(&days, &secs, NULL, next)) {
+            min = 0;
+            break;
+        }
+        diff = days * 86400L + secs;
+        if (diff < 0)
+            diff = 0;
+        if (min < 0 || diff < min)
+            min = diff;
+    }
+    X509_STORE_unlock(store);
+    return min;
+}
+
+/*
+ * internal function
+ * stores the given server cert, which has been validated against the given
+ * store, for the sender and senderKID of the given message in the cache.
+ * The entry expires after the ttl of the cache or at the nextUpdate time of
+ * the CRLs in the store, whichever comes first.
+ * failing to store is not an error; the cert is just validated again next time
+ */
+static void srvcert_cache_add(CMP_SRVCERT_CACHE *cache, X509_STORE *store,
+                              const CMP_PKIMESSAGE *msg, X509 *cert)
+{
+    const X509_NAME *sender = msg->header.sender->d.directoryName;
+    const ASN1_OCTET_STRING *kid = msg->header.senderKID;
+    CMP_SRVCERT_CACHE_ENTRY *e = NULL;
+    long lifetime = crls_next_update(store);
+    int i;
+
+    if (cache->ttl > 0 && (lifetime < 0 || lifetime > cache->ttl))
+        lifetime = cache->ttl;
+    if (lifetime == 0)
+        return; /* revocation information is stale or unclear */
+    if (!CRYPTO_THREAD_write_lock(cache->lock))
+        return;
+    for (i = 0; i < CMP_SRVCERT_CACHE_SIZE; i++)
+        if (srvcert_cache_entry_matches(&cache->entries[i], store, sender, kid))
+            e = &cache->entries[i];
+    if (e == NULL) {
+        e = &cache->entries[cache->next];
+        cache->next = (cache->next + 1) % CMP_SRVCERT_CACHE_SIZE;
+    }
+    srvcert_cache_entry_clear(e);
+    if ((e->sender = X509_NAME_dup((X509_NAME *)sender)) == NULL ||
+        (kid != NULL && (e->kid = ASN1_OCTET_STRING_dup(kid)) == NULL) ||
+        !X509_STORE_up_ref(store)) {
+        srvcert_cache_entry_clear(e);
+    } else {
+        e->store = store;
+        e->expires = lifetime > 0 ? time(NULL) + lifetime : 0;
+        X509_up_ref(cert);
+        e->cert = cert;
+    }
+    CRYPTO_THREAD_unlock(cache->lock);
+}
+
+/*
+ * internal function
+ * determines the server cert to use for verifying the given message,
+ * setting *cached to 1 if it has been taken from ctx->srvcert_cache, else 0
+ * returns the cert, owned by ctx, or NULL if none has been found
+ */
+static X509 *find_srvcert(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg,
+                          int *cached)
 {
     X509 *scrt = NULL;
     int valid = 0;
-    GENERAL_NAME *sender = msg->header->sender;
+    GENERAL_NAME *sender = msg->header.sender;
+
+    *cached = 0;
 
     if (sender == NULL || msg->body == NULL)
         return 0; /* other NULL cases already have been checked */
@@ -528,8 +846,20 @@ static X509 *find_srvcert(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
         cert_acceptable(ctx->validatedSrvCert, msg, ctx->trusted_store)) {
         scrt = ctx->validatedSrvCert;
         valid = 1;
+    } else if (ctx->srvcert_cache != NULL &&
+               (scrt = srvcert_cache_get1(ctx->srvcert_cache,
+                                          ctx->trusted_store, msg)) != NULL) {
+        /* validated earlier, possibly in a different ctx using the cache */
+        X509_free(ctx->validatedSrvCert);
+        ctx->validatedSrvCert = scrt;
+        if (!CMP_sk_X509_add1_certs(ctx->untrusted_certs,
+                        msg->extraCerts, 1/* no self-signed */, 1/* no dups */))
+            return NULL;
+        *cached = 1;
+        valid = 1;
     } else {
         STACK_OF(X509) *found_crts = NULL;
+        int trusted_3gpp = 0;
         int i;
 
         /* tentatively set error, which allows accumulating diagnostic info */
@@ -564,7 +894,7 @@ static X509 *find_srvcert(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
                 CMP_PKIMESSAGE_get_bodytype(msg) == V_CMP_PKIBODY_IP) {
             for (i = 0; !valid && i < sk_X509_num(found_crts); i++) {
                 scrt = sk_X509_value(found_crts, i);
-                valid = srv_cert_valid_3gpp(ctx, scrt, msg);
+                valid = trusted_3gpp = srv_cert_valid_3gpp(ctx, scrt, msg);
             }
         }
 
@@ -572,6 +902,10 @@ static X509 *find_srvcert(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
             /* store trusted srv cert for future msgs of same transaction */
             X509_up_ref(scrt);
             ctx->validatedSrvCert = scrt;
+            /* and for other transactions unless trusted only for this one */
+            if (ctx->srvcert_cache != NULL && !trusted_3gpp)
+                srvcert_cache_add(ctx->srvcert_cache, ctx->trusted_store, msg,
+                                  scrt);
             (void)ERR_pop_to_mark();
                         /* discard any diagnostic info on finding server cert */
         } else {
@@ -585,8 +919,9 @@ static X509 *find_srvcert(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
 
 /*
  * Validates the protection of the given PKIMessage using either password-
- * based mac (PBM) or a signature algorithm. In the case of signature algorithm,
- * the certificate can be provided in ctx->srvCert,
+ * based mac (PBM), DH-based mac (DHBM) with our DH key in ctx->pkey, or a
+ * signature algorithm. In the case of DHBM or signature algorithm, the
+ * sender's certificate can be provided in ctx->srvCert,
  * else it is taken from extraCerts and validated against ctx->trusted_store
  * utilizing ctx->untrusted_certs and extraCerts.
  *
@@ -605,19 +940,20 @@ int CMP_validate_msg(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
 #endif
     ASN1_OBJECT *algorOID = NULL;
     X509 *scrt = NULL;
+    int cached = 0, verified;
 
-    if (ctx == NULL || msg == NULL || msg->header == NULL ||
-        msg->header->protectionAlg == NULL) /* unprotected message */
+    if (ctx == NULL || msg == NULL ||
+        msg->header.protectionAlg == NULL) /* unprotected message */
         return 0;
 
     /* determine the nid for the used protection algorithm */
-    X509_ALGOR_get0(&algorOID, NULL, NULL, msg->header->protectionAlg);
+    X509_ALGOR_get0(&algorOID, NULL, NULL, msg->header.protectionAlg);
     nid = OBJ_obj2nid(algorOID);
 
     switch (nid) {
         /* 5.1.3.1.  Shared Secret Information */
     case NID_id_PasswordBasedMAC:
-        if (CMP_verify_PBMAC(msg, ctx->secretValue)) {
+        if (CMP_verify_PBMAC(msg, ctx->secretValue, ctx->pbm_cache)) {
             /*
              * RFC 4210, 5.3.2: 'Note that if the PKI Message Protection is
              * "shared secret information", then any certificate transported in
@@ -638,12 +974,11 @@ int CMP_validate_msg(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
         }
         return 0;
 
-        /* TODO: 5.1.3.2.  DH Key Pairs --> feature request #33 */
+        /*
+         * 5.1.3.2.  DH Key Pairs
+         * the sender's DH certificate is determined like a signer certificate
+         */
     case NID_id_DHBasedMac:
-        CMPerr(CMP_F_CMP_VALIDATE_MSG,
-               CMP_R_UNSUPPORTED_PROTECTION_ALG_DHBASEDMAC);
-        break;
-
         /*
          * 5.1.3.3.  Signature */
         /* TODO: should that better white-list DSA/RSA etc.?
@@ -652,7 +987,7 @@ int CMP_validate_msg(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
     default:
 
         /* validate sender name of received msg */
-        if (msg->header->sender->type != GEN_DIRNAME) {
+        if (msg->header.sender->type != GEN_DIRNAME) {
             CMPerr(CMP_F_CMP_VALIDATE_MSG,
                    CMP_R_SENDER_GENERALNAME_TYPE_NOT_SUPPORTED);
             return 0; /* FR#42: support for more than X509_NAME */
@@ -663,7 +998,7 @@ int CMP_validate_msg(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
          * entity of a trusted hierarchy.
          */
         if (ctx->expected_sender) { /* set explicitly or subj of ctx->srvCert */
-            X509_NAME *sender_name = msg->header->sender->d.directoryName;
+            X509_NAME *sender_name = msg->header.sender->d.directoryName;
             if (X509_NAME_cmp(ctx->expected_sender, sender_name) != 0) {
                 CMPerr(CMP_F_CMP_VALIDATE_MSG, CMP_R_UNEXPECTED_SENDER);
                 add_name_mismatch_data("", ctx->expected_sender, sender_name);
@@ -671,12 +1006,36 @@ int CMP_validate_msg(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg)
             }
         }/* Note: if recipient was NULL-DN it could be learned here if needed */
 
-        if (ctx->srvCert && !check_kid(ctx->srvCert, msg->header->senderKID,
+        if (ctx->srvCert && !check_kid(ctx->srvCert, msg->header.senderKID,
                                        CMP_F_CMP_VALIDATE_MSG))
             return 0;
 
-        if ((scrt = ctx->srvCert ? ctx->srvCert : find_srvcert(ctx, msg))) {
-            if (CMP_verify_signature(ctx, msg, scrt))
+        scrt = ctx->srvCert;
+        if (scrt == NULL && (scrt = find_srvcert(ctx, msg, &cached)) != NULL
+                && cached) {
+            (void)ERR_set_mark();
+            verified = nid == NID_id_DHBasedMac
+                ? CMP_verify_DHBMAC(ctx, msg, scrt)
+                : CMP_verify_signature(ctx, msg, scrt);
+            if (verified) {
+                (void)ERR_clear_last_mark();
+                return 1;
+            }
+            (void)ERR_pop_to_mark();
+            /*
+             * the cached cert may be outdated, e.g., after the server has
+             * changed its key, so drop it and search again among extraCerts
+             * and the trusted and untrusted certs
+             */
+            srvcert_cache_remove(ctx->srvcert_cache, ctx->trusted_store, msg,
+                                 scrt);
+            X509_free(ctx->validatedSrvCert);
+            ctx->validatedSrvCert = NULL;
+            scrt = find_srvcert(ctx, msg, &cached);
+        }
+        if (scrt != NULL) {
+            if (nid == NID_id_DHBasedMac ? CMP_verify_DHBMAC(ctx, msg, scrt)
+                                         : CMP_verify_signature(ctx, msg, scrt))
                 return 1;
             put_cert_verify_err(CMP_F_CMP_VALIDATE_MSG);
         }
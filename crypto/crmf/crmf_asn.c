@@ -229,8 +229,8 @@ IMPLEMENT_ASN1_FUNCTIONS(CRMF_CERTTEMPLATE)
 
 
 ASN1_SEQUENCE(CRMF_CERTREQUEST) = {
-    ASN1_SIMPLE(CRMF_CERTREQUEST, certReqId, ASN1_INTEGER),
-    ASN1_SIMPLE(CRMF_CERTREQUEST, certTemplate, CRMF_CERTTEMPLATE),
+    ASN1_EMBED(CRMF_CERTREQUEST, certReqId, ASN1_INTEGER),
+    ASN1_EMBED(CRMF_CERTREQUEST, certTemplate, CRMF_CERTTEMPLATE),
     ASN1_SEQUENCE_OF_OPT(CRMF_CERTREQUEST, controls, CRMF_ATTRIBUTETYPEANDVALUE)
 } ASN1_SEQUENCE_END(CRMF_CERTREQUEST)
 IMPLEMENT_ASN1_FUNCTIONS(CRMF_CERTREQUEST)
@@ -238,7 +238,7 @@ IMPLEMENT_ASN1_DUP_FUNCTION(CRMF_CERTREQUEST)
 
 
 ASN1_SEQUENCE(CRMF_CERTREQMSG) = {
-    ASN1_SIMPLE(CRMF_CERTREQMSG, certReq, CRMF_CERTREQUEST),
+    ASN1_EMBED(CRMF_CERTREQMSG, certReq, CRMF_CERTREQUEST),
     ASN1_OPT(CRMF_CERTREQMSG, popo, CRMF_PROOFOFPOSSESION),
     ASN1_SEQUENCE_OF_OPT(CRMF_CERTREQMSG, regInfo, CRMF_ATTRIBUTETYPEANDVALUE)
 } ASN1_SEQUENCE_END(CRMF_CERTREQMSG)
@@ -16,6 +16,8 @@
 static const ERR_STRING_DATA CRMF_str_functs[] = {
     {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_CERTREQMSG_CREATE_POPO, 0),
      "CRMF_CERTREQMSG_create_popo"},
+    {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_CERTREQMSG_GET_CERTREQID, 0),
+     "CRMF_CERTREQMSG_get_certReqId"},
     {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_CERTREQMSG_PUSH0_EXTENSION, 0),
      "CRMF_CERTREQMSG_push0_extension"},
     {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_CERTREQMSG_PUSH0_REGCTRL, 0),
@@ -40,7 +42,11 @@ static const ERR_STRING_DATA CRMF_str_functs[] = {
      "CRMF_CERTREQMSG_set_version2"},
     {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_PASSWORDBASEDMAC_NEW, 0),
      "CRMF_passwordBasedMac_new"},
+    {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_PASSWORDBASEDMAC_NEW_EX, 0),
+     "CRMF_passwordBasedMac_new_ex"},
     {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_PBMP_NEW, 0), "CRMF_pbmp_new"},
+    {ERR_PACK(ERR_LIB_CRMF, CRMF_F_CRMF_PBM_CACHE_NEW, 0),
+     "CRMF_PBM_CACHE_new"},
     {ERR_PACK(ERR_LIB_CRMF, CRMF_F_POPOSIGKEY_NEW, 0), "poposigkey_new"},
     {0, NULL}
 };
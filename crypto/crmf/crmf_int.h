@@ -238,6 +238,27 @@ struct crmf_pbmparameter_st {
 DECLARE_ASN1_FUNCTIONS(CRMF_PBMPARAMETER)
 #define CRMF_PBM_MAX_ITERATION_COUNT 100000 /* manipulated cnt leads to DoS */
 
+/*
+ * cache of PBM base keys, i.e., the result of the salted owf iterations,
+ * keyed by the secret, salt, owf, and iteration count they were derived from
+ */
+#define CRMF_PBM_CACHE_SIZE 4
+typedef struct crmf_pbm_cache_entry_st {
+    unsigned char *secret; /* NULL if entry is unused */
+    size_t secretLen;
+    unsigned char *salt;
+    size_t saltLen;
+    int owf_nid;
+    long iterations;
+    unsigned char basekey[EVP_MAX_MD_SIZE];
+    unsigned int basekeyLen;
+} CRMF_PBM_CACHE_ENTRY;
+
+struct crmf_pbm_cache_st {
+    CRMF_PBM_CACHE_ENTRY entries[CRMF_PBM_CACHE_SIZE];
+    int next; /* entry to be replaced next */
+} /* CRMF_PBM_CACHE */;
+
 /*
  * POPOSigningKeyInput ::= SEQUENCE {
  * authInfo                        CHOICE {
@@ -325,8 +346,8 @@ DECLARE_ASN1_FUNCTIONS(CRMF_OPTIONALVALIDITY)
  * controls          Controls OPTIONAL }   -- Attributes affecting issuance
  */
 struct crmf_certrequest_st {
-    ASN1_INTEGER *certReqId;
-    CRMF_CERTTEMPLATE *certTemplate;
+    ASN1_INTEGER certReqId; /* embedded */
+    CRMF_CERTTEMPLATE certTemplate; /* embedded */
     /* TODO: make CRMF_CONTROLS out of that - but only cosmetical */
     STACK_OF(CRMF_ATTRIBUTETYPEANDVALUE) *controls;
 } /* CRMF_CERTREQUEST */;
@@ -378,7 +399,7 @@ CRMF_ATTRIBUTETYPEANDVALUE *CRMF_ATTRIBUTETYPEANDVALUE_dup(
  * regInfo   SEQUENCE SIZE(1..MAX) OF AttributeTypeAndValue OPTIONAL }
  */
 struct crmf_certreqmsg_st {
-    CRMF_CERTREQUEST *certReq;
+    CRMF_CERTREQUEST certReq; /* embedded */
     /* 0 */
     CRMF_PROOFOFPOSSESION *popo;
     /* 1 */
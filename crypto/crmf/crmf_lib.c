@@ -70,16 +70,16 @@ static int CRMF_CERTREQMSG_push0_regCtrl(CRMF_CERTREQMSG *crm,
 {
     int new = 0;
 
-    if (!crm || !crm->certReq || !ctrl)
+    if (!crm || !ctrl)
         goto err;
 
-    if (!(crm->certReq->controls)) {
-        if (!(crm->certReq->controls =
+    if (!(crm->certReq.controls)) {
+        if (!(crm->certReq.controls =
                                       sk_CRMF_ATTRIBUTETYPEANDVALUE_new_null()))
             goto err;
         new = 1;
     }
-    if (!sk_CRMF_ATTRIBUTETYPEANDVALUE_push(crm->certReq->controls, ctrl))
+    if (!sk_CRMF_ATTRIBUTETYPEANDVALUE_push(crm->certReq.controls, ctrl))
         goto err;
 
     return 1;
@@ -87,8 +87,8 @@ static int CRMF_CERTREQMSG_push0_regCtrl(CRMF_CERTREQMSG *crm,
     CRMFerr(CRMF_F_CRMF_CERTREQMSG_PUSH0_REGCTRL, CRMF_R_ERROR);
 
     if (new) {
-        sk_CRMF_ATTRIBUTETYPEANDVALUE_free(crm->certReq->controls);
-        crm->certReq->controls = NULL;
+        sk_CRMF_ATTRIBUTETYPEANDVALUE_free(crm->certReq.controls);
+        crm->certReq.controls = NULL;
     }
     return 0;
 }
@@ -191,9 +191,9 @@ IMPLEMENT_CRMF_CTRL_FUNC(certReq, CRMF_CERTREQUEST, regInfo)
 
 
 static CRMF_CERTTEMPLATE *tmpl(CRMF_CERTREQMSG *crm) {
-    if (crm->certReq == NULL)
+    if (crm == NULL)
         return NULL;
-    return crm->certReq->certTemplate;
+    return &crm->certReq.certTemplate;
 }
 
 
@@ -246,15 +246,25 @@ int CRMF_CERTREQMSG_set_validity(CRMF_CERTREQMSG *crm, time_t from, time_t to)
 
 int CRMF_CERTREQMSG_set_certReqId(CRMF_CERTREQMSG *crm, long rid)
 {
-    if (crm == NULL || crm->certReq == NULL)
+    if (crm == NULL)
         goto err;
 
-    return ASN1_INTEGER_set(crm->certReq->certReqId, rid);
+    return ASN1_INTEGER_set(&crm->certReq.certReqId, rid);
  err:
     CRMFerr(CRMF_F_CRMF_CERTREQMSG_SET_CERTREQID, CRMF_R_ERROR);
     return 0;
 }
 
+/* returns the certReqId of the given CRMF_CERTREQMSG, or -1 on error */
+long CRMF_CERTREQMSG_get_certReqId(CRMF_CERTREQMSG *crm)
+{
+    if (crm == NULL) {
+        CRMFerr(CRMF_F_CRMF_CERTREQMSG_GET_CERTREQID, CRMF_R_NULL_ARGUMENT);
+        return -1;
+    }
+    return ASN1_INTEGER_get(&crm->certReq.certReqId);
+}
+
 
 int CRMF_CERTREQMSG_set1_publicKey(CRMF_CERTREQMSG *crm, const EVP_PKEY *pkey)
 {
@@ -439,7 +449,7 @@ int CRMF_CERTREQMSG_create_popo(CRMF_CERTREQMSG *crm, const EVP_PKEY *pkey,
         break;
 
     case CRMF_POPO_SIGNATURE:
-        if ((pp->value.signature = poposigkey_new(crm->certReq, pkey, dgst))
+        if ((pp->value.signature = poposigkey_new(&crm->certReq, pkey, dgst))
             == NULL)
             goto err;
         pp->type = CRMF_PROOFOFPOSESSION_SIGNATURE;
@@ -20,6 +20,7 @@
 #include <openssl/hmac.h>
 #include <openssl/err.h>
 #include <openssl/crypto.h>
+#include <string.h>
 #include "crmf_int.h"
 
 /*
@@ -108,6 +109,105 @@ CRMF_PBMPARAMETER *CRMF_pbmp_new(size_t slen, int owfnid,
     return NULL;
 }
 
+/*
+ * allocates an empty cache for PBM base keys, to be passed to
+ * CRMF_passwordBasedMac_new_ex()
+ * returns pointer to CRMF_PBM_CACHE on success, NULL on error
+ */
+CRMF_PBM_CACHE *CRMF_PBM_CACHE_new(void)
+{
+    CRMF_PBM_CACHE *cache = OPENSSL_zalloc(sizeof(*cache));
+
+    if (cache == NULL)
+        CRMFerr(CRMF_F_CRMF_PBM_CACHE_NEW, CRMF_R_MALLOC_FAILURE);
+    return cache;
+}
+
+/*
+ * internal function
+ * wipes the given cache entry and marks it as unused
+ */
+static void pbm_cache_entry_clear(CRMF_PBM_CACHE_ENTRY *e)
+{
+    OPENSSL_clear_free(e->secret, e->secretLen);
+    OPENSSL_free(e->salt);
+    OPENSSL_cleanse(e->basekey, sizeof(e->basekey));
+    memset(e, 0, sizeof(*e));
+}
+
+/*
+ * frees the given cache, wiping all base keys and secrets held in it
+ */
+void CRMF_PBM_CACHE_free(CRMF_PBM_CACHE *cache)
+{
+    int i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < CRMF_PBM_CACHE_SIZE; i++)
+        pbm_cache_entry_clear(&cache->entries[i]);
+    OPENSSL_free(cache);
+}
+
+/*
+ * internal function
+ * looks up the base key for the given secret and PBM parameters in the cache
+ * returns pointer to the matching entry, or NULL if there is none
+ */
+static CRMF_PBM_CACHE_ENTRY *pbm_cache_find(CRMF_PBM_CACHE *cache,
+                                            const CRMF_PBMPARAMETER *pbm,
+                                            int owf_nid, long iterations,
+                                            const unsigned char *secret,
+                                            size_t secretLen)
+{
+    CRMF_PBM_CACHE_ENTRY *e;
+    int i;
+
+    if (cache == NULL)
+        return NULL;
+    for (i = 0; i < CRMF_PBM_CACHE_SIZE; i++) {
+        e = &cache->entries[i];
+        if (e->secret != NULL
+                && e->owf_nid == owf_nid && e->iterations == iterations
+                && e->saltLen == (size_t)pbm->salt->length
+                && memcmp(e->salt, pbm->salt->data, e->saltLen) == 0
+                && e->secretLen == secretLen
+                && CRYPTO_memcmp(e->secret, secret, secretLen) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+ * internal function
+ * stores the given base key in the cache, replacing the oldest entry
+ * failing to store is not an error; the key is just recomputed next time
+ */
+static void pbm_cache_add(CRMF_PBM_CACHE *cache, const CRMF_PBMPARAMETER *pbm,
+                          int owf_nid, long iterations,
+                          const unsigned char *secret, size_t secretLen,
+                          const unsigned char *basekey, unsigned int basekeyLen)
+{
+    CRMF_PBM_CACHE_ENTRY *e;
+
+    if (cache == NULL || secretLen == 0 || pbm->salt->length <= 0)
+        return;
+    e = &cache->entries[cache->next];
+    cache->next = (cache->next + 1) % CRMF_PBM_CACHE_SIZE;
+    pbm_cache_entry_clear(e);
+    if ((e->salt = OPENSSL_memdup(pbm->salt->data, pbm->salt->length)) == NULL
+            || (e->secret = OPENSSL_memdup(secret, secretLen)) == NULL) {
+        pbm_cache_entry_clear(e);
+        return;
+    }
+    e->secretLen = secretLen;
+    e->saltLen = pbm->salt->length;
+    e->owf_nid = owf_nid;
+    e->iterations = iterations;
+    memcpy(e->basekey, basekey, basekeyLen);
+    e->basekeyLen = basekeyLen;
+}
+
 /*
  * calculates the PBM based on the settings of the given CRMF_PBMPARAMETER
  * @pbm identifies the algorithms to use
@@ -126,17 +226,37 @@ int CRMF_passwordBasedMac_new(const CRMF_PBMPARAMETER *pbm,
                               const unsigned char *secret, size_t secretLen,
                               unsigned char **mac, unsigned int *macLen)
 {
-    int mac_nid, hmac_md_nid = NID_undef;
+    return CRMF_passwordBasedMac_new_ex(pbm, msg, msgLen, secret, secretLen,
+                                        NULL, mac, macLen);
+}
+
+/*
+ * same as CRMF_passwordBasedMac_new(), but if @cache is not NULL it is used to
+ * look up and store the base key derived from the secret and the salt, owf,
+ * and iterationCount in @pbm, such that the owf iterations are done only once
+ * for all messages using the same secret and PBM parameters
+ *
+ * returns 1 at success, 0 at error
+ */
+int CRMF_passwordBasedMac_new_ex(const CRMF_PBMPARAMETER *pbm,
+                                 const unsigned char *msg, size_t msgLen,
+                                 const unsigned char *secret,
+                                 size_t secretLen, CRMF_PBM_CACHE *cache,
+                                 unsigned char **mac, unsigned int *macLen)
+{
+    int mac_nid, owf_nid, hmac_md_nid = NID_undef;
     const EVP_MD *m = NULL;
     EVP_MD_CTX *ctx = NULL;
+    CRMF_PBM_CACHE_ENTRY *cached = NULL;
     unsigned char basekey[EVP_MAX_MD_SIZE];
-    unsigned int basekeyLen;
+    unsigned int basekeyLen = 0;
 #if OPENSSL_VERSION_NUMBER > 0x10100000L
     uint64_t
 #else
     long
 #endif
          iterations;
+    long itercnt;
     int error = CRMF_R_CRMFERROR;
 
     if (mac == NULL || pbm == NULL || pbm->mac == NULL ||
@@ -160,23 +280,8 @@ int CRMF_passwordBasedMac_new(const CRMF_PBMPARAMETER *pbm,
         error = CRMF_R_UNSUPPORTED_ALGORITHM;
         goto err;
     }
+    owf_nid = OBJ_obj2nid(pbm->owf->algorithm);
 
-    if ((ctx = EVP_MD_CTX_create()) == NULL) {
-        error = CRMF_R_MALLOC_FAILURE;
-        goto err;
-    }
-
-    /* compute the basekey of the salted secret */
-    if (!(EVP_DigestInit_ex(ctx, m, NULL)))
-        goto err;
-    /* first the secret */
-    if (!EVP_DigestUpdate(ctx, secret, secretLen))
-        goto err;
-    /* then the salt */
-    if (!EVP_DigestUpdate(ctx, pbm->salt->data, pbm->salt->length))
-        goto err;
-    if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen)))
-        goto err;
     if (
 #if OPENSSL_VERSION_NUMBER > 0x10100000L
         !ASN1_INTEGER_get_uint64(&iterations, pbm->iterationCount)
@@ -189,15 +294,41 @@ int CRMF_passwordBasedMac_new(const CRMF_PBMPARAMETER *pbm,
         error = CRMF_R_BAD_PBM_ITERATIONCOUNT;
         goto err;
     }
+    itercnt = (long)iterations;
+
+    if ((cached = pbm_cache_find(cache, pbm, owf_nid, itercnt,
+                                 secret, secretLen)) != NULL) {
+        memcpy(basekey, cached->basekey, cached->basekeyLen);
+        basekeyLen = cached->basekeyLen;
+    } else {
+        if ((ctx = EVP_MD_CTX_create()) == NULL) {
+            error = CRMF_R_MALLOC_FAILURE;
+            goto err;
+        }
 
-    /* the first iteration was already done above */
-    while (--iterations > 0) {
+        /* compute the basekey of the salted secret */
         if (!(EVP_DigestInit_ex(ctx, m, NULL)))
             goto err;
-        if (!EVP_DigestUpdate(ctx, basekey, basekeyLen))
+        /* first the secret */
+        if (!EVP_DigestUpdate(ctx, secret, secretLen))
+            goto err;
+        /* then the salt */
+        if (!EVP_DigestUpdate(ctx, pbm->salt->data, pbm->salt->length))
             goto err;
         if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen)))
             goto err;
+
+        /* the first iteration was already done above */
+        while (--iterations > 0) {
+            if (!(EVP_DigestInit_ex(ctx, m, NULL)))
+                goto err;
+            if (!EVP_DigestUpdate(ctx, basekey, basekeyLen))
+                goto err;
+            if (!(EVP_DigestFinal_ex(ctx, basekey, &basekeyLen)))
+                goto err;
+        }
+        pbm_cache_add(cache, pbm, owf_nid, itercnt, secret, secretLen,
+                      basekey, basekeyLen);
     }
 
     /*
@@ -239,11 +370,13 @@ int CRMF_passwordBasedMac_new(const CRMF_PBMPARAMETER *pbm,
 
     return 1;
  err:
+    OPENSSL_cleanse(basekey, sizeof(basekey));
+    EVP_MD_CTX_destroy(ctx);
     if (mac && *mac) {
         OPENSSL_free(*mac);
         *mac = NULL;
     }
-    CRMFerr(CRMF_F_CRMF_PASSWORDBASEDMAC_NEW, error);
+    CRMFerr(CRMF_F_CRMF_PASSWORDBASEDMAC_NEW_EX, error);
     if (pbm && pbm->mac) {
         char buf[128];
         if (OBJ_obj2txt(buf, sizeof(buf), pbm->mac->algorithm, 0))
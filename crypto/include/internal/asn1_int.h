@@ -106,3 +106,7 @@ struct asn1_pctx_st {
 
 int asn1_valid_host(const ASN1_STRING *host);
 int asn1_d2i_read_bio(BIO *in, BUF_MEM **pb);
+int asn1_item_verify_tbs(EVP_MD_CTX *ctx, const ASN1_ITEM *it, X509_ALGOR *a,
+                         ASN1_BIT_STRING *signature, void *asn,
+                         const unsigned char *tbs, size_t tbslen,
+                         EVP_PKEY *pkey);
@@ -250,6 +250,7 @@ typedef ASN1_INTEGER CMP_PKISTATUS;
 
 /* Forward declarations */
 typedef struct cmp_ctx_st CMP_CTX;
+typedef struct cmp_certreq_template_st CMP_CERTREQ_TEMPLATE;
 typedef struct cmp_pkiheader_st CMP_PKIHEADER;
 typedef struct cmp_pkimessage_st CMP_PKIMESSAGE;
 typedef struct cmp_certstatus_st CMP_CERTSTATUS;
@@ -300,6 +301,17 @@ typedef int (*cmp_certConf_cb_t) (CMP_CTX *ctx, const X509 *cert, int failure,
 typedef BIO *(*cmp_http_cb_t) (CMP_CTX *ctx, BIO *hbio, int connect);
 typedef int (*cmp_transfer_cb_t) (CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
                                   CMP_PKIMESSAGE **res);
+/* phases of a transaction reported to the phase callback */
+# define CMP_PHASE_PROTECT     0 /* creating the protection of a message */
+# define CMP_PHASE_CONNECT     1 /* establishing the TCP connection */
+# define CMP_PHASE_TLS         2 /* TLS handshake */
+# define CMP_PHASE_ENCODE      3 /* DER-encoding the request with HTTP header */
+# define CMP_PHASE_TRANSFER    4 /* sending, server wait, and receiving */
+# define CMP_PHASE_DECODE      5 /* decoding the response */
+# define CMP_PHASE_VALIDATE    6 /* CMP_validate_msg() incl. path building */
+# define CMP_PHASE_CERTCONF_CB 7 /* the certConf callback */
+typedef void (*cmp_phase_cb_t) (CMP_CTX *ctx, int phase, uint64_t start,
+                                uint64_t end, size_t bytes);
 typedef STACK_OF(ASN1_UTF8STRING) CMP_PKIFREETEXT;
 
 /*
@@ -337,6 +349,9 @@ typedef STACK_OF(ASN1_UTF8STRING) CMP_PKIFREETEXT;
 # define V_CMP_PKIBODY_POLLREP  26
 
 CMP_PKIMESSAGE *CMP_certreq_new(CMP_CTX *ctx, int bodytype, int err_code);
+CMP_CERTREQ_TEMPLATE *CMP_CERTREQ_TEMPLATE_new(const CMP_CTX *ctx);
+int CMP_CERTREQ_TEMPLATE_up_ref(CMP_CERTREQ_TEMPLATE *tmpl);
+void CMP_CERTREQ_TEMPLATE_free(CMP_CERTREQ_TEMPLATE *tmpl);
 CMP_PKIMESSAGE *CMP_rr_new(CMP_CTX *ctx);
 CMP_PKIMESSAGE *CMP_certConf_new(CMP_CTX *ctx, int failure, const char *text);
 CMP_PKIMESSAGE *CMP_genm_new(CMP_CTX *ctx);
@@ -355,6 +370,7 @@ void CMP_add_error_txt(const char *separator, const char *txt);
 # define TRANSACTIONID_LENGTH 16
 # define SENDERNONCE_LENGTH 16
 CMP_PKIHEADER *CMP_PKIMESSAGE_get0_header(const CMP_PKIMESSAGE *msg);
+void CMP_PKIMESSAGE_modified(CMP_PKIMESSAGE *msg);
 ASN1_OCTET_STRING *CMP_PKIHEADER_get0_transactionID(const CMP_PKIHEADER *hdr);
 ASN1_OCTET_STRING *CMP_PKIHEADER_get0_senderNonce(const CMP_PKIHEADER *hdr);
 ASN1_OCTET_STRING *CMP_PKIHEADER_get0_recipNonce(const CMP_PKIHEADER *hdr);
@@ -434,6 +450,11 @@ int CMP_validate_msg(CMP_CTX *ctx, const CMP_PKIMESSAGE *msg);
 int CMP_validate_cert_path(const CMP_CTX *ctx, const X509_STORE *trusted_store,
                            const X509 *cert, int defer_errors);
 int CMP_print_cert_verify_cb(int ok, X509_STORE_CTX *ctx);
+typedef struct cmp_srvcert_cache_st CMP_SRVCERT_CACHE;
+CMP_SRVCERT_CACHE *CMP_SRVCERT_CACHE_new(long ttl);
+int CMP_SRVCERT_CACHE_up_ref(CMP_SRVCERT_CACHE *cache);
+void CMP_SRVCERT_CACHE_free(CMP_SRVCERT_CACHE *cache);
+void CMP_SRVCERT_CACHE_flush(CMP_SRVCERT_CACHE *cache);
 
 /*
  * from cmp_http.c
@@ -463,6 +484,27 @@ X509 *CMP_exec_KUR_ses(CMP_CTX *ctx);
 X509 *CMP_exec_P10CR_ses(CMP_CTX *ctx);
 int CMP_exec_RR_ses(CMP_CTX *ctx);
 STACK_OF(CMP_INFOTYPEANDVALUE) *CMP_exec_GENM_ses(CMP_CTX *ctx);
+typedef struct cmp_ses_st CMP_SES;
+# define CMP_SES_ERROR      -1
+# define CMP_SES_DONE        0
+# define CMP_SES_WANT_READ   1
+# define CMP_SES_WANT_WRITE  2
+# define CMP_SES_WANT_TIMER  3
+# define CMP_SES_WANT_ASYNC  4
+CMP_SES *CMP_SES_start(CMP_CTX *ctx, int req_type);
+int CMP_SES_step(CMP_SES *ses);
+int CMP_SES_get_fd(const CMP_SES *ses);
+time_t CMP_SES_get_deadline(const CMP_SES *ses);
+void CMP_SES_free(CMP_SES *ses);
+typedef struct cmp_ses_sched_st CMP_SES_SCHED;
+typedef void (*cmp_ses_sched_cb_t) (CMP_SES *ses, int rv, void *arg);
+CMP_SES_SCHED *CMP_SES_SCHED_new(void);
+int CMP_SES_SCHED_add(CMP_SES_SCHED *sched, CMP_SES *ses, void *arg);
+int CMP_SES_SCHED_remove(CMP_SES_SCHED *sched, CMP_SES *ses);
+int CMP_SES_SCHED_num(const CMP_SES_SCHED *sched);
+time_t CMP_SES_SCHED_next_deadline(const CMP_SES_SCHED *sched);
+int CMP_SES_SCHED_run(CMP_SES_SCHED *sched, cmp_ses_sched_cb_t cb);
+void CMP_SES_SCHED_free(CMP_SES_SCHED *sched);
 /* exported just for testing: */
 int CMP_exchange_certConf(CMP_CTX *ctx, int failure, const char *txt);
 int CMP_exchange_error(CMP_CTX *ctx, int status, int failure, const char *txt);
@@ -486,6 +528,34 @@ int CMP_SRV_CTX_set_send_error(CMP_SRV_CTX *srv_ctx, int error);
 int CMP_SRV_CTX_set_checkAfterTime(CMP_SRV_CTX *srv_ctx, long seconds);
 int CMP_SRV_CTX_set_pollCount(CMP_SRV_CTX *srv_ctx, int count);
 int CMP_SRV_CTX_set_accept_raverified(CMP_SRV_CTX *srv_ctx, int raverified);
+int CMP_SRV_CTX_set_transaction_timeout(CMP_SRV_CTX *srv_ctx, long seconds);
+int CMP_SRV_CTX_set_http_timeout(CMP_SRV_CTX *srv_ctx, long seconds);
+int CMP_SRV_CTX_set_encoding_check(CMP_SRV_CTX *srv_ctx, int interval);
+int CMP_SRV_CTX_num_transactions(CMP_SRV_CTX *srv_ctx);
+typedef int (*cmp_srv_cert_request_cb_t)(CMP_SRV_CTX *srv_ctx,
+                                         const CMP_PKIMESSAGE *certReq,
+                                         int idx, CMP_PKISTATUSINFO **si,
+                                         X509 **certOut);
+typedef int (*cmp_srv_rr_cb_t)(CMP_SRV_CTX *srv_ctx, const X509_NAME *issuer,
+                               const ASN1_INTEGER *serial,
+                               CMP_PKISTATUSINFO **si);
+int CMP_SRV_CTX_set_cert_request_cb(CMP_SRV_CTX *srv_ctx,
+                                    cmp_srv_cert_request_cb_t cb);
+int CMP_SRV_CTX_set_rr_cb(CMP_SRV_CTX *srv_ctx, cmp_srv_rr_cb_t cb);
+int CMP_SRV_CTX_set_cb_arg(CMP_SRV_CTX *srv_ctx, void *arg);
+void *CMP_SRV_CTX_get_cb_arg(const CMP_SRV_CTX *srv_ctx);
+typedef struct cmp_popo_batch_st CMP_POPO_BATCH;
+CMP_POPO_BATCH *CMP_POPO_BATCH_new(CMP_SRV_CTX *srv_ctx);
+int CMP_POPO_BATCH_add(CMP_POPO_BATCH *batch, const CMP_PKIMESSAGE *req);
+int CMP_POPO_BATCH_num(const CMP_POPO_BATCH *batch);
+int CMP_POPO_BATCH_verify(CMP_POPO_BATCH *batch);
+int CMP_POPO_BATCH_get_result(const CMP_POPO_BATCH *batch, int idx);
+void CMP_POPO_BATCH_free(CMP_POPO_BATCH *batch);
+CMP_PKIMESSAGE *CMP_SRV_process_request(CMP_SRV_CTX *srv_ctx,
+                                        const CMP_PKIMESSAGE *req);
+# ifndef OPENSSL_NO_SOCK
+int CMP_SRV_http_serve(CMP_SRV_CTX *srv_ctx, BIO *cbio);
+# endif
 
 /* from cmp_asn.c */
 void CMP_INFOTYPEANDVALUE_set(CMP_INFOTYPEANDVALUE *itav,
@@ -500,6 +570,7 @@ CMP_PKIMESSAGE *CMP_PKIMESSAGE_dup(CMP_PKIMESSAGE *x);
 
 /* from cmp_ctx.c */
 CMP_CTX *CMP_CTX_create(void);
+CMP_CTX *CMP_CTX_dup(const CMP_CTX *tmpl);
 int CMP_CTX_init(CMP_CTX *ctx);
 X509_STORE *CMP_CTX_get0_trustedStore(CMP_CTX *ctx);
 int CMP_CTX_set0_trustedStore(CMP_CTX *ctx, X509_STORE *store);
@@ -515,11 +586,16 @@ int CMP_CTX_set_log_cb(CMP_CTX *ctx, cmp_log_cb_t cb);
 int CMP_CTX_set_certConf_cb(CMP_CTX *ctx, cmp_certConf_cb_t cb);
 int CMP_CTX_set_certConf_cb_arg(CMP_CTX *ctx, void *arg);
 void *CMP_CTX_get_certConf_cb_arg(CMP_CTX *ctx);
+int CMP_CTX_set_phase_cb(CMP_CTX *ctx, cmp_phase_cb_t cb);
+int CMP_CTX_set_phase_cb_arg(CMP_CTX *ctx, void *arg);
+void *CMP_CTX_get_phase_cb_arg(CMP_CTX *ctx);
 int CMP_CTX_set1_referenceValue(CMP_CTX *ctx, const unsigned char *ref,
                                 size_t len);
 int CMP_CTX_set1_secretValue(CMP_CTX *ctx, const unsigned char *sec,
                              const size_t len);
 int CMP_CTX_set1_srvCert(CMP_CTX *ctx, const X509 *cert);
+int CMP_CTX_set1_srvCert_cache(CMP_CTX *ctx, CMP_SRVCERT_CACHE *cache);
+int CMP_CTX_set1_certReqTemplate(CMP_CTX *ctx, CMP_CERTREQ_TEMPLATE *tmpl);
 int CMP_CTX_set1_clCert(CMP_CTX *ctx, const X509 *cert);
 int CMP_CTX_set1_oldClCert(CMP_CTX *ctx, const X509 *cert);
 int CMP_CTX_set1_p10CSR(CMP_CTX *ctx, const X509_REQ *csr);
@@ -527,6 +603,11 @@ int CMP_CTX_set1_issuer(CMP_CTX *ctx, const X509_NAME *name);
 int CMP_CTX_set1_subjectName(CMP_CTX *ctx, const X509_NAME *name);
 int CMP_CTX_set1_recipient(CMP_CTX *ctx, const X509_NAME *name);
 int CMP_CTX_subjectAltName_push1(CMP_CTX *ctx, const GENERAL_NAME *name);
+int CMP_CTX_certReq_push1(CMP_CTX *ctx, const EVP_PKEY *pkey,
+                          const X509_NAME *subject,
+                          const X509_EXTENSIONS *exts);
+int CMP_CTX_revCert_push1(CMP_CTX *ctx, const X509_NAME *issuer,
+                          const ASN1_INTEGER *serial);
 STACK_OF(X509) *CMP_CTX_caPubs_get1(CMP_CTX *ctx);
 X509 *CMP_CTX_caPubs_pop(CMP_CTX *ctx);
 int CMP_CTX_caPubs_num(CMP_CTX *ctx);
@@ -545,6 +626,8 @@ int CMP_CTX_extraCertsIn_num(CMP_CTX *ctx);
 
 int CMP_CTX_set1_newClCert(CMP_CTX *ctx, const X509 *cert);
 X509 *CMP_CTX_get0_newClCert(CMP_CTX *ctx);
+STACK_OF(X509) *CMP_CTX_newClCerts_get1(CMP_CTX *ctx);
+STACK_OF(CMP_PKISTATUSINFO) *CMP_CTX_get0_revStatus(const CMP_CTX *ctx);
 int CMP_CTX_set0_pkey(CMP_CTX *ctx, const EVP_PKEY *pkey);
 int CMP_CTX_set1_pkey(CMP_CTX *ctx, const EVP_PKEY *pkey);
 int CMP_CTX_set0_newPkey(CMP_CTX *ctx, const EVP_PKEY *pkey);
@@ -587,6 +670,13 @@ ASN1_OCTET_STRING *CMP_CTX_get0_recipNonce(CMP_CTX *ctx);
 # define CMP_CTX_OPT_IGNORE_KEYUSAGE 12
 # define CMP_CTX_OPT_SUBJECTALTNAME_NODEFAULT 13
 # define CMP_CTX_OPT_POLICIES_CRITICAL 14
+# define CMP_CTX_OPT_KEEP_ALIVE 15
+# define CMP_CTX_OPT_KEEP_ALIVE_IDLE 16
+# define CMP_CTX_OPT_KEEP_ALIVE_MAXREQ 17
+# define CMP_CTX_OPT_PBM_REUSE_SALT 18
+# define CMP_CTX_OPT_ASYNC 19
+# define CMP_CTX_OPT_DHBASEDMAC 20
+# define CMP_CTX_OPT_REVOCATION_BATCH 21
 int CMP_CTX_set_option(CMP_CTX *ctx, const int opt, const int val);
 # if 0
 int CMP_CTX_push_freeText(CMP_CTX *ctx, const char *text);
@@ -26,14 +26,20 @@ int ERR_load_CMP_strings(void);
 /*
  * CMP function codes.
  */
+#  define CMP_F_CERTREQS_INIT                              215
+#  define CMP_F_CHECK_RESPONSE                             207
 #  define CMP_F_CMP_ASN1_OCTET_STRING_SET1                 100
 #  define CMP_F_CMP_ASN1_OCTET_STRING_SET1_BYTES           199
+#  define CMP_F_CMP_CALC_DHBMAC                            244
 #  define CMP_F_CMP_CALC_PROTECTION                        101
+#  define CMP_F_CMP_CALC_PROTECTION_CACHED                 221
 #  define CMP_F_CMP_CERTCONF_NEW                           102
+#  define CMP_F_CMP_CERTCONF_NEW_MULTI                     216
 #  define CMP_F_CMP_CERTORENCCERT_ENCCERT_GET1             103
 #  define CMP_F_CMP_CERTREPMESSAGE_CERTRESPONSE_GET0       104
 #  define CMP_F_CMP_CERTREP_NEW                            184
 #  define CMP_F_CMP_CERTREQ_NEW                            105
+#  define CMP_F_CMP_CERTREQ_TEMPLATE_NEW                   241
 #  define CMP_F_CMP_CERTRESPONSE_GET_CERTIFICATE           106
 #  define CMP_F_CMP_CERTRESPONSE_NEW                       182
 #  define CMP_F_CMP_CERTSTATUS_SET_CERTHASH                107
@@ -41,19 +47,27 @@ int ERR_load_CMP_strings(void);
 #  define CMP_F_CMP_CTX_CAPUBS_NUM                         109
 #  define CMP_F_CMP_CTX_CAPUBS_POP                         110
 #  define CMP_F_CMP_CTX_CAPUBS_SET0                        179
+#  define CMP_F_CMP_CTX_CERTREQ_PUSH1                      217
 #  define CMP_F_CMP_CTX_CREATE                             111
+#  define CMP_F_CMP_CTX_DERIVE                             222
+#  define CMP_F_CMP_CTX_DHBM_BASEKEY                       245
+#  define CMP_F_CMP_CTX_DUP                                231
 #  define CMP_F_CMP_CTX_EXTRACERTSIN_GET1                  112
 #  define CMP_F_CMP_CTX_EXTRACERTSIN_NUM                   113
 #  define CMP_F_CMP_CTX_EXTRACERTSIN_POP                   114
 #  define CMP_F_CMP_CTX_EXTRACERTSOUT_NUM                  115
 #  define CMP_F_CMP_CTX_EXTRACERTSOUT_PUSH1                116
+#  define CMP_F_CMP_CTX_GET0_REVSTATUS                     248
 #  define CMP_F_CMP_CTX_INIT                               117
+#  define CMP_F_CMP_CTX_NEWCLCERTS_GET1                    218
 #  define CMP_F_CMP_CTX_PUSH_FREETEXT                      206
+#  define CMP_F_CMP_CTX_REVCERT_PUSH1                      249
 #  define CMP_F_CMP_CTX_SET0_NEWPKEY                       118
 #  define CMP_F_CMP_CTX_SET0_PKEY                          119
 #  define CMP_F_CMP_CTX_SET0_REQEXTENSIONS                 120
 #  define CMP_F_CMP_CTX_SET0_TLSBIO                        121
 #  define CMP_F_CMP_CTX_SET1_CAPUBS                        122
+#  define CMP_F_CMP_CTX_SET1_CERTREQTEMPLATE               242
 #  define CMP_F_CMP_CTX_SET1_CLCERT                        123
 #  define CMP_F_CMP_CTX_SET1_EXPECTED_SENDER               124
 #  define CMP_F_CMP_CTX_SET1_EXTRACERTSIN                  125
@@ -73,12 +87,17 @@ int ERR_load_CMP_strings(void);
 #  define CMP_F_CMP_CTX_SET1_SERVERNAME                    138
 #  define CMP_F_CMP_CTX_SET1_SERVERPATH                    139
 #  define CMP_F_CMP_CTX_SET1_SRVCERT                       140
+#  define CMP_F_CMP_CTX_SET1_SRVCERT_CACHE                 227
 #  define CMP_F_CMP_CTX_SET1_SUBJECTNAME                   141
 #  define CMP_F_CMP_CTX_SET1_TRANSACTIONID                 142
 #  define CMP_F_CMP_CTX_SET_PROXYPORT                      143
 #  define CMP_F_CMP_CTX_SET_SERVERPORT                     144
+#  define CMP_F_CMP_CTX_SIG_PREPARE                        229
 #  define CMP_F_CMP_CTX_SUBJECTALTNAME_PUSH1               145
+#  define CMP_F_CMP_ENCCERT_NEW                            247
 #  define CMP_F_CMP_ERROR_NEW                              146
+#  define CMP_F_CMP_EXCHANGE_CERTCONF                      171
+#  define CMP_F_CMP_EXCHANGE_ERROR                         175
 #  define CMP_F_CMP_EXEC_CR_SES                            147
 #  define CMP_F_CMP_EXEC_GENM_SES                          148
 #  define CMP_F_CMP_EXEC_IR_SES                            149
@@ -100,6 +119,7 @@ int ERR_load_CMP_strings(void);
 #  define CMP_F_CMP_PKIMESSAGE_GENERALINFO_ITEMS_PUSH1     156
 #  define CMP_F_CMP_PKIMESSAGE_GENM_ITEMS_PUSH1            157
 #  define CMP_F_CMP_PKIMESSAGE_GENM_ITEM_PUSH0             158
+#  define CMP_F_CMP_PKIMESSAGE_HTTP_NBIO                   208
 #  define CMP_F_CMP_PKIMESSAGE_HTTP_PERFORM                159
 #  define CMP_F_CMP_PKIMESSAGE_POLLRESPONSE_GET0           160
 #  define CMP_F_CMP_PKIMESSAGE_PROTECT                     161
@@ -109,35 +129,62 @@ int ERR_load_CMP_strings(void);
 #  define CMP_F_CMP_POLLREPCONTENT_POLLREP_GET0            166
 #  define CMP_F_CMP_POLLREP_NEW                            188
 #  define CMP_F_CMP_POLLREQ_NEW                            164
+#  define CMP_F_CMP_POLLREQ_NEW_MULTI                      219
+#  define CMP_F_CMP_POPO_BATCH_ADD                         236
+#  define CMP_F_CMP_POPO_BATCH_GET_RESULT                  237
+#  define CMP_F_CMP_POPO_BATCH_NEW                         238
+#  define CMP_F_CMP_POPO_BATCH_VERIFY                      239
 #  define CMP_F_CMP_PROCESS_CERT_REQUEST                   185
 #  define CMP_F_CMP_REVREPCONTENT_PKISTATUSINFO_GET        165
 #  define CMP_F_CMP_RP_NEW                                 189
 #  define CMP_F_CMP_RR_NEW                                 169
+#  define CMP_F_CMP_RR_NEW_RANGE                           250
+#  define CMP_F_CMP_SES_SCHED_ADD                          232
+#  define CMP_F_CMP_SES_SCHED_NEW                          233
+#  define CMP_F_CMP_SES_SCHED_REMOVE                       234
+#  define CMP_F_CMP_SES_SCHED_RUN                          235
+#  define CMP_F_CMP_SES_START                              209
+#  define CMP_F_CMP_SES_STEP                               210
+#  define CMP_F_CMP_SRVCERT_CACHE_NEW                      228
 #  define CMP_F_CMP_SRV_CTX_CREATE                         190
+#  define CMP_F_CMP_SRV_HTTP_SERVE                         223
+#  define CMP_F_CMP_SRV_PROCESS_REQUEST                    224
 #  define CMP_F_CMP_VALIDATE_CERT_PATH                     167
 #  define CMP_F_CMP_VALIDATE_MSG                           168
+#  define CMP_F_CMP_VERIFY_DHBMAC                          246
 #  define CMP_F_CMP_VERIFY_PBMAC                           172
 #  define CMP_F_CMP_VERIFY_POPO                            196
 #  define CMP_F_CMP_VERIFY_SIGNATURE                       170
-#  define CMP_F_CMP_EXCHANGE_CERTCONF                      171
-#  define CMP_F_CMP_EXCHANGE_ERROR                         175
+#  define CMP_F_CRM_NEW_FROM_TEMPLATE                      243
 #  define CMP_F_FIND_SRVCERT                               173
 #  define CMP_F_GET_CERT_STATUS                            174
+#  define CMP_F_GET_CHECKAFTER                             211
 #  define CMP_F_POLLFORRESPONSE                            178
+#  define CMP_F_POPO_ITEM_PREPARE                          240
 #  define CMP_F_PROCESS_CERTCONF                           191
+#  define CMP_F_PROCESS_CERT_RESPONSES                     220
 #  define CMP_F_PROCESS_ERROR                              192
 #  define CMP_F_PROCESS_GENM                               193
 #  define CMP_F_PROCESS_POLLREQ                            194
 #  define CMP_F_PROCESS_REQUEST                            176
 #  define CMP_F_PROCESS_RR                                 195
+#  define CMP_F_RR_EXCHANGE                                251
 #  define CMP_F_SEND_RECEIVE_CHECK                         177
+#  define CMP_F_SES_EXCHANGE                               212
+#  define CMP_F_SES_HANDLE_RESPONSE                        213
+#  define CMP_F_SES_RUN                                    230
+#  define CMP_F_SES_SEND                                   214
 #  define CMP_F_SET1_AOSTR_ELSE_RANDOM                     181
 #  define CMP_F_SET1_GENERAL_NAME                          205
+#  define CMP_F_TRANSACTION_ACQUIRE                        225
+#  define CMP_F_TRANSACTION_CHECK_SENDER                   252
+#  define CMP_F_TRANSACTION_NEW                            226
 
 /*
  * CMP reason codes.
  */
 #  define CMP_R_ALGORITHM_NOT_SUPPORTED                    100
+#  define CMP_R_ASYNC_JOB_FAILED                           198
 #  define CMP_R_CERTIFICATE_NOT_ACCEPTED                   101
 #  define CMP_R_CERTIFICATE_NOT_FOUND                      102
 #  define CMP_R_CERTREQMSG_NOT_FOUND                       182
@@ -170,6 +217,7 @@ int ERR_load_CMP_strings(void);
 #  define CMP_R_ERROR_DECRYPTING_ENCCERT                   124
 #  define CMP_R_ERROR_DECRYPTING_KEY                       125
 #  define CMP_R_ERROR_DECRYPTING_SYMMETRIC_KEY             126
+#  define CMP_R_ERROR_ENCRYPTING_CERTIFICATE               201
 #  define CMP_R_ERROR_LEARNING_TRANSACTIONID               179
 #  define CMP_R_ERROR_PARSING_PKISTATUS                    127
 #  define CMP_R_ERROR_PROCESSING_CERTREQ                   188
@@ -194,8 +242,12 @@ int ERR_load_CMP_strings(void);
 #  define CMP_R_INVALID_KEY                                144
 #  define CMP_R_INVALID_PARAMETERS                         143
 #  define CMP_R_IP_NOT_RECEIVED                            145
+#  define CMP_R_KEY_AGREEMENT_FAILED                       174
 #  define CMP_R_KUP_NOT_RECEIVED                           146
+#  define CMP_R_MISSING_CONTENT_LENGTH                     203
 #  define CMP_R_MISSING_KEY_INPUT_FOR_CREATING_PROTECTION  147
+#  define CMP_R_MISSING_KEY_USAGE_DIGITALSIGNATUE          176
+#  define CMP_R_MISSING_KEY_USAGE_KEYAGREEMENT             199
 #  define CMP_R_MISSING_PROTECTION                         181
 #  define CMP_R_MULTIPLE_SAN_SOURCES                       180
 #  define CMP_R_NO_NULL_ARGUMENT                           195
@@ -213,6 +265,7 @@ int ERR_load_CMP_strings(void);
 #  define CMP_R_RECIPNONCE_UNMATCHED                       158
 #  define CMP_R_REQUEST_NOT_ACCEPTED                       194
 #  define CMP_R_REQUEST_REJECTED_BY_CA                     159
+#  define CMP_R_REQUEST_TOO_LARGE                          204
 #  define CMP_R_RP_NOT_RECEIVED                            160
 #  define CMP_R_SENDER_GENERALNAME_TYPE_NOT_SUPPORTED      161
 #  define CMP_R_SERVER_NOT_REACHABLE                       162
@@ -230,11 +283,11 @@ int ERR_load_CMP_strings(void);
 #  define CMP_R_UNSUPPORTED_CIPHER                         172
 #  define CMP_R_UNSUPPORTED_KEY_TYPE                       173
 #  define CMP_R_UNSUPPORTED_POPO_METHOD                    192
-#  define CMP_R_UNSUPPORTED_PROTECTION_ALG_DHBASEDMAC      174
 #  define CMP_R_WRONG_ALGORITHM_OID                        175
 #  define CMP_R_WRONG_CERT_HASH                            193
-#  define CMP_R_MISSING_KEY_USAGE_DIGITALSIGNATUE          176
+#  define CMP_R_WRONG_DHBM_VALUE                           200
 #  define CMP_R_WRONG_PBM_VALUE                            177
+#  define CMP_R_WRONG_RP_COMPONENT_COUNT                   202
 
 # endif
 #endif
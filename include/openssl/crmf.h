@@ -46,6 +46,7 @@ DEFINE_STACK_OF(CRMF_CERTREQMSG)
 typedef struct crmf_attributetypeandvalue_st CRMF_ATTRIBUTETYPEANDVALUE;
 typedef struct crmf_pbmparameter_st CRMF_PBMPARAMETER;
 DECLARE_ASN1_FUNCTIONS(CRMF_PBMPARAMETER)
+typedef struct crmf_pbm_cache_st CRMF_PBM_CACHE;
 typedef struct crmf_poposigningkey_st CRMF_POPOSIGNINGKEY;
 typedef struct crmf_certrequest_st CRMF_CERTREQUEST;
 typedef struct crmf_certid_st CRMF_CERTID;
@@ -134,6 +135,13 @@ int CRMF_passwordBasedMac_new(const CRMF_PBMPARAMETER *pbm,
                               const unsigned char *secret,
                               size_t secretLen, unsigned char **mac,
                               unsigned int *macLen);
+int CRMF_passwordBasedMac_new_ex(const CRMF_PBMPARAMETER *pbm,
+                                 const unsigned char *msg, size_t msgLen,
+                                 const unsigned char *secret,
+                                 size_t secretLen, CRMF_PBM_CACHE *cache,
+                                 unsigned char **mac, unsigned int *macLen);
+CRMF_PBM_CACHE *CRMF_PBM_CACHE_new(void);
+void CRMF_PBM_CACHE_free(CRMF_PBM_CACHE *cache);
 
 /* crmf_lib.c */
 int CRMF_CERTREQMSG_set1_regCtrl_regToken(CRMF_CERTREQMSG *msg,
@@ -159,6 +167,7 @@ int CRMF_CERTREQMSG_set1_regInfo_certReq(CRMF_CERTREQMSG *msg,
 int CRMF_CERTREQMSG_set_version2(CRMF_CERTREQMSG *crm);
 int CRMF_CERTREQMSG_set_validity(CRMF_CERTREQMSG *crm, time_t from, time_t to);
 int CRMF_CERTREQMSG_set_certReqId(CRMF_CERTREQMSG *crm, long rid);
+long CRMF_CERTREQMSG_get_certReqId(CRMF_CERTREQMSG *crm);
 int CRMF_CERTREQMSG_set1_publicKey(CRMF_CERTREQMSG *crm, const EVP_PKEY *pkey);
 int CRMF_CERTREQMSG_set1_subject(CRMF_CERTREQMSG *crm, const X509_NAME *subj);
 int CRMF_CERTREQMSG_set1_issuer(CRMF_CERTREQMSG *crm, const X509_NAME *is);
@@ -12,17 +12,15 @@
 # define HEADER_CRMFERR_H
 
 # ifdef  __cplusplus
-extern "C" {
+extern "C"
 # endif
 int ERR_load_CRMF_strings(void);
-# ifdef  __cplusplus
-}
-# endif
 
 /*
  * CRMF function codes.
  */
 # define CRMF_F_CRMF_CERTREQMSG_CREATE_POPO               100
+# define CRMF_F_CRMF_CERTREQMSG_GET_CERTREQID             115
 # define CRMF_F_CRMF_CERTREQMSG_PUSH0_EXTENSION           101
 # define CRMF_F_CRMF_CERTREQMSG_PUSH0_REGCTRL             102
 # define CRMF_F_CRMF_CERTREQMSG_PUSH0_REGINFO             103
@@ -35,7 +33,9 @@ int ERR_load_CRMF_strings(void);
 # define CRMF_F_CRMF_CERTREQMSG_SET_VALIDITY              110
 # define CRMF_F_CRMF_CERTREQMSG_SET_VERSION2              111
 # define CRMF_F_CRMF_PASSWORDBASEDMAC_NEW                 112
+# define CRMF_F_CRMF_PASSWORDBASEDMAC_NEW_EX              116
 # define CRMF_F_CRMF_PBMP_NEW                             113
+# define CRMF_F_CRMF_PBM_CACHE_NEW                        117
 # define CRMF_F_POPOSIGKEY_NEW                            114
 
 /*
@@ -0,0 +1,691 @@
+/*
+ * Copyright OpenSSL 2007-2018
+ * Copyright Nokia 2007-2018
+ * Copyright Siemens AG 2015-2018
+ *
+ * Contents licensed under the terms of the OpenSSL license
+ * See https://www.openssl.org/source/license.html for details
+ *
+ * SPDX-License-Identifier: OpenSSL
+ *
+ * CMP load generation and latency benchmark.
+ */
+
+#include "cmptestlib.h"
+#include "internal/nelem.h"
+#include "testutil/output.h"
+#include <openssl/x509v3.h>
+#include <openssl/ec.h>
+#include <string.h>
+
+#ifndef _WIN32
+# include <sys/time.h>
+#else
+# include <windows.h>
+#endif
+
+#if defined(OPENSSL_THREADS) && defined(OPENSSL_SYS_UNIX) && \
+    !defined(OPENSSL_NO_SOCK) && !defined(OPENSSL_NO_OCSP)
+# define CMP_BENCH_HTTP
+# include <pthread.h>
+# include <sys/select.h>
+#endif
+
+#ifndef NDEBUG /* the benchmark needs mock server, available only if !NDEBUG */
+
+/*
+ * Options, given as "-option value" on the command line:
+ * -num n      number of transactions per message type (default 100)
+ * -conc n     number of transactions in flight at the same time (default 8)
+ * -prot p     protection: pbm, rsa, or ec signature (default pbm)
+ * -keytype t  type of the keys to be certified: rsa or ec (default ec)
+ * -depth n    number of CA certs above the client cert (default 1)
+ * -types l    comma-separated list of ir, cr, kur, rr, genm (default all)
+ * -http port  use a local HTTP responder on the given port instead of
+ *             calling the mock server directly
+ * -zerocopy   hand over messages to the in-process mock server without
+ *             encoding them (benchmarks the client side only)
+ */
+static int num_tx = 100;
+static int concurrency = 8;
+static const char *prot = "pbm";
+static const char *keytype = "ec";
+static int chain_depth = 1;
+static const char *types = "ir,cr,kur,rr,genm";
+static int http_port = 0;
+static int zerocopy = 0;
+
+static EVP_PKEY *root_key = NULL;
+static X509 *root_cert = NULL;
+static STACK_OF(X509) *intermediates = NULL; /* certs between root and leaf */
+static EVP_PKEY *srv_key = NULL;
+static X509 *srv_cert = NULL;
+static EVP_PKEY *cl_key = NULL;
+static X509 *cl_cert = NULL;
+static EVP_PKEY *new_key = NULL;
+static X509 *new_cert = NULL;
+static unsigned char ref[TEST_CMP_REFVALUE_LENGTH];
+static unsigned char secret[16];
+
+static CMP_SRV_CTX *srv_ctx = NULL;
+static CMP_CTX *cl_tmpl = NULL;
+
+static const struct {
+    const char *name;
+    int type;
+} msg_types[] = {
+    {"ir", V_CMP_PKIBODY_IR},
+    {"cr", V_CMP_PKIBODY_CR},
+    {"kur", V_CMP_PKIBODY_KUR},
+    {"rr", V_CMP_PKIBODY_RR},
+    {"genm", V_CMP_PKIBODY_GENM},
+};
+
+static double now_ms(void)
+{
+#ifndef _WIN32
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+#else
+    return (double)GetTickCount64();
+#endif
+}
+
+static EVP_PKEY *gen_key(const char *type)
+{
+    EVP_PKEY_CTX *ctx = NULL;
+    EVP_PKEY *pkey = NULL;
+
+    if (strcmp(type, "rsa") == 0)
+        return gen_rsa();
+    if (strcmp(type, "ec") != 0) {
+        TEST_error("unsupported key type: %s", type);
+        return NULL;
+    }
+    if (!TEST_ptr(ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL)) ||
+        !TEST_int_gt(EVP_PKEY_keygen_init(ctx), 0) ||
+        !TEST_int_gt(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx,
+                                              NID_X9_62_prime256v1), 0) ||
+        !TEST_int_gt(EVP_PKEY_keygen(ctx, &pkey), 0))
+        pkey = NULL;
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+static int add_ext(X509 *cert, X509 *issuer, int nid, const char *value)
+{
+    X509V3_CTX v3ctx;
+    X509_EXTENSION *ext;
+    int ok;
+
+    X509V3_set_ctx(&v3ctx, issuer, cert, NULL, NULL, 0);
+    if ((ext = X509V3_EXT_conf_nid(NULL, &v3ctx, nid, (char *)value)) == NULL)
+        return 0;
+    ok = X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+    return ok;
+}
+
+/*
+ * creates a cert for pkey with the given subject CN, issued by the given
+ * issuer cert and key, or self-signed if issuer is NULL
+ */
+static X509 *make_cert(const char *cn, EVP_PKEY *pkey, int ca,
+                       X509 *issuer, EVP_PKEY *issuer_key)
+{
+    static long serial = 1;
+    X509 *cert = X509_new();
+    X509_NAME *name = X509_NAME_new();
+
+    if (cert == NULL || name == NULL ||
+        !X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                    (const unsigned char *)cn, -1, -1, 0) ||
+        !X509_set_version(cert, 2) ||
+        !ASN1_INTEGER_set(X509_get_serialNumber(cert), serial++) ||
+        !X509_set_subject_name(cert, name) ||
+        !X509_set_issuer_name(cert, issuer != NULL ?
+                              X509_get_subject_name(issuer) : name) ||
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0) == NULL ||
+        X509_time_adj_ex(X509_getm_notAfter(cert), 1, 0, NULL) == NULL ||
+        !X509_set_pubkey(cert, pkey) ||
+        !add_ext(cert, issuer != NULL ? issuer : cert, NID_basic_constraints,
+                 ca ? "critical,CA:TRUE" : "critical,CA:FALSE") ||
+        !add_ext(cert, issuer != NULL ? issuer : cert, NID_key_usage,
+                 ca ? "critical,keyCertSign,cRLSign"
+                    : "critical,digitalSignature") ||
+        !add_ext(cert, issuer != NULL ? issuer : cert,
+                 NID_subject_key_identifier, "hash") ||
+        !X509_sign(cert, issuer_key != NULL ? issuer_key : pkey,
+                   EVP_sha256())) {
+        X509_free(cert);
+        cert = NULL;
+    }
+    X509_NAME_free(name);
+    return cert;
+}
+
+/*
+ * creates the PKI: a root CA, chain_depth - 1 intermediate CAs,
+ * the client cert issued by the last CA, the server cert, and the cert
+ * to be returned by the mock server for new_key
+ */
+static int make_pki(const char *type)
+{
+    X509 *ca_cert;
+    EVP_PKEY *ca_key = NULL, *pkey = NULL;
+    char cn[32];
+    int i, ok = 0;
+
+    if (!TEST_ptr(root_key = gen_key(type)) ||
+        !TEST_ptr(root_cert = make_cert("bench root CA", root_key, 1,
+                                        NULL, NULL)) ||
+        !TEST_ptr(intermediates = sk_X509_new_null()))
+        return 0;
+    ca_cert = root_cert;
+    ca_key = root_key;
+    EVP_PKEY_up_ref(ca_key);
+    for (i = 1; i < chain_depth; i++) {
+        X509 *cert;
+
+        BIO_snprintf(cn, sizeof(cn), "bench intermediate CA %d", i);
+        if (!TEST_ptr(pkey = gen_key(type)) ||
+            !TEST_ptr(cert = make_cert(cn, pkey, 1, ca_cert, ca_key)))
+            goto err;
+        if (!sk_X509_push(intermediates, cert)) {
+            X509_free(cert);
+            goto err;
+        }
+        EVP_PKEY_free(ca_key);
+        ca_key = pkey;
+        pkey = NULL;
+        ca_cert = cert;
+    }
+    ok = TEST_ptr(cl_key = gen_key(type)) &&
+        TEST_ptr(cl_cert = make_cert("bench client", cl_key, 0,
+                                     ca_cert, ca_key)) &&
+        TEST_ptr(srv_key = gen_key(type)) &&
+        TEST_ptr(srv_cert = make_cert("bench server", srv_key, 0,
+                                      root_cert, root_key)) &&
+        TEST_ptr(new_key = gen_key(keytype)) &&
+        TEST_ptr(new_cert = make_cert("bench client", new_key, 0,
+                                      root_cert, root_key));
+ err:
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_free(ca_key);
+    return ok;
+}
+
+#ifdef CMP_BENCH_HTTP
+static BIO *acbio = NULL;
+static CRYPTO_RWLOCK *accept_lock = NULL;
+static CRYPTO_RWLOCK *stop_lock = NULL;
+static int srv_stop = 0;
+static pthread_t *srv_threads = NULL;
+static int srv_num_threads = 0;
+
+static int get_srv_stop(void)
+{
+    int stop;
+
+    if (!CRYPTO_THREAD_read_lock(stop_lock))
+        return 1;
+    stop = srv_stop;
+    CRYPTO_THREAD_unlock(stop_lock);
+    return stop;
+}
+
+static void *srv_worker(void *arg)
+{
+    for (;;) {
+        BIO *cbio = NULL;
+        int stop;
+
+        if (!CRYPTO_THREAD_write_lock(accept_lock))
+            break;
+        if (!get_srv_stop() && BIO_do_accept(acbio) > 0)
+            cbio = BIO_pop(acbio);
+        stop = cbio == NULL || get_srv_stop();
+        CRYPTO_THREAD_unlock(accept_lock);
+        if (!stop)
+            (void)CMP_SRV_http_serve(srv_ctx, cbio);
+        BIO_free_all(cbio);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+/* starts a local HTTP responder with one thread per concurrent transaction */
+static int start_http_responder(void)
+{
+    char port[12];
+
+    BIO_snprintf(port, sizeof(port), "%d", http_port);
+    if (!TEST_ptr(accept_lock = CRYPTO_THREAD_lock_new()) ||
+        !TEST_ptr(stop_lock = CRYPTO_THREAD_lock_new()) ||
+        !TEST_ptr(acbio = BIO_new_accept(port)) ||
+        !TEST_int_ge(BIO_set_bind_mode(acbio, BIO_BIND_REUSEADDR), 0) ||
+        !TEST_int_gt(BIO_do_accept(acbio), 0) ||
+        !TEST_ptr(srv_threads = OPENSSL_malloc(concurrency *
+                                               sizeof(*srv_threads))))
+        return 0;
+    for (srv_num_threads = 0; srv_num_threads < concurrency; srv_num_threads++)
+        if (!TEST_int_eq(pthread_create(&srv_threads[srv_num_threads], NULL,
+                                        srv_worker, NULL), 0))
+            return 0;
+    return 1;
+}
+
+static void stop_http_responder(void)
+{
+    char addr[32];
+    int i;
+
+    if (stop_lock == NULL)
+        return;
+    if (CRYPTO_THREAD_write_lock(stop_lock)) {
+        srv_stop = 1;
+        CRYPTO_THREAD_unlock(stop_lock);
+    }
+    /* wake up any thread waiting for a connection */
+    BIO_snprintf(addr, sizeof(addr), "127.0.0.1:%d", http_port);
+    for (i = 0; i < srv_num_threads; i++) {
+        BIO *cbio = BIO_new_connect(addr);
+
+        if (cbio != NULL)
+            (void)BIO_do_connect(cbio);
+        BIO_free_all(cbio);
+    }
+    for (i = 0; i < srv_num_threads; i++)
+        pthread_join(srv_threads[i], NULL);
+    OPENSSL_free(srv_threads);
+    BIO_free_all(acbio);
+    CRYPTO_THREAD_lock_free(accept_lock);
+    CRYPTO_THREAD_lock_free(stop_lock);
+}
+#endif
+
+/* suppresses the per-message progress output, which would dominate timing */
+static int quiet_log_cb(const char *file, int lineno, severity level,
+                        const char *msg)
+{
+    return level > LOG_ERROR || CMP_puts(file, lineno, level, msg);
+}
+
+static int setup_server(void)
+{
+    CMP_CTX *ctx;
+
+    if (!TEST_ptr(srv_ctx = CMP_SRV_CTX_create()) ||
+        !TEST_true(CMP_SRV_CTX_set1_certOut(srv_ctx, new_cert)) ||
+        !TEST_true(CMP_SRV_CTX_set_encoding_check(srv_ctx, zerocopy ? 0 : 1))
+        || !TEST_ptr(ctx = CMP_SRV_CTX_get0_ctx(srv_ctx)) ||
+        !TEST_true(CMP_CTX_set_log_cb(ctx, quiet_log_cb)) ||
+        !TEST_true(CMP_CTX_set1_clCert(ctx, srv_cert)) ||
+        !TEST_true(CMP_CTX_set1_pkey(ctx, srv_key)))
+        return 0;
+    if (strcmp(prot, "pbm") == 0)
+        return TEST_true(CMP_CTX_set1_referenceValue(ctx, ref, sizeof(ref))) &&
+            TEST_true(CMP_CTX_set1_secretValue(ctx, secret, sizeof(secret)));
+    else {
+        X509_STORE *ts = X509_STORE_new();
+
+        if (!TEST_ptr(ts) || !TEST_true(X509_STORE_add_cert(ts, root_cert)) ||
+            !TEST_true(CMP_CTX_set0_trustedStore(ctx, ts))) {
+            X509_STORE_free(ts);
+            return 0;
+        }
+        return 1;
+    }
+}
+
+static int setup_client(void)
+{
+    int i;
+
+    if (!TEST_ptr(cl_tmpl = CMP_CTX_create()) ||
+        !TEST_true(CMP_CTX_set_log_cb(cl_tmpl, quiet_log_cb)) ||
+        !TEST_true(CMP_CTX_set1_srvCert(cl_tmpl, srv_cert)) ||
+        !TEST_true(CMP_CTX_set1_oldClCert(cl_tmpl, cl_cert)) ||
+        !TEST_true(CMP_CTX_set1_newPkey(cl_tmpl, new_key)))
+        return 0;
+    if (http_port > 0) {
+        if (!TEST_true(CMP_CTX_set1_serverName(cl_tmpl, "127.0.0.1")) ||
+            !TEST_true(CMP_CTX_set_serverPort(cl_tmpl, http_port)))
+            return 0;
+    } else if (!TEST_true(CMP_CTX_set_transfer_cb(cl_tmpl,
+                                                  CMP_mock_server_perform)) ||
+               !TEST_true(CMP_CTX_set_transfer_cb_arg(cl_tmpl, srv_ctx))) {
+        return 0;
+    }
+    if (strcmp(prot, "pbm") == 0)
+        return TEST_true(CMP_CTX_set1_referenceValue(cl_tmpl,
+                                                     ref, sizeof(ref))) &&
+            TEST_true(CMP_CTX_set1_secretValue(cl_tmpl,
+                                               secret, sizeof(secret)));
+    if (!TEST_true(CMP_CTX_set1_clCert(cl_tmpl, cl_cert)) ||
+        !TEST_true(CMP_CTX_set1_pkey(cl_tmpl, cl_key)))
+        return 0;
+    for (i = sk_X509_num(intermediates) - 1; i >= 0; i--)
+        if (!TEST_true(CMP_CTX_extraCertsOut_push1(cl_tmpl,
+                                             sk_X509_value(intermediates, i))))
+            return 0;
+    return 1;
+}
+
+typedef struct {
+    CMP_CTX *ctx;
+    CMP_SES *ses;
+    double start;
+    int rv;
+    int ready;
+} BENCH_SLOT;
+
+static void slot_finish(BENCH_SLOT *slot, double *lat, int *num_lat,
+                        int *errors)
+{
+    if (slot->rv == CMP_SES_DONE)
+        lat[(*num_lat)++] = now_ms() - slot->start;
+    else
+        (*errors)++;
+    CMP_SES_free(slot->ses);
+    CMP_CTX_delete(slot->ctx);
+    memset(slot, 0, sizeof(*slot));
+}
+
+/*
+ * runs num_tx IR, CR, or KUR transactions with up to concurrency of them
+ * in flight, recording the latency of each successful one in lat.
+ * Returns 1 unless some internal error occurred
+ */
+static int run_cert_req(int type, double *lat, int *num_lat, int *errors)
+{
+    BENCH_SLOT *slots;
+    int next = 0, active = 0, i, ok = 0;
+
+    if (!TEST_ptr(slots = OPENSSL_zalloc(concurrency * sizeof(*slots))))
+        return 0;
+    while (next < num_tx || active > 0) {
+        time_t now;
+#ifdef CMP_BENCH_HTTP
+        fd_set readfds, writefds;
+        struct timeval tv;
+        int maxfd = -1;
+#endif
+
+        for (i = 0; i < concurrency && next < num_tx; i++) {
+            BENCH_SLOT *slot = &slots[i];
+
+            if (slot->ctx != NULL)
+                continue;
+            next++;
+            slot->start = now_ms();
+            if ((slot->ctx = CMP_CTX_dup(cl_tmpl)) == NULL)
+                goto end;
+            if ((slot->ses = CMP_SES_start(slot->ctx, type)) == NULL) {
+                slot->rv = CMP_SES_ERROR;
+                slot_finish(slot, lat, num_lat, errors);
+                i--; /* try again with the same slot */
+                continue;
+            }
+            slot->ready = 1;
+            active++;
+        }
+
+        now = time(NULL);
+        for (i = 0; i < concurrency; i++) {
+            BENCH_SLOT *slot = &slots[i];
+            time_t deadline;
+
+            if (slot->ctx == NULL)
+                continue;
+            if (!slot->ready && slot->rv == CMP_SES_WANT_TIMER &&
+                (deadline = CMP_SES_get_deadline(slot->ses)) <= now)
+                slot->ready = 1;
+            if (!slot->ready)
+                continue;
+            slot->rv = CMP_SES_step(slot->ses);
+            if (slot->rv == CMP_SES_DONE || slot->rv == CMP_SES_ERROR) {
+                slot_finish(slot, lat, num_lat, errors);
+                active--;
+            } else {
+                slot->ready = slot->rv == CMP_SES_WANT_ASYNC;
+            }
+        }
+
+#ifdef CMP_BENCH_HTTP
+        /* wait for any socket I/O, for at most a second due to timers */
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        for (i = 0; i < concurrency; i++) {
+            BENCH_SLOT *slot = &slots[i];
+            int fd;
+
+            if (slot->ctx == NULL || slot->ready ||
+                (slot->rv != CMP_SES_WANT_READ &&
+                 slot->rv != CMP_SES_WANT_WRITE))
+                continue;
+            if ((fd = CMP_SES_get_fd(slot->ses)) < 0) {
+                slot->ready = 1;
+                continue;
+            }
+            FD_SET(fd, slot->rv == CMP_SES_WANT_READ ? &readfds : &writefds);
+            if (fd > maxfd)
+                maxfd = fd;
+        }
+        if (maxfd < 0)
+            continue;
+        tv.tv_sec = 1;
+        tv.tv_usec = 0;
+        if (!TEST_int_ge(select(maxfd + 1, &readfds, &writefds, NULL, &tv),
+                         0))
+            goto end;
+        for (i = 0; i < concurrency; i++) {
+            BENCH_SLOT *slot = &slots[i];
+            int fd;
+
+            if (slot->ctx == NULL || slot->ready ||
+                (fd = CMP_SES_get_fd(slot->ses)) < 0)
+                continue;
+            slot->ready = FD_ISSET(fd, &readfds) || FD_ISSET(fd, &writefds)
+                || CMP_SES_get_deadline(slot->ses) <= time(NULL);
+        }
+#endif
+    }
+    ok = 1;
+
+ end:
+    for (i = 0; i < concurrency; i++)
+        if (slots[i].ctx != NULL) {
+            slots[i].rv = CMP_SES_ERROR;
+            slot_finish(&slots[i], lat, num_lat, errors);
+        }
+    OPENSSL_free(slots);
+    return ok;
+}
+
+/*
+ * runs num_tx RR or GENM transactions, one at a time since there is no
+ * resumable API for them, recording the latency of each successful one
+ */
+static int run_other(int type, double *lat, int *num_lat, int *errors)
+{
+    int i;
+
+    for (i = 0; i < num_tx; i++) {
+        double start = now_ms();
+        CMP_CTX *ctx = CMP_CTX_dup(cl_tmpl);
+        int success = 0;
+
+        if (ctx == NULL)
+            return 0;
+        if (type == V_CMP_PKIBODY_RR) {
+            /* the mock server accepts revocation only of the cert it issues */
+            success = CMP_CTX_set1_oldClCert(ctx, new_cert) &&
+                CMP_exec_RR_ses(ctx);
+        } else {
+            STACK_OF(CMP_INFOTYPEANDVALUE) *itavs = CMP_exec_GENM_ses(ctx);
+
+            success = itavs != NULL;
+            sk_CMP_INFOTYPEANDVALUE_pop_free(itavs, CMP_INFOTYPEANDVALUE_free);
+        }
+        if (success)
+            lat[(*num_lat)++] = now_ms() - start;
+        else
+            (*errors)++;
+        CMP_CTX_delete(ctx);
+    }
+    return 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of the sorted latencies, per mille */
+static double percentile(const double *lat, int num, int per_mille)
+{
+    int rank = (int)(((long)num * per_mille + 999) / 1000);
+
+    return num == 0 ? 0 : lat[rank > 0 ? rank - 1 : 0];
+}
+
+static int bench_type(const char *name, int type)
+{
+    double *lat, start, elapsed;
+    int num_lat = 0, errors = 0, ok;
+
+    if (!TEST_ptr(lat = OPENSSL_malloc(num_tx * sizeof(*lat))))
+        return 0;
+    start = now_ms();
+    if (type == V_CMP_PKIBODY_RR || type == V_CMP_PKIBODY_GENM)
+        ok = run_other(type, lat, &num_lat, &errors);
+    else
+        ok = run_cert_req(type, lat, &num_lat, &errors);
+    elapsed = now_ms() - start;
+    ERR_print_errors_fp(stderr);
+
+    qsort(lat, num_lat, sizeof(*lat), cmp_double);
+    test_printf_stdout("%-4s %6d ok %4d failed %9.1f tx/s"
+                       "   p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms\n",
+                       name, num_lat, errors,
+                       elapsed > 0 ? num_lat * 1000.0 / elapsed : 0,
+                       percentile(lat, num_lat, 500),
+                       percentile(lat, num_lat, 990),
+                       percentile(lat, num_lat, 999));
+    OPENSSL_free(lat);
+    return ok && TEST_int_eq(errors, 0);
+}
+
+static int test_cmp_bench(void)
+{
+    const char *name, *end;
+    int ok = 1;
+    size_t i, len;
+
+    test_printf_stdout("%d transactions per type, %d concurrent, %s protection"
+                       ", %s keys, chain depth %d, %s\n",
+                       num_tx, concurrency, prot, keytype, chain_depth,
+                       http_port > 0 ? "HTTP" : zerocopy ? "in-process zero-copy"
+                                                         : "in-process");
+    for (name = types; *name != '\0'; name = *end == ',' ? end + 1 : end) {
+        if ((end = strchr(name, ',')) == NULL)
+            end = name + strlen(name);
+        len = end - name;
+        for (i = 0; i < OSSL_NELEM(msg_types); i++)
+            if (strlen(msg_types[i].name) == len &&
+                strncmp(name, msg_types[i].name, len) == 0)
+                break;
+        if (i == OSSL_NELEM(msg_types)) {
+            TEST_error("unknown message type: %.*s", (int)len, name);
+            ok = 0;
+            continue;
+        }
+        ok &= bench_type(msg_types[i].name, msg_types[i].type);
+    }
+    return ok;
+}
+
+static int get_int_option(const char *option, int *val, int min)
+{
+    const char *p = test_get_option_argument(option);
+
+    if (p == NULL)
+        return 1;
+    *val = atoi(p);
+    if (*val < min) {
+        TEST_error("%s must be at least %d", option, min);
+        return 0;
+    }
+    return 1;
+}
+
+void cleanup_tests(void)
+{
+#ifdef CMP_BENCH_HTTP
+    stop_http_responder();
+#endif
+    CMP_CTX_delete(cl_tmpl);
+    CMP_SRV_CTX_delete(srv_ctx);
+    EVP_PKEY_free(root_key);
+    X509_free(root_cert);
+    sk_X509_pop_free(intermediates, X509_free);
+    EVP_PKEY_free(srv_key);
+    X509_free(srv_cert);
+    EVP_PKEY_free(cl_key);
+    X509_free(cl_cert);
+    EVP_PKEY_free(new_key);
+    X509_free(new_cert);
+}
+
+int setup_tests(void)
+{
+    const char *p;
+
+    if (!get_int_option("-num", &num_tx, 1) ||
+        !get_int_option("-conc", &concurrency, 1) ||
+        !get_int_option("-depth", &chain_depth, 1) ||
+        !get_int_option("-http", &http_port, 1))
+        return 0;
+    if ((p = test_get_option_argument("-prot")) != NULL)
+        prot = p;
+    if ((p = test_get_option_argument("-keytype")) != NULL)
+        keytype = p;
+    if ((p = test_get_option_argument("-types")) != NULL)
+        types = p;
+    zerocopy = test_has_option("-zerocopy");
+#ifndef CMP_BENCH_HTTP
+    if (http_port > 0) {
+        TEST_error("-http is not supported in this build");
+        return 0;
+    }
+#endif
+
+    if (!TEST_int_eq(1, RAND_bytes(ref, sizeof(ref))) ||
+        !TEST_int_eq(1, RAND_bytes(secret, sizeof(secret))) ||
+        !make_pki(strcmp(prot, "pbm") == 0 ? keytype : prot) ||
+        !setup_server() || !setup_client())
+        return 0;
+#ifdef CMP_BENCH_HTTP
+    if (http_port > 0 && !start_http_responder())
+        return 0;
+#endif
+
+    ADD_TEST(test_cmp_bench);
+    return 1;
+}
+
+#else /* !defined (NDEBUG) */
+
+int setup_tests(void)
+{
+    TEST_note("CMP benchmark is disabled in this build (NDEBUG).");
+    return 1;
+}
+
+#endif
@@ -83,6 +83,61 @@ static int test_cmp_ctx_reqextensions_have_san(void)
     return result;
 }
 
+static int execute_cmp_ctx_dup_test(CMP_CTX_TEST_FIXTURE *fixture)
+{
+    int good = 0;
+    CMP_CTX *ctx = NULL, *dup = NULL;
+    X509_STORE *store = NULL;
+    static int arg;
+
+    if (!TEST_ptr_null(CMP_CTX_dup(NULL)) ||
+        !TEST_ptr(ctx = CMP_CTX_create()) ||
+        !TEST_ptr(store = X509_STORE_new()) ||
+        !TEST_true(CMP_CTX_set0_trustedStore(ctx, store)) ||
+        !TEST_true(CMP_CTX_set_transfer_cb_arg(ctx, &arg)) ||
+        !TEST_true(CMP_CTX_set_certConf_cb_arg(ctx, &arg)) ||
+        !TEST_true(CMP_CTX_set0_reqExtensions(ctx, fixture->exts)))
+        goto err;
+    fixture->exts = NULL;
+    if (!TEST_ptr(dup = CMP_CTX_dup(ctx)))
+        goto err;
+    /* the trust store is shared, while the request extensions are copied */
+    good = TEST_ptr_eq(CMP_CTX_get0_trustedStore(dup), store) &&
+        TEST_ptr_eq(CMP_CTX_get_transfer_cb_arg(dup), &arg) &&
+        TEST_ptr_eq(CMP_CTX_get_certConf_cb_arg(dup), &arg) &&
+        TEST_true(CMP_CTX_reqExtensions_have_SAN(dup)) &&
+        TEST_true(CMP_CTX_set0_reqExtensions(dup, NULL)) &&
+        TEST_true(CMP_CTX_reqExtensions_have_SAN(ctx));
+
+ err:
+    CMP_CTX_delete(dup);
+    CMP_CTX_delete(ctx);
+    return good;
+}
+
+static int test_cmp_ctx_dup(void)
+{
+    SETUP_TEST_FIXTURE(CMP_CTX_TEST_FIXTURE, set_up);
+    unsigned char str[16];
+    ASN1_OCTET_STRING *data = NULL;
+    X509_EXTENSION *ext = NULL;
+
+    if (!TEST_int_eq(1, RAND_bytes(str, sizeof(str))) ||
+        !TEST_ptr(data = ASN1_OCTET_STRING_new()) ||
+        !TEST_true(ASN1_OCTET_STRING_set(data, str, sizeof(str))) ||
+        !TEST_ptr(ext =
+                  X509_EXTENSION_create_by_NID(NULL, NID_subject_alt_name, 0,
+                                               data))
+        || !TEST_true(sk_X509_EXTENSION_push(fixture->exts, ext))) {
+        X509_EXTENSION_free(ext);
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    ASN1_OCTET_STRING_free(data);
+    EXECUTE_TEST(execute_cmp_ctx_dup_test, tear_down);
+    return result;
+}
+
 void cleanup_tests(void)
 {
     return;
@@ -91,6 +146,7 @@ void cleanup_tests(void)
 int setup_tests(void)
 {
     ADD_TEST(test_cmp_ctx_reqextensions_have_san);
+    ADD_TEST(test_cmp_ctx_dup);
 
     return 1;
 }
@@ -14,6 +14,7 @@
 #include "cmptestlib.h"
 
 #include <crypto/cmp/cmp_int.h>
+#include <crypto/crmf/crmf_int.h>
 
 /* Add test code as per
  * http://wiki.openssl.org/index.php/How_To_Write_Unit_Tests_For_OpenSSL#Style
@@ -103,7 +104,7 @@ static int execute_cmp_pkiheader_init_test(CMP_INT_TEST_FIXTURE *fixture)
                      CMP_PKIHEADER_init(fixture->cmp_ctx, header)))
         goto err;
     if (fixture->expected) {
-        if (!TEST_long_eq(ASN1_INTEGER_get(header->pvno), CMP_VERSION) ||
+        if (!TEST_long_eq(ASN1_INTEGER_get(&header->pvno), CMP_VERSION) ||
             !TEST_true(0 == ASN1_OCTET_STRING_cmp(header->senderNonce,
                                                   fixture->
                                                   cmp_ctx->last_senderNonce))
@@ -138,7 +139,7 @@ static int verify_signature(CMP_PKIMESSAGE *msg, EVP_PKEY *pkey,
     EVP_MD_CTX *ctx = NULL;
     int res;
 
-    prot_part.header = msg->header;
+    prot_part.header = &msg->header;
     prot_part.body = msg->body;
     res =
         TEST_int_ge(l = i2d_CMP_PROTECTEDPART(&prot_part, &prot_part_der), 0) &&
@@ -175,7 +176,7 @@ static int test_cmp_calc_protection_no_key_no_secret(void)
      * side effects */
     if (!TEST_ptr(fixture->msg =
                   load_pkimsg("../cmp-test/CMP_IR_unprotected.der")) ||
-        !TEST_ptr(fixture->msg->header->protectionAlg = X509_ALGOR_new())) {
+        !TEST_ptr(fixture->msg->header.protectionAlg = X509_ALGOR_new())) {
         tear_down(fixture);
         fixture = NULL;
     }
@@ -258,10 +259,390 @@ static int test_cmp_pkiheader_init_no_ref_no_subject(void)
     return result;
 }
 
+static X509 *endentity1 = NULL, *endentity2 = NULL, *intermediate = NULL;
+static X509 *srvcert = NULL;
+
+static int execute_cmp_add_extracerts_chain_test(CMP_INT_TEST_FIXTURE *fixture)
+{
+    CMP_CTX *ctx = fixture->cmp_ctx;
+    CMP_PKIMESSAGE *msg2 = NULL;
+    STACK_OF(X509) *chain = NULL, *untrusted;
+    int res = 0;
+
+    /* the chain is built once and reused for further messages */
+    if (!TEST_ptr(msg2 = CMP_PKIMESSAGE_new()) ||
+        !TEST_true(CMP_PKIMESSAGE_add_extraCerts(ctx, fixture->msg)) ||
+        !TEST_int_eq(sk_X509_num(fixture->msg->extraCerts), 1) ||
+        !TEST_ptr(chain = ctx->clCert_chain) ||
+        !TEST_true(CMP_PKIMESSAGE_add_extraCerts(ctx, msg2)) ||
+        !TEST_ptr_eq(ctx->clCert_chain, chain))
+        goto end;
+
+    /* adding an untrusted cert may extend the chain */
+    CMP_PKIMESSAGE_free(msg2);
+    if (!TEST_true(STACK_OF_X509_push1(CMP_CTX_get0_untrusted_certs(ctx),
+                                       intermediate)) ||
+        !TEST_ptr(msg2 = CMP_PKIMESSAGE_new()) ||
+        !TEST_true(CMP_PKIMESSAGE_add_extraCerts(ctx, msg2)) ||
+        !TEST_int_eq(sk_X509_num(msg2->extraCerts), 2) ||
+        !TEST_int_eq(0, X509_cmp(sk_X509_value(msg2->extraCerts, 0),
+                                 endentity2)) ||
+        !TEST_int_eq(0, X509_cmp(sk_X509_value(msg2->extraCerts, 1),
+                                 intermediate)))
+        goto end;
+
+    /* replacing an untrusted cert, which keeps their number, is noticed */
+    CMP_PKIMESSAGE_free(msg2);
+    msg2 = NULL;
+    untrusted = CMP_CTX_get0_untrusted_certs(ctx);
+    if (!TEST_int_eq(sk_X509_num(untrusted), 2) ||
+        !TEST_true(X509_up_ref(endentity1)))
+        goto end;
+    X509_free(sk_X509_value(untrusted, 1));
+    (void)sk_X509_set(untrusted, 1, endentity1);
+    if (!TEST_ptr(msg2 = CMP_PKIMESSAGE_new()) ||
+        !TEST_true(CMP_PKIMESSAGE_add_extraCerts(ctx, msg2)) ||
+        !TEST_int_eq(sk_X509_num(msg2->extraCerts), 1))
+        goto end;
+
+    /* setting a new client cert invalidates the chain */
+    if (!TEST_true(CMP_CTX_set1_clCert(ctx, endentity1)) ||
+        !TEST_ptr_null(ctx->clCert_chain))
+        goto end;
+    res = 1;
+
+ end:
+    CMP_PKIMESSAGE_free(msg2);
+    return res;
+}
+
+static int test_cmp_add_extracerts_chain_cached(void)
+{
+    SETUP_TEST_FIXTURE(CMP_INT_TEST_FIXTURE, set_up);
+    if (!TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, endentity2)) ||
+        !TEST_true(STACK_OF_X509_push1(CMP_CTX_get0_untrusted_certs
+                                       (fixture->cmp_ctx), endentity1)) ||
+        !TEST_ptr(fixture->msg = CMP_PKIMESSAGE_new())) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_add_extracerts_chain_test, tear_down);
+    return result;
+}
+
+static int execute_cmp_protect_signing_repeated_test(CMP_INT_TEST_FIXTURE *
+                                                     fixture)
+{
+    CMP_CTX *ctx = fixture->cmp_ctx;
+    CMP_PKIMESSAGE *msg2 = NULL;
+    EVP_MD_CTX *sig_ctx = NULL;
+    int res = 0;
+
+    /* the signing context prepared for the first message is reused */
+    if (!TEST_ptr(msg2 = CMP_PKIMESSAGE_dup(fixture->msg)) ||
+        !TEST_true(CMP_PKIMESSAGE_protect(ctx, fixture->msg)) ||
+        !TEST_ptr(sig_ctx = ctx->sig_md_ctx) ||
+        !TEST_true(CMP_PKIMESSAGE_protect(ctx, msg2)) ||
+        !TEST_ptr_eq(ctx->sig_md_ctx, sig_ctx) ||
+        !TEST_true(CMP_validate_msg(ctx, fixture->msg)) ||
+        !TEST_true(CMP_validate_msg(ctx, msg2)))
+        goto end;
+
+    /* changing the digest requires preparing anew */
+    CMP_PKIMESSAGE_free(msg2);
+    if (!TEST_ptr(msg2 = CMP_PKIMESSAGE_dup(fixture->msg)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_DIGEST_ALGNID,
+                                      NID_sha384)) ||
+        !TEST_ptr_null(ctx->sig_md_ctx) ||
+        !TEST_true(CMP_PKIMESSAGE_protect(ctx, msg2)) ||
+        !TEST_int_eq(OBJ_obj2nid(msg2->header.protectionAlg->algorithm),
+                     NID_sha384WithRSAEncryption) ||
+        !TEST_true(CMP_validate_msg(ctx, msg2)))
+        goto end;
+    res = 1;
+
+ end:
+    CMP_PKIMESSAGE_free(msg2);
+    return res;
+}
+
+static int test_cmp_protect_signing_repeated(void)
+{
+    SETUP_TEST_FIXTURE(CMP_INT_TEST_FIXTURE, set_up);
+    if (!TEST_ptr(fixture->msg =
+                  load_pkimsg("../cmp-test/CMP_IR_unprotected.der")) ||
+        !TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, loadedprivkey)) ||
+        !TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, srvcert)) ||
+        !TEST_true(CMP_CTX_set1_srvCert(fixture->cmp_ctx, srvcert)) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_IGNORE_KEYUSAGE, 1))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_protect_signing_repeated_test, tear_down);
+    return result;
+}
+
+/* returns the DER encoding of the certReqMsg at position idx in msg */
+static int certreqmsg_der(const CMP_PKIMESSAGE *msg, int idx,
+                          unsigned char **der)
+{
+    return i2d_CRMF_CERTREQMSG(sk_CRMF_CERTREQMSG_value(msg->body->value.cr,
+                                                        idx), der);
+}
+
+/* returns a self-signed cert for the given key with the given SAN */
+static X509 *san_cert_new(EVP_PKEY *pkey, const char *dns)
+{
+    X509 *cert = NULL;
+    GENERAL_NAMES *sans = NULL;
+    GENERAL_NAME *san = NULL;
+    X509_NAME *name = NULL;
+    int ok = 0;
+
+    if ((cert = X509_new()) == NULL ||
+        (sans = GENERAL_NAMES_new()) == NULL ||
+        (san = a2i_GENERAL_NAME(NULL, NULL, NULL, GEN_DNS, (char *)dns, 0))
+        == NULL || !sk_GENERAL_NAME_push(sans, san))
+        goto end;
+    san = NULL;
+    ok = (name = X509_get_subject_name(cert)) != NULL &&
+        X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                   (unsigned char *)"old device", -1, -1, 0) &&
+        X509_set_issuer_name(cert, name) &&
+        ASN1_INTEGER_set(X509_get_serialNumber(cert), 42) &&
+        X509_gmtime_adj(X509_getm_notBefore(cert), 0) != NULL &&
+        X509_gmtime_adj(X509_getm_notAfter(cert), 60) != NULL &&
+        X509_set_pubkey(cert, pkey) &&
+        X509_add1_ext_i2d(cert, NID_subject_alt_name, sans, 0, 0) &&
+        X509_sign(cert, pkey, EVP_sha256()) > 0;
+ end:
+    GENERAL_NAME_free(san);
+    GENERAL_NAMES_free(sans);
+    if (!ok) {
+        X509_free(cert);
+        cert = NULL;
+    }
+    return cert;
+}
+
+/*
+ * checks that the request built from the template in dev_ctx equals the one
+ * built the usual way from ctx and whether it has a subjectAltName extension
+ */
+static int certreq_template_eq(CMP_CTX *ctx, CMP_CTX *dev_ctx, int bodytype,
+                               int err_code, int with_san)
+{
+    CMP_PKIMESSAGE *msg = NULL;
+    CRMF_CERTREQMSG *crm;
+    X509_EXTENSIONS *exts;
+    unsigned char *der1 = NULL, *der2 = NULL;
+    int len1 = 0, len2 = 0, res = 0;
+
+    if (!TEST_ptr(msg = CMP_certreq_new(ctx, bodytype, err_code)) ||
+        !TEST_int_gt(len1 = certreqmsg_der(msg, 0, &der1), 0))
+        goto err;
+    CMP_PKIMESSAGE_free(msg);
+    if (!TEST_ptr(msg = CMP_certreq_new(dev_ctx, bodytype, err_code)) ||
+        !TEST_int_gt(len2 = certreqmsg_der(msg, 0, &der2), 0) ||
+        !TEST_mem_eq(der1, len1, der2, len2) ||
+        !TEST_ptr(crm = sk_CRMF_CERTREQMSG_value(msg->body->value.cr, 0)))
+        goto err;
+    exts = crm->certReq.certTemplate.extensions;
+    if (!TEST_int_eq(X509v3_get_ext_by_NID(exts, NID_subject_alt_name,
+                                           -1) >= 0, with_san))
+        goto err;
+    res = 1;
+
+ err:
+    OPENSSL_free(der1);
+    OPENSSL_free(der2);
+    CMP_PKIMESSAGE_free(msg);
+    return res;
+}
+
+/* clears the subject and subjectAltNames of an individual device from ctx */
+static void clear_device_names(CMP_CTX *ctx)
+{
+    X509_NAME_free(ctx->subjectName);
+    ctx->subjectName = NULL;
+    sk_GENERAL_NAME_pop_free(ctx->subjectAltNames, GENERAL_NAME_free);
+    ctx->subjectAltNames = NULL;
+}
+
+static int execute_certreq_template_test(CMP_INT_TEST_FIXTURE *fixture)
+{
+    CMP_CTX *ctx = fixture->cmp_ctx, *dev_ctx = NULL;
+    CMP_CERTREQ_TEMPLATE *tmpl = NULL;
+    GENERAL_NAME *san = NULL, *san2 = NULL;
+    X509_NAME *subject = NULL;
+    X509 *oldcert = NULL;
+    int res = 0;
+
+    if (!TEST_ptr(subject = X509_NAME_new()) ||
+        !TEST_true(X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC,
+                                              (unsigned char *)"device 1",
+                                              -1, -1, 0)) ||
+        !TEST_ptr(san = a2i_GENERAL_NAME(NULL, NULL, NULL, GEN_DNS,
+                                         "device1.example.com", 0)) ||
+        !TEST_ptr(oldcert = san_cert_new(loadedprivkey,
+                                         "device1.example.com")) ||
+        /* the profile shared by all devices */
+        !TEST_true(CMP_CTX_set1_issuer(ctx, X509_get_subject_name(srvcert))) ||
+        !TEST_true(CMP_CTX_policyOID_push1(ctx, "1.2.3.4")) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_UNPROTECTED_SEND, 1)) ||
+        !TEST_ptr(tmpl = CMP_CERTREQ_TEMPLATE_new(ctx)) ||
+        /* the individual parameters */
+        !TEST_true(CMP_CTX_set1_newPkey(ctx, loadedprivkey)) ||
+        !TEST_true(CMP_CTX_set1_subjectName(ctx, subject)) ||
+        !TEST_true(CMP_CTX_subjectAltName_push1(ctx, san)) ||
+        !TEST_ptr(dev_ctx = CMP_CTX_create()) ||
+        !TEST_true(CMP_CTX_set_option(dev_ctx,
+                                      CMP_CTX_OPT_UNPROTECTED_SEND, 1)) ||
+        !TEST_true(CMP_CTX_set1_certReqTemplate(dev_ctx, tmpl)) ||
+        !TEST_true(CMP_CTX_set1_newPkey(dev_ctx, loadedprivkey)) ||
+        !TEST_true(CMP_CTX_set1_subjectName(dev_ctx, subject)) ||
+        !TEST_true(CMP_CTX_subjectAltName_push1(dev_ctx, san)))
+        goto err;
+
+    /* requests from the template equal those built the usual way */
+    if (!certreq_template_eq(ctx, dev_ctx, V_CMP_PKIBODY_CR,
+                             CMP_R_ERROR_CREATING_CR, 1))
+        goto err;
+
+    /* the subjectAltNames of KUR requests default to those of oldcert */
+    clear_device_names(ctx);
+    clear_device_names(dev_ctx);
+    if (!TEST_true(CMP_CTX_set1_clCert(ctx, srvcert)) ||
+        !TEST_true(CMP_CTX_set1_clCert(dev_ctx, srvcert)) ||
+        !TEST_true(CMP_CTX_set1_oldClCert(ctx, oldcert)) ||
+        !TEST_true(CMP_CTX_set1_oldClCert(dev_ctx, oldcert)) ||
+        !certreq_template_eq(ctx, dev_ctx, V_CMP_PKIBODY_KUR,
+                             CMP_R_ERROR_CREATING_KUR, 1))
+        goto err;
+
+    /* else to those of the client cert */
+    X509_free(ctx->oldClCert);
+    ctx->oldClCert = NULL;
+    X509_free(dev_ctx->oldClCert);
+    dev_ctx->oldClCert = NULL;
+    if (!TEST_true(CMP_CTX_set1_clCert(ctx, oldcert)) ||
+        !TEST_true(CMP_CTX_set1_clCert(dev_ctx, oldcert)) ||
+        !certreq_template_eq(ctx, dev_ctx, V_CMP_PKIBODY_KUR,
+                             CMP_R_ERROR_CREATING_KUR, 1))
+        goto err;
+
+    /* unless overridden by the subjectAltNames given */
+    if (!TEST_ptr(san2 = a2i_GENERAL_NAME(NULL, NULL, NULL, GEN_DNS,
+                                          "device2.example.com", 0)) ||
+        !TEST_true(CMP_CTX_subjectAltName_push1(ctx, san2)) ||
+        !TEST_true(CMP_CTX_subjectAltName_push1(dev_ctx, san2)) ||
+        !certreq_template_eq(ctx, dev_ctx, V_CMP_PKIBODY_KUR,
+                             CMP_R_ERROR_CREATING_KUR, 1))
+        goto err;
+
+    /* or switched off */
+    clear_device_names(ctx);
+    clear_device_names(dev_ctx);
+    if (!TEST_true(CMP_CTX_set_option(ctx,
+                                      CMP_CTX_OPT_SUBJECTALTNAME_NODEFAULT,
+                                      1)) ||
+        !TEST_true(CMP_CTX_set_option(dev_ctx,
+                                      CMP_CTX_OPT_SUBJECTALTNAME_NODEFAULT,
+                                      1)) ||
+        !certreq_template_eq(ctx, dev_ctx, V_CMP_PKIBODY_KUR,
+                             CMP_R_ERROR_CREATING_KUR, 0))
+        goto err;
+    res = 1;
+
+ err:
+    CMP_CERTREQ_TEMPLATE_free(tmpl);
+    CMP_CTX_delete(dev_ctx);
+    GENERAL_NAME_free(san);
+    GENERAL_NAME_free(san2);
+    X509_NAME_free(subject);
+    X509_free(oldcert);
+    return res;
+}
+
+static int test_cmp_certreq_template(void)
+{
+    SETUP_TEST_FIXTURE(CMP_INT_TEST_FIXTURE, set_up);
+    EXECUTE_TEST(execute_certreq_template_test, tear_down);
+    return result;
+}
+
+static int execute_encrcert_get_test(CMP_INT_TEST_FIXTURE *fixture)
+{
+    CMP_CTX *ctx = fixture->cmp_ctx;
+    CMP_SRV_CTX *srv_ctx = NULL;
+    CMP_PKIMESSAGE *req = NULL, *rsp = NULL;
+    CMP_CERTRESPONSE *crep;
+    X509 *cert1 = NULL, *cert2 = NULL;
+    unsigned char *der1 = NULL, *der2 = NULL;
+    int len1 = 0, len2 = 0, res = 0;
+
+    if (!TEST_ptr(srv_ctx = CMP_SRV_CTX_create()) ||
+        !TEST_true(CMP_SRV_CTX_set_accept_unprotected(srv_ctx, 1)) ||
+        !TEST_true(CMP_SRV_CTX_set1_certOut(srv_ctx, srvcert)) ||
+        !TEST_true(CMP_CTX_set1_clCert(CMP_SRV_CTX_get0_ctx(srv_ctx),
+                                       srvcert)) ||
+        !TEST_true(CMP_CTX_set1_pkey(CMP_SRV_CTX_get0_ctx(srv_ctx),
+                                     loadedprivkey)) ||
+        !TEST_true(CMP_CTX_set_transfer_cb_arg(ctx, srv_ctx)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_UNPROTECTED_SEND, 1)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_POPOMETHOD,
+                                      CRMF_POPO_ENCRCERT)) ||
+        !TEST_true(CMP_CTX_set1_referenceValue(ctx, (unsigned char *)"ref",
+                                               3)) ||
+        !TEST_true(CMP_CTX_set1_pkey(ctx, loadedprivkey)) ||
+        !TEST_ptr(req = CMP_certreq_new(ctx, V_CMP_PKIBODY_IR,
+                                        CMP_R_ERROR_CREATING_IR)) ||
+        !TEST_int_eq(CMP_mock_server_perform(ctx, req, &rsp), 0) ||
+        !TEST_int_eq(CMP_PKIMESSAGE_get_bodytype(rsp), V_CMP_PKIBODY_IP) ||
+        !TEST_ptr(crep = CMP_CERTREPMESSAGE_certResponse_get0
+                  (rsp->body->value.ip, 0)) ||
+        !TEST_int_gt(len1 = i2d_CMP_PKIMESSAGE(rsp, &der1), 0))
+        goto err;
+
+    /* retrieving the certificate leaves the received message unchanged */
+    if (!TEST_ptr(cert1 = CMP_CERTRESPONSE_get_certificate(ctx, crep)) ||
+        !TEST_int_eq(X509_cmp(cert1, srvcert), 0) ||
+        !TEST_int_eq(crep->certifiedKeyPair->certOrEncCert->type,
+                     CMP_CERTORENCCERT_ENCRYPTEDCERT) ||
+        !TEST_int_gt(len2 = i2d_CMP_PKIMESSAGE(rsp, &der2), 0) ||
+        !TEST_mem_eq(der1, len1, der2, len2) ||
+        !TEST_ptr(cert2 = CMP_CERTRESPONSE_get_certificate(ctx, crep)) ||
+        !TEST_int_eq(X509_cmp(cert2, srvcert), 0))
+        goto err;
+    res = 1;
+
+ err:
+    OPENSSL_free(der1);
+    OPENSSL_free(der2);
+    X509_free(cert1);
+    X509_free(cert2);
+    CMP_PKIMESSAGE_free(req);
+    CMP_PKIMESSAGE_free(rsp);
+    CMP_SRV_CTX_delete(srv_ctx);
+    return res;
+}
+
+static int test_cmp_encrcert_get(void)
+{
+    SETUP_TEST_FIXTURE(CMP_INT_TEST_FIXTURE, set_up);
+    EXECUTE_TEST(execute_encrcert_get_test, tear_down);
+    return result;
+}
+
 void cleanup_tests(void)
 {
     EVP_PKEY_free(loadedprivkey);
     EVP_PKEY_free(loadedpubkey);
+    X509_free(endentity1);
+    X509_free(endentity2);
+    X509_free(intermediate);
+    X509_free(srvcert);
 }
 
 int setup_tests(void)
@@ -270,6 +651,15 @@ int setup_tests(void)
         return 0;
     if (TEST_true(EVP_PKEY_up_ref(loadedprivkey)))
         loadedpubkey = loadedprivkey;
+    if (!TEST_ptr(endentity1 =
+                  load_pem_cert("../cmp-test/chain/EndEntity1.crt")) ||
+        !TEST_ptr(endentity2 =
+                  load_pem_cert("../cmp-test/chain/EndEntity2.crt")) ||
+        !TEST_ptr(intermediate =
+                  load_pem_cert("../cmp-test/chain/Intermediate_CA.crt")) ||
+        !TEST_ptr(srvcert =
+                  load_pem_cert("../cmp-test/openssl_cmp_test_server.crt")))
+        return 0;
 
     /* Message protection tests */
     ADD_TEST(test_cmp_calc_protection_no_key_no_secret);
@@ -280,5 +670,13 @@ int setup_tests(void)
     ADD_TEST(test_cmp_pkiheader_init_with_subject);
     ADD_TEST(test_cmp_pkiheader_init_no_ref_no_subject);
 
+    ADD_TEST(test_cmp_add_extracerts_chain_cached);
+    ADD_TEST(test_cmp_protect_signing_repeated);
+
+    ADD_TEST(test_cmp_certreq_template);
+
+    /* Certificate response tests */
+    ADD_TEST(test_cmp_encrcert_get);
+
     return 1;
 }
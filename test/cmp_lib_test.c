@@ -13,6 +13,8 @@
 
 #include "cmptestlib.h"
 
+#include <string.h>
+
 typedef struct test_fixture {
     const char *test_case_name;
     int expected;
@@ -70,6 +72,48 @@ static X509 *endentity1 = NULL, *endentity2 = NULL,
     *root = NULL, *intermediate = NULL;
 static unsigned char rand_data[TRANSACTIONID_LENGTH];
 static CMP_PKIMESSAGE *ir_unprotected, *ir_protected, *insta_unprotected;
+/* X25519 keys and certificates for DHBasedMac protection */
+static EVP_PKEY *dh_key[3] = { NULL, NULL, NULL };
+static X509 *dh_cert[3] = { NULL, NULL, NULL };
+
+static EVP_PKEY *gen_x25519(void)
+{
+    EVP_PKEY_CTX *ctx = NULL;
+    EVP_PKEY *pkey = NULL;
+
+    (void)(TEST_ptr(ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL)) &&
+           TEST_int_gt(EVP_PKEY_keygen_init(ctx), 0) &&
+           TEST_int_gt(EVP_PKEY_keygen(ctx, &pkey), 0));
+    EVP_PKEY_CTX_free(ctx);
+    return pkey;
+}
+
+/* issues with loadedkey a certificate for the given key agreement key */
+static X509 *dh_cert_new(EVP_PKEY *pkey, const char *cn)
+{
+    X509 *x = NULL;
+    X509_NAME *name = NULL;
+
+    if (TEST_ptr(x = X509_new()) &&
+        TEST_true(X509_set_version(x, 2)) &&
+        TEST_true(ASN1_INTEGER_set(X509_get_serialNumber(x), 1)) &&
+        TEST_ptr(X509_gmtime_adj(X509_getm_notBefore(x), 0)) &&
+        TEST_ptr(X509_gmtime_adj(X509_getm_notAfter(x), 3600)) &&
+        TEST_ptr(name = X509_NAME_new()) &&
+        TEST_true(X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                             (const unsigned char *)cn,
+                                             -1, -1, 0)) &&
+        TEST_true(X509_set_subject_name(x, name)) &&
+        TEST_true(X509_set_issuer_name(x, X509_get_subject_name(cert))) &&
+        TEST_true(X509_set_pubkey(x, pkey)) &&
+        TEST_int_gt(X509_sign(x, loadedkey, EVP_sha256()), 0)) {
+        X509_NAME_free(name);
+        return x;
+    }
+    X509_NAME_free(name);
+    X509_free(x);
+    return NULL;
+}
 
 
 static int allow_unprotected(const CMP_CTX *ctx, int arg,
@@ -84,6 +128,165 @@ static int execute_protection_test(CMP_LIB_TEST_FIXTURE *fixture)
                        CMP_PKIMESSAGE_protect(fixture->cmp_ctx, fixture->msg));
 }
 
+static int execute_pbm_reuse_salt_test(CMP_LIB_TEST_FIXTURE *fixture)
+{
+    CMP_PKIMESSAGE *msg2 = NULL;
+    unsigned char *der1 = NULL, *der2 = NULL;
+    int len1, len2;
+    int res = 0;
+
+    /* a second message of the same transaction, with the same contents */
+    if (!TEST_ptr(msg2 = CMP_PKIMESSAGE_dup(fixture->msg)))
+        return 0;
+    if (!TEST_true(CMP_PKIMESSAGE_protect(fixture->cmp_ctx, fixture->msg)) ||
+        !TEST_true(CMP_PKIMESSAGE_protect(fixture->cmp_ctx, msg2)) ||
+        !TEST_int_gt(len1 = i2d_CMP_PKIMESSAGE(fixture->msg, &der1), 0) ||
+        !TEST_int_gt(len2 = i2d_CMP_PKIMESSAGE(msg2, &der2), 0))
+        goto end;
+    /* the encodings, including the PBM salt, are equal iff it was reused */
+    if (TEST_int_eq(fixture->expected,
+                    len1 == len2 && memcmp(der1, der2, len1) == 0) &&
+        TEST_true(CMP_validate_msg(fixture->cmp_ctx, fixture->msg)) &&
+        TEST_true(CMP_validate_msg(fixture->cmp_ctx, msg2)))
+        res = 1;
+ end:
+    OPENSSL_free(der1);
+    OPENSSL_free(der2);
+    CMP_PKIMESSAGE_free(msg2);
+    return res;
+}
+
+static int execute_protect_der_test(CMP_LIB_TEST_FIXTURE *fixture)
+{
+    CMP_PKIMESSAGE *msg2 = NULL;
+    unsigned char *der1 = NULL, *der2 = NULL;
+    const unsigned char *p;
+    int len1, len2;
+    int res = 0;
+
+    if (!TEST_true(CMP_PKIMESSAGE_protect(fixture->cmp_ctx, fixture->msg)) ||
+        /* uses the encoding retained when protecting */
+        !TEST_int_gt(len1 = i2d_CMP_PKIMESSAGE(fixture->msg, &der1), 0) ||
+        /* a no-op change, after which the message needs to be encoded */
+        !TEST_true(CMP_PKIMESSAGE_set_bodytype(fixture->msg,
+                               CMP_PKIMESSAGE_get_bodytype(fixture->msg))) ||
+        !TEST_int_gt(len2 = i2d_CMP_PKIMESSAGE(fixture->msg, &der2), 0) ||
+        !TEST_mem_eq(der1, len1, der2, len2))
+        goto end;
+    /* protection is verified on the encoding retained when decoding */
+    p = der1;
+    if (TEST_ptr(msg2 = d2i_CMP_PKIMESSAGE(NULL, &p, len1)) &&
+        TEST_true(CMP_validate_msg(fixture->cmp_ctx, msg2)) &&
+        TEST_true(CMP_validate_msg(fixture->cmp_ctx, fixture->msg)))
+        res = 1;
+ end:
+    OPENSSL_free(der1);
+    OPENSSL_free(der2);
+    CMP_PKIMESSAGE_free(msg2);
+    return res;
+}
+
+/* changes made via the header of a decoded message must not get lost */
+static int execute_modified_header_test(CMP_LIB_TEST_FIXTURE *fixture)
+{
+    static unsigned char kid[] = "changed senderKID";
+    CMP_PKIMESSAGE *msg2 = NULL, *msg3 = NULL, *msg4 = NULL;
+    ASN1_OCTET_STRING *id = NULL;
+    unsigned char *der1 = NULL, *der2 = NULL, *der3 = NULL, *der4 = NULL;
+    const unsigned char *p;
+    int len1, len2, len3, len4;
+    int res = 0;
+
+    if (!TEST_true(CMP_PKIMESSAGE_protect(fixture->cmp_ctx, fixture->msg)) ||
+        !TEST_int_gt(len1 = i2d_CMP_PKIMESSAGE(fixture->msg, &der1), 0))
+        goto end;
+    p = der1;
+    if (!TEST_ptr(msg2 = d2i_CMP_PKIMESSAGE(NULL, &p, len1)) ||
+        !TEST_ptr(id = ASN1_OCTET_STRING_new()) ||
+        !TEST_true(ASN1_OCTET_STRING_set(id, kid, sizeof(kid))) ||
+        !TEST_true(CMP_PKIHEADER_set1_senderKID(
+                       CMP_PKIMESSAGE_get0_header(msg2), id)))
+        goto end;
+    CMP_PKIMESSAGE_modified(msg2);
+    if (!TEST_int_gt(len2 = i2d_CMP_PKIMESSAGE(msg2, &der2), 0))
+        goto end;
+    p = der2;
+    if (TEST_ptr(msg3 = d2i_CMP_PKIMESSAGE(NULL, &p, len2)) &&
+        TEST_ptr(msg4 = CMP_PKIMESSAGE_dup(msg2)) &&
+        TEST_int_gt(len3 = i2d_CMP_PKIMESSAGE(msg3, &der3), 0) &&
+        TEST_int_gt(len4 = i2d_CMP_PKIMESSAGE(msg4, &der4), 0) &&
+        /* the new senderKID made it into the encoding and its copies */
+        TEST_mem_ne(der1, len1, der2, len2) &&
+        TEST_mem_eq(der2, len2, der3, len3) &&
+        TEST_mem_eq(der2, len2, der4, len4) &&
+        /* the protection does not match the changed header any more */
+        TEST_false(CMP_validate_msg(fixture->cmp_ctx, msg2)))
+        res = 1;
+ end:
+    OPENSSL_free(der1);
+    OPENSSL_free(der2);
+    OPENSSL_free(der3);
+    OPENSSL_free(der4);
+    ASN1_OCTET_STRING_free(id);
+    CMP_PKIMESSAGE_free(msg2);
+    CMP_PKIMESSAGE_free(msg3);
+    CMP_PKIMESSAGE_free(msg4);
+    return res;
+}
+
+/* a context holding the given DH key, with the peer's DH certificate */
+static CMP_CTX *dhbm_ctx_new(EVP_PKEY *pkey, X509 *own, X509 *peer)
+{
+    CMP_CTX *ctx;
+
+    if (!TEST_ptr(ctx = CMP_CTX_create()))
+        return NULL;
+    if (!TEST_true(CMP_CTX_set1_pkey(ctx, pkey)) ||
+        !TEST_true(CMP_CTX_set1_clCert(ctx, own)) ||
+        !TEST_true(CMP_CTX_set1_srvCert(ctx, peer)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_DHBASEDMAC, 1))) {
+        CMP_CTX_delete(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static int execute_dhbmac_test(CMP_LIB_TEST_FIXTURE *fixture)
+{
+    CMP_CTX *peer_ctx = NULL, *other_ctx = NULL;
+    CMP_PKIMESSAGE *rsp = NULL;
+    int res = 0;
+
+    if (!TEST_ptr(peer_ctx = dhbm_ctx_new(dh_key[1], dh_cert[1], dh_cert[0]))
+        || !TEST_ptr(other_ctx = dhbm_ctx_new(dh_key[2], dh_cert[2],
+                                              dh_cert[0]))
+        || !TEST_ptr(rsp = CMP_PKIMESSAGE_dup(fixture->msg)))
+        goto end;
+    if (!TEST_int_eq(fixture->expected,
+                     CMP_PKIMESSAGE_protect(fixture->cmp_ctx, fixture->msg)))
+        goto end;
+    if (!fixture->expected) {
+        res = 1;
+        goto end;
+    }
+    /* the second validation uses the cached base key */
+    if (!TEST_true(CMP_validate_msg(peer_ctx, fixture->msg)) ||
+        !TEST_true(CMP_validate_msg(peer_ctx, fixture->msg)) ||
+        /* the message cannot be validated with any other DH key */
+        !TEST_false(CMP_validate_msg(other_ctx, fixture->msg)))
+        goto end;
+    /* a response protected by the peer with the same agreed secret */
+    if (TEST_true(CMP_PKIMESSAGE_protect(peer_ctx, rsp)) &&
+        TEST_true(CMP_validate_msg(fixture->cmp_ctx, rsp)) &&
+        TEST_false(CMP_validate_msg(other_ctx, rsp)))
+        res = 1;
+ end:
+    CMP_PKIMESSAGE_free(rsp);
+    CMP_CTX_delete(peer_ctx);
+    CMP_CTX_delete(other_ctx);
+    return res;
+}
+
 static int execute_check_received_test(CMP_LIB_TEST_FIXTURE *fixture)
 {
     if (!TEST_int_eq(CMP_PKIMESSAGE_check_received(fixture->cmp_ctx,
@@ -268,6 +471,27 @@ static int test_cmp_protection_with_msg_sig_alg_protection_plus_rsa_key(void)
     return result;
 }
 
+static int test_cmp_protection_pbm_salt(int reuse)
+{
+    SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
+    const size_t size = sizeof(rand_data) / 2;
+    /* with fresh salts, the algorithm parameters differ between messages */
+    fixture->expected = reuse;
+
+    if (!TEST_ptr(fixture->msg = CMP_PKIMESSAGE_dup(ir_unprotected)) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_PBM_REUSE_SALT, reuse)) ||
+        !TEST_true(CMP_CTX_set1_referenceValue(fixture->cmp_ctx, rand_data,
+                size)) ||
+        !TEST_true(CMP_CTX_set1_secretValue(fixture->cmp_ctx, rand_data + size,
+                size))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_pbm_reuse_salt_test, tear_down);
+    return result;
+}
+
 static int test_cmp_protection_with_certificate_and_key(void)
 {
     SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
@@ -289,6 +513,78 @@ static int test_cmp_protection_with_certificate_and_key(void)
     return result;
 }
 
+static int test_cmp_protection_retains_der(void)
+{
+    SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
+
+    if (!TEST_ptr(fixture->msg = CMP_PKIMESSAGE_dup(ir_unprotected)) ||
+        !TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, loadedkey)) ||
+        !TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, cert)) ||
+        !TEST_true(CMP_CTX_set1_srvCert(fixture->cmp_ctx, cert)) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_IGNORE_KEYUSAGE, 1))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_protect_der_test, tear_down);
+    return result;
+}
+
+static int test_cmp_pkimessage_modified_header(void)
+{
+    SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
+
+    if (!TEST_ptr(fixture->msg = CMP_PKIMESSAGE_dup(ir_unprotected)) ||
+        !TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, loadedkey)) ||
+        !TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, cert)) ||
+        !TEST_true(CMP_CTX_set1_srvCert(fixture->cmp_ctx, cert)) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_IGNORE_KEYUSAGE, 1))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_modified_header_test, tear_down);
+    return result;
+}
+
+static int test_cmp_protection_dhbasedmac(int with_peer_cert)
+{
+    SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
+    /* without the recipient's DH certificate, protection is not possible */
+    fixture->expected = with_peer_cert;
+
+    if (!TEST_ptr(fixture->msg = CMP_PKIMESSAGE_dup(ir_unprotected)) ||
+        !TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, dh_key[0])) ||
+        !TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, dh_cert[0])) ||
+        (with_peer_cert &&
+         !TEST_true(CMP_CTX_set1_srvCert(fixture->cmp_ctx, dh_cert[1]))) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_DHBASEDMAC, 1))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_dhbmac_test, tear_down);
+    return result;
+}
+
+static int test_cmp_protection_cert_and_key_mismatch(void)
+{
+    SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
+    fixture->expected = 0;
+
+    if (!TEST_ptr(fixture->msg = CMP_PKIMESSAGE_dup(ir_unprotected)) ||
+        !TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, loadedkey)) ||
+        !TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, cert)) ||
+        !TEST_true(CMP_PKIMESSAGE_protect(fixture->cmp_ctx, fixture->msg)) ||
+        /* the key check must be done again for the new cert */
+        !TEST_true(CMP_CTX_set1_clCert(fixture->cmp_ctx, endentity1))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_protection_test, tear_down);
+    return result;
+}
+
 static int test_cmp_protection_certificate_based_without_cert(void)
 {
     SETUP_TEST_FIXTURE(CMP_LIB_TEST_FIXTURE, set_up);
@@ -608,8 +904,41 @@ static int test_cmp_x509_store_only_self_signed(void)
 }
 
 
+static int test_cmp_sk_x509_add1_certs(void)
+{
+    STACK_OF(X509) *sk = NULL, *certs = NULL, *expected = NULL;
+    int res = 0;
+
+    /* duplicates and self-signed certs are skipped, order is preserved */
+    if (!TEST_ptr(sk = sk_X509_new_null()) ||
+        !TEST_ptr(certs = sk_X509_new_null()) ||
+        !TEST_ptr(expected = sk_X509_new_null()) ||
+        !TEST_true(CMP_sk_X509_add1_cert(sk, endentity1, 1)) ||
+        !TEST_true(CMP_sk_X509_add1_cert(sk, intermediate, 1)) ||
+        !TEST_true(CMP_sk_X509_add1_cert(sk, endentity1, 1)) ||
+        !TEST_true(sk_X509_push(certs, root)) ||
+        !TEST_true(sk_X509_push(certs, intermediate)) ||
+        !TEST_true(sk_X509_push(certs, endentity2)) ||
+        !TEST_true(sk_X509_push(certs, endentity1)) ||
+        !TEST_true(sk_X509_push(certs, endentity2)) ||
+        !TEST_true(sk_X509_push(expected, endentity1)) ||
+        !TEST_true(sk_X509_push(expected, intermediate)) ||
+        !TEST_true(sk_X509_push(expected, endentity2)) ||
+        !TEST_true(CMP_sk_X509_add1_certs(sk, certs, 1, 1)) ||
+        !TEST_int_eq(0, STACK_OF_X509_cmp(sk, expected)))
+        goto err;
+    res = 1;
+ err:
+    sk_X509_pop_free(sk, X509_free);
+    sk_X509_free(certs);
+    sk_X509_free(expected);
+    return res;
+}
+
 void cleanup_tests(void)
 {
+    int i;
+
     EVP_PKEY_free(loadedkey);
     X509_free(cert);
     X509_free(endentity1);
@@ -619,12 +948,18 @@ void cleanup_tests(void)
     CMP_PKIMESSAGE_free(ir_protected);
     CMP_PKIMESSAGE_free(ir_unprotected);
     CMP_PKIMESSAGE_free(insta_unprotected);
+    for (i = 0; i < 3; i++) {
+        EVP_PKEY_free(dh_key[i]);
+        X509_free(dh_cert[i]);
+    }
 
     return;
 }
 
 int setup_tests(void)
 {
+    int i;
+
     if(!TEST_int_eq(1, RAND_bytes(rand_data, TRANSACTIONID_LENGTH)))
         return 0;
     if (!TEST_ptr(endentity1 =
@@ -646,10 +981,23 @@ int setup_tests(void)
         !TEST_ptr(insta_unprotected =
                 load_pkimsg("../cmp-test/insta_removed_protection.der")))
         return 0;
+    for (i = 0; i < 3; i++) {
+        char cn[] = "DH peer 0";
+
+        cn[sizeof(cn) - 2] += i;
+        if (!TEST_ptr(dh_key[i] = gen_x25519()) ||
+            !TEST_ptr(dh_cert[i] = dh_cert_new(dh_key[i], cn)))
+            return 0;
+    }
 
     /* Message protection tests */
     ADD_TEST(test_cmp_protection_with_msg_sig_alg_protection_plus_rsa_key);
+    ADD_ALL_TESTS(test_cmp_protection_pbm_salt, 2);
     ADD_TEST(test_cmp_protection_with_certificate_and_key);
+    ADD_TEST(test_cmp_protection_retains_der);
+    ADD_TEST(test_cmp_pkimessage_modified_header);
+    ADD_ALL_TESTS(test_cmp_protection_dhbasedmac, 2);
+    ADD_TEST(test_cmp_protection_cert_and_key_mismatch);
     ADD_TEST(test_cmp_protection_certificate_based_without_cert);
     ADD_TEST(test_cmp_protection_unprotected_request);
     ADD_TEST(test_cmp_protection_no_key_no_secret);
@@ -672,6 +1020,7 @@ int setup_tests(void)
     ADD_TEST(test_cmp_build_cert_chain_no_certs);
     ADD_TEST(test_cmp_x509_store);
     ADD_TEST(test_cmp_x509_store_only_self_signed);
+    ADD_TEST(test_cmp_sk_x509_add1_certs);
     /* TODO make sure that total number of tests (here currently 24) is shown,
      also for other cmp_*text.c. Currently the test drivers always show 1. */
 
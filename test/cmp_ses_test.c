@@ -12,6 +12,24 @@
  */
 
 #include "cmptestlib.h"
+#include <openssl/async.h>
+#include <string.h>
+#include <openssl/rsa.h>
+#include "internal/nelem.h"
+
+#ifndef _WIN32
+# include <unistd.h>
+#else
+# include <windows.h>
+# define sleep(x) Sleep((x) * 1000)
+#endif
+
+#if defined(OPENSSL_THREADS) && defined(OPENSSL_SYS_UNIX) && \
+    !defined(OPENSSL_NO_SOCK)
+# define CMP_SES_TEST_SLOW_CLIENT
+# include <pthread.h>
+# include <sys/socket.h>
+#endif
 
 #ifndef NDEBUG /* tests need mock server, which is available only if !NDEBUG */
 
@@ -22,6 +40,12 @@ typedef struct test_fixture {
     int expected;
     X509 *(*exec_cert_ses_cb) (CMP_CTX *);
     STACK_OF(X509) *ca_pubs;
+    int req_type; /* for the resumable API */
+    int timer_waits; /* expected number of CMP_SES_WANT_TIMER results */
+    int async_waits; /* minimum number of CMP_SES_WANT_ASYNC results */
+    int num_certs; /* if > 0, expected number of newly enrolled certs */
+    int num_revs; /* if > 0, expected number of revocation results */
+    const int *rev_status; /* expected PKIStatus of each revocation */
 } CMP_SES_TEST_FIXTURE;
 
 static X509 *cert = NULL;
@@ -42,6 +66,27 @@ static void tear_down(CMP_SES_TEST_FIXTURE *fixture)
     OPENSSL_free(fixture);
 }
 
+/* creates a client context that talks to the given mock server */
+static CMP_CTX *client_ctx_new(CMP_SRV_CTX *srv_ctx)
+{
+    CMP_CTX *ctx;
+
+    if (!TEST_ptr(ctx = CMP_CTX_create()))
+        return NULL;
+    if (!TEST_true(CMP_CTX_set_transfer_cb(ctx, CMP_mock_server_perform)) ||
+        !TEST_true(CMP_CTX_set_transfer_cb_arg(ctx, srv_ctx)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_UNPROTECTED_SEND, 1)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_UNPROTECTED_ERRORS, 1))
+        || !TEST_true(CMP_CTX_set1_oldClCert(ctx, cert)) ||
+        !TEST_true(CMP_CTX_set1_srvCert(ctx, cert)) ||
+        !TEST_true(CMP_CTX_set1_pkey(ctx, key)) ||
+        !TEST_true(CMP_CTX_set1_referenceValue(ctx, ref, sizeof(ref)))) {
+        CMP_CTX_delete(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
 static CMP_SES_TEST_FIXTURE *set_up(const char *const test_case_name)
 {
     CMP_SES_TEST_FIXTURE *fixture;
@@ -59,20 +104,7 @@ static CMP_SES_TEST_FIXTURE *set_up(const char *const test_case_name)
         !TEST_true(CMP_CTX_set1_pkey(srv_cmp_ctx, key)))
         goto err;
 
-    if (!TEST_ptr(fixture->cmp_ctx = CMP_CTX_create()) ||
-        !TEST_true(CMP_CTX_set_transfer_cb(fixture->cmp_ctx,
-                                           CMP_mock_server_perform)) ||
-        !TEST_true(CMP_CTX_set_transfer_cb_arg(fixture->cmp_ctx,
-                                               fixture->srv_ctx)) ||
-        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
-                                      CMP_CTX_OPT_UNPROTECTED_SEND, 1)) ||
-        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
-                                      CMP_CTX_OPT_UNPROTECTED_ERRORS, 1)) ||
-        !TEST_true(CMP_CTX_set1_oldClCert(fixture->cmp_ctx, cert)) ||
-        !TEST_true(CMP_CTX_set1_srvCert(fixture->cmp_ctx, cert)) ||
-        !TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, key)) ||
-        !TEST_true(CMP_CTX_set1_referenceValue(
-                fixture->cmp_ctx, ref, sizeof(ref))))
+    if ((fixture->cmp_ctx = client_ctx_new(fixture->srv_ctx)) == NULL)
         goto err;
 
     fixture->exec_cert_ses_cb = NULL;
@@ -89,7 +121,22 @@ static CMP_SES_TEST_FIXTURE *set_up(const char *const test_case_name)
 
 static int execute_cmp_exec_rr_ses_test(CMP_SES_TEST_FIXTURE *fixture)
 {
-    return TEST_int_eq(fixture->expected, CMP_exec_RR_ses(fixture->cmp_ctx));
+    STACK_OF(CMP_PKISTATUSINFO) *sis;
+    int i;
+
+    if (!TEST_int_eq(fixture->expected, CMP_exec_RR_ses(fixture->cmp_ctx)))
+        return 0;
+    if (fixture->num_revs <= 0)
+        return 1;
+    sis = CMP_CTX_get0_revStatus(fixture->cmp_ctx);
+    if (!TEST_int_eq(sk_CMP_PKISTATUSINFO_num(sis), fixture->num_revs))
+        return 0;
+    for (i = 0; i < fixture->num_revs; i++)
+        if (!TEST_int_eq(CMP_PKISTATUSINFO_PKIStatus_get(
+                             sk_CMP_PKISTATUSINFO_value(sis, i)),
+                         fixture->rev_status[i]))
+            return 0;
+    return 1;
 }
 
 static int execute_cmp_exec_genm_ses_test(CMP_SES_TEST_FIXTURE *fixture)
@@ -102,12 +149,29 @@ static int execute_cmp_exec_genm_ses_test(CMP_SES_TEST_FIXTURE *fixture)
     return 1;
 }
 
+static int check_newClCerts(CMP_SES_TEST_FIXTURE *fixture)
+{
+    STACK_OF(X509) *certs = NULL;
+    int i, ret;
+
+    if (fixture->num_certs <= 0)
+        return 1;
+    if (!TEST_ptr(certs = CMP_CTX_newClCerts_get1(fixture->cmp_ctx)))
+        return 0;
+    ret = TEST_int_eq(sk_X509_num(certs), fixture->num_certs);
+    for (i = 0; ret && i < sk_X509_num(certs); i++)
+        ret = TEST_int_eq(X509_cmp(sk_X509_value(certs, i), cert), 0);
+    sk_X509_pop_free(certs, X509_free);
+    return ret;
+}
+
 static int execute_cmp_exec_certrequest_ses_test(CMP_SES_TEST_FIXTURE *fixture)
 {
     X509 *res = NULL;
     if (fixture->expected) {
         if (TEST_ptr(res = fixture->exec_cert_ses_cb(fixture->cmp_ctx)) &&
-            (res == cert || TEST_int_eq(X509_cmp(res, cert), 0))) {
+            (res == cert || TEST_int_eq(X509_cmp(res, cert), 0)) &&
+            check_newClCerts(fixture)) {
             if (fixture->ca_pubs != NULL) {
                 STACK_OF(X509) *ca_pubs = CMP_CTX_caPubs_get1(fixture->cmp_ctx);
                 int ret = TEST_int_eq(0,
@@ -122,6 +186,564 @@ static int execute_cmp_exec_certrequest_ses_test(CMP_SES_TEST_FIXTURE *fixture)
     return TEST_ptr_null(res = fixture->exec_cert_ses_cb(fixture->cmp_ctx));
 }
 
+static int execute_cmp_ses_step_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_SES *ses = NULL;
+    int rv, timer_waits = 0, async_waits = 0;
+    long wait;
+    int ret = 0;
+
+    if (!TEST_ptr(ses = CMP_SES_start(fixture->cmp_ctx, fixture->req_type)))
+        return 0;
+    for (;;) {
+        if ((rv = CMP_SES_step(ses)) == CMP_SES_WANT_TIMER) {
+            timer_waits++;
+            if ((wait = (long)(CMP_SES_get_deadline(ses) - time(NULL))) > 0)
+                sleep((unsigned int)wait);
+        } else if (rv == CMP_SES_WANT_ASYNC) {
+            /* the paused signature can be continued right away */
+            async_waits++;
+        } else {
+            break;
+        }
+    }
+    if (!fixture->expected) {
+        ret = TEST_int_eq(rv, CMP_SES_ERROR);
+        goto end;
+    }
+    /* the mock server is called synchronously, so no socket I/O is pending */
+    if (TEST_int_eq(rv, CMP_SES_DONE) &&
+        TEST_int_eq(timer_waits, fixture->timer_waits) &&
+        (fixture->async_waits == 0 ? TEST_int_eq(async_waits, 0)
+                                   : TEST_int_ge(async_waits,
+                                                 fixture->async_waits)) &&
+        TEST_int_eq(CMP_SES_get_fd(ses), -1) &&
+        TEST_int_eq(X509_cmp(CMP_CTX_get0_newClCert(fixture->cmp_ctx), cert),
+                    0) &&
+        check_newClCerts(fixture))
+        ret = 1;
+ end:
+    CMP_SES_free(ses);
+    return ret;
+}
+
+/*
+ * RSA private key operations that pause the current ASYNC_JOB once,
+ * like those of the dasync engine (engines/e_dasync.c), which is not
+ * available in builds with static engines
+ */
+static RSA_METHOD *pausing_rsa_meth = NULL;
+static int rsa_pauses = 0;
+static OSSL_ASYNC_FD rsa_wait_fd = OSSL_BAD_ASYNC_FD; /* signaled if set */
+
+static int pausing_rsa_priv_enc(int flen, const unsigned char *from,
+                                unsigned char *to, RSA *rsa, int padding)
+{
+    ASYNC_JOB *job = ASYNC_get_current_job();
+
+    if (job != NULL) {
+        rsa_pauses++;
+        if (rsa_wait_fd != OSSL_BAD_ASYNC_FD)
+            (void)ASYNC_WAIT_CTX_set_wait_fd(ASYNC_get_wait_ctx(job),
+                                             &rsa_wait_fd, rsa_wait_fd,
+                                             NULL, NULL);
+        ASYNC_pause_job();
+    }
+    return RSA_meth_get_priv_enc(RSA_PKCS1_OpenSSL())(flen, from, to, rsa,
+                                                      padding);
+}
+
+/* returns a copy of the RSA key whose signing operations pause the job */
+static EVP_PKEY *pausing_key_new(void)
+{
+    EVP_PKEY *pkey = NULL;
+    RSA *rsa = NULL;
+
+    if (pausing_rsa_meth == NULL &&
+        (!TEST_ptr(pausing_rsa_meth = RSA_meth_dup(RSA_PKCS1_OpenSSL())) ||
+         !TEST_true(RSA_meth_set_priv_enc(pausing_rsa_meth,
+                                          pausing_rsa_priv_enc))))
+        return NULL;
+    if (!TEST_ptr(rsa = RSAPrivateKey_dup(EVP_PKEY_get0_RSA(key))) ||
+        !TEST_true(RSA_set_method(rsa, pausing_rsa_meth)) ||
+        !TEST_ptr(pkey = EVP_PKEY_new()) ||
+        !TEST_true(EVP_PKEY_assign_RSA(pkey, rsa))) {
+        EVP_PKEY_free(pkey);
+        RSA_free(rsa);
+        return NULL;
+    }
+    return pkey;
+}
+
+static int set_pausing_key(CMP_SES_TEST_FIXTURE *fixture)
+{
+    EVP_PKEY *pkey = pausing_key_new();
+    int ret = TEST_ptr(pkey) &&
+        TEST_true(CMP_CTX_set1_pkey(fixture->cmp_ctx, pkey)) &&
+        TEST_true(CMP_CTX_set_option(fixture->cmp_ctx, CMP_CTX_OPT_ASYNC, 1));
+
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
+/*
+ * frees a transaction while its POPO signature is paused,
+ * where the engine may provide a wait fd signaling it can be continued
+ */
+static int execute_cmp_ses_free_paused_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_SES *ses = NULL;
+    int ret;
+
+    rsa_pauses = 0;
+    ret = TEST_ptr(ses = CMP_SES_start(fixture->cmp_ctx, V_CMP_PKIBODY_IR)) &&
+        TEST_int_eq(rsa_pauses, 0) &&
+        TEST_int_eq(CMP_SES_step(ses), CMP_SES_WANT_ASYNC) &&
+        TEST_int_eq(rsa_pauses, 1);
+    if (rsa_wait_fd != OSSL_BAD_ASYNC_FD)
+        ret = ret && TEST_int_eq(CMP_SES_get_fd(ses), rsa_wait_fd);
+    CMP_SES_free(ses);
+    /* the request has not been sent */
+    return ret && TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx),
+                              0);
+}
+
+/* runs two transactions that are in progress at the server at the same time */
+static int execute_cmp_srv_interleaved_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_CTX *other_ctx = NULL;
+    CMP_SES *ses1 = NULL, *ses2 = NULL;
+    int rv1, rv2;
+    int ret = 0;
+
+    if (!TEST_ptr(other_ctx = client_ctx_new(fixture->srv_ctx)) ||
+        !TEST_ptr(ses1 = CMP_SES_start(fixture->cmp_ctx, V_CMP_PKIBODY_CR)) ||
+        !TEST_ptr(ses2 = CMP_SES_start(other_ctx, V_CMP_PKIBODY_IR)) ||
+        !TEST_int_eq(rv1 = CMP_SES_step(ses1), CMP_SES_WANT_TIMER) ||
+        !TEST_int_eq(rv2 = CMP_SES_step(ses2), CMP_SES_WANT_TIMER) ||
+        !TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx), 2))
+        goto end;
+    while (rv1 == CMP_SES_WANT_TIMER || rv2 == CMP_SES_WANT_TIMER) {
+        sleep(1);
+        if (rv1 == CMP_SES_WANT_TIMER)
+            rv1 = CMP_SES_step(ses1);
+        if (rv2 == CMP_SES_WANT_TIMER)
+            rv2 = CMP_SES_step(ses2);
+    }
+    if (TEST_int_eq(rv1, CMP_SES_DONE) && TEST_int_eq(rv2, CMP_SES_DONE) &&
+        TEST_int_eq(X509_cmp(CMP_CTX_get0_newClCert(fixture->cmp_ctx), cert),
+                    0) &&
+        TEST_int_eq(X509_cmp(CMP_CTX_get0_newClCert(other_ctx), cert), 0) &&
+        /* both transactions have been finished by certConf */
+        TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx), 0))
+        ret = 1;
+ end:
+    CMP_SES_free(ses1);
+    CMP_SES_free(ses2);
+    CMP_CTX_delete(other_ctx);
+    return ret;
+}
+
+#define SCHED_SESSIONS 3
+
+static void sched_done_cb(CMP_SES *ses, int rv, void *arg)
+{
+    *(int *)arg = rv;
+}
+
+/* polls for several transactions, one with two certificate requests */
+static int execute_cmp_ses_sched_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_SES_SCHED *sched = NULL;
+    CMP_CTX *ctx[SCHED_SESSIONS] = { NULL };
+    CMP_SES *ses[SCHED_SESSIONS] = { NULL };
+    int rv[SCHED_SESSIONS];
+    STACK_OF(X509) *certs = NULL;
+    time_t deadline;
+    int i, runs = 0;
+    int ret = 0;
+
+    if (!TEST_ptr(sched = CMP_SES_SCHED_new()))
+        goto end;
+    for (i = 0; i < SCHED_SESSIONS; i++) {
+        if (!TEST_ptr(ctx[i] = client_ctx_new(fixture->srv_ctx)) ||
+            (i == 0 && !TEST_true(CMP_CTX_certReq_push1(ctx[i], key,
+                                                        NULL, NULL))) ||
+            !TEST_ptr(ses[i] = CMP_SES_start(ctx[i], V_CMP_PKIBODY_CR)) ||
+            !TEST_int_eq(rv[i] = CMP_SES_step(ses[i]), CMP_SES_WANT_TIMER) ||
+            !TEST_true(CMP_SES_SCHED_add(sched, ses[i], &rv[i])))
+            goto end;
+    }
+    if (!TEST_false(CMP_SES_SCHED_add(sched, ses[0], NULL)) ||
+        !TEST_int_eq(CMP_SES_SCHED_num(sched), SCHED_SESSIONS))
+        goto end;
+    while (CMP_SES_SCHED_num(sched) > 0) {
+        if (!TEST_time_t_gt(deadline = CMP_SES_SCHED_next_deadline(sched), 0))
+            goto end;
+        if (deadline > time(NULL))
+            sleep((unsigned int)(deadline - time(NULL)));
+        if (!TEST_int_ge(CMP_SES_SCHED_run(sched, sched_done_cb), 0) ||
+            !TEST_int_le(++runs, 10))
+            goto end;
+    }
+    for (i = 0; i < SCHED_SESSIONS; i++)
+        if (!TEST_int_eq(rv[i], CMP_SES_DONE) ||
+            !TEST_int_eq(X509_cmp(CMP_CTX_get0_newClCert(ctx[i]), cert), 0))
+            goto end;
+    /* both requests of the first transaction have been polled for together */
+    if (TEST_ptr(certs = CMP_CTX_newClCerts_get1(ctx[0])) &&
+        TEST_int_eq(sk_X509_num(certs), 2) &&
+        TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx), 0))
+        ret = 1;
+ end:
+    sk_X509_pop_free(certs, X509_free);
+    CMP_SES_SCHED_free(sched);
+    for (i = 0; i < SCHED_SESSIONS; i++) {
+        CMP_SES_free(ses[i]);
+        CMP_CTX_delete(ctx[i]);
+    }
+    return ret;
+}
+
+/* freeing a waiting transaction removes it from the scheduler */
+static int execute_cmp_ses_sched_free_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_SES_SCHED *sched = NULL;
+    CMP_SES *ses = NULL;
+    int ret = 0;
+
+    if (TEST_ptr(sched = CMP_SES_SCHED_new()) &&
+        TEST_ptr(ses = CMP_SES_start(fixture->cmp_ctx, V_CMP_PKIBODY_IR)) &&
+        TEST_false(CMP_SES_SCHED_add(sched, ses, NULL)) &&
+        TEST_int_eq(CMP_SES_step(ses), CMP_SES_WANT_TIMER) &&
+        TEST_true(CMP_SES_SCHED_add(sched, ses, NULL)) &&
+        TEST_time_t_eq(CMP_SES_SCHED_next_deadline(sched),
+                       CMP_SES_get_deadline(ses))) {
+        CMP_SES_free(ses);
+        ses = NULL;
+        ret = TEST_int_eq(CMP_SES_SCHED_num(sched), 0) &&
+            TEST_time_t_eq(CMP_SES_SCHED_next_deadline(sched), 0);
+    }
+    CMP_SES_free(ses);
+    CMP_SES_SCHED_free(sched);
+    return ret;
+}
+
+#ifndef OPENSSL_NO_SOCK
+static int execute_cmp_srv_http_serve_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_PKIMESSAGE *req = NULL, *rsp = NULL;
+    unsigned char *der = NULL;
+    const unsigned char *data;
+    BIO *bio = NULL;
+    char line[256];
+    int len;
+    int ret = 0;
+
+    if (!TEST_ptr(req = CMP_genm_new(fixture->cmp_ctx)) ||
+        !TEST_int_gt(len = i2d_CMP_PKIMESSAGE(req, &der), 0) ||
+        !TEST_ptr(bio = BIO_new(BIO_s_mem())) ||
+        !TEST_int_gt(BIO_printf(bio, "POST /pkix/ HTTP/1.0\r\n"
+                                "Content-Type: application/pkixcmp\r\n"
+                                "Content-Length: %d\r\n\r\n", len), 0) ||
+        !TEST_int_eq(BIO_write(bio, der, len), len) ||
+        !TEST_int_eq(CMP_SRV_http_serve(fixture->srv_ctx, bio), 1))
+        goto end;
+    /* the request has been consumed, so only the response is left */
+    if (!TEST_int_gt(BIO_gets(bio, line, sizeof(line)), 0) ||
+        !TEST_strn_eq(line, "HTTP/1.0 200 ", 13))
+        goto end;
+    while (BIO_gets(bio, line, sizeof(line)) > 2)
+        continue;
+    if (TEST_int_gt(len = BIO_get_mem_data(bio, &data), 0) &&
+        TEST_ptr(rsp = d2i_CMP_PKIMESSAGE(NULL, &data, len)) &&
+        TEST_int_eq(CMP_PKIMESSAGE_get_bodytype(rsp), V_CMP_PKIBODY_GENP))
+        ret = 1;
+ end:
+    BIO_free(bio);
+    OPENSSL_free(der);
+    CMP_PKIMESSAGE_free(req);
+    CMP_PKIMESSAGE_free(rsp);
+    return ret;
+}
+
+/* serves the given HTTP request header, which must be rejected with status */
+static int http_serve_reject(CMP_SRV_CTX *srv_ctx, const char *header,
+                             const char *status)
+{
+    BIO *bio = NULL;
+    char line[256];
+    int ret = 0;
+
+    if (TEST_ptr(bio = BIO_new(BIO_s_mem())) &&
+        TEST_int_gt(BIO_puts(bio, header), 0) &&
+        TEST_int_eq(CMP_SRV_http_serve(srv_ctx, bio), -1) &&
+        TEST_int_gt(BIO_gets(bio, line, sizeof(line)), 0) &&
+        TEST_strn_eq(line, status, strlen(status)))
+        ret = 1;
+    BIO_free(bio);
+    return ret;
+}
+
+static int execute_cmp_srv_http_reject_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    return http_serve_reject(fixture->srv_ctx, "POST /pkix/ HTTP/1.0\r\n"
+                             "Content-Type: application/pkixcmp\r\n\r\n",
+                             "HTTP/1.0 411 ") &&
+        http_serve_reject(fixture->srv_ctx, "POST /pkix/ HTTP/1.0\r\n"
+                          "Content-Type: application/pkixcmp\r\n"
+                          "Content-Length: 999999999\r\n\r\n",
+                          "HTTP/1.0 413 ") &&
+        http_serve_reject(fixture->srv_ctx, "POST /pkix/ HTTP/1.0\r\n"
+                          "Content-Length: 4\r\n\r\nxxxx",
+                          "HTTP/1.0 400 ");
+}
+#endif
+
+#ifdef CMP_SES_TEST_SLOW_CLIENT
+typedef struct slow_client_st {
+    int fd;
+    volatile int stop;
+} SLOW_CLIENT;
+
+/* sends a request byte by byte, each one well within the HTTP timeout */
+static void *slow_client(void *arg)
+{
+    static const char req[] = "POST /pkix/ HTTP/1.0\r\n"
+        "Content-Type: application/pkixcmp\r\nContent-Length: 4\r\n\r\nxxxx";
+    SLOW_CLIENT *client = arg;
+    size_t i;
+
+    for (i = 0; i < sizeof(req) - 1 && !client->stop; i++) {
+        if (write(client->fd, req + i, 1) != 1)
+            break;
+        usleep(200000);
+    }
+    return NULL;
+}
+
+/* the request as a whole must arrive within the HTTP timeout */
+static int execute_cmp_srv_http_slow_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    SLOW_CLIENT client;
+    pthread_t thread;
+    BIO *bio = NULL;
+    char line[256];
+    int fds[2], ret = 0;
+    time_t start;
+
+    if (!TEST_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0))
+        return 0;
+    client.fd = fds[1];
+    client.stop = 0;
+    if (!TEST_true(CMP_SRV_CTX_set_http_timeout(fixture->srv_ctx, 1)) ||
+        !TEST_ptr(bio = BIO_new_socket(fds[0], BIO_NOCLOSE)) ||
+        !TEST_int_eq(pthread_create(&thread, NULL, slow_client, &client), 0))
+        goto end;
+    start = time(NULL);
+    ret = TEST_int_eq(CMP_SRV_http_serve(fixture->srv_ctx, bio), -1) &&
+        TEST_time_t_le(time(NULL) - start, 3);
+    client.stop = 1;
+    pthread_join(thread, NULL);
+    ret = ret && TEST_int_gt(read(fds[1], line, sizeof(line) - 1), 12) &&
+        TEST_strn_eq(line, "HTTP/1.0 408 ", 13);
+ end:
+    BIO_free(bio);
+    close(fds[0]);
+    close(fds[1]);
+    return ret;
+}
+#endif
+
+static int backend_calls = 0;
+
+/* CA backend accepting each request, overriding the mock server's status */
+static int backend_cert_request(CMP_SRV_CTX *srv_ctx,
+                                const CMP_PKIMESSAGE *certReq, int idx,
+                                CMP_PKISTATUSINFO **si, X509 **certOut)
+{
+    if (CMP_SRV_CTX_get_cb_arg(srv_ctx) != &backend_calls)
+        return 0;
+    backend_calls++;
+    if ((*si = CMP_statusInfo_new(CMP_PKISTATUS_accepted, 0, NULL)) == NULL
+        || !X509_up_ref(cert))
+        return 0;
+    *certOut = cert;
+    return 1;
+}
+
+static int execute_cmp_srv_backend_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    backend_calls = 0;
+    return execute_cmp_exec_certrequest_ses_test(fixture) &&
+        TEST_int_eq(backend_calls, fixture->num_certs);
+}
+
+/* rejects the second request and issues cert for all others */
+static int reject_second_cert_request(CMP_SRV_CTX *srv_ctx,
+                                      const CMP_PKIMESSAGE *certReq, int idx,
+                                      CMP_PKISTATUSINFO **si, X509 **certOut)
+{
+    if (idx == 1)
+        return (*si = CMP_statusInfo_new(CMP_PKISTATUS_rejection,
+                                         1 << CMP_PKIFAILUREINFO_badCertTemplate,
+                                         NULL)) != NULL;
+    if ((*si = CMP_statusInfo_new(CMP_PKISTATUS_accepted, 0, NULL)) == NULL
+        || !X509_up_ref(cert))
+        return 0;
+    *certOut = cert;
+    return 1;
+}
+
+static int partial_certConfs = 0;
+static int partial_pkiConfs = 0;
+
+static int partial_transfer_cb(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                               CMP_PKIMESSAGE **res)
+{
+    int ret = CMP_mock_server_perform(ctx, req, res);
+
+    if (CMP_PKIMESSAGE_get_bodytype(req) == V_CMP_PKIBODY_CERTCONF) {
+        partial_certConfs++;
+        if (ret == 0 &&
+            CMP_PKIMESSAGE_get_bodytype(*res) == V_CMP_PKIBODY_PKICONF)
+            partial_pkiConfs++;
+    }
+    return ret;
+}
+
+static int intruder_errors = 0;
+
+/* lets an intruder try to confirm the cert before the actual client does */
+static int intruder_transfer_cb(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                                CMP_PKIMESSAGE **res)
+{
+    static const unsigned char kid[] = "intruder";
+    CMP_PKIMESSAGE *fake, *rsp = NULL;
+    ASN1_OCTET_STRING *fake_kid;
+
+    if (CMP_PKIMESSAGE_get_bodytype(req) == V_CMP_PKIBODY_CERTCONF &&
+        (fake = CMP_PKIMESSAGE_dup((CMP_PKIMESSAGE *)req)) != NULL) {
+        if ((fake_kid = ASN1_OCTET_STRING_new()) != NULL &&
+            ASN1_OCTET_STRING_set(fake_kid, kid, sizeof(kid) - 1) &&
+            CMP_PKIHEADER_set1_senderKID(CMP_PKIMESSAGE_get0_header(fake),
+                                         fake_kid)) {
+            CMP_PKIMESSAGE_modified(fake);
+            if (CMP_mock_server_perform(ctx, fake, &rsp) == 0 &&
+                CMP_PKIMESSAGE_get_bodytype(rsp) == V_CMP_PKIBODY_ERROR)
+                intruder_errors++;
+        }
+        ASN1_OCTET_STRING_free(fake_kid);
+        CMP_PKIMESSAGE_free(fake);
+        CMP_PKIMESSAGE_free(rsp);
+    }
+    return CMP_mock_server_perform(ctx, req, res);
+}
+
+/* other clients cannot inject messages into a transaction */
+static int execute_cmp_exec_ir_ses_intruder_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    intruder_errors = 0;
+    return execute_cmp_exec_certrequest_ses_test(fixture) &&
+        TEST_int_eq(intruder_errors, 1) &&
+        TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx), 0);
+}
+
+/* one of two requests is rejected, while the other cert is still confirmed */
+static int execute_cmp_exec_cr_ses_partial_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    STACK_OF(X509) *certs = NULL;
+    int ret;
+
+    partial_certConfs = partial_pkiConfs = 0;
+    ret = execute_cmp_exec_certrequest_ses_test(fixture) &&
+        TEST_int_eq(partial_certConfs, 1) &&
+        TEST_int_eq(partial_pkiConfs, 1) &&
+        TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx), 0) &&
+        TEST_ptr(certs = CMP_CTX_newClCerts_get1(fixture->cmp_ctx)) &&
+        TEST_int_eq(sk_X509_num(certs), 1) &&
+        TEST_int_eq(X509_cmp(sk_X509_value(certs, 0), cert), 0);
+    sk_X509_pop_free(certs, X509_free);
+    return ret;
+}
+
+/* changes all occurrences of the given string in the DER of msg */
+static CMP_PKIMESSAGE *tampered_dup(const CMP_PKIMESSAGE *msg, const char *str)
+{
+    CMP_PKIMESSAGE *res;
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    size_t len = strlen(str);
+    int i, derlen;
+
+    if ((derlen = i2d_CMP_PKIMESSAGE((CMP_PKIMESSAGE *)msg, &der)) <= 0)
+        return NULL;
+    for (i = 0; i + (int)len <= derlen; i++)
+        if (memcmp(der + i, str, len) == 0)
+            der[i] ^= 0x20;
+    p = der;
+    res = d2i_CMP_PKIMESSAGE(NULL, &p, derlen);
+    OPENSSL_free(der);
+    return res;
+}
+
+static int execute_cmp_popo_batch_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    CMP_CTX *ctx = fixture->cmp_ctx;
+    CMP_PKIMESSAGE *ir = NULL, *p10cr = NULL, *bad = NULL, *rav = NULL;
+    CMP_POPO_BATCH *batch = NULL;
+    X509_NAME *subject = NULL;
+    X509_REQ *csr = NULL;
+    int res = 0;
+
+    if (!TEST_ptr(subject = X509_NAME_new()) ||
+        !TEST_true(X509_NAME_add_entry_by_txt(subject, "CN", MBSTRING_ASC,
+                                              (unsigned char *)"popo-batch",
+                                              -1, -1, 0)) ||
+        !TEST_true(CMP_CTX_set1_subjectName(ctx, subject)) ||
+        !TEST_true(CMP_CTX_certReq_push1(ctx, key, NULL, NULL)) ||
+        !TEST_ptr(ir = CMP_certreq_new(ctx, V_CMP_PKIBODY_IR, 0)) ||
+        !TEST_ptr(csr = load_csr("../cmp-test/pkcs10.der")) ||
+        !TEST_true(CMP_CTX_set1_p10CSR(ctx, csr)) ||
+        !TEST_ptr(p10cr = CMP_certreq_new(ctx, V_CMP_PKIBODY_P10CR, 0)) ||
+        !TEST_true(CMP_CTX_set_option(ctx, CMP_CTX_OPT_POPOMETHOD,
+                                      CRMF_POPO_RAVERIFIED)) ||
+        !TEST_ptr(rav = CMP_certreq_new(ctx, V_CMP_PKIBODY_CR, 0)))
+        goto err;
+    /* the signatures cover the subjects in the certificate templates */
+    if (!TEST_ptr(bad = tampered_dup(ir, "popo-batch")) ||
+        !TEST_ptr(batch = CMP_POPO_BATCH_new(fixture->srv_ctx)) ||
+        !TEST_int_eq(CMP_POPO_BATCH_add(batch, bad), 0) ||
+        !TEST_int_eq(CMP_POPO_BATCH_add(batch, ir), 2) ||
+        !TEST_int_eq(CMP_POPO_BATCH_add(batch, rav), 4) ||
+        !TEST_int_eq(CMP_POPO_BATCH_add(batch, p10cr), 6) ||
+        !TEST_int_eq(CMP_POPO_BATCH_num(batch), 7) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 2), -1) ||
+        /* the RAVerified requests are rejected without any verification */
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 4), 0) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 5), 0) ||
+        !TEST_int_eq(CMP_POPO_BATCH_verify(batch), 5) ||
+        !TEST_int_eq(CMP_POPO_BATCH_verify(batch), 0) ||
+        !TEST_int_eq(CMP_POPO_BATCH_add(batch, ir), -1) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 0), 0) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 1), 0) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 2), 1) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 3), 1) ||
+        !TEST_int_eq(CMP_POPO_BATCH_get_result(batch, 6), 1))
+        goto err;
+    res = 1;
+
+ err:
+    CMP_POPO_BATCH_free(batch);
+    CMP_PKIMESSAGE_free(ir);
+    CMP_PKIMESSAGE_free(p10cr);
+    CMP_PKIMESSAGE_free(bad);
+    CMP_PKIMESSAGE_free(rav);
+    X509_REQ_free(csr);
+    X509_NAME_free(subject);
+    return res;
+}
+
 static int test_cmp_exec_rr_ses(void)
 {
     SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
@@ -142,6 +764,101 @@ static int test_cmp_exec_rr_ses_receive_error(void)
     return result;
 }
 
+/* adds cert and the cert with its serial number plus offset to be revoked */
+static int push_rev_certs(CMP_SES_TEST_FIXTURE *fixture, int offset)
+{
+    BIGNUM *bn = ASN1_INTEGER_to_BN(X509_get0_serialNumber(cert), NULL);
+    ASN1_INTEGER *serial = NULL;
+    int ret = TEST_ptr(bn) &&
+        TEST_true(BN_add_word(bn, offset)) &&
+        TEST_ptr(serial = BN_to_ASN1_INTEGER(bn, NULL)) &&
+        TEST_true(CMP_CTX_revCert_push1(fixture->cmp_ctx,
+                                        X509_get_issuer_name(cert),
+                                        X509_get0_serialNumber(cert))) &&
+        TEST_true(CMP_CTX_revCert_push1(fixture->cmp_ctx,
+                                        X509_get_issuer_name(cert), serial));
+
+    BN_free(bn);
+    ASN1_INTEGER_free(serial);
+    return ret;
+}
+
+static int test_cmp_exec_rr_ses_batch(void)
+{
+    static const int status[] = {
+        CMP_PKISTATUS_accepted, CMP_PKISTATUS_accepted, CMP_PKISTATUS_accepted
+    };
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->expected = 1;
+    fixture->num_revs = OSSL_NELEM(status);
+    fixture->rev_status = status;
+    if (!push_rev_certs(fixture, 0)) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_rr_ses_test, tear_down);
+    return result;
+}
+
+static int test_cmp_exec_rr_ses_batch_partly_rejected(void)
+{
+    static const int status[] = {
+        CMP_PKISTATUS_accepted, CMP_PKISTATUS_accepted, CMP_PKISTATUS_rejection
+    };
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->expected = 0;
+    fixture->num_revs = OSSL_NELEM(status);
+    fixture->rev_status = status;
+    /* the mock server accepts revocation only for the cert it enrolls */
+    if (!push_rev_certs(fixture, 1)) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_rr_ses_test, tear_down);
+    return result;
+}
+
+static int rr_count = 0;
+
+static int rr_count_transfer_cb(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                                CMP_PKIMESSAGE **res)
+{
+    if (CMP_PKIMESSAGE_get_bodytype(req) == V_CMP_PKIBODY_RR)
+        rr_count++;
+    return CMP_mock_server_perform(ctx, req, res);
+}
+
+/* more certs than fit into one RR are revoked with a sequence of them */
+static int execute_cmp_exec_rr_ses_split_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    rr_count = 0;
+    return execute_cmp_exec_rr_ses_test(fixture) &&
+        TEST_int_eq(rr_count, 3) &&
+        TEST_int_eq(CMP_SRV_CTX_num_transactions(fixture->srv_ctx), 0);
+}
+
+static int test_cmp_exec_rr_ses_batch_split(void)
+{
+    static const int status[] = {
+        CMP_PKISTATUS_accepted, CMP_PKISTATUS_accepted, CMP_PKISTATUS_rejection,
+        CMP_PKISTATUS_accepted, CMP_PKISTATUS_rejection
+    };
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->expected = 0;
+    fixture->num_revs = OSSL_NELEM(status);
+    fixture->rev_status = status;
+    if (!TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_REVOCATION_BATCH, 2)) ||
+        !TEST_true(CMP_CTX_set_transfer_cb(fixture->cmp_ctx,
+                                           rr_count_transfer_cb)) ||
+        !push_rev_certs(fixture, 1) || !push_rev_certs(fixture, 2)) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_rr_ses_split_test, tear_down);
+    return result;
+}
+
 static int test_cmp_exec_ir_ses(void)
 {
     SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
@@ -156,6 +873,92 @@ static int test_cmp_exec_ir_ses(void)
     return result;
 }
 
+/* equal certs received in caPubs and extraCerts are decoded only once */
+static int execute_cmp_exec_ir_ses_shared_certs_test(CMP_SES_TEST_FIXTURE *
+                                                     fixture)
+{
+    STACK_OF(X509) *caPubs = NULL, *extraCerts = NULL;
+    X509 *res = NULL;
+    int ret = 0;
+
+    if (!TEST_ptr(res = CMP_exec_IR_ses(fixture->cmp_ctx)) ||
+        !TEST_ptr(caPubs = CMP_CTX_caPubs_get1(fixture->cmp_ctx)) ||
+        !TEST_ptr(extraCerts = CMP_CTX_extraCertsIn_get1(fixture->cmp_ctx)) ||
+        !TEST_int_eq(sk_X509_num(caPubs), 2) ||
+        !TEST_int_ge(sk_X509_num(extraCerts), 1))
+        goto end;
+    if (TEST_ptr_eq(sk_X509_value(caPubs, 0), sk_X509_value(caPubs, 1)) &&
+        TEST_ptr_eq(sk_X509_value(extraCerts, 0), sk_X509_value(caPubs, 0)) &&
+        TEST_int_eq(X509_cmp(sk_X509_value(caPubs, 0), cert), 0))
+        ret = 1;
+ end:
+    sk_X509_pop_free(caPubs, X509_free);
+    sk_X509_pop_free(extraCerts, X509_free);
+    return ret;
+}
+
+static int test_cmp_exec_ir_ses_shared_certs(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->ca_pubs = sk_X509_new_null();
+    if (!TEST_ptr(fixture->ca_pubs) ||
+        !TEST_true(sk_X509_push(fixture->ca_pubs, cert)) ||
+        !TEST_true(sk_X509_push(fixture->ca_pubs, cert)) ||
+        !TEST_true(CMP_SRV_CTX_set1_caPubsOut(fixture->srv_ctx,
+                                              fixture->ca_pubs)) ||
+        !TEST_true(CMP_SRV_CTX_set1_chainOut(fixture->srv_ctx,
+                                             fixture->ca_pubs))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_ir_ses_shared_certs_test, tear_down);
+    return result;
+}
+
+static int phase_counts[CMP_PHASE_CERTCONF_CB + 1];
+
+static void count_phase_cb(CMP_CTX *ctx, int phase, uint64_t start,
+                           uint64_t end, size_t bytes)
+{
+    if (phase >= 0 && phase <= CMP_PHASE_CERTCONF_CB && end >= start)
+        phase_counts[phase]++;
+}
+
+static int keep_failure_cb(CMP_CTX *ctx, const X509 *cert, int failure,
+                           const char **txt)
+{
+    return failure;
+}
+
+static int execute_cmp_exec_ses_phases_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    memset(phase_counts, 0, sizeof(phase_counts));
+    return execute_cmp_exec_certrequest_ses_test(fixture) &&
+        /* the requests are unprotected and not sent via HTTP */
+        TEST_int_eq(phase_counts[CMP_PHASE_PROTECT], 0) &&
+        TEST_int_eq(phase_counts[CMP_PHASE_CONNECT], 0) &&
+        TEST_int_eq(phase_counts[CMP_PHASE_ENCODE], 0) &&
+        /* ir/ip and certConf/pkiConf */
+        TEST_int_eq(phase_counts[CMP_PHASE_TRANSFER], 2) &&
+        TEST_int_eq(phase_counts[CMP_PHASE_VALIDATE], 2) &&
+        TEST_int_eq(phase_counts[CMP_PHASE_CERTCONF_CB], 1);
+}
+
+static int test_cmp_exec_ir_ses_phases(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_IR_ses;
+    fixture->expected = 1;
+    if (!TEST_true(CMP_CTX_set_phase_cb(fixture->cmp_ctx, count_phase_cb)) ||
+        !TEST_true(CMP_CTX_set_certConf_cb(fixture->cmp_ctx,
+                                           keep_failure_cb))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_ses_phases_test, tear_down);
+    return result;
+}
+
 static int test_cmp_exec_ir_ses_poll(void)
 {
     SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
@@ -171,6 +974,19 @@ static int test_cmp_exec_ir_ses_poll(void)
     return result;
 }
 
+static int test_cmp_exec_ir_ses_poll_no_encoding_check(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_IR_ses;
+    fixture->expected = 1;
+    /* messages are passed between client and server without any copying */
+    CMP_SRV_CTX_set_encoding_check(fixture->srv_ctx, 0);
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, 2);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    EXECUTE_TEST(execute_cmp_exec_certrequest_ses_test, tear_down);
+    return result;
+}
+
 static int test_cmp_exec_ir_ses_poll_timeout(void)
 {
     SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
@@ -186,6 +1002,132 @@ static int test_cmp_exec_ir_ses_poll_timeout(void)
     return result;
 }
 
+static int test_cmp_exec_ir_ses_multi_poll(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_IR_ses;
+    fixture->expected = 1;
+    fixture->num_certs = 3;
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, 2);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    /* the mock server returns the same cert, so all requests use its key */
+    if (!TEST_true(CMP_CTX_certReq_push1(fixture->cmp_ctx, key, NULL, NULL)) ||
+        !TEST_true(CMP_CTX_certReq_push1(fixture->cmp_ctx, key,
+                                         X509_get_subject_name(cert), NULL))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_certrequest_ses_test, tear_down);
+    return result;
+}
+
+static int test_cmp_exec_cr_ses_multi_wrong_key(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    EVP_PKEY *other = NULL;
+    fixture->exec_cert_ses_cb = CMP_exec_CR_ses;
+    fixture->expected = 0;
+    /* the cert returned for the second request does not match its key */
+    if (!TEST_ptr(other = gen_rsa()) ||
+        !TEST_true(CMP_CTX_certReq_push1(fixture->cmp_ctx, other, NULL,
+                                         NULL))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EVP_PKEY_free(other);
+    EXECUTE_TEST(execute_cmp_exec_certrequest_ses_test, tear_down);
+    return result;
+}
+
+/* counts the messages exchanged and the copies of cert in cert responses */
+static int encrcert_certConfs = 0;
+static int encrcert_cert_copies = -1;
+static int encrcert_implicit = 0;
+
+static int count_cert_copies(const unsigned char *der, int len)
+{
+    unsigned char *cert_der = NULL;
+    int cert_len = i2d_X509(cert, &cert_der);
+    int i, n = 0;
+
+    for (i = 0; cert_len > 0 && i + cert_len <= len; i++)
+        if (memcmp(der + i, cert_der, cert_len) == 0)
+            n++;
+    OPENSSL_free(cert_der);
+    return n;
+}
+
+static int encrcert_transfer_cb(CMP_CTX *ctx, const CMP_PKIMESSAGE *req,
+                                CMP_PKIMESSAGE **res)
+{
+    unsigned char *der = NULL;
+    int len, ret;
+
+    if (CMP_PKIMESSAGE_get_bodytype(req) == V_CMP_PKIBODY_CERTCONF)
+        encrcert_certConfs++;
+    if ((ret = CMP_mock_server_perform(ctx, req, res)) != 0)
+        return ret;
+    if (CMP_PKIMESSAGE_get_bodytype(*res) == V_CMP_PKIBODY_IP) {
+        encrcert_implicit = CMP_PKIMESSAGE_check_implicitConfirm(*res);
+        if ((len = i2d_CMP_PKIMESSAGE(*res, &der)) > 0)
+            encrcert_cert_copies = count_cert_copies(der, len);
+        OPENSSL_free(der);
+    }
+    return 0;
+}
+
+static int execute_cmp_exec_ir_ses_encrcert_test(CMP_SES_TEST_FIXTURE *fixture)
+{
+    encrcert_certConfs = encrcert_implicit = 0;
+    encrcert_cert_copies = -1;
+    return execute_cmp_exec_certrequest_ses_test(fixture) &&
+        /* the (unprotected) response does not contain cert in plain */
+        TEST_int_eq(encrcert_cert_copies, 0) &&
+        /* certConf is required as proof of possession despite being offered */
+        TEST_false(encrcert_implicit) &&
+        TEST_int_eq(encrcert_certConfs, 1);
+}
+
+static int test_cmp_exec_ir_ses_encrcert(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_IR_ses;
+    fixture->expected = 1;
+    if (!TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_POPOMETHOD,
+                                      CRMF_POPO_ENCRCERT)) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_IMPLICITCONFIRM, 1)) ||
+        !TEST_true(CMP_SRV_CTX_set_grant_implicit_confirm(fixture->srv_ctx,
+                                                          1)) ||
+        !TEST_true(CMP_CTX_set_transfer_cb(fixture->cmp_ctx,
+                                           encrcert_transfer_cb))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_ir_ses_encrcert_test, tear_down);
+    return result;
+}
+
+static int test_cmp_exec_ir_ses_encrcert_wrong_key(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    EVP_PKEY *other = NULL;
+    fixture->exec_cert_ses_cb = CMP_exec_IR_ses;
+    fixture->expected = 0;
+    /* the cert is encrypted for its own key, which the client does not hold */
+    if (!TEST_ptr(other = gen_rsa()) ||
+        !TEST_true(CMP_CTX_set1_newPkey(fixture->cmp_ctx, other)) ||
+        !TEST_true(CMP_CTX_set_option(fixture->cmp_ctx,
+                                      CMP_CTX_OPT_POPOMETHOD,
+                                      CRMF_POPO_ENCRCERT))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EVP_PKEY_free(other);
+    EXECUTE_TEST(execute_cmp_exec_certrequest_ses_test, tear_down);
+    return result;
+}
 
 static int test_cmp_exec_cr_ses(void)
 {
@@ -232,6 +1174,217 @@ static int test_cmp_exec_p10cr_ses(void)
     return result;
 }
 
+static int test_cmp_ses_step_cr(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->req_type = V_CMP_PKIBODY_CR;
+    fixture->expected = 1;
+    EXECUTE_TEST(execute_cmp_ses_step_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_step_ir_poll(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    const int pollCount = 2;
+    fixture->req_type = V_CMP_PKIBODY_IR;
+    fixture->expected = 1;
+    /* the mock server counts the initial 'waiting' response as a poll */
+    fixture->timer_waits = pollCount - 1;
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, pollCount);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    EXECUTE_TEST(execute_cmp_ses_step_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_step_cr_multi(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->req_type = V_CMP_PKIBODY_CR;
+    fixture->expected = 1;
+    fixture->num_certs = 2;
+    if (!TEST_true(CMP_CTX_certReq_push1(fixture->cmp_ctx, key, NULL, NULL))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_ses_step_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_step_ir_poll_timeout(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    const int pollCount = 3;
+    const int checkAfter = 1;
+    fixture->req_type = V_CMP_PKIBODY_IR;
+    fixture->expected = 0;
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, pollCount + 1);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, checkAfter);
+    CMP_CTX_set_option(fixture->cmp_ctx, CMP_CTX_OPT_TOTALTIMEOUT,
+                       pollCount * checkAfter);
+    EXECUTE_TEST(execute_cmp_ses_step_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_step_ir_poll_async(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->req_type = V_CMP_PKIBODY_IR;
+    fixture->expected = 1;
+    fixture->timer_waits = 1;
+    /* the POPO signature is paused while creating the request */
+    fixture->async_waits = 1;
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, 2);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    if (!set_pausing_key(fixture)) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_ses_step_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_free_paused(int with_wait_fd)
+{
+#ifdef OPENSSL_SYS_UNIX
+    int fds[2] = { -1, -1 };
+#endif
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    if (!set_pausing_key(fixture)) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+#ifdef OPENSSL_SYS_UNIX
+    /* a pipe that is readable already, so waiting on it does not block */
+    if (with_wait_fd && fixture != NULL &&
+        (!TEST_int_eq(pipe(fds), 0) || !TEST_int_eq(write(fds[1], "", 1), 1))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    rsa_wait_fd = fds[0];
+#endif
+    EXECUTE_TEST(execute_cmp_ses_free_paused_test, tear_down);
+#ifdef OPENSSL_SYS_UNIX
+    rsa_wait_fd = OSSL_BAD_ASYNC_FD;
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+#endif
+    return result;
+}
+
+static int test_cmp_srv_interleaved(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, 2);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    EXECUTE_TEST(execute_cmp_srv_interleaved_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_sched(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, 3);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    EXECUTE_TEST(execute_cmp_ses_sched_test, tear_down);
+    return result;
+}
+
+static int test_cmp_ses_sched_free(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    CMP_SRV_CTX_set_pollCount(fixture->srv_ctx, 2);
+    CMP_SRV_CTX_set_checkAfterTime(fixture->srv_ctx, 1);
+    EXECUTE_TEST(execute_cmp_ses_sched_free_test, tear_down);
+    return result;
+}
+
+#ifndef OPENSSL_NO_SOCK
+static int test_cmp_srv_http_serve(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    EXECUTE_TEST(execute_cmp_srv_http_serve_test, tear_down);
+    return result;
+}
+
+static int test_cmp_srv_http_reject(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    EXECUTE_TEST(execute_cmp_srv_http_reject_test, tear_down);
+    return result;
+}
+#endif
+
+#ifdef CMP_SES_TEST_SLOW_CLIENT
+static int test_cmp_srv_http_slow(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    EXECUTE_TEST(execute_cmp_srv_http_slow_test, tear_down);
+    return result;
+}
+#endif
+
+static int test_cmp_srv_backend(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_CR_ses;
+    fixture->expected = 1;
+    fixture->num_certs = 2;
+    /* without the backend, the mock server would reject the requests */
+    if (!TEST_true(CMP_SRV_CTX_set_statusInfo(fixture->srv_ctx,
+                                              CMP_PKISTATUS_rejection,
+                                              0, NULL)) ||
+        !TEST_true(CMP_SRV_CTX_set_cert_request_cb(fixture->srv_ctx,
+                                                   backend_cert_request)) ||
+        !TEST_true(CMP_SRV_CTX_set_cb_arg(fixture->srv_ctx, &backend_calls)) ||
+        !TEST_true(CMP_CTX_certReq_push1(fixture->cmp_ctx, key, NULL, NULL))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_srv_backend_test, tear_down);
+    return result;
+}
+
+static int test_cmp_exec_cr_ses_partial(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_CR_ses;
+    fixture->expected = 0;
+    if (!TEST_true(CMP_SRV_CTX_set_cert_request_cb(fixture->srv_ctx,
+                                                   reject_second_cert_request))
+        || !TEST_true(CMP_CTX_set_transfer_cb(fixture->cmp_ctx,
+                                              partial_transfer_cb)) ||
+        !TEST_true(CMP_CTX_certReq_push1(fixture->cmp_ctx, key, NULL, NULL))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_cr_ses_partial_test, tear_down);
+    return result;
+}
+
+static int test_cmp_exec_ir_ses_intruder(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    fixture->exec_cert_ses_cb = CMP_exec_IR_ses;
+    fixture->expected = 1;
+    if (!TEST_true(CMP_CTX_set_transfer_cb(fixture->cmp_ctx,
+                                           intruder_transfer_cb))) {
+        tear_down(fixture);
+        fixture = NULL;
+    }
+    EXECUTE_TEST(execute_cmp_exec_ir_ses_intruder_test, tear_down);
+    return result;
+}
+
+static int test_cmp_popo_batch(void)
+{
+    SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
+    EXECUTE_TEST(execute_cmp_popo_batch_test, tear_down);
+    return result;
+}
+
 static int test_cmp_exec_genm_ses(void)
 {
     SETUP_TEST_FIXTURE(CMP_SES_TEST_FIXTURE, set_up);
@@ -279,6 +1432,7 @@ void cleanup_tests(void)
 {
     X509_free(cert);
     EVP_PKEY_free(key);
+    RSA_meth_free(pausing_rsa_meth);
     return;
 }
 
@@ -292,13 +1446,49 @@ int setup_tests(void)
 
     ADD_TEST(test_cmp_exec_rr_ses);
     ADD_TEST(test_cmp_exec_rr_ses_receive_error);
+    ADD_TEST(test_cmp_exec_rr_ses_batch);
+    ADD_TEST(test_cmp_exec_rr_ses_batch_partly_rejected);
+    ADD_TEST(test_cmp_exec_rr_ses_batch_split);
     ADD_TEST(test_cmp_exec_cr_ses);
     ADD_TEST(test_cmp_exec_cr_ses_implicit_confirm);
     ADD_TEST(test_cmp_exec_ir_ses);
+    ADD_TEST(test_cmp_exec_ir_ses_shared_certs);
+    ADD_TEST(test_cmp_exec_ir_ses_phases);
     ADD_TEST(test_cmp_exec_ir_ses_poll);
+    ADD_TEST(test_cmp_exec_ir_ses_poll_no_encoding_check);
     ADD_TEST(test_cmp_exec_ir_ses_poll_timeout);
+    ADD_TEST(test_cmp_exec_ir_ses_multi_poll);
+    ADD_TEST(test_cmp_exec_cr_ses_multi_wrong_key);
+    ADD_TEST(test_cmp_exec_ir_ses_encrcert);
+    ADD_TEST(test_cmp_exec_ir_ses_encrcert_wrong_key);
     ADD_TEST(test_cmp_exec_kur_ses);
     ADD_TEST(test_cmp_exec_p10cr_ses);
+    ADD_TEST(test_cmp_ses_step_cr);
+    ADD_TEST(test_cmp_ses_step_ir_poll);
+    ADD_TEST(test_cmp_ses_step_cr_multi);
+    ADD_TEST(test_cmp_ses_step_ir_poll_timeout);
+    if (ASYNC_is_capable()) {
+        ADD_TEST(test_cmp_ses_step_ir_poll_async);
+#ifdef OPENSSL_SYS_UNIX
+        ADD_ALL_TESTS(test_cmp_ses_free_paused, 2);
+#else
+        ADD_ALL_TESTS(test_cmp_ses_free_paused, 1);
+#endif
+    }
+    ADD_TEST(test_cmp_srv_interleaved);
+    ADD_TEST(test_cmp_ses_sched);
+    ADD_TEST(test_cmp_ses_sched_free);
+#ifndef OPENSSL_NO_SOCK
+    ADD_TEST(test_cmp_srv_http_serve);
+    ADD_TEST(test_cmp_srv_http_reject);
+#endif
+#ifdef CMP_SES_TEST_SLOW_CLIENT
+    ADD_TEST(test_cmp_srv_http_slow);
+#endif
+    ADD_TEST(test_cmp_srv_backend);
+    ADD_TEST(test_cmp_exec_cr_ses_partial);
+    ADD_TEST(test_cmp_exec_ir_ses_intruder);
+    ADD_TEST(test_cmp_popo_batch);
     ADD_TEST(test_cmp_exec_genm_ses);
     ADD_TEST(test_exchange_certconf);
     ADD_TEST(test_exchange_error);
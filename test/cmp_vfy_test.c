@@ -144,6 +144,29 @@ static int test_cmp_validate_msg_signature_bad(void)
     return result;
 }
 
+static int test_cmp_validate_msg_signature_trusted_store(void)
+{
+    X509_STORE *trusted = NULL;
+    SETUP_TEST_FIXTURE(CMP_VFY_TEST_FIXTURE, set_up);
+    /* server cert to be found among other certs in the trusted store */
+    fixture->expected = 1;
+    if (!TEST_ptr(fixture->msg =
+                  load_pkimsg("../cmp-test/CMP_IR_protected.der")) ||
+        !TEST_ptr(trusted = CMP_CTX_get0_trustedStore(fixture->cmp_ctx)) ||
+        !TEST_true(X509_STORE_add_cert(trusted, root)) ||
+        !TEST_true(X509_STORE_add_cert(trusted, intermediate)) ||
+        !TEST_true(X509_STORE_add_cert(trusted, srvcert)) ||
+        !TEST_true(X509_STORE_add_cert(trusted, clcert))) {
+        tear_down(fixture);
+        fixture = NULL;
+    } else {
+        X509_VERIFY_PARAM_set_time(X509_STORE_get0_param(trusted),
+                                   test_time_valid);
+    }
+    EXECUTE_TEST(execute_validation_test, tear_down);
+    return result;
+}
+
 static int test_cmp_validate_msg_signature_expected_sender(void)
 {
     SETUP_TEST_FIXTURE(CMP_VFY_TEST_FIXTURE, set_up);
@@ -198,6 +221,149 @@ static int test_cmp_validate_msg_unprotected_request(void)
     return result;
 }
 
+static int verify_calls = 0;
+
+/* counts successful cert checks, not diagnostic calls on failed ones */
+static int count_verify_cb(int ok, X509_STORE_CTX *ctx)
+{
+    if (ok)
+        verify_calls++;
+    return ok;
+}
+
+static CMP_CTX *srvcert_cache_ctx_new(X509_STORE *store,
+                                      CMP_SRVCERT_CACHE *cache)
+{
+    CMP_CTX *ctx = CMP_CTX_create();
+
+    if (ctx == NULL || !X509_STORE_up_ref(store))
+        goto err;
+    if (!CMP_CTX_set0_trustedStore(ctx, store)) {
+        X509_STORE_free(store);
+        goto err;
+    }
+    if (!CMP_CTX_set1_srvCert_cache(ctx, cache))
+        goto err;
+    return ctx;
+ err:
+    CMP_CTX_delete(ctx);
+    return NULL;
+}
+
+static int test_cmp_validate_msg_srvcert_cache(void)
+{
+    X509_STORE *store = NULL, *other_store = NULL;
+    CMP_SRVCERT_CACHE *cache = NULL;
+    CMP_CTX *ctx1 = NULL, *ctx2 = NULL, *ctx3 = NULL;
+    CMP_PKIMESSAGE *msg = NULL;
+    int calls, result = 0;
+
+    if (!TEST_ptr(msg = load_pkimsg("../cmp-test/CMP_IR_protected.der"))
+        || !TEST_ptr(store = X509_STORE_new())
+        || !TEST_true(X509_STORE_add_cert(store, srvcert))
+        || !TEST_ptr(other_store = X509_STORE_new())
+        || !TEST_ptr(cache = CMP_SRVCERT_CACHE_new(0))
+        || !TEST_ptr(ctx1 = srvcert_cache_ctx_new(store, cache))
+        || !TEST_ptr(ctx2 = srvcert_cache_ctx_new(store, cache))
+        || !TEST_ptr(ctx3 = srvcert_cache_ctx_new(other_store, cache)))
+        goto end;
+    X509_VERIFY_PARAM_set_time(X509_STORE_get0_param(store), test_time_valid);
+    X509_VERIFY_PARAM_set_time(X509_STORE_get0_param(other_store),
+                               test_time_valid);
+    X509_STORE_set_verify_cb(store, count_verify_cb);
+
+    /* the first validation fills the cache, the second one uses it */
+    verify_calls = 0;
+    if (!TEST_true(CMP_validate_msg(ctx1, msg))
+        || !TEST_int_gt(calls = verify_calls, 0)
+        || !TEST_true(CMP_validate_msg(ctx2, msg))
+        || !TEST_int_eq(verify_calls, calls))
+        goto end;
+
+    /* the cached cert must not be used with a different trust store */
+    if (!TEST_false(CMP_validate_msg(ctx3, msg)))
+        goto end;
+
+    /* after flushing the cache the cert is validated again */
+    CMP_SRVCERT_CACHE_flush(cache);
+    CMP_CTX_delete(ctx2);
+    if (!TEST_ptr(ctx2 = srvcert_cache_ctx_new(store, cache))
+        || !TEST_true(CMP_validate_msg(ctx2, msg))
+        || !TEST_int_gt(verify_calls, calls))
+        goto end;
+    result = 1;
+
+ end:
+    ERR_clear_error();
+    CMP_CTX_delete(ctx1);
+    CMP_CTX_delete(ctx2);
+    CMP_CTX_delete(ctx3);
+    CMP_SRVCERT_CACHE_free(cache);
+    X509_STORE_free(store);
+    X509_STORE_free(other_store);
+    CMP_PKIMESSAGE_free(msg);
+    return result;
+}
+
+/* a cached cert failing to verify a message is dropped and searched again */
+static int test_cmp_validate_msg_srvcert_cache_stale(void)
+{
+    X509_STORE *store = NULL;
+    CMP_SRVCERT_CACHE *cache = NULL;
+    CMP_CTX *ctx1 = NULL, *ctx2 = NULL, *ctx3 = NULL;
+    CMP_PKIMESSAGE *msg = NULL, *bad = NULL;
+    ASN1_UTF8STRING *text = NULL;
+    int calls, result = 0;
+
+    if (!TEST_ptr(msg = load_pkimsg("../cmp-test/CMP_IR_protected.der"))
+        || !TEST_ptr(bad = CMP_PKIMESSAGE_dup(msg))
+        || !TEST_ptr(text = ASN1_UTF8STRING_new())
+        || !TEST_true(ASN1_STRING_set(text, "changed", -1))
+        /* same sender and senderKID, but the protection does not match */
+        || !TEST_true(CMP_PKIHEADER_push1_freeText(
+                          CMP_PKIMESSAGE_get0_header(bad), text)))
+        goto end;
+    CMP_PKIMESSAGE_modified(bad);
+    if (!TEST_ptr(store = X509_STORE_new())
+        || !TEST_true(X509_STORE_add_cert(store, srvcert))
+        || !TEST_ptr(cache = CMP_SRVCERT_CACHE_new(0))
+        || !TEST_ptr(ctx1 = srvcert_cache_ctx_new(store, cache))
+        || !TEST_ptr(ctx2 = srvcert_cache_ctx_new(store, cache))
+        || !TEST_ptr(ctx3 = srvcert_cache_ctx_new(store, cache)))
+        goto end;
+    X509_VERIFY_PARAM_set_time(X509_STORE_get0_param(store), test_time_valid);
+    X509_STORE_set_verify_cb(store, count_verify_cb);
+
+    verify_calls = 0;
+    if (!TEST_true(CMP_validate_msg(ctx1, msg))
+        || !TEST_int_gt(calls = verify_calls, 0))
+        goto end;
+
+    /* the cached cert does not verify, so the cert is validated again */
+    if (!TEST_false(CMP_validate_msg(ctx2, bad))
+        || !TEST_int_gt(verify_calls, calls))
+        goto end;
+
+    /* which has put it back into the cache */
+    calls = verify_calls;
+    if (!TEST_true(CMP_validate_msg(ctx3, msg))
+        || !TEST_int_eq(verify_calls, calls))
+        goto end;
+    result = 1;
+
+ end:
+    ERR_clear_error();
+    CMP_CTX_delete(ctx1);
+    CMP_CTX_delete(ctx2);
+    CMP_CTX_delete(ctx3);
+    CMP_SRVCERT_CACHE_free(cache);
+    X509_STORE_free(store);
+    ASN1_UTF8STRING_free(text);
+    CMP_PKIMESSAGE_free(msg);
+    CMP_PKIMESSAGE_free(bad);
+    return result;
+}
+
 static int test_cmp_validate_cert_path(void)
 {
     STACK_OF(X509) *untrusted = NULL;
@@ -308,11 +474,14 @@ int setup_tests(void)
     /* Message validation tests */
     ADD_TEST(test_cmp_validate_msg_signature);
     ADD_TEST(test_cmp_validate_msg_signature_bad);
+    ADD_TEST(test_cmp_validate_msg_signature_trusted_store);
     ADD_TEST(test_cmp_validate_msg_signature_expected_sender);
     ADD_TEST(test_cmp_validate_msg_signature_unexpected_sender);
     ADD_TEST(test_cmp_validate_msg_unprotected_request);
     ADD_TEST(test_cmp_validate_msg_mac_alg_protection);
     ADD_TEST(test_cmp_validate_msg_mac_alg_protection_bad);
+    ADD_TEST(test_cmp_validate_msg_srvcert_cache);
+    ADD_TEST(test_cmp_validate_msg_srvcert_cache_stale);
 
     /* Cert path validation tests */
     ADD_TEST(test_cmp_validate_cert_path);
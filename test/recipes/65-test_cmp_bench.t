@@ -0,0 +1,36 @@
+#! /usr/bin/env perl
+# Copyright OpenSSL 2007-2018
+# Copyright Nokia 2007-2018
+# Copyright Siemens AG 2015-2018
+#
+# Contents licensed under the terms of the OpenSSL license
+# See https://www.openssl.org/source/license.html for details
+#
+# SPDX-License-Identifier: OpenSSL
+#
+# CMP benchmark smoke test; set CMP_BENCH for a full run with default options.
+
+use strict;
+use warnings;
+
+use OpenSSL::Test;
+use OpenSSL::Test::Utils;
+
+setup("test_cmp_bench");
+
+plan skip_all => "This test is unsupported in a shared library build on Windows"
+    if $^O eq 'MSWin32' && !disabled("shared");
+plan skip_all => "CMP is not supported by this OpenSSL build"
+    if disabled("cmp");
+
+plan tests => 3;
+
+my @quick = exists $ENV{'CMP_BENCH'} ? () : ("-num", "4", "-conc", "2");
+
+ok(run(test(["cmp_bench", @quick, "-prot", "pbm"])),
+   "PBM-protected transactions");
+ok(run(test(["cmp_bench", @quick, "-prot", "ec", "-depth", "3"])),
+   "EC signature-protected transactions with intermediate CAs");
+ok(run(test(["cmp_bench", @quick, "-prot", "rsa", "-keytype", "rsa",
+             "-zerocopy"])),
+   "RSA signature-protected transactions without encoding");
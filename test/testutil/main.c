@@ -95,7 +95,7 @@ const char *test_get_option_argument(const char *option)
     for (i = 1; i <= arg_count; i++)
         if (strncmp(args[i], option, n) == 0) {
             arg_used[i] = 1;
-            if (args[i][n] == '\0' && i + 1 < arg_count) {
+            if (args[i][n] == '\0' && i + 1 <= arg_count) {
                 arg_used[++i] = 1;
                 return args[i];
             }